@@ -0,0 +1,506 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+#include <type_traits>
+
+#include "netnode.h"
+#include "treenode.h"
+
+/**
+ * An edge in a network arena.
+ */
+struct ArenaEdge {
+	double distance; // The length of the edge.
+	int32_t node; // The index of the node it points to.
+	int32_t paramId; // The index in the params vector.
+	EdgeType type; // Which output of the node it reads.
+	int32_t unused; // Keeps the layout free of padding.
+};
+
+/**
+ * A node in a network arena.
+ */
+struct ArenaNetNode {
+	double leftProbability; // For network nodes.
+	NodeType type;
+	int32_t name; // The offset of the name in the name table.
+	int32_t introgressionId; // For network nodes, the index in the params vector for the left probability.
+	int32_t unused; // Keeps the layout free of padding.
+	ArenaEdge edges[2]; // Tree nodes use both, network nodes only use the first.
+
+	/**
+	 * Get the number of edges.
+	 */
+	int getNumEdges() const {
+		switch (type) {
+			case NodeType::LEAF:
+				return 0;
+			case NodeType::TREE:
+				return 2;
+			case NodeType::NETWORK:
+				return 1;
+
+			default:
+				return 0;
+		}
+	}
+
+	/**
+	 * Check that the node only links to nodes before it.
+	 */
+	bool hasValidLinks(int32_t index) const {
+		if (type != NodeType::LEAF && type != NodeType::TREE && type != NodeType::NETWORK) {
+			return false;
+		}
+
+		for (int i = 0; i < getNumEdges(); i++) {
+			if (edges[i].node < 0 || edges[i].node >= index || edges[i].paramId < 0 || (int32_t) edges[i].type < 0 || (int32_t) edges[i].type > 2) {
+				return false;
+			}
+		}
+
+		return type != NodeType::NETWORK || introgressionId >= 0;
+	}
+};
+
+/**
+ * A node in a tree arena. Leaves have no children.
+ */
+struct ArenaTreeNode {
+	int32_t name; // The offset of the name in the name table.
+	int32_t leftChild;
+	int32_t rightChild;
+
+	/**
+	 * Check if the node is a leaf.
+	 */
+	bool isLeaf() const {
+		return leftChild < 0;
+	}
+
+	/**
+	 * Check that the node only links to nodes before it.
+	 */
+	bool hasValidLinks(int32_t index) const {
+		if (isLeaf()) {
+			return rightChild < 0;
+		}
+
+		return leftChild < index && rightChild >= 0 && rightChild < index;
+	}
+};
+
+static_assert(std::is_trivially_copyable<ArenaNetNode>::value, "Arena nodes must be copyable as bytes");
+static_assert(std::is_trivially_copyable<ArenaTreeNode>::value, "Arena nodes must be copyable as bytes");
+static_assert(sizeof(ArenaNetNode) == 72 && sizeof(ArenaTreeNode) == 12, "Arena nodes must not have padding");
+
+/**
+ * Nodes stored in post-order in one flat vector, linked by index.
+ * Children always come before their parents, so any prefix is a valid arena.
+ * Names are kept out of the nodes in a single block of null terminated strings.
+ */
+template<typename Node, uint32_t Magic>
+class NodeArena {
+public:
+	/**
+	 * Reserve space for the given number of nodes.
+	 */
+	void reserve(int size) {
+		nodes.reserve(size);
+	}
+
+	/**
+	 * Remove every node, keeping the memory for reuse.
+	 */
+	void clear() {
+		nodes.clear();
+		names.clear();
+	}
+
+	/**
+	 * Get the number of nodes.
+	 */
+	int32_t size() const {
+		return nodes.size();
+	}
+
+	/**
+	 * Get the name of a node.
+	 */
+	const char* getName(int32_t index) const {
+		return names.data() + nodes[index].name;
+	}
+
+	/**
+	 * Find which nodes are reachable from root.
+	 */
+	std::vector<bool> getReachable(int32_t root) const {
+		std::vector<bool> reachable(root + 1, false);
+		reachable[root] = true;
+
+		// Children come before their parents, so a single backwards pass is enough
+		for (int32_t i = root; i >= 0; i--) {
+			if (reachable[i]) {
+				forEachChild(nodes[i], [&reachable](int32_t child) {
+					reachable[child] = true;
+				});
+			}
+		}
+
+		return reachable;
+	}
+
+	/**
+	 * Add every node of another arena after the nodes of this one.
+	 * Returns the offset added to the indices of the other arena.
+	 */
+	int32_t append(const NodeArena& other) {
+		int32_t offset = nodes.size();
+		int32_t nameOffset = names.size();
+
+		nodes.reserve(nodes.size() + other.nodes.size());
+		for (Node node : other.nodes) {
+			offsetLinks(node, offset);
+			node.name += nameOffset;
+			nodes.push_back(node);
+		}
+
+		names.insert(names.end(), other.names.begin(), other.names.end());
+
+		return offset;
+	}
+
+	/**
+	 * Write the arena as a single block of bytes.
+	 */
+	std::vector<char> serialize() const {
+		Header header = {Magic, version, (uint32_t) nodes.size(), (uint32_t) names.size()};
+
+		std::vector<char> result(sizeof(Header) + nodes.size() * sizeof(Node) + names.size());
+		char* next = result.data();
+
+		std::memcpy(next, &header, sizeof(Header));
+		next += sizeof(Header);
+
+		std::memcpy(next, nodes.data(), nodes.size() * sizeof(Node));
+		next += nodes.size() * sizeof(Node);
+
+		std::memcpy(next, names.data(), names.size());
+
+		return result;
+	}
+
+	/**
+	 * Read an arena written by serialize.
+	 * Returns false, leaving the arena untouched, if the bytes are not a valid arena.
+	 */
+	bool deserialize(const char* data, size_t length) {
+		Header header;
+		if (length < sizeof(Header)) {
+			return false;
+		}
+		std::memcpy(&header, data, sizeof(Header));
+
+		if (header.magic != Magic || header.version != version || length != sizeof(Header) + (size_t) header.numNodes * sizeof(Node) + header.nameBytes) {
+			return false;
+		}
+
+		std::vector<Node> nextNodes(header.numNodes);
+		std::memcpy(nextNodes.data(), data + sizeof(Header), header.numNodes * sizeof(Node));
+
+		const char* nameData = data + sizeof(Header) + header.numNodes * sizeof(Node);
+		std::vector<char> nextNames(nameData, nameData + header.nameBytes);
+
+		if (!nextNames.empty() && nextNames.back() != '\0') {
+			return false;
+		}
+
+		for (int32_t i = 0; i < (int32_t) nextNodes.size(); i++) {
+			if (!nextNodes[i].hasValidLinks(i) || nextNodes[i].name < 0 || nextNodes[i].name >= (int32_t) nextNames.size()) {
+				return false;
+			}
+		}
+
+		nodes = std::move(nextNodes);
+		names = std::move(nextNames);
+		return true;
+	}
+
+	/**
+	 * Save the arena to a file.
+	 */
+	bool save(const char* path) const {
+		std::vector<char> bytes = serialize();
+		std::ofstream file(path, std::ios::binary);
+		file.write(bytes.data(), bytes.size());
+		return (bool) file;
+	}
+
+	/**
+	 * Load an arena saved by save.
+	 */
+	bool load(const char* path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			return false;
+		}
+
+		std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		return deserialize(bytes.data(), bytes.size());
+	}
+
+	std::vector<Node> nodes;
+
+protected:
+	/**
+	 * Add a node, checking that it only links to existing nodes.
+	 * Returns -1 without adding it if it doesn't.
+	 */
+	int32_t addNode(Node node, const char* name) {
+		int32_t index = nodes.size();
+		if (!node.hasValidLinks(index)) {
+			std::cerr<<"Node "<<name<<" links to a node that doesn't exist yet"<<std::endl;
+			return -1;
+		}
+
+		node.name = names.size();
+		names.insert(names.end(), name, name + std::strlen(name) + 1);
+
+		nodes.push_back(node);
+		return index;
+	}
+
+	/**
+	 * Call f with the index of each child of a network node.
+	 */
+	template<typename F>
+	static void forEachChild(const ArenaNetNode& node, F f) {
+		for (int i = 0; i < node.getNumEdges(); i++) {
+			f(node.edges[i].node);
+		}
+	}
+
+	/**
+	 * Call f with the index of each child of a tree node.
+	 */
+	template<typename F>
+	static void forEachChild(const ArenaTreeNode& node, F f) {
+		if (!node.isLeaf()) {
+			f(node.leftChild);
+			f(node.rightChild);
+		}
+	}
+
+	/**
+	 * Move the links of a network node by offset.
+	 */
+	static void offsetLinks(ArenaNetNode& node, int32_t offset) {
+		for (int i = 0; i < node.getNumEdges(); i++) {
+			node.edges[i].node += offset;
+		}
+	}
+
+	/**
+	 * Move the links of a tree node by offset.
+	 */
+	static void offsetLinks(ArenaTreeNode& node, int32_t offset) {
+		if (!node.isLeaf()) {
+			node.leftChild += offset;
+			node.rightChild += offset;
+		}
+	}
+
+	std::vector<char> names;
+
+private:
+	/**
+	 * The start of serialized arenas.
+	 */
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t numNodes;
+		uint32_t nameBytes;
+	};
+
+	static const uint32_t version = 1;
+};
+
+/**
+ * A flat store of network nodes. A single arena can hold many networks.
+ */
+class NetworkArena : public NodeArena<ArenaNetNode, 0x4e504e41> {
+public:
+	/**
+	 * Add a leaf node.
+	 */
+	int32_t addLeaf(const char* name) {
+		ArenaNetNode node = {0, NodeType::LEAF, 0, -1, 0, {}};
+		return addNode(node, name);
+	}
+
+	/**
+	 * Add a tree node.
+	 */
+	int32_t addTree(const char* name, ArenaEdge leftEdge, ArenaEdge rightEdge) {
+		ArenaNetNode node = {0, NodeType::TREE, 0, -1, 0, {leftEdge, rightEdge}};
+		return addNode(node, name);
+	}
+
+	/**
+	 * Add a network node.
+	 */
+	int32_t addNetwork(const char* name, ArenaEdge childEdge, double leftProbability, int32_t introgressionId) {
+		ArenaNetNode node = {leftProbability, NodeType::NETWORK, 0, introgressionId, 0, {childEdge}};
+		return addNode(node, name);
+	}
+
+	/**
+	 * Set the parameters of the network at root.
+	 */
+	void setParams(int32_t root, const double* params) {
+		std::vector<bool> reachable = getReachable(root);
+
+		for (int32_t i = 0; i <= root; i++) {
+			if (reachable[i]) {
+				ArenaNetNode& node = nodes[i];
+				for (int j = 0; j < node.getNumEdges(); j++) {
+					node.edges[j].distance = params[node.edges[j].paramId];
+				}
+				if (node.type == NodeType::NETWORK) {
+					node.leftProbability = params[node.introgressionId];
+				}
+			}
+		}
+	}
+
+	/**
+	 * Get the parameters of the network at root, the inverse of setParams.
+	 */
+	void getParams(int32_t root, double* params) const {
+		std::vector<bool> reachable = getReachable(root);
+
+		for (int32_t i = 0; i <= root; i++) {
+			if (reachable[i]) {
+				const ArenaNetNode& node = nodes[i];
+				for (int j = 0; j < node.getNumEdges(); j++) {
+					params[node.edges[j].paramId] = node.edges[j].distance;
+				}
+				if (node.type == NodeType::NETWORK) {
+					params[node.introgressionId] = node.leftProbability;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Get the maximum parameter index of the network at root.
+	 */
+	int getMaximumParamId(int32_t root) const {
+		std::vector<bool> reachable = getReachable(root);
+
+		int result = -1;
+		for (int32_t i = 0; i <= root; i++) {
+			if (reachable[i]) {
+				const ArenaNetNode& node = nodes[i];
+				for (int j = 0; j < node.getNumEdges(); j++) {
+					result = std::max(result, (int) node.edges[j].paramId);
+				}
+				if (node.type == NodeType::NETWORK) {
+					result = std::max(result, (int) node.introgressionId);
+				}
+			}
+		}
+
+		return result;
+	}
+};
+
+/**
+ * A flat store of tree nodes. A single arena can hold many trees.
+ */
+class TreeArena : public NodeArena<ArenaTreeNode, 0x4e505441> {
+public:
+	/**
+	 * Add a leaf node.
+	 */
+	int32_t addLeaf(const char* name) {
+		return addNode({0, -1, -1}, name);
+	}
+
+	/**
+	 * Add a tree node.
+	 */
+	int32_t addTree(const char* name, int32_t leftChild, int32_t rightChild) {
+		return addNode({0, leftChild, rightChild}, name);
+	}
+};
+
+/**
+ * Add a network node and everything below it to an arena.
+ */
+inline int32_t appendNetNode(NetworkArena& arena, const NetNode& node, std::map<const NetNode*, int32_t>& indices) {
+	auto found = indices.find(&node);
+	if (found != indices.end()) {
+		return found->second;
+	}
+
+	auto appendEdge = [&arena, &indices](const Edge<NetNode>& edge) {
+		ArenaEdge result = {edge.distance, appendNetNode(arena, edge.toNode, indices), (int32_t) edge.id, edge.type, 0};
+		return result;
+	};
+
+	int32_t index;
+
+	switch (node.type) {
+		case NodeType::LEAF:
+			index = arena.addLeaf(node.name.c_str());
+			break;
+
+		case NodeType::TREE: {
+			ArenaEdge leftEdge = appendEdge(*node.leftEdge);
+			ArenaEdge rightEdge = appendEdge(*node.rightEdge);
+			index = arena.addTree(node.name.c_str(), leftEdge, rightEdge);
+			break;
+		}
+
+		case NodeType::NETWORK:
+			index = arena.addNetwork(node.name.c_str(), appendEdge(*node.childEdge), node.leftProbability, node.introgressionId);
+			break;
+
+		default:
+			std::cerr<<"Unknown type"<<std::endl;
+			exit(-1);
+	}
+
+	indices[&node] = index;
+	return index;
+}
+
+/**
+ * Add a whole network to an arena, returning the index of its root.
+ */
+inline int32_t appendNetwork(NetworkArena& arena, const NetNode& species) {
+	std::map<const NetNode*, int32_t> indices;
+	return appendNetNode(arena, species, indices);
+}
+
+/**
+ * Add a whole tree to an arena, returning the index of its root.
+ */
+inline int32_t appendTree(TreeArena& arena, const TreeNode& node) {
+	if (node.isLeaf) {
+		return arena.addLeaf(node.name.c_str());
+	}
+
+	int32_t left = appendTree(arena, *node.leftChild);
+	int32_t right = appendTree(arena, *node.rightChild);
+	return arena.addTree(node.name.c_str(), left, right);
+}
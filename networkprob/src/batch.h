@@ -0,0 +1,239 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include "arena.h"
+#include "prepared.h"
+#include "topology.h"
+#include "parallel.h"
+#include "subtreecache.h"
+
+/**
+ * A weighted set of gene trees prepared against one network, with one entry per unique topology.
+ */
+struct GeneTreeBatch {
+	std::vector<PreparedGeneTree> trees;
+	std::vector<double> weights; // The summed weight of every tree with the topology.
+	std::vector<int32_t> uniqueIndices; // For every original tree, the index of its topology.
+};
+
+/**
+ * Prepare a batch of weighted gene trees, collapsing duplicate topologies.
+ * Returns false, after printing why, if any gene tree can't be evaluated against the network.
+ */
+inline bool prepareGeneTreeBatch(const PreparedNetwork& network, const TreeArena& arena, const std::vector<int32_t>& roots, const std::vector<double>& weights, GeneTreeBatch& result) {
+	UniqueGeneTrees unique = findUniqueGeneTrees(arena, roots, weights);
+
+	result.trees.assign(unique.roots.size(), PreparedGeneTree());
+	result.weights = std::move(unique.weights);
+	result.uniqueIndices = std::move(unique.uniqueIndices);
+
+	std::vector<char> prepared(unique.roots.size());
+	parallelFor(unique.roots.size(), [&](int i) {
+		prepared[i] = prepareGeneTree(network, arena, unique.roots[i], result.trees[i]);
+	});
+
+	return std::find(prepared.begin(), prepared.end(), false) == prepared.end();
+}
+
+/**
+ * The type densemap histories are kept in while evaluating a batch.
+ * Float halves the memory every map takes, for screening many params or networks quickly.
+ */
+enum class HistoryPrecision : int32_t {
+	DOUBLE = 0,
+	FLOAT = 1,
+};
+
+/**
+ * Settings for the precision of batch evaluations.
+ */
+struct PrecisionOptions {
+	HistoryPrecision precision = HistoryPrecision::DOUBLE;
+	double tolerance = 1e-2; // Float evaluations whose estimated log likelihood error is larger are done again in double.
+	double pruneTolerance = 0; // Above 0, each tree drops histories that can't change its probability by more than this fraction.
+
+	// What each tree's probability is expected to be, which pruning measures what it drops against, see
+	// EvaluationContext::pruneScale. Each evaluation fills it in with the probabilities it got, so passing the same
+	// vector to the next one, at nearby params, lets it prune. Trees without one yet, 0, aren't pruned.
+	std::vector<double>* treeProbabilities = nullptr;
+};
+
+/**
+ * How a batch was evaluated.
+ */
+struct PrecisionReport {
+	HistoryPrecision precision = HistoryPrecision::DOUBLE; // The precision the result was computed in.
+	double errorEstimate = 0; // The estimated error of the log likelihood.
+	bool fellBack = false; // Float was asked for, but its estimate exceeded the tolerance.
+	int64_t prunedHistories = 0;
+	int64_t prunedMaps = 0;
+	double pruneBound = 0; // How much pruning can have lowered the log likelihood, at most.
+	int pruneFallbacks = 0; // Trees that pruning dropped too much of, so they were computed again without it.
+};
+
+/**
+ * Estimate the relative rounding error of the probability of a gene tree computed with histories of type T.
+ * Every history is rounded once per operation at each node and once per term summed into it, and the root sums
+ * its maps, which bounds the longest chain of roundings. Every term is positive, so like the probabilistic analysis
+ * of Higham and Mary the estimate grows with the square root of that length. Probabilities T can't hold to full
+ * precision get an infinite estimate.
+ */
+template<typename T>
+double estimateRelativeError(const PreparedNetwork& network, const PreparedGeneTree& tree, size_t rootMaps, T probability) {
+	if (!(probability >= std::numeric_limits<T>::min() / std::numeric_limits<T>::epsilon())) {
+		return std::numeric_limits<double>::infinity();
+	}
+
+	double roundings = network.nodes.size() * ((1 << tree.events.size()) + 4.0) + rootMaps;
+	return 5 * std::sqrt(roundings) * std::numeric_limits<T>::epsilon() / 2; // Five deviations of independent roundings.
+}
+
+/**
+ * Compute the probability of one tree of a batch, using cache if it is not nullptr.
+ */
+inline double calcTreeProbability(const PreparedNetwork& network, const PreparedGeneTree& tree, const double* params, EvaluationContext<double>& context, std::vector<double>* derivatives, SubtreeCache* cache) {
+	return cache != nullptr ? calcProbability(network, tree, params, context, derivatives, *cache) : calcProbability(network, tree, DoubleParams{params}, context, derivatives);
+}
+
+/**
+ * Compute the probability of one tree of a batch in float. The cache only holds double maps, so it isn't used.
+ */
+inline float calcTreeProbability(const PreparedNetwork& network, const PreparedGeneTree& tree, const double* params, EvaluationContext<float>& context, std::vector<float>* derivatives, SubtreeCache*) {
+	return calcProbability(network, tree, DoubleParams{params}, context, derivatives);
+}
+
+/**
+ * Compute the weighted log likelihood of a batch with histories of type T, summing in double.
+ * Prunes histories with pruneTolerance against treeProbabilities and then fills it in, if it is not nullptr.
+ * Fills in the error estimate and pruning of report if it is not nullptr.
+ */
+template<typename T>
+double calcLogLikelihoodIn(const PreparedNetwork& network, const GeneTreeBatch& batch, const double* params, std::vector<double>* derivatives, SubtreeCache* cache, double pruneTolerance, std::vector<double>* treeProbabilities, PrecisionReport* report) {
+	TraceSpan span("logLikelihood");
+	int numTrees = batch.trees.size();
+
+	if (treeProbabilities != nullptr) {
+		treeProbabilities->resize(numTrees, 0.0);
+	}
+
+	std::vector<double> partialResults(getNumThreads(), 0.0);
+	std::vector<PrecisionReport> partialReports(partialResults.size());
+	std::vector<std::vector<double>> partialDerivatives(partialResults.size());
+
+	int numChunks = parallelChunks(numTrees, [&](int chunk, int begin, int end) {
+		static thread_local EvaluationContext<T> context;
+		context.pruneTolerance = treeProbabilities != nullptr ? pruneTolerance : 0;
+
+		std::vector<T> treeDerivatives;
+		if (derivatives != nullptr) {
+			partialDerivatives[chunk].assign(network.numParams, 0.0);
+		}
+
+		for (int i = begin; i < end; i++) {
+			TraceSpan treeSpan("tree", i);
+			double weight = batch.weights[i];
+
+			std::vector<T>* target = derivatives != nullptr ? &treeDerivatives : nullptr;
+			context.pruneScale = treeProbabilities != nullptr ? (*treeProbabilities)[i] : 0;
+			T probability = calcTreeProbability(network, batch.trees[i], params, context, target, cache);
+			if (treeProbabilities != nullptr) {
+				(*treeProbabilities)[i] = probability;
+			}
+
+			partialResults[chunk] += weight * std::log((double) probability);
+
+			if (report != nullptr) {
+				PrecisionReport& partial = partialReports[chunk];
+				size_t rootMaps = context.nodes.empty() ? 0 : context.nodes.back().currentData.size();
+				double relative = estimateRelativeError(network, batch.trees[i], rootMaps, probability);
+				partial.errorEstimate += relative < 1 ? std::abs(weight) * relative / (1 - relative) : std::numeric_limits<double>::infinity();
+
+				// The exact probability is at most the pruned one plus the mass that was dropped
+				partial.prunedHistories += context.pruned.histories;
+				partial.prunedMaps += context.pruned.maps;
+				partial.pruneBound += std::abs(weight) * std::log1p(context.pruned.mass / (double) probability);
+				partial.pruneFallbacks += context.pruned.fellBack;
+			}
+
+			if (derivatives != nullptr) {
+				for (int j = 0; j < network.numParams; j++) {
+					partialDerivatives[chunk][j] += weight * (double) treeDerivatives[j] / (double) probability;
+				}
+			}
+		}
+	});
+
+	// Add up in chunk order so results don't depend on thread timing
+	double result = 0;
+	if (derivatives != nullptr) {
+		derivatives->assign(network.numParams, 0.0);
+	}
+	if (report != nullptr) {
+		*report = PrecisionReport();
+	}
+
+	for (int chunk = 0; chunk < numChunks; chunk++) {
+		result += partialResults[chunk];
+		if (derivatives != nullptr) {
+			for (int j = 0; j < network.numParams; j++) {
+				(*derivatives)[j] += partialDerivatives[chunk][j];
+			}
+		}
+		if (report != nullptr) {
+			report->errorEstimate += partialReports[chunk].errorEstimate;
+			report->prunedHistories += partialReports[chunk].prunedHistories;
+			report->prunedMaps += partialReports[chunk].prunedMaps;
+			report->pruneBound += partialReports[chunk].pruneBound;
+			report->pruneFallbacks += partialReports[chunk].pruneFallbacks;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Compute the weighted log likelihood of a batch, the sum of weight * log(P(tree | network)).
+ * Each unique topology is evaluated once, in parallel.
+ * Also computes the derivatives if it is not nullptr.
+ * If cache is not nullptr, species subtrees are shared between gene trees with the same events inside them,
+ * and with earlier calls at params that only differ outside them.
+ */
+inline double calcLogLikelihood(const PreparedNetwork& network, const GeneTreeBatch& batch, const double* params, std::vector<double>* derivatives = nullptr, SubtreeCache* cache = nullptr) {
+	return calcLogLikelihoodIn<double>(network, batch, params, derivatives, cache, 0, nullptr, nullptr);
+}
+
+/**
+ * Compute the weighted log likelihood of a batch with histories in the given precision.
+ * A float result whose error estimate exceeds the tolerance is computed again in double, and float never uses cache.
+ * Pruning doesn't use cache either, since cached subtrees are shared by trees that prune differently.
+ * If report is not nullptr it gets how the result was computed, its error estimate and what was pruned.
+ */
+inline double calcLogLikelihood(const PreparedNetwork& network, const GeneTreeBatch& batch, const double* params, const PrecisionOptions& precision, PrecisionReport* report, std::vector<double>* derivatives = nullptr, SubtreeCache* cache = nullptr) {
+	PrecisionReport result;
+	if (precision.pruneTolerance > 0) {
+		cache = nullptr;
+	}
+
+	if (precision.precision == HistoryPrecision::FLOAT) {
+		double logLikelihood = calcLogLikelihoodIn<float>(network, batch, params, derivatives, nullptr, precision.pruneTolerance, precision.treeProbabilities, &result);
+		if (result.errorEstimate <= precision.tolerance) {
+			result.precision = HistoryPrecision::FLOAT;
+			if (report != nullptr) {
+				*report = result;
+			}
+			return logLikelihood;
+		}
+	}
+
+	double logLikelihood = calcLogLikelihoodIn<double>(network, batch, params, derivatives, cache, precision.pruneTolerance, precision.treeProbabilities, &result);
+	result.fellBack = precision.precision == HistoryPrecision::FLOAT;
+	if (report != nullptr) {
+		*report = result;
+	}
+	return logLikelihood;
+}
@@ -0,0 +1,662 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "densemap.h"
+#include "mathutils.h"
+#include "netnode.h"
+#include "example.h"
+#include "newick.h"
+#include "prepared.h"
+#include "batch.h"
+#include "circuit.h"
+#include "netsearch.h"
+#include "simulate.h"
+#include "perfcounters.h"
+
+// Benchmarks for the densemap operations and for whole evaluations.
+// Usage: bench [--filter text] [--min-time seconds] [--json path] [--compare baseline.json] [--threshold percent] [--counters]
+
+/**
+ * The number of allocations so far, counted by the replaced operator new.
+ */
+static std::atomic<long long> allocationCount(0);
+
+// Replacing the global allocation functions is what lets allocations be counted
+__attribute__((noinline)) void* operator new(size_t size) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	void* result = std::malloc(size == 0 ? 1 : size);
+	if (result == nullptr) {
+		throw std::bad_alloc();
+	}
+	return result;
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer) noexcept {
+	std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, size_t) noexcept {
+	std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void* pointer) noexcept {
+	std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void* pointer, size_t) noexcept {
+	std::free(pointer);
+}
+
+/**
+ * Keep the compiler from optimizing away a value.
+ */
+template<typename T>
+inline void keep(const T& value) {
+	asm volatile("" : : "r"(&value) : "memory");
+}
+
+/**
+ * One benchmark. run does one operation and returns the number of densemaps it produced.
+ */
+struct Benchmark {
+	std::string name;
+	std::function<long long()> run;
+};
+
+/**
+ * What a benchmark measured, per operation.
+ */
+struct BenchmarkResult {
+	std::string name;
+	double nanoseconds;
+	double maps;
+	double allocations;
+	std::array<double, numPerfCounters> counters; // Hardware events per operation, or -1 if they weren't counted.
+};
+
+/**
+ * Time a benchmark, growing the number of operations until a batch takes at least minTime seconds.
+ * Keeps the fastest of three batches. If counters is not nullptr, the hardware events of the last batch are counted.
+ */
+inline BenchmarkResult measure(const Benchmark& benchmark, double minTime, PerfCounters* counters) {
+	using Clock = std::chrono::steady_clock;
+
+	// The first call warms up caches and lazily built tables
+	long long maps = benchmark.run();
+
+	long long iterations = 1;
+	double seconds = 0;
+	while (true) {
+		auto start = Clock::now();
+		for (long long i = 0; i < iterations; i++) {
+			keep(benchmark.run());
+		}
+		seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+		if (seconds >= minTime || iterations >= (1LL << 40)) {
+			break;
+		}
+		iterations = seconds <= 0 ? iterations * 10 : std::max(iterations * 2, (long long) (iterations * minTime * 1.2 / seconds));
+	}
+
+	double best = seconds;
+	long long allocations = 0;
+	std::array<double, numPerfCounters> events;
+	events.fill(-1);
+	for (int repeat = 0; repeat < 2; repeat++) {
+		bool counting = counters != nullptr && repeat == 1;
+		if (counting) {
+			counters->start();
+		}
+
+		long long allocationsBefore = allocationCount.load();
+		auto start = Clock::now();
+		for (long long i = 0; i < iterations; i++) {
+			keep(benchmark.run());
+		}
+		best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+		allocations = allocationCount.load() - allocationsBefore;
+
+		if (counting) {
+			events = counters->stop();
+		}
+	}
+
+	for (double& count : events) {
+		if (count >= 0) {
+			count /= iterations;
+		}
+	}
+
+	return {benchmark.name, best * 1e9 / iterations, (double) maps, (double) allocations / iterations, events};
+}
+
+/**
+ * Make a leaf densemap for a taxon of a gene tree, like a leaf of the network does.
+ */
+inline densemap makeLeafMap(const std::map<std::string, int>& taxa, const std::string& name, int numNetNodes) {
+	densemap result;
+	result.init(1 << taxa.find(name)->second, std::vector<int64_t>(numNetNodes, -1));
+	result.setHistory(0, 1.0);
+	return result;
+}
+
+/**
+ * Count the densemaps held by every node of a network after an evaluation.
+ */
+inline long long countMaps(const std::vector<NetNode>& nodes) {
+	long long result = 0;
+	for (auto&& node : nodes) {
+		result += node.currentData.size() + node.leftData.size() + node.rightData.size();
+		for (auto&& maps : node.derivatives) {
+			result += maps.size();
+		}
+		for (auto&& maps : node.leftDerivatives) {
+			result += maps.size();
+		}
+		for (auto&& maps : node.rightDerivatives) {
+			result += maps.size();
+		}
+	}
+	return result;
+}
+
+/**
+ * Count the densemaps held by an evaluation context after an evaluation.
+ */
+template<typename T>
+long long countMaps(const EvaluationContext<T>& context) {
+	long long result = 0;
+	for (auto&& node : context.nodes) {
+		result += node.countMaps();
+	}
+	return result;
+}
+
+/**
+ * Inputs shared by the micro benchmarks, built from the 7 taxa gene tree in example.h.
+ */
+struct MicroInputs {
+	std::vector<TreeNode> genes;
+	std::map<std::string, int> taxa;
+	std::vector<int> events;
+
+	std::vector<densemap> leaf; // A single leaf.
+	std::vector<densemap> left; // Two sister leaves after coalescing along an edge.
+	std::vector<densemap> right; // Three leaves after coalescing along an edge.
+	std::vector<densemap> joined; // Both of them after another edge.
+};
+
+/**
+ * Build the inputs for the micro benchmarks.
+ */
+inline void makeMicroInputs(MicroInputs& inputs) {
+	TreeNode& gene = createGene(inputs.genes);
+	inputs.taxa = getTaxa(gene);
+	inputs.events = getEvents(gene, inputs.taxa);
+
+	auto leaf = [&inputs](const char* name) {
+		return update(std::vector<densemap>{makeLeafMap(inputs.taxa, name, 1)}, inputs.events, 0.3);
+	};
+
+	inputs.leaf = {makeLeafMap(inputs.taxa, "A", 1)};
+	inputs.left = update(combine(leaf("A"), leaf("B")), inputs.events, 0.5);
+	inputs.right = update(combine(leaf("C"), update(combine(leaf("D"), leaf("F")), inputs.events, 0.2)), inputs.events, 0.5);
+	inputs.joined = update(combine(inputs.left, inputs.right), inputs.events, 0.4);
+}
+
+/**
+ * Add the micro benchmarks of the densemap operations.
+ */
+inline void addMicroBenchmarks(std::vector<Benchmark>& benchmarks, const MicroInputs& inputs) {
+	const densemap& sample = inputs.joined[0];
+	int history = 63 - __builtin_clzll(sample.getHistoryBitset());
+
+	benchmarks.push_back({"micro/performBFS", [&inputs, &sample, history]() {
+		auto result = performBFS(history, sample.getTaxaBits(), inputs.events);
+		keep(result);
+		return 0LL;
+	}});
+
+	benchmarks.push_back({"micro/update", [&inputs]() {
+		auto result = update(inputs.joined, inputs.events, 0.7);
+		return (long long) result.size();
+	}});
+
+	benchmarks.push_back({"micro/update_leaf", [&inputs]() {
+		auto result = update(inputs.leaf, inputs.events, 0.7);
+		return (long long) result.size();
+	}});
+
+	benchmarks.push_back({"micro/combine", [&inputs]() {
+		auto result = combine(inputs.left, inputs.right);
+		return (long long) result.size();
+	}});
+
+	benchmarks.push_back({"micro/split", [&inputs]() {
+		auto result = split(inputs.joined, 0, inputs.events, 0.4);
+		return (long long) (result.first.size() + result.second.size());
+	}});
+
+	benchmarks.push_back({"micro/createSubsets", []() {
+		auto result = createSubsets(0b1111111111);
+		keep(result);
+		return 0LL;
+	}});
+
+	benchmarks.push_back({"micro/puv", []() {
+		double total = 0;
+		for (int u = 1; u <= 7; u++) {
+			for (int v = 1; v <= u; v++) {
+				total += puv(u, v, 0.37);
+			}
+		}
+		keep(total);
+		return 0LL;
+	}});
+}
+
+/**
+ * A network from example.h with a gene tree over its leaves.
+ */
+struct ExampleCase {
+	std::string name;
+	std::vector<NetNode> species;
+	std::vector<TreeNode> genes;
+	NetNode* speciesRoot;
+	TreeNode* geneRoot;
+	std::vector<double> params;
+	PreparedNetwork prepared;
+	PreparedGeneTree preparedGene;
+	EvaluationContext<double> context;
+	Circuit circuit;
+	std::vector<double> gradient;
+};
+
+/**
+ * Add the legacy and prepared evaluations of an example with and without derivatives.
+ */
+inline void addExampleBenchmarks(std::vector<Benchmark>& benchmarks, ExampleCase& example) {
+	example.prepared = prepareNetwork(*example.speciesRoot);
+	example.params = example.prepared.params;
+	if (!prepareGeneTree(example.prepared, *example.geneRoot, example.preparedGene)) {
+		std::cerr<<"The gene tree of "<<example.name<<" doesn't match its network"<<std::endl;
+		exit(-1);
+	}
+	example.circuit = compileCircuit(example.prepared, example.preparedGene);
+	example.gradient.resize(example.circuit.getNumParams());
+
+	for (bool derivatives : {false, true}) {
+		std::string suffix = derivatives ? "/derivatives" : "";
+
+		benchmarks.push_back({"legacy/" + example.name + suffix, [&example, derivatives]() {
+			std::vector<double> result;
+			example.speciesRoot->setParams(example.params.data());
+			keep(calcProbability(*example.speciesRoot, *example.geneRoot, derivatives ? &result : nullptr));
+			return countMaps(example.species);
+		}});
+
+		benchmarks.push_back({"prepared/" + example.name + suffix, [&example, derivatives]() {
+			std::vector<double> result;
+			keep(calcProbability(example.prepared, example.preparedGene, DoubleParams{example.params.data()}, example.context, derivatives ? &result : nullptr));
+			return countMaps(example.context);
+		}});
+
+		benchmarks.push_back({"circuit/" + example.name + suffix, [&example, derivatives]() {
+			keep(example.circuit.evaluate(example.params.data(), derivatives ? example.gradient.data() : nullptr));
+			return 0LL;
+		}});
+	}
+}
+
+/**
+ * A generated network with a simulated gene tree over its leaves.
+ */
+struct GeneratedCase {
+	std::string name;
+	PreparedNetwork network;
+	PreparedGeneTree gene;
+	EvaluationContext<double> context;
+	EvaluationContext<float> floatContext;
+};
+
+/**
+ * Write a balanced tree over the leaves T<first> to T<last - 1> as Newick, without the final semicolon.
+ */
+inline std::string makeBalancedNewick(int first, int last) {
+	if (last - first == 1) {
+		return "T" + std::to_string(first);
+	}
+
+	int middle = (first + last) / 2;
+	return "(" + makeBalancedNewick(first, middle) + ":0.5," + makeBalancedNewick(middle, last) + ":0.5)";
+}
+
+/**
+ * Generate a network with the given number of leaves and reticulations, and simulate a gene tree for it.
+ * The same arguments always give the same network and gene tree.
+ */
+inline void makeGeneratedCase(int numTaxa, int numReticulations, GeneratedCase& result) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	if (!parseNetwork(makeBalancedNewick(0, numTaxa) + ";", arena, root, numParams)) {
+		exit(-1);
+	}
+
+	std::mt19937_64 generator(numTaxa * 16 + numReticulations);
+	EditableNetwork network = makeEditableNetwork(arena, root);
+
+	std::vector<int> touched;
+	while (getNumReticulations(network) < numReticulations) {
+		EditableNetwork candidate = network;
+		if (applyRandomMove(candidate, NetworkMove::ADD_RETICULATION, generator, touched) && isValidNetwork(candidate)) {
+			network = candidate;
+		}
+	}
+
+	NetworkArena generated;
+	result.name = "generated/taxa" + std::to_string(numTaxa) + "_reticulations" + std::to_string(numReticulations);
+	result.network = prepareNetwork(generated, appendEditableNetwork(generated, network));
+
+	TreeArena trees;
+	GeneTreeSimulator simulator(result.network, result.network.params.data());
+	int32_t geneRoot = simulator.simulate(generator, trees);
+	if (!prepareGeneTree(result.network, trees, geneRoot, result.gene)) {
+		std::cerr<<"The simulated gene tree of "<<result.name<<" doesn't match its network"<<std::endl;
+		exit(-1);
+	}
+}
+
+/**
+ * Add the evaluation of a generated network with and without derivatives, and with float histories.
+ */
+inline void addGeneratedBenchmarks(std::vector<Benchmark>& benchmarks, GeneratedCase& generated) {
+	for (bool derivatives : {false, true}) {
+		benchmarks.push_back({generated.name + (derivatives ? "/derivatives" : ""), [&generated, derivatives]() {
+			std::vector<double> result;
+			keep(calcProbability(generated.network, generated.gene, DoubleParams{generated.network.params.data()}, generated.context, derivatives ? &result : nullptr));
+			return countMaps(generated.context);
+		}});
+	}
+
+	benchmarks.push_back({generated.name + "/float", [&generated]() {
+		keep(calcProbability(generated.network, generated.gene, DoubleParams{generated.network.params.data()}, generated.floatContext));
+		return countMaps(generated.floatContext);
+	}});
+}
+
+/**
+ * A batch of gene trees simulated from a network with weak introgression, where pruning has the most to drop.
+ */
+struct PruningCase {
+	PreparedNetwork network;
+	GeneTreeBatch batch;
+	std::vector<double> treeProbabilities;
+	EvaluationContext<double> context;
+};
+
+/**
+ * Evaluate every tree of a pruning case, pruning against the probabilities of the last call if pruneTolerance is above 0.
+ */
+inline long long runPruningCase(PruningCase& pruning, double pruneTolerance) {
+	pruning.context.pruneTolerance = pruneTolerance;
+	pruning.treeProbabilities.resize(pruning.batch.trees.size(), 0.0);
+
+	long long maps = 0;
+	for (unsigned int i = 0; i < pruning.batch.trees.size(); i++) {
+		pruning.context.pruneScale = pruning.treeProbabilities[i];
+		pruning.treeProbabilities[i] = calcProbability(pruning.network, pruning.batch.trees[i], DoubleParams{pruning.network.params.data()}, pruning.context);
+		maps += countMaps(pruning.context);
+	}
+	return maps;
+}
+
+/**
+ * Add evaluations of the gene trees of a pruning case, exact and pruned at 1e-6.
+ */
+inline void addPruningBenchmarks(std::vector<Benchmark>& benchmarks, PruningCase& pruning) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	if (!parseNetwork("(((((A:0.05,B:0.05):0.05,(C:0.05,D:0.05):0.05):0.05,E:0.2):0.05)#H1:1::0.9999,(#H1:1,F:2):0.5);", arena, root, numParams)) {
+		exit(-1);
+	}
+	pruning.network = prepareNetwork(arena, root);
+
+	TreeArena trees;
+	std::vector<int32_t> roots;
+	std::mt19937_64 generator(1);
+	GeneTreeSimulator simulator(pruning.network, pruning.network.params.data());
+	for (int i = 0; i < 1000; i++) {
+		roots.push_back(simulator.simulate(generator, trees));
+	}
+	if (!prepareGeneTreeBatch(pruning.network, trees, roots, std::vector<double>(roots.size(), 1), pruning.batch)) {
+		exit(-1);
+	}
+
+	benchmarks.push_back({"pruning/exact", [&pruning]() {
+		return runPruningCase(pruning, 0);
+	}});
+
+	benchmarks.push_back({"pruning/1e-6", [&pruning]() {
+		return runPruningCase(pruning, 1e-6);
+	}});
+}
+
+/**
+ * Write results as JSON, one benchmark per line so baselines are easy to diff.
+ */
+inline void writeJson(const std::vector<BenchmarkResult>& results, std::ostream& out) {
+	out<<"{\n  \"benchmarks\": [\n";
+	for (unsigned int i = 0; i < results.size(); i++) {
+		const BenchmarkResult& result = results[i];
+		out<<"    {\"name\": \""<<result.name<<"\", \"ns_per_op\": "<<result.nanoseconds<<", \"maps_per_op\": "<<result.maps;
+		out<<", \"allocations_per_op\": "<<result.allocations;
+		for (int j = 0; j < numPerfCounters; j++) {
+			if (result.counters[j] >= 0) {
+				out<<", \""<<getPerfCounterName(j)<<"_per_op\": "<<result.counters[j];
+			}
+		}
+		out<<"}"<<(i + 1 < results.size() ? "," : "")<<"\n";
+	}
+	out<<"  ]\n}\n";
+}
+
+/**
+ * Read the ns/op of every benchmark in a file written by writeJson. Returns false if the file can't be read.
+ */
+inline bool readBaseline(const char* path, std::map<std::string, double>& baseline) {
+	std::ifstream file(path);
+	if (!file) {
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(file, line)) {
+		size_t name = line.find("\"name\": \"");
+		size_t time = line.find("\"ns_per_op\": ");
+		if (name == std::string::npos || time == std::string::npos) {
+			continue;
+		}
+
+		name += std::strlen("\"name\": \"");
+		std::string key = line.substr(name, line.find('"', name) - name);
+		baseline[key] = std::atof(line.c_str() + time + std::strlen("\"ns_per_op\": "));
+	}
+
+	return true;
+}
+
+/**
+ * Print instructions per cycle and misses per densemap produced, or - for what wasn't counted.
+ */
+inline void printCounters(const BenchmarkResult& result) {
+	const std::array<double, numPerfCounters>& counters = result.counters;
+	int cycles = (int) PerfCounter::CYCLES;
+	int instructions = (int) PerfCounter::INSTRUCTIONS;
+
+	if (counters[cycles] > 0 && counters[instructions] >= 0) {
+		printf(" %6.2f", counters[instructions] / counters[cycles]);
+	} else {
+		printf(" %6s", "-");
+	}
+
+	for (PerfCounter counter : {PerfCounter::L1_MISSES, PerfCounter::LLC_MISSES, PerfCounter::BRANCH_MISSES}) {
+		double count = counters[(int) counter];
+		if (count >= 0) {
+			printf(" %10.2f", count / std::max(1.0, result.maps));
+		} else {
+			printf(" %10s", "-");
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string filter;
+	double minTime = 0.2;
+	const char* jsonPath = nullptr;
+	const char* comparePath = nullptr;
+	double threshold = 10;
+	bool useCounters = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 < argc && arg == "--filter") {
+			filter = argv[++i];
+		} else if (i + 1 < argc && arg == "--min-time") {
+			minTime = std::atof(argv[++i]);
+		} else if (i + 1 < argc && arg == "--json") {
+			jsonPath = argv[++i];
+		} else if (i + 1 < argc && arg == "--compare") {
+			comparePath = argv[++i];
+		} else if (i + 1 < argc && arg == "--threshold") {
+			threshold = std::atof(argv[++i]);
+		} else if (arg == "--counters") {
+			useCounters = true;
+		} else {
+			std::cerr<<"Usage: "<<argv[0]<<" [--filter text] [--min-time seconds] [--json path] [--compare baseline.json] [--threshold percent] [--counters]"<<std::endl;
+			return 2;
+		}
+	}
+
+	std::map<std::string, double> baseline;
+	if (comparePath != nullptr && !readBaseline(comparePath, baseline)) {
+		std::cerr<<"Can't read the baseline "<<comparePath<<std::endl;
+		return 2;
+	}
+
+	// Without permission for perf events the benchmarks still run, just without the counter columns
+	std::unique_ptr<PerfCounters> counters;
+	if (useCounters) {
+		counters.reset(new PerfCounters());
+		if (!counters->isAnyAvailable()) {
+			std::cerr<<"Hardware counters are unavailable ("<<counters->getError()<<"), check /proc/sys/kernel/perf_event_paranoid"<<std::endl;
+			counters.reset();
+		} else if (!counters->getError().empty()) {
+			std::cerr<<"Some hardware counters are unavailable ("<<counters->getError()<<")"<<std::endl;
+		}
+	}
+
+	std::vector<Benchmark> benchmarks;
+
+	MicroInputs inputs;
+	makeMicroInputs(inputs);
+	addMicroBenchmarks(benchmarks, inputs);
+
+	double simpleParams[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<ExampleCase> examples(4);
+	examples[0].name = "species";
+	examples[0].speciesRoot = &createSpecies(examples[0].species);
+	examples[0].geneRoot = &createGene(examples[0].genes);
+	examples[1].name = "speciesWithTrivialIntro";
+	examples[1].speciesRoot = &createSpeciesWithTrivialIntro(examples[1].species);
+	examples[1].geneRoot = &createGene(examples[1].genes);
+	examples[2].name = "speciesWithIntro";
+	examples[2].speciesRoot = &createSpeciesWithIntro(examples[2].species);
+	examples[2].geneRoot = &createGene(examples[2].genes);
+	examples[3].name = "simpleSpecies";
+	examples[3].speciesRoot = &createSimpleSpecies(examples[3].species, simpleParams);
+	examples[3].geneRoot = &createSimpleGene(examples[3].genes);
+	for (auto&& example : examples) {
+		addExampleBenchmarks(benchmarks, example);
+	}
+
+	std::vector<GeneratedCase> generated;
+	generated.reserve(12);
+	for (int numTaxa = 4; numTaxa <= 7; numTaxa++) {
+		for (int numReticulations = 0; numReticulations <= 2; numReticulations++) {
+			generated.emplace_back();
+			makeGeneratedCase(numTaxa, numReticulations, generated.back());
+			addGeneratedBenchmarks(benchmarks, generated.back());
+		}
+	}
+
+	PruningCase pruning;
+	addPruningBenchmarks(benchmarks, pruning);
+
+	std::vector<BenchmarkResult> results;
+	bool regressed = false;
+
+	printf("%-50s %12s %10s %10s", "benchmark", "ns/op", "maps/op", "allocs/op");
+	if (counters) {
+		printf(" %6s %10s %10s %10s", "IPC", "L1/map", "LLC/map", "brmiss/map");
+	}
+	if (comparePath != nullptr) {
+		printf(" %12s %9s", "baseline", "change");
+	}
+	printf("\n");
+
+	for (auto&& benchmark : benchmarks) {
+		if (benchmark.name.find(filter) == std::string::npos) {
+			continue;
+		}
+
+		BenchmarkResult result = measure(benchmark, minTime, counters.get());
+		results.push_back(result);
+
+		printf("%-50s %12.1f %10.0f %10.1f", result.name.c_str(), result.nanoseconds, result.maps, result.allocations);
+		if (counters) {
+			printCounters(result);
+		}
+
+		auto found = baseline.find(result.name);
+		if (found != baseline.end() && found->second > 0) {
+			double change = 100 * (result.nanoseconds / found->second - 1);
+			bool slower = change > threshold;
+			regressed = regressed || slower;
+			printf(" %12.1f %+8.1f%%%s", found->second, change, slower ? " REGRESSION" : "");
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (jsonPath != nullptr) {
+		std::ofstream file(jsonPath);
+		writeJson(results, file);
+		if (!file) {
+			std::cerr<<"Can't write "<<jsonPath<<std::endl;
+			return 2;
+		}
+	}
+
+	return regressed ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+/**
+ * Hands out memory by bumping a pointer through large blocks. Nothing is freed on its own;
+ * reset makes all of it available again at once. One arena belongs to one thread at a time.
+ */
+class BumpArena {
+public:
+	/**
+	 * Create an empty arena whose first block has blockSize bytes.
+	 */
+	explicit BumpArena(size_t a_blockSize = 1 << 16) : blockSize(a_blockSize), current(0), used(0), bytesUsed(0) {}
+
+	// A copy starts out empty, since what was handed out belongs to the original.
+	BumpArena(const BumpArena& other) : BumpArena(other.blockSize) {}
+
+	BumpArena& operator=(const BumpArena&) {
+		return *this;
+	}
+
+	/**
+	 * Get bytes aligned to alignment, which must be a power of two.
+	 */
+	void* allocate(size_t bytes, size_t alignment) {
+		while (current < blocks.size()) {
+			Block& block = blocks[current];
+			uintptr_t start = reinterpret_cast<uintptr_t>(block.data.get());
+			uintptr_t aligned = (start + used + alignment - 1) & ~(uintptr_t) (alignment - 1);
+
+			if (aligned + bytes <= start + block.size) {
+				bytesUsed += aligned + bytes - (start + used);
+				used = aligned + bytes - start;
+				return reinterpret_cast<void*>(aligned);
+			}
+
+			// Move on to the next block, leaving the end of this one unused
+			current++;
+			used = 0;
+		}
+
+		size_t size = std::max(bytes + alignment, blocks.empty() ? blockSize : blocks.back().size * 2);
+		blocks.push_back({std::unique_ptr<char[]>(new char[size]), size});
+		return allocate(bytes, alignment);
+	}
+
+	/**
+	 * Make everything handed out available again. Anything still using it must already be gone.
+	 * If the last use took several blocks they are merged, so the next use fits in one.
+	 */
+	void reset() {
+		if (blocks.size() > 1) {
+			size_t total = 0;
+			for (const Block& block : blocks) {
+				total += block.size;
+			}
+
+			blocks.clear();
+			blocks.push_back({std::unique_ptr<char[]>(new char[total]), total});
+		}
+
+		current = 0;
+		used = 0;
+		bytesUsed = 0;
+	}
+
+	/**
+	 * Get the bytes handed out since the last reset, including alignment.
+	 */
+	size_t getBytesUsed() const {
+		return bytesUsed;
+	}
+
+	/**
+	 * Get the bytes held in blocks.
+	 */
+	size_t getCapacity() const {
+		size_t result = 0;
+		for (const Block& block : blocks) {
+			result += block.size;
+		}
+		return result;
+	}
+
+private:
+	struct Block {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+
+	size_t blockSize;
+	std::vector<Block> blocks;
+	size_t current; // The block being bumped through.
+	size_t used; // The bytes used in the current block.
+	size_t bytesUsed;
+};
+
+/**
+ * A standard allocator that draws from a BumpArena, or from the heap if it has no arena.
+ * Containers built with it pass it on to the elements they construct that take an allocator, like
+ * std::scoped_allocator_adaptor, so a vector of densemaps keeps their choices in the same arena.
+ * Like std::pmr, copying a container moves it to the heap, so copies never outlive the arena by accident.
+ */
+template<typename T>
+class ArenaAllocator {
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::false_type;
+	using propagate_on_container_move_assignment = std::false_type;
+	using propagate_on_container_swap = std::false_type;
+
+	/**
+	 * Create an allocator that uses the heap.
+	 */
+	ArenaAllocator() : arena(nullptr) {}
+
+	/**
+	 * Create an allocator that uses an arena.
+	 */
+	explicit ArenaAllocator(BumpArena* a_arena) : arena(a_arena) {}
+
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.getArena()) {}
+
+	T* allocate(size_t n) {
+		if (arena == nullptr) {
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		}
+		return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	/**
+	 * Memory from an arena is only given back when the arena is reset.
+	 */
+	void deallocate(T* pointer, size_t) {
+		if (arena == nullptr) {
+			::operator delete(pointer);
+		}
+	}
+
+	/**
+	 * Construct an element, passing this allocator on if it takes one.
+	 */
+	template<typename U, typename... Args>
+	void construct(U* pointer, Args&&... args) {
+		using Tag = std::integral_constant<int, !std::uses_allocator<U, ArenaAllocator>::value ? 0 : std::is_constructible<U, std::allocator_arg_t, const ArenaAllocator&, Args...>::value ? 1 : 2>;
+		constructWith(Tag(), pointer, std::forward<Args>(args)...);
+	}
+
+	template<typename U>
+	void destroy(U* pointer) {
+		pointer->~U();
+	}
+
+	/**
+	 * Copies of containers go to the heap.
+	 */
+	ArenaAllocator select_on_container_copy_construction() const {
+		return ArenaAllocator();
+	}
+
+	/**
+	 * Get the arena, or nullptr for the heap.
+	 */
+	BumpArena* getArena() const {
+		return arena;
+	}
+
+private:
+	template<typename U, typename... Args>
+	void constructWith(std::integral_constant<int, 0>, U* pointer, Args&&... args) {
+		::new ((void*) pointer) U(std::forward<Args>(args)...);
+	}
+
+	template<typename U, typename... Args>
+	void constructWith(std::integral_constant<int, 1>, U* pointer, Args&&... args) {
+		::new ((void*) pointer) U(std::allocator_arg, *this, std::forward<Args>(args)...);
+	}
+
+	template<typename U, typename... Args>
+	void constructWith(std::integral_constant<int, 2>, U* pointer, Args&&... args) {
+		::new ((void*) pointer) U(std::forward<Args>(args)..., *this);
+	}
+
+	BumpArena* arena;
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+	return a.getArena() == b.getArena();
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+	return a.getArena() != b.getArena();
+}
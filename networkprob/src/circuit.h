@@ -0,0 +1,724 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+
+#include "densemap.h"
+#include "mathutils.h"
+#include "netnode.h"
+#include "treenode.h"
+#include "prepared.h"
+
+/**
+ * The operations that can appear in a likelihood circuit.
+ */
+enum class CircuitOp : uint8_t {
+	CONSTANT = 0, // A fixed value.
+	DECAY = 1, // exp(-rate * params[param])
+	LEFT_POWER = 2, // params[param] ^ exponent
+	RIGHT_POWER = 3, // (1 - params[param]) ^ exponent
+	ADD = 4,
+	MULTIPLY = 5,
+	SQRT = 6,
+};
+
+/**
+ * A node in a circuit that is still being recorded.
+ * Leaves store the parameter index in a and the rate or exponent in b.
+ * Interior nodes store their operands in a and b.
+ */
+struct CircuitNode {
+	CircuitOp op;
+	int32_t a;
+	int32_t b;
+	double constant;
+};
+
+/**
+ * Check if two circuit nodes are identical.
+ */
+inline bool operator==(const CircuitNode& left, const CircuitNode& right) {
+	return left.op == right.op && left.a == right.a && left.b == right.b && std::memcmp(&left.constant, &right.constant, sizeof(double)) == 0;
+}
+
+/**
+ * A hash for circuit nodes so that identical nodes are only created once.
+ */
+struct CircuitNodeHash {
+	size_t operator()(const CircuitNode& node) const {
+		uint64_t constantBits;
+		std::memcpy(&constantBits, &node.constant, sizeof(double));
+
+		uint64_t hash = 14695981039346656037ULL;
+		for (uint64_t part : {(uint64_t)node.op, (uint64_t)(uint32_t)node.a, (uint64_t)(uint32_t)node.b, constantBits}) {
+			hash = (hash ^ part) * 1099511628211ULL;
+		}
+		return hash;
+	}
+};
+
+/**
+ * A run of consecutive slots in a compiled circuit that all perform the same operation.
+ */
+struct CircuitRun {
+	CircuitOp op;
+	int32_t begin;
+	int32_t end;
+};
+
+/**
+ * A straight line arithmetic circuit for the probability of a gene tree given a network.
+ * The slots are laid out as constants, then leaves, then interior nodes.
+ * The interior nodes are sorted by depth and operation so they evaluate as a few tight loops.
+ */
+class Circuit {
+public:
+	/**
+	 * Get the number of parameters the circuit reads.
+	 */
+	int getNumParams() const {
+		return numParams;
+	}
+
+	/**
+	 * Get the total number of slots in the circuit.
+	 */
+	int getSize() const {
+		return size;
+	}
+
+	/**
+	 * Evaluate the circuit at the given params.
+	 * If gradient is not nullptr, it is filled with the derivative for each param.
+	 * The slots live in a buffer each thread keeps between calls, so repeated evaluations don't allocate.
+	 */
+	double evaluate(const double* params, double* gradient = nullptr) const {
+		static thread_local std::vector<double> values;
+		values.resize(size);
+		double* v = values.data();
+
+		std::copy(constants.begin(), constants.end(), v);
+		evaluateLeaves(params, v);
+
+		for (const auto& run : runs) {
+			const int32_t* a = operandA.data();
+			const int32_t* b = operandB.data();
+
+			switch (run.op) {
+				case CircuitOp::ADD:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						v[i] = v[a[i]] + v[b[i]];
+					}
+					break;
+
+				case CircuitOp::MULTIPLY:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						v[i] = v[a[i]] * v[b[i]];
+					}
+					break;
+
+				case CircuitOp::SQRT:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						v[i] = std::sqrt(v[a[i]]);
+					}
+					break;
+
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+
+		if (gradient != nullptr) {
+			backpropagate(params, v, gradient);
+		}
+
+		return v[output];
+	}
+
+	int numParams = 0;
+	int32_t size = 0;
+	int32_t firstLeaf = 0;
+	int32_t firstInterior = 0;
+	int32_t output = 0;
+
+	// The values of the constant slots.
+	std::vector<double> constants;
+
+	// The leaf slots, which read params.
+	// leafParams and leafArgs are indexed by slot.
+	std::vector<CircuitRun> leafRuns;
+	std::vector<int32_t> leafParams;
+	std::vector<int32_t> leafArgs;
+
+	// The interior slots, which read other slots.
+	// operandA and operandB are indexed by slot.
+	std::vector<CircuitRun> runs;
+	std::vector<int32_t> operandA;
+	std::vector<int32_t> operandB;
+
+private:
+	/**
+	 * Compute the values of all the leaves.
+	 */
+	void evaluateLeaves(const double* params, double* v) const {
+		const int32_t* param = leafParams.data();
+		const int32_t* arg = leafArgs.data();
+
+		for (const auto& run : leafRuns) {
+			switch (run.op) {
+				case CircuitOp::DECAY:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						v[i] = std::exp(-(double)arg[i] * params[param[i]]);
+					}
+					break;
+
+				case CircuitOp::LEFT_POWER:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						v[i] = leftInheritance(params[param[i]], arg[i]);
+					}
+					break;
+
+				case CircuitOp::RIGHT_POWER:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						v[i] = rightInheritance(params[param[i]], arg[i]);
+					}
+					break;
+
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+	}
+
+	/**
+	 * Push the derivative of the output back through the circuit into the gradient.
+	 */
+	void backpropagate(const double* params, const double* v, double* gradient) const {
+		static thread_local std::vector<double> adjoints;
+		adjoints.assign(size, 0.0);
+		double* adjoint = adjoints.data();
+		adjoint[output] = 1.0;
+
+		const int32_t* a = operandA.data();
+		const int32_t* b = operandB.data();
+
+		for (auto run = runs.rbegin(); run != runs.rend(); ++run) {
+			switch (run->op) {
+				case CircuitOp::ADD:
+					for (int32_t i = run->end - 1; i >= run->begin; i--) {
+						adjoint[a[i]] += adjoint[i];
+						adjoint[b[i]] += adjoint[i];
+					}
+					break;
+
+				case CircuitOp::MULTIPLY:
+					for (int32_t i = run->end - 1; i >= run->begin; i--) {
+						adjoint[a[i]] += adjoint[i] * v[b[i]];
+						adjoint[b[i]] += adjoint[i] * v[a[i]];
+					}
+					break;
+
+				case CircuitOp::SQRT:
+					for (int32_t i = run->end - 1; i >= run->begin; i--) {
+						// The derivative of sqrt at zero is undefined, so a zero history simply doesn't contribute
+						if (v[i] != 0) {
+							adjoint[a[i]] += adjoint[i] * 0.5 / v[i];
+						}
+					}
+					break;
+
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+
+		std::fill(gradient, gradient + numParams, 0.0);
+
+		const int32_t* param = leafParams.data();
+		const int32_t* arg = leafArgs.data();
+
+		for (const auto& run : leafRuns) {
+			switch (run.op) {
+				case CircuitOp::DECAY:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						gradient[param[i]] -= adjoint[i] * arg[i] * v[i];
+					}
+					break;
+
+				case CircuitOp::LEFT_POWER:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						gradient[param[i]] += adjoint[i] * arg[i] * leftInheritance(params[param[i]], arg[i] - 1);
+					}
+					break;
+
+				case CircuitOp::RIGHT_POWER:
+					for (int32_t i = run.begin; i < run.end; i++) {
+						gradient[param[i]] -= adjoint[i] * arg[i] * rightInheritance(params[param[i]], arg[i] - 1);
+					}
+					break;
+
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+	}
+};
+
+/**
+ * Records a circuit, simplifying as it goes.
+ * Identical nodes are shared, constants are folded and trivial operations are removed.
+ */
+class CircuitBuilder {
+public:
+	static const int32_t ZERO = 0;
+	static const int32_t ONE = 1;
+
+	/**
+	 * Create an empty circuit with just zero and one.
+	 */
+	CircuitBuilder() {
+		constant(0.0);
+		constant(1.0);
+	}
+
+	/**
+	 * Get a constant node.
+	 */
+	int32_t constant(double value) {
+		return intern({CircuitOp::CONSTANT, 0, 0, value});
+	}
+
+	/**
+	 * Check if a node is a constant.
+	 */
+	bool isConstant(int32_t node) const {
+		return nodes[node].op == CircuitOp::CONSTANT;
+	}
+
+	/**
+	 * Get the value of a constant node.
+	 */
+	double getConstant(int32_t node) const {
+		return nodes[node].constant;
+	}
+
+	/**
+	 * Get a node for exp(-rate * params[param]).
+	 */
+	int32_t decay(int param, int rate) {
+		if (rate == 0) {
+			return ONE;
+		}
+		return intern({CircuitOp::DECAY, param, rate, 0.0});
+	}
+
+	/**
+	 * Get a node for params[param] ^ exponent.
+	 */
+	int32_t leftPower(int param, int exponent) {
+		if (exponent == 0) {
+			return ONE;
+		}
+		return intern({CircuitOp::LEFT_POWER, param, exponent, 0.0});
+	}
+
+	/**
+	 * Get a node for (1 - params[param]) ^ exponent.
+	 */
+	int32_t rightPower(int param, int exponent) {
+		if (exponent == 0) {
+			return ONE;
+		}
+		return intern({CircuitOp::RIGHT_POWER, param, exponent, 0.0});
+	}
+
+	/**
+	 * Add two nodes.
+	 */
+	int32_t add(int32_t a, int32_t b) {
+		if (a == ZERO) {
+			return b;
+		}
+		if (b == ZERO) {
+			return a;
+		}
+		if (isConstant(a) && isConstant(b)) {
+			return constant(getConstant(a) + getConstant(b));
+		}
+		if (a > b) {
+			std::swap(a, b);
+		}
+		return intern({CircuitOp::ADD, a, b, 0.0});
+	}
+
+	/**
+	 * Multiply two nodes.
+	 */
+	int32_t multiply(int32_t a, int32_t b) {
+		if (a == ZERO || b == ZERO) {
+			return ZERO;
+		}
+		if (a == ONE) {
+			return b;
+		}
+		if (b == ONE) {
+			return a;
+		}
+		if (isConstant(a) && isConstant(b)) {
+			return constant(getConstant(a) * getConstant(b));
+		}
+
+		// Constants always go first so that scalings can be merged
+		if (isConstant(b) || (!isConstant(a) && a > b)) {
+			std::swap(a, b);
+		}
+
+		if (isConstant(a) && nodes[b].op == CircuitOp::MULTIPLY && isConstant(nodes[b].a)) {
+			return multiply(constant(getConstant(a) * getConstant(nodes[b].a)), nodes[b].b);
+		}
+
+		return intern({CircuitOp::MULTIPLY, a, b, 0.0});
+	}
+
+	/**
+	 * Take the square root of a node.
+	 */
+	int32_t sqrt(int32_t a) {
+		if (isConstant(a)) {
+			return constant(std::sqrt(getConstant(a)));
+		}
+		return intern({CircuitOp::SQRT, a, 0, 0.0});
+	}
+
+	/**
+	 * Get the number of nodes recorded so far.
+	 */
+	int32_t getNumNodes() const {
+		return nodes.size();
+	}
+
+	/**
+	 * Turn the recording into a circuit that computes output.
+	 * Nodes that output doesn't depend on are dropped.
+	 */
+	Circuit compile(int32_t output, int numParams) const {
+		std::vector<bool> reachable(nodes.size(), false);
+		reachable[output] = true;
+
+		for (int32_t i = output; i >= 0; i--) {
+			if (reachable[i] && isInterior(nodes[i].op)) {
+				reachable[nodes[i].a] = true;
+				if (nodes[i].op != CircuitOp::SQRT) {
+					reachable[nodes[i].b] = true;
+				}
+			}
+		}
+
+		std::vector<int32_t> level(nodes.size(), 0);
+		std::vector<int32_t> constantNodes;
+		std::vector<int32_t> leafNodes;
+		std::vector<int32_t> interiorNodes;
+
+		for (int32_t i = 0; i <= output; i++) {
+			if (!reachable[i]) {
+				continue;
+			}
+
+			const CircuitNode& node = nodes[i];
+			if (node.op == CircuitOp::CONSTANT) {
+				constantNodes.push_back(i);
+			} else if (!isInterior(node.op)) {
+				leafNodes.push_back(i);
+			} else {
+				level[i] = 1 + level[node.a];
+				if (node.op != CircuitOp::SQRT) {
+					level[i] = std::max(level[i], 1 + level[node.b]);
+				}
+				interiorNodes.push_back(i);
+			}
+		}
+
+		std::sort(leafNodes.begin(), leafNodes.end(), [this](int32_t x, int32_t y) {
+			return std::make_tuple(nodes[x].op, nodes[x].a, nodes[x].b) < std::make_tuple(nodes[y].op, nodes[y].a, nodes[y].b);
+		});
+
+		std::stable_sort(interiorNodes.begin(), interiorNodes.end(), [this, &level](int32_t x, int32_t y) {
+			return std::make_pair(level[x], nodes[x].op) < std::make_pair(level[y], nodes[y].op);
+		});
+
+		Circuit result;
+		result.numParams = numParams;
+		result.firstLeaf = constantNodes.size();
+		result.firstInterior = result.firstLeaf + leafNodes.size();
+		result.size = result.firstInterior + interiorNodes.size();
+
+		result.leafParams.resize(result.size, 0);
+		result.leafArgs.resize(result.size, 0);
+		result.operandA.resize(result.size, 0);
+		result.operandB.resize(result.size, 0);
+
+		std::vector<int32_t> slot(nodes.size(), -1);
+		int32_t nextSlot = 0;
+
+		for (int32_t node : constantNodes) {
+			slot[node] = nextSlot++;
+			result.constants.push_back(nodes[node].constant);
+		}
+
+		for (int32_t node : leafNodes) {
+			appendToRun(result.leafRuns, nodes[node].op, nextSlot);
+			result.leafParams[nextSlot] = nodes[node].a;
+			result.leafArgs[nextSlot] = nodes[node].b;
+			slot[node] = nextSlot++;
+		}
+
+		for (int32_t node : interiorNodes) {
+			appendToRun(result.runs, nodes[node].op, nextSlot);
+			result.operandA[nextSlot] = slot[nodes[node].a];
+			result.operandB[nextSlot] = nodes[node].op == CircuitOp::SQRT ? 0 : slot[nodes[node].b];
+			slot[node] = nextSlot++;
+		}
+
+		result.output = slot[output];
+
+		return result;
+	}
+
+private:
+	/**
+	 * Check if an operation reads other nodes.
+	 */
+	static bool isInterior(CircuitOp op) {
+		return op == CircuitOp::ADD || op == CircuitOp::MULTIPLY || op == CircuitOp::SQRT;
+	}
+
+	/**
+	 * Add a slot to the list of runs, starting a new run if the operation changes.
+	 */
+	static void appendToRun(std::vector<CircuitRun>& runs, CircuitOp op, int32_t slot) {
+		if (runs.empty() || runs.back().op != op) {
+			runs.push_back({op, slot, slot + 1});
+		} else {
+			runs.back().end = slot + 1;
+		}
+	}
+
+	/**
+	 * Get the existing node identical to node, or create it.
+	 */
+	int32_t intern(const CircuitNode& node) {
+		auto found = existing.find(node);
+		if (found != existing.end()) {
+			return found->second;
+		}
+
+		int32_t index = nodes.size();
+		nodes.push_back(node);
+		existing[node] = index;
+		return index;
+	}
+
+	std::vector<CircuitNode> nodes;
+	std::unordered_map<CircuitNode, int32_t, CircuitNodeHash> existing;
+};
+
+/**
+ * A value in a circuit that is being recorded.
+ * A default constructed value is the constant zero, which belongs to every circuit.
+ */
+struct CircuitValue {
+	CircuitValue() : builder(nullptr), node(CircuitBuilder::ZERO) {}
+	CircuitValue(CircuitBuilder* a_builder, int32_t a_node) : builder(a_builder), node(a_node) {}
+
+	CircuitBuilder* builder;
+	int32_t node;
+};
+
+/**
+ * A parameter of a circuit.
+ * It is either an index into the params vector or a fixed value when index is negative.
+ */
+struct CircuitParameter {
+	CircuitBuilder* builder;
+	int index;
+	double value;
+};
+
+/**
+ * Add two circuit values.
+ */
+inline CircuitValue operator+(const CircuitValue& a, const CircuitValue& b) {
+	CircuitBuilder* builder = a.builder != nullptr ? a.builder : b.builder;
+	if (builder == nullptr) {
+		return CircuitValue();
+	}
+	return CircuitValue(builder, builder->add(a.node, b.node));
+}
+
+/**
+ * Add a circuit value in place.
+ */
+inline CircuitValue& operator+=(CircuitValue& a, const CircuitValue& b) {
+	a = a + b;
+	return a;
+}
+
+/**
+ * Multiply two circuit values.
+ */
+inline CircuitValue operator*(const CircuitValue& a, const CircuitValue& b) {
+	CircuitBuilder* builder = a.builder != nullptr ? a.builder : b.builder;
+	if (builder == nullptr) {
+		return CircuitValue();
+	}
+	return CircuitValue(builder, builder->multiply(a.node, b.node));
+}
+
+/**
+ * Multiply a circuit value by a constant.
+ */
+inline CircuitValue operator*(const CircuitValue& a, double b) {
+	if (a.builder == nullptr) {
+		return CircuitValue();
+	}
+	return CircuitValue(a.builder, a.builder->multiply(a.node, a.builder->constant(b)));
+}
+
+/**
+ * Take the square root of a circuit value.
+ */
+inline CircuitValue sqrt(const CircuitValue& a) {
+	if (a.builder == nullptr) {
+		return CircuitValue();
+	}
+	return CircuitValue(a.builder, a.builder->sqrt(a.node));
+}
+
+/**
+ * Check if a circuit value is anything other than the given constant.
+ */
+inline bool operator!=(const CircuitValue& a, double b) {
+	if (a.builder == nullptr) {
+		return b != 0;
+	}
+	return !(a.builder->isConstant(a.node) && a.builder->getConstant(a.node) == b);
+}
+
+/**
+ * Compute the puv function for a circuit parameter.
+ * This expands puv into a sum of exp(-k(k-1)T/2) leaves.
+ */
+inline CircuitValue puv(int u, int v, const CircuitParameter& length) {
+	CircuitBuilder& builder = *length.builder;
+
+	if (length.index < 0) {
+		return CircuitValue(&builder, builder.constant(puv(u, v, length.value)));
+	}
+
+	if (v == 0 && u == 0) {
+		return CircuitValue(&builder, CircuitBuilder::ONE);
+	}
+
+	int32_t sum = CircuitBuilder::ZERO;
+
+	for (int k = v; k <= u; k++) {
+		if (puvArray[u][v][k] != 0) {
+			int32_t term = builder.multiply(builder.decay(length.index, k * (k - 1) / 2), builder.constant(puvArray[u][v][k]));
+			sum = builder.add(sum, term);
+		}
+	}
+
+	return CircuitValue(&builder, sum);
+}
+
+/**
+ * Compute the probability of lineages taking the left parent for a circuit parameter.
+ */
+inline CircuitValue leftInheritance(const CircuitParameter& leftProbability, int numLineages) {
+	CircuitBuilder& builder = *leftProbability.builder;
+
+	if (leftProbability.index < 0) {
+		return CircuitValue(&builder, builder.constant(leftInheritance(leftProbability.value, numLineages)));
+	}
+
+	return CircuitValue(&builder, builder.leftPower(leftProbability.index, numLineages));
+}
+
+/**
+ * Compute the probability of lineages taking the right parent for a circuit parameter.
+ */
+inline CircuitValue rightInheritance(const CircuitParameter& leftProbability, int numLineages) {
+	CircuitBuilder& builder = *leftProbability.builder;
+
+	if (leftProbability.index < 0) {
+		return CircuitValue(&builder, builder.constant(rightInheritance(leftProbability.value, numLineages)));
+	}
+
+	return CircuitValue(&builder, builder.rightPower(leftProbability.index, numLineages));
+}
+
+/**
+ * Params for recording a prepared network into a circuit.
+ */
+struct CircuitParams {
+	CircuitBuilder* builder;
+
+	/**
+	 * Get the length of an edge, where -1 is the infinite root edge.
+	 */
+	CircuitParameter length(int paramId) const {
+		return {builder, paramId, paramId < 0 ? std::numeric_limits<double>::infinity() : 0.0};
+	}
+
+	/**
+	 * Get the left probability of a network node.
+	 */
+	CircuitParameter inheritance(int paramId) const {
+		return {builder, paramId, 0.0};
+	}
+
+	/**
+	 * Get the probability a leaf starts with.
+	 */
+	CircuitValue one() const {
+		return CircuitValue(builder, CircuitBuilder::ONE);
+	}
+};
+
+/**
+ * Compile the probability of a prepared gene tree given a prepared network into a circuit.
+ * The circuit reads the same params vector as the prepared network.
+ */
+inline Circuit compileCircuit(const PreparedNetwork& network, const PreparedGeneTree& tree) {
+	CircuitBuilder builder;
+	EvaluationContext<CircuitValue> context;
+
+	CircuitValue probability = calcProbability(network, tree, CircuitParams{&builder}, context);
+
+	return builder.compile(probability.node, network.numParams);
+}
+
+/**
+ * Compile the probability of a gene tree given a species network into a circuit.
+ * The circuit reads the same params vector as setParams.
+ */
+inline Circuit compileCircuit(const NetNode& species, const TreeNode& geneTree) {
+	PreparedNetwork network = prepareNetwork(species);
+	PreparedGeneTree tree;
+
+	if (!prepareGeneTree(network, geneTree, tree)) {
+		exit(-1);
+	}
+
+	return compileCircuit(network, tree);
+}
@@ -2,7 +2,9 @@
 
 #include <cstdlib>
 #include <cstdint>
-#include <cstring>
+#include <iterator>
+#include <memory>
+#include <initializer_list>
 #include <vector>
 #include <array>
 #include <tuple>
@@ -12,18 +14,55 @@
 
 /**
  * A class for holding a bunch of histories mapped to probabilities.
+ * T is the type used to store each probability, and Allocator allocates the choices.
  */
-class densemap {
+template<typename T, typename Allocator = std::allocator<int64_t>>
+class basic_densemap {
 
 public:
+	using value_type = T;
+	using allocator_type = Allocator;
 
 	/**
 	 * Dummy constructor. Doesn't actually initialize it.
 	 */
-	densemap() {
+	basic_densemap() {
 		initialized = false;
 	}
 
+	/**
+	 * Dummy constructor with an allocator for the choices.
+	 */
+	basic_densemap(std::allocator_arg_t, const Allocator& allocator) : choices(allocator) {
+		initialized = false;
+	}
+
+	/**
+	 * Copy another map, with an allocator for the choices.
+	 */
+	basic_densemap(std::allocator_arg_t, const Allocator& allocator, const basic_densemap& other) : choices(other.choices, allocator) {
+		copyFrom(other);
+	}
+
+	/**
+	 * Move another map, with an allocator for the choices.
+	 */
+	basic_densemap(std::allocator_arg_t, const Allocator& allocator, basic_densemap&& other) : choices(std::move(other.choices), allocator) {
+		copyFrom(other);
+	}
+
+	basic_densemap(const basic_densemap&) = default;
+	basic_densemap(basic_densemap&&) = default;
+	basic_densemap& operator=(const basic_densemap&) = default;
+	basic_densemap& operator=(basic_densemap&&) = default;
+
+	/**
+	 * Get the allocator of the choices.
+	 */
+	Allocator get_allocator() const {
+		return choices.get_allocator();
+	}
+
 	/**
 	 * Check if the map is initialized.
 	 */
@@ -36,18 +75,30 @@ public:
 	 * taxa_bits are the taxas in this map.
 	 * netNodeChoices are the choices at each network node.
 	 */
-	void init(uint16_t taxa_bits, std::vector<int64_t> netNodeChoices) {
+	template<typename Choices = std::initializer_list<int64_t>>
+	void init(uint16_t taxa_bits, const Choices& netNodeChoices) {
+		initialized = true;
+		std::fill(std::begin(histories), std::end(histories), T());
+		history_bitset = 0;
+		this->taxa_bits = taxa_bits;
+		choices.assign(netNodeChoices.begin(), netNodeChoices.end());
+	}
+
+	/**
+	 * Initialize a map for a leaf, which hasn't made a choice at any of the numNetNodes network nodes.
+	 */
+	void initLeaf(uint16_t taxa_bits, int numNetNodes) {
 		initialized = true;
-		std::memset(histories, 0, sizeof(histories));
+		std::fill(std::begin(histories), std::end(histories), T());
 		history_bitset = 0;
 		this->taxa_bits = taxa_bits;
-		choices = netNodeChoices;
+		choices.assign(numNetNodes, -1);
 	}
 
 	/**
 	 * Check if the two densmaps are compatabile (have the same choices)
 	 */
-	bool isCompatible(const densemap& other) const {
+	bool isCompatible(const basic_densemap& other) const {
 		for (unsigned int i = 0; i < choices.size(); i++) {
 			if (choices[i] != other.choices[i] && choices[i] != -1 && other.choices[i] != -1) {
 				return false;
@@ -60,7 +111,7 @@ public:
 	/**
 	 * Add a value to the history.
 	 */
-	void addToHistory(int history, double value) {
+	void addToHistory(int history, const T& value) {
 		histories[history] += value;
 		history_bitset |= 1LL << history;
 	}
@@ -68,15 +119,23 @@ public:
 	/**
 	 * Set a history value.
 	 */
-	void setHistory(int history, double value) {
+	void setHistory(int history, const T& value) {
 		histories[history] = value;
 		history_bitset |= 1LL << history;
 	}
 
+	/**
+	 * Remove a history, as if it was never set.
+	 */
+	void removeHistory(int history) {
+		histories[history] = T();
+		history_bitset &= ~(1ULL << history);
+	}
+
 	/**
 	 * Get a history value.
 	 */
-	double getHistory(int history) const {
+	const T& getHistory(int history) const {
 		return histories[history];
 	}
 
@@ -104,7 +163,7 @@ public:
 	/**
 	 * Add two densmaps together.
 	 */
-	densemap& operator+=(const densemap& rhs) {
+	basic_densemap& operator+=(const basic_densemap& rhs) {
 		uint64_t rhsBitset = rhs.getHistoryBitset();
 
 		while (rhsBitset != 0) {
@@ -121,9 +180,19 @@ public:
 	/**
 	 * The current choices.
 	 */
-	std::vector<int64_t> choices;
+	std::vector<int64_t, Allocator> choices;
 
 private:
+	/**
+	 * Copy everything but the choices.
+	 */
+	void copyFrom(const basic_densemap& other) {
+		initialized = other.initialized;
+		taxa_bits = other.taxa_bits;
+		std::copy(std::begin(other.histories), std::end(other.histories), std::begin(histories));
+		history_bitset = other.history_bitset;
+	}
+
 	// If this map is initialized.
 	bool initialized;
 
@@ -131,7 +200,7 @@ private:
 	uint16_t taxa_bits;
 
 	// All the histories.
-	double histories[1 << 6];
+	T histories[1 << 6];
 
 	// Which histories are set.
 	uint64_t history_bitset;
@@ -139,30 +208,31 @@ private:
 };
 
 /**
- * Merge the choices of two densemaps.
+ * The densemap used for normal double precision computations.
+ */
+using densemap = basic_densemap<double>;
+
+/**
+ * Initialize result with the merged taxa and choices of two densemaps.
  */
-inline std::vector<int64_t> mergeChoices(const densemap& left, const densemap& right) {
-	std::vector<int64_t> result(left.choices.size());
+template<typename T, typename A>
+void initMerged(basic_densemap<T, A>& result, const basic_densemap<T, A>& left, const basic_densemap<T, A>& right) {
+	result.init(left.getTaxaBits() | right.getTaxaBits(), left.choices);
 
-	for (unsigned int i = 0; i <result.size();i++) {
+	for (unsigned int i = 0; i < result.choices.size(); i++) {
 		if (left.choices[i] == -1) {
-			result[i] = right.choices[i];
-		} else if (right.choices[i] == -1) {
-			result[i] = left.choices[i];
-		} else {
-			result[i] = left.choices[i];
+			result.choices[i] = right.choices[i];
 		}
 	}
-
-	return result;
 }
 
 /**
  * Combine two densemaps.
  */
-inline densemap combine(const densemap& left, const densemap& right) {
-	densemap result;
-	result.init(left.getTaxaBits() | right.getTaxaBits(), mergeChoices(left, right));
+template<typename T, typename A>
+basic_densemap<T, A> combine(const basic_densemap<T, A>& left, const basic_densemap<T, A>& right) {
+	basic_densemap<T, A> result(std::allocator_arg, left.get_allocator());
+	initMerged(result, left, right);
 
 	uint64_t leftBitset = left.getHistoryBitset();
 
@@ -186,9 +256,10 @@ inline densemap combine(const densemap& left, const densemap& right) {
 /**
  * Combine the derivatives of densemaps.
  */
-inline densemap combineDerivatives(const densemap& left, const densemap& leftDerivative, const densemap& right, const densemap& rightDerivative) {
-	densemap result;
-	result.init(left.getTaxaBits() | right.getTaxaBits(), mergeChoices(left, right));
+template<typename T, typename A>
+basic_densemap<T, A> combineDerivatives(const basic_densemap<T, A>& left, const basic_densemap<T, A>& leftDerivative, const basic_densemap<T, A>& right, const basic_densemap<T, A>& rightDerivative) {
+	basic_densemap<T, A> result(std::allocator_arg, left.get_allocator());
+	initMerged(result, left, right);
 
 	uint64_t leftBitset = left.getHistoryBitset();
 
@@ -210,10 +281,11 @@ inline densemap combineDerivatives(const densemap& left, const densemap& leftDer
 }
 
 /**
- * Combine a list of densemaps.
+ * Combine a list of densemaps. The result uses the allocator of left.
  */
-inline std::vector<densemap> combine(const std::vector<densemap>& left, const std::vector<densemap>& right) {
-	std::vector<densemap> result;
+template<typename T, typename A, typename L>
+std::vector<basic_densemap<T, A>, L> combine(const std::vector<basic_densemap<T, A>, L>& left, const std::vector<basic_densemap<T, A>, L>& right) {
+	std::vector<basic_densemap<T, A>, L> result(left.get_allocator());
 	for (auto&& leftOne : left) {
 		for (auto&& rightOne : right) {
 			if (leftOne.isCompatible(rightOne)) {
@@ -228,8 +300,9 @@ inline std::vector<densemap> combine(const std::vector<densemap>& left, const st
 /**
  * Combine the derivatives for a list of densemaps.
  */
-inline std::vector<densemap> combineDerivatives(const std::vector<densemap>& left, const std::vector<densemap>& leftDerivatives, const std::vector<densemap>& right, const std::vector<densemap>& rightDerivatives) {
-	std::vector<densemap> result;
+template<typename T, typename A, typename L>
+std::vector<basic_densemap<T, A>, L> combineDerivatives(const std::vector<basic_densemap<T, A>, L>& left, const std::vector<basic_densemap<T, A>, L>& leftDerivatives, const std::vector<basic_densemap<T, A>, L>& right, const std::vector<basic_densemap<T, A>, L>& rightDerivatives) {
+	std::vector<basic_densemap<T, A>, L> result(left.get_allocator());
 	for (unsigned int leftIndex = 0; leftIndex < left.size(); leftIndex ++) {
 		for (unsigned int rightIndex = 0; rightIndex < right.size(); rightIndex ++) {
 			auto&& leftOne = left[leftIndex];
@@ -282,9 +355,11 @@ inline std::pair<std::array<int, 1<<6 >, uint64_t> performBFS(uint8_t history, u
 
 /**
  * Update a densemap along a certain amount of time.
+ * Length is anything puv accepts as a branch length.
  */
-inline densemap update(const densemap& current, const std::vector<int>& events, double length) {
-	densemap result;
+template<typename T, typename A, typename Length>
+basic_densemap<T, A> update(const basic_densemap<T, A>& current, const std::vector<int>& events, const Length& length) {
+	basic_densemap<T, A> result(std::allocator_arg, current.get_allocator());
 	result.init(current.getTaxaBits(), current.choices);
 
 	uint64_t bitset = current.getHistoryBitset();
@@ -310,7 +385,7 @@ inline densemap update(const densemap& current, const std::vector<int>& events,
 
 			double weight = (double) numberOfWays / numberOfOptions;
 
-			double total = current.getHistory(history) * weight * puv(startingCount, finalCount, length);
+			T total = current.getHistory(history) * weight * puv(startingCount, finalCount, length);
 
 			if (total != 0) {
 				result.addToHistory(reachable, total);
@@ -367,8 +442,9 @@ inline densemap derivativeUpdate(const densemap& current, const std::vector<int>
 /**
  * Update a list of densemaps.
  */
-inline std::vector<densemap> update(const std::vector<densemap>& current, const std::vector<int>& events, double length) {
-	std::vector<densemap> result;
+template<typename T, typename A, typename L, typename Length>
+std::vector<basic_densemap<T, A>, L> update(const std::vector<basic_densemap<T, A>, L>& current, const std::vector<int>& events, const Length& length) {
+	std::vector<basic_densemap<T, A>, L> result(current.get_allocator());
 	result.reserve(current.size());
 
 	for (auto&& one : current) {
@@ -423,24 +499,26 @@ inline std::vector<uint16_t> createSubsets(uint16_t bitset) {
 /**
  * Add a result from a split operation.
  */
-inline void addResult(const densemap& current, std::vector<densemap>& results, int nodeIndex, uint16_t taxaBits, uint16_t historyBits, int64_t choice, double probability) {
-	std::vector<int64_t> choices = current.choices;
+template<typename T, typename A, typename L>
+void addResult(const basic_densemap<T, A>& current, std::vector<basic_densemap<T, A>, L>& results, int nodeIndex, uint16_t taxaBits, uint16_t historyBits, int64_t choice, const T& probability) {
+	results.emplace_back();
+	basic_densemap<T, A>& result = results.back();
 
-	choices[nodeIndex] = choice;
-
-	densemap result;
-	result.init(taxaBits, choices);
+	result.init(taxaBits, current.choices);
+	result.choices[nodeIndex] = choice;
 	result.setHistory(historyBits, probability);
-
-	results.push_back(result);
 }
 
 /**
  * Split a densmap at a network node.
+ * Probability is anything leftInheritance and rightInheritance accept.
  */
-inline std::pair<std::vector<densemap>, std::vector<densemap>> split(const std::vector<densemap>& current, int nodeIndex, const std::vector<int>& events, double leftProbability) {
-	std::vector<densemap> leftResults;
-	std::vector<densemap> rightResults;
+template<typename T, typename Probability>
+std::pair<std::vector<basic_densemap<T>>, std::vector<basic_densemap<T>>> split(const std::vector<basic_densemap<T>>& current, int nodeIndex, const std::vector<int>& events, const Probability& leftProbability) {
+	using std::sqrt;
+
+	std::vector<basic_densemap<T>> leftResults;
+	std::vector<basic_densemap<T>> rightResults;
 	for (auto&& map: current) {
 		uint64_t bitset = map.getHistoryBitset();
 		while (bitset != 0) {
@@ -485,8 +563,8 @@ inline std::pair<std::vector<densemap>, std::vector<densemap>> split(const std::
 
 				uint16_t taxaBits = finalSubset    & 0b1111111111000000;
 				uint16_t historyBits = finalSubset & 0b0000000000111111;
-				addResult(map, leftResults, nodeIndex, taxaBits, historyBits, leftChoiceId, std::sqrt(map.getHistory(history)) * std::pow(leftProbability, numLeft));
-				addResult(map, rightResults, nodeIndex, taxaBits, historyBits, rightChoiceId, std::sqrt(map.getHistory(history)) * std::pow(1-leftProbability, numLeft));
+				addResult(map, leftResults, nodeIndex, taxaBits, historyBits, leftChoiceId, T(sqrt(map.getHistory(history)) * leftInheritance(leftProbability, numLeft)));
+				addResult(map, rightResults, nodeIndex, taxaBits, historyBits, rightChoiceId, T(sqrt(map.getHistory(history)) * rightInheritance(leftProbability, numLeft)));
 			}
 		}
 	}
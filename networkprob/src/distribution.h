@@ -0,0 +1,504 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include <utility>
+#include <iostream>
+#include <unordered_map>
+
+#include "mathutils.h"
+#include "arena.h"
+#include "prepared.h"
+#include "enumerate.h"
+
+/**
+ * The largest number of network leaves the topology distribution supports, so that every clade fits in a byte.
+ */
+const int maxDistributionLeaves = 8;
+
+/**
+ * A forest of partial gene trees, packed into 64 bits.
+ * The low byte is the set of taxa in the forest, and the other bytes are the clades with more than one taxon,
+ * sorted from largest to smallest value and padded with zeros.
+ * A clade always sorts before the clades inside it, so the first clade of every tree is its root.
+ */
+using Forest = uint64_t;
+
+/**
+ * Get the taxa in a forest.
+ */
+inline uint8_t getForestTaxa(Forest forest) {
+	return forest & 0xff;
+}
+
+/**
+ * Get the clade with the given index in a forest, or 0 past the last one.
+ */
+inline uint8_t getForestClade(Forest forest, int index) {
+	return (forest >> (8 * (index + 1))) & 0xff;
+}
+
+/**
+ * Get the lineages of a forest, the taxa below the root of each tree.
+ * Returns the number of lineages.
+ */
+inline int getForestLineages(Forest forest, uint8_t lineages[maxDistributionLeaves]) {
+	int numLineages = 0;
+	uint8_t covered = 0;
+
+	for (int i = 0; i < maxDistributionLeaves - 1; i++) {
+		uint8_t clade = getForestClade(forest, i);
+		if (clade == 0) {
+			break;
+		}
+		if ((clade & covered) == 0) {
+			lineages[numLineages++] = clade;
+			covered |= clade;
+		}
+	}
+
+	uint8_t singles = getForestTaxa(forest) & ~covered;
+	while (singles != 0) {
+		uint8_t single = singles & -singles;
+		singles ^= single;
+		lineages[numLineages++] = single;
+	}
+
+	return numLineages;
+}
+
+/**
+ * Build a forest from its taxa and its clades, in any order.
+ */
+inline Forest makeForest(uint8_t taxa, uint8_t* clades, int numClades) {
+	std::sort(clades, clades + numClades, [](uint8_t a, uint8_t b) { return a > b; });
+
+	Forest result = taxa;
+	for (int i = 0; i < numClades; i++) {
+		result |= (Forest) clades[i] << (8 * (i + 1));
+	}
+	return result;
+}
+
+/**
+ * Get the forest after two of its lineages coalesce into the given clade.
+ */
+inline Forest addForestClade(Forest forest, uint8_t clade) {
+	uint8_t clades[maxDistributionLeaves];
+	int numClades = 0;
+
+	for (int i = 0; i < maxDistributionLeaves - 1 && getForestClade(forest, i) != 0; i++) {
+		clades[numClades++] = getForestClade(forest, i);
+	}
+	clades[numClades++] = clade;
+
+	return makeForest(getForestTaxa(forest), clades, numClades);
+}
+
+/**
+ * Get the forest made of two forests over different taxa.
+ */
+inline Forest joinForests(Forest a, Forest b) {
+	uint8_t clades[maxDistributionLeaves];
+	int numClades = 0;
+
+	for (Forest forest : {a, b}) {
+		for (int i = 0; i < maxDistributionLeaves - 1 && getForestClade(forest, i) != 0; i++) {
+			clades[numClades++] = getForestClade(forest, i);
+		}
+	}
+
+	return makeForest(getForestTaxa(a) | getForestTaxa(b), clades, numClades);
+}
+
+/**
+ * Get the trees of a forest that are inside the given taxa, which must be a union of its lineages.
+ */
+inline Forest restrictForest(Forest forest, uint8_t taxa) {
+	uint8_t clades[maxDistributionLeaves];
+	int numClades = 0;
+
+	for (int i = 0; i < maxDistributionLeaves - 1 && getForestClade(forest, i) != 0; i++) {
+		uint8_t clade = getForestClade(forest, i);
+		if ((clade & ~taxa) == 0) {
+			clades[numClades++] = clade;
+		}
+	}
+
+	return makeForest(taxa, clades, numClades);
+}
+
+/**
+ * Forests for one set of choices at the network nodes, along with their probabilities.
+ * This plays the part of a densemap, with forests instead of the histories of one gene tree.
+ */
+struct ForestMap {
+	std::vector<int64_t> choices;
+	std::unordered_map<Forest, double> forests;
+
+	/**
+	 * Check if two maps came from the same choices at every network node they share.
+	 */
+	bool isCompatible(const ForestMap& other) const {
+		for (unsigned int i = 0; i < choices.size(); i++) {
+			if (choices[i] != other.choices[i] && choices[i] != -1 && other.choices[i] != -1) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+};
+
+/**
+ * The forests a forest can turn into, grouped by the number of coalescences.
+ * levels[j] holds each forest after exactly j coalescences, with its probability given that j happen.
+ */
+struct ForestCoalescences {
+	std::vector<std::vector<std::pair<Forest, double>>> levels;
+};
+
+/**
+ * Computes the probability of every rooted gene tree topology for a network in one pass.
+ * Instead of the events of a single gene tree it tracks forests of clades, so topologies that share
+ * a clade history share all of the work for it.
+ */
+class TopologyDistribution {
+public:
+	/**
+	 * Create a distribution for a network, which needs at most maxDistributionLeaves leaves, see canComputeDistribution.
+	 */
+	TopologyDistribution(const PreparedNetwork& a_network, const double* a_params) : network(a_network), params{a_params} {}
+
+	/**
+	 * Compute the probability of every complete gene tree, keyed by its forest.
+	 */
+	std::unordered_map<Forest, double> run() {
+		nodes.assign(network.nodes.size(), NodeData());
+
+		for (unsigned int i = 0; i < network.nodes.size(); i++) {
+			computeNode(i);
+		}
+
+		PreparedEdge rootEdge = {(int) network.nodes.size() - 1, -1, EdgeType::NORMAL};
+		std::vector<ForestMap> root = getEdgeData(rootEdge);
+
+		uint8_t allTaxa = (1 << network.leafNames.size()) - 1;
+
+		std::unordered_map<Forest, double> result;
+		for (auto&& map : root) {
+			for (auto&& forest : map.forests) {
+				if (getForestTaxa(forest.first) == allTaxa) {
+					result[forest.first] += forest.second;
+				}
+			}
+		}
+
+		return result;
+	}
+
+private:
+	/**
+	 * The maps flowing out of a node. Network nodes use left and right, the others use data.
+	 */
+	struct NodeData {
+		std::vector<ForestMap> data;
+		std::vector<ForestMap> leftData;
+		std::vector<ForestMap> rightData;
+
+		/**
+		 * Get the maps for an edge type.
+		 */
+		const std::vector<ForestMap>& get(EdgeType type) const {
+			switch (type) {
+				case EdgeType::LEFT:
+					return leftData;
+				case EdgeType::RIGHT:
+					return rightData;
+				default:
+					return data;
+			}
+		}
+	};
+
+	/**
+	 * Compute the maps for a node, assuming its children are already done.
+	 */
+	void computeNode(int index) {
+		const PreparedNetNode& node = network.nodes[index];
+		NodeData& data = nodes[index];
+
+		if (node.type == NodeType::LEAF) {
+			ForestMap leaf;
+			leaf.choices.assign(network.numNetNodes, -1);
+			leaf.forests[1 << node.leafIndex] = 1;
+			data.data.push_back(std::move(leaf));
+		} else if (node.type == NodeType::TREE) {
+			data.data = combine(getEdgeData(node.edges[0]), getEdgeData(node.edges[1]));
+		} else if (node.type == NodeType::NETWORK) {
+			split(getEdgeData(node.edges[0]), node.netNodeIndex, params.inheritance(node.introgressionId), data.leftData, data.rightData);
+		}
+	}
+
+	/**
+	 * Get the maps flowing up through an edge, letting lineages coalesce along it.
+	 */
+	std::vector<ForestMap> getEdgeData(const PreparedEdge& edge) {
+		double length = params.length(edge.paramId);
+		const std::vector<ForestMap>& current = nodes[edge.node].get(edge.type);
+
+		std::vector<ForestMap> result(current.size());
+		uint8_t lineages[maxDistributionLeaves];
+
+		for (unsigned int i = 0; i < current.size(); i++) {
+			result[i].choices = current[i].choices;
+
+			for (auto&& entry : current[i].forests) {
+				int numLineages = getForestLineages(entry.first, lineages);
+				if (numLineages == 0) {
+					// Empty maps from splits pass through unchanged
+					result[i].forests[entry.first] += entry.second;
+					continue;
+				}
+
+				const ForestCoalescences& coalescences = getCoalescences(entry.first);
+				for (int j = 0; j < numLineages; j++) {
+					double probability = puv(numLineages, numLineages - j, length);
+					if (probability == 0) {
+						continue;
+					}
+
+					for (auto&& next : coalescences.levels[j]) {
+						result[i].forests[next.first] += entry.second * probability * next.second;
+					}
+				}
+			}
+		}
+
+		return result;
+	}
+
+	/**
+	 * Get the forests a forest can coalesce into, shared between every edge.
+	 * Each coalescence joins one of the pairs of lineages, all equally likely.
+	 */
+	const ForestCoalescences& getCoalescences(Forest forest) {
+		auto found = coalescences.find(forest);
+		if (found != coalescences.end()) {
+			return found->second;
+		}
+
+		ForestCoalescences result;
+		result.levels.push_back({{forest, 1.0}});
+
+		uint8_t lineages[maxDistributionLeaves];
+
+		while (true) {
+			std::unordered_map<Forest, double> next;
+
+			for (auto&& entry : result.levels.back()) {
+				int numLineages = getForestLineages(entry.first, lineages);
+				if (numLineages <= 1) {
+					break;
+				}
+
+				double pairProbability = entry.second * 2.0 / (numLineages * (numLineages - 1));
+				for (int a = 0; a < numLineages; a++) {
+					for (int b = a + 1; b < numLineages; b++) {
+						next[addForestClade(entry.first, lineages[a] | lineages[b])] += pairProbability;
+					}
+				}
+			}
+
+			if (next.empty()) {
+				break;
+			}
+			result.levels.emplace_back(next.begin(), next.end());
+		}
+
+		return coalescences[forest] = std::move(result);
+	}
+
+	/**
+	 * Combine the maps of the two children of a tree node, merging maps with the same choices.
+	 */
+	static std::vector<ForestMap> combine(const std::vector<ForestMap>& left, const std::vector<ForestMap>& right) {
+		std::vector<ForestMap> result;
+		std::map<std::vector<int64_t>, int> indices;
+
+		for (auto&& leftOne : left) {
+			for (auto&& rightOne : right) {
+				if (!leftOne.isCompatible(rightOne)) {
+					continue;
+				}
+
+				std::vector<int64_t> choices(leftOne.choices.size());
+				for (unsigned int i = 0; i < choices.size(); i++) {
+					choices[i] = leftOne.choices[i] == -1 ? rightOne.choices[i] : leftOne.choices[i];
+				}
+
+				auto inserted = indices.insert({choices, result.size()});
+				if (inserted.second) {
+					result.push_back({std::move(choices), {}});
+				}
+				ForestMap& target = result[inserted.first->second];
+
+				for (auto&& a : leftOne.forests) {
+					for (auto&& b : rightOne.forests) {
+						target.forests[joinForests(a.first, b.first)] += a.second * b.second;
+					}
+				}
+			}
+		}
+
+		return result;
+	}
+
+	/**
+	 * Split maps at a network node, sending every subset of the lineages left and the rest right.
+	 * Both halves get the square root of the probability, so they multiply back together when they meet,
+	 * and both record the same choice id so that only matching halves meet.
+	 */
+	static void split(const std::vector<ForestMap>& current, int netNodeIndex, double leftProbability, std::vector<ForestMap>& leftResults, std::vector<ForestMap>& rightResults) {
+		uint8_t lineages[maxDistributionLeaves];
+		int64_t nextState = 0;
+
+		for (auto&& map : current) {
+			for (auto&& entry : map.forests) {
+				int numLineages = getForestLineages(entry.first, lineages);
+				double root = std::sqrt(entry.second);
+				int64_t state = nextState++;
+
+				for (int subset = 0; subset < (1 << numLineages); subset++) {
+					uint8_t leftTaxa = 0;
+					for (int i = 0; i < numLineages; i++) {
+						if (subset & (1 << i)) {
+							leftTaxa |= lineages[i];
+						}
+					}
+					uint8_t rightTaxa = getForestTaxa(entry.first) & ~leftTaxa;
+
+					int numLeft = __builtin_popcount(subset);
+					int64_t choiceId = (state << maxDistributionLeaves) | subset;
+
+					ForestMap left = {map.choices, {}};
+					left.choices[netNodeIndex] = choiceId;
+					left.forests[restrictForest(entry.first, leftTaxa)] = root * leftInheritance(leftProbability, numLeft);
+					leftResults.push_back(std::move(left));
+
+					ForestMap right = {map.choices, {}};
+					right.choices[netNodeIndex] = choiceId;
+					right.forests[restrictForest(entry.first, rightTaxa)] = root * rightInheritance(leftProbability, numLineages - numLeft);
+					rightResults.push_back(std::move(right));
+				}
+			}
+		}
+	}
+
+	const PreparedNetwork& network;
+	DoubleParams params;
+
+	std::vector<NodeData> nodes;
+	std::unordered_map<Forest, ForestCoalescences> coalescences;
+};
+
+/**
+ * Get the forest of a complete gene tree over the leaves of a network.
+ * Returns 0 if a leaf isn't in the network.
+ */
+inline Forest getTopologyForest(const PreparedNetwork& network, const TreeArena& arena, int32_t root) {
+	uint8_t clades[maxDistributionLeaves];
+	int numClades = 0;
+	bool valid = true;
+
+	std::function<uint8_t(int32_t)> visit = [&](int32_t index) -> uint8_t {
+		const ArenaTreeNode& node = arena.nodes[index];
+		if (node.isLeaf()) {
+			for (unsigned int i = 0; i < network.leafNames.size(); i++) {
+				if (network.leafNames[i] == arena.getName(index)) {
+					return 1 << i;
+				}
+			}
+			valid = false;
+			return 0;
+		}
+
+		uint8_t clade = visit(node.leftChild) | visit(node.rightChild);
+		if (numClades < maxDistributionLeaves - 1) {
+			clades[numClades++] = clade;
+		} else {
+			valid = false;
+		}
+		return clade;
+	};
+
+	uint8_t taxa = visit(root);
+	return valid ? makeForest(taxa, clades, numClades) : 0;
+}
+
+/**
+ * Check if a network has few enough leaves for topology distributions, printing why not if it doesn't.
+ */
+inline bool canComputeDistribution(const PreparedNetwork& network) {
+	if ((int) network.leafNames.size() > maxDistributionLeaves) {
+		std::cerr<<"The topology distribution supports at most "<<maxDistributionLeaves<<" leaves"<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Compute the probability of every rooted topology over the leaves of a network in one pass, keyed by forest.
+ * Returns false if the network has more than maxDistributionLeaves leaves.
+ */
+inline bool calcTopologyDistribution(const PreparedNetwork& network, const double* params, std::unordered_map<Forest, double>& distribution) {
+	if (!canComputeDistribution(network)) {
+		return false;
+	}
+
+	distribution = TopologyDistribution(network, params).run();
+	return true;
+}
+
+/**
+ * Put a distribution keyed by forest in the order of TopologyIterator, with 0 for missing topologies.
+ */
+inline void orderTopologyDistribution(const PreparedNetwork& network, const std::unordered_map<Forest, double>& distribution, std::vector<double>& probabilities) {
+	int numTopologies = countTopologies(network.leafNames.size());
+	probabilities.assign(numTopologies, 0.0);
+
+	TreeArena arena;
+	TopologyIterator iterator(network.leafNames);
+
+	for (int i = 0; i < numTopologies; i++) {
+		arena.clear();
+
+		int32_t root;
+		iterator.next(arena, root);
+
+		auto found = distribution.find(getTopologyForest(network, arena, root));
+		if (found != distribution.end()) {
+			probabilities[i] = found->second;
+		}
+	}
+}
+
+/**
+ * Compute the probability of every rooted topology over the leaves of a network in one pass, in the order of TopologyIterator.
+ * This gives the same results as calcAllTopologyProbabilities, without evaluating each topology separately.
+ * Returns false if the network has more than maxDistributionLeaves leaves.
+ */
+inline bool calcTopologyDistribution(const PreparedNetwork& network, const double* params, std::vector<double>& probabilities) {
+	std::unordered_map<Forest, double> distribution;
+	if (!calcTopologyDistribution(network, params, distribution)) {
+		return false;
+	}
+
+	orderTopologyDistribution(network, distribution, probabilities);
+	return true;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "arena.h"
+#include "prepared.h"
+#include "parallel.h"
+
+/**
+ * Get the number of rooted binary topologies over a number of leaves, (2n-3)!!.
+ */
+inline uint64_t countTopologies(int numLeaves) {
+	if (numLeaves > 20) {
+		std::cerr<<"Topologies can only be counted for at most 20 leaves"<<std::endl;
+		exit(-1);
+	}
+
+	uint64_t result = numLeaves == 0 ? 0 : 1;
+	for (int i = 3; i <= numLeaves; i++) {
+		result *= 2 * i - 3;
+	}
+	return result;
+}
+
+/**
+ * Streams every rooted binary topology over a set of leaves, or a range of them.
+ * Topology i is built by inserting leaf k above one of the 2k-1 existing nodes, in mixed radix order,
+ * so any range can be generated independently of the others.
+ */
+class TopologyIterator {
+public:
+	/**
+	 * Iterate over the topologies with indices in [begin, end).
+	 */
+	TopologyIterator(const std::vector<std::string>& a_leafNames, uint64_t a_begin, uint64_t a_end) : leafNames(a_leafNames), current(a_begin), end(a_end) {
+		int numNodes = std::max(1, 2 * (int) leafNames.size() - 1);
+		parent.resize(numNodes);
+		left.resize(numNodes);
+		right.resize(numNodes);
+	}
+
+	/**
+	 * Iterate over every topology.
+	 */
+	explicit TopologyIterator(const std::vector<std::string>& a_leafNames) : TopologyIterator(a_leafNames, 0, countTopologies(a_leafNames.size())) {}
+
+	/**
+	 * Add the next topology to an arena.
+	 * Returns false once every topology has been added.
+	 */
+	bool next(TreeArena& arena, int32_t& root) {
+		if (current >= end) {
+			return false;
+		}
+
+		root = appendTopology(current++, arena);
+		return true;
+	}
+
+	/**
+	 * Add the topology with the given index to an arena, returning its root.
+	 */
+	int32_t appendTopology(uint64_t index, TreeArena& arena) {
+		int numLeaves = leafNames.size();
+
+		// Nodes are numbered in the order they are made, leaf 0 and then leaf k followed by the node joining it in
+		int numNodes = 1;
+		int treeRoot = 0;
+		parent[0] = -1;
+		left[0] = -1;
+		right[0] = -1;
+
+		for (int k = 1; k < numLeaves; k++) {
+			int numChoices = 2 * k - 1;
+			int above = index % numChoices;
+			index /= numChoices;
+
+			int leaf = numNodes++;
+			int internal = numNodes++;
+
+			left[leaf] = -1;
+			right[leaf] = -1;
+			parent[leaf] = internal;
+
+			int oldParent = parent[above];
+			left[internal] = above;
+			right[internal] = leaf;
+			parent[internal] = oldParent;
+			parent[above] = internal;
+
+			if (oldParent == -1) {
+				treeRoot = internal;
+			} else if (left[oldParent] == above) {
+				left[oldParent] = internal;
+			} else {
+				right[oldParent] = internal;
+			}
+		}
+
+		return emit(treeRoot, arena);
+	}
+
+private:
+	/**
+	 * Add a node and everything below it to an arena.
+	 */
+	int32_t emit(int node, TreeArena& arena) const {
+		if (left[node] == -1) {
+			// Leaf k is node 2k-1
+			int leafIndex = node == 0 ? 0 : (node + 1) / 2;
+			return arena.addLeaf(leafNames[leafIndex].c_str());
+		}
+
+		int32_t leftChild = emit(left[node], arena);
+		int32_t rightChild = emit(right[node], arena);
+		return arena.addTree("", leftChild, rightChild);
+	}
+
+	const std::vector<std::string>& leafNames;
+	uint64_t current;
+	uint64_t end;
+
+	std::vector<int> parent;
+	std::vector<int> left;
+	std::vector<int> right;
+};
+
+/**
+ * Add every rooted binary topology over a set of leaves to an arena, returning their roots.
+ */
+inline std::vector<int32_t> enumerateTopologies(const std::vector<std::string>& leafNames, TreeArena& arena) {
+	std::vector<int32_t> roots;
+	roots.reserve(countTopologies(leafNames.size()));
+
+	TopologyIterator iterator(leafNames);
+	int32_t root;
+	while (iterator.next(arena, root)) {
+		roots.push_back(root);
+	}
+
+	return roots;
+}
+
+/**
+ * Compute the probability of every rooted topology over the leaves of a network, in the order of TopologyIterator.
+ * Topologies are streamed in parallel, so they are never all in memory at once.
+ * Also computes the derivatives of each probability if derivatives is not nullptr.
+ * Returns false if the network has more leaves than gene trees can have.
+ */
+inline bool calcAllTopologyProbabilities(const PreparedNetwork& network, const double* params, std::vector<double>& probabilities, std::vector<std::vector<double>>* derivatives = nullptr) {
+	if ((int) network.leafNames.size() > maxGeneTreeLeaves) {
+		std::cerr<<"Gene trees and networks can have at most "<<maxGeneTreeLeaves<<" taxa"<<std::endl;
+		return false;
+	}
+
+	size_t numTopologies = countTopologies(network.leafNames.size());
+	probabilities.assign(numTopologies, 0.0);
+	if (derivatives != nullptr) {
+		derivatives->assign(numTopologies, std::vector<double>());
+	}
+
+	parallelChunks(numTopologies, [&](int, int begin, int end) {
+		static thread_local EvaluationContext<double> context;
+		DoubleParams values = {params};
+
+		TreeArena arena;
+		PreparedGeneTree tree;
+		TopologyIterator iterator(network.leafNames, begin, end);
+
+		for (int i = begin; i < end; i++) {
+			arena.clear();
+
+			int32_t root;
+			iterator.next(arena, root);
+
+			// Every leaf of the network is in the topology, and there are few enough of them, so this can't fail
+			prepareGeneTree(network, arena, root, tree);
+
+			probabilities[i] = calcProbability(network, tree, values, context, derivatives != nullptr ? &(*derivatives)[i] : nullptr);
+		}
+	});
+	return true;
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "newick.h"
+#include "parallel.h"
+
+/**
+ * A file of gene trees, all stored in one arena.
+ */
+struct GeneTreeFile {
+	TreeArena arena;
+	std::vector<int32_t> roots;
+	std::vector<double> weights;
+};
+
+/**
+ * A read only memory mapping of a whole file.
+ */
+class MappedFile {
+public:
+	MappedFile() : data(nullptr), size(0) {}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		if (data != nullptr) {
+			munmap((void*) data, size);
+		}
+	}
+
+	/**
+	 * Map a file. Returns false if it can't be read.
+	 */
+	bool open(const char* path) {
+		int file = ::open(path, O_RDONLY);
+		if (file == -1) {
+			return false;
+		}
+
+		struct stat info;
+		if (fstat(file, &info) == -1) {
+			close(file);
+			return false;
+		}
+
+		size = info.st_size;
+
+		// Empty files can't be mapped, but they are still valid
+		if (size != 0) {
+			void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+			if (mapping == MAP_FAILED) {
+				close(file);
+				size = 0;
+				return false;
+			}
+			data = (const char*) mapping;
+			madvise(mapping, size, MADV_SEQUENTIAL);
+		}
+
+		close(file);
+		return true;
+	}
+
+	const char* data;
+	size_t size;
+};
+
+/**
+ * A non empty line of a gene tree file.
+ */
+struct GeneTreeLine {
+	const char* begin;
+	const char* end;
+	int number; // Starting from 1.
+};
+
+/**
+ * Get a tab separated field from a line, or false if there aren't enough fields.
+ */
+inline bool getField(const GeneTreeLine& line, int column, const char*& begin, const char*& end) {
+	begin = line.begin;
+	for (int i = 0; i < column; i++) {
+		begin = (const char*) std::memchr(begin, '\t', line.end - begin);
+		if (begin == nullptr) {
+			return false;
+		}
+		begin++;
+	}
+
+	end = (const char*) std::memchr(begin, '\t', line.end - begin);
+	if (end == nullptr) {
+		end = line.end;
+	}
+
+	// Trim spaces so that hand written files work too
+	while (begin != end && (*begin == ' ' || *begin == '\r')) {
+		begin++;
+	}
+	while (begin != end && (end[-1] == ' ' || end[-1] == '\r')) {
+		end--;
+	}
+
+	return true;
+}
+
+/**
+ * Split text into its non empty lines.
+ */
+inline std::vector<GeneTreeLine> splitLines(const char* data, size_t length) {
+	std::vector<GeneTreeLine> result;
+
+	const char* current = data;
+	const char* end = data + length;
+	int number = 1;
+
+	while (current != end) {
+		const char* lineEnd = (const char*) std::memchr(current, '\n', end - current);
+		if (lineEnd == nullptr) {
+			lineEnd = end;
+		}
+
+		for (const char* c = current; c != lineEnd; c++) {
+			if (*c != ' ' && *c != '\t' && *c != '\r') {
+				result.push_back({current, lineEnd, number});
+				break;
+			}
+		}
+
+		current = lineEnd == end ? end : lineEnd + 1;
+		number++;
+	}
+
+	return result;
+}
+
+/**
+ * Load gene trees from text, either a TSV with a TREE column and optional WEIGHT column, or one Newick tree per line.
+ * Without a header, a tab and a weight may follow each tree. Missing weights are 1.
+ * Lines are parsed in parallel, and the trees end up in file order.
+ * Returns false, after printing why, if any line is invalid.
+ */
+inline bool loadGeneTrees(const char* data, size_t length, GeneTreeFile& result) {
+	std::vector<GeneTreeLine> lines = splitLines(data, length);
+
+	int treeColumn = 0;
+	int weightColumn = 1;
+	unsigned int firstLine = 0;
+
+	if (!lines.empty()) {
+		const char* begin;
+		const char* end;
+		getField(lines[0], 0, begin, end);
+
+		if (begin == end || *begin != '(') {
+			// A header, so look up the columns by name
+			treeColumn = -1;
+			weightColumn = -1;
+			firstLine = 1;
+
+			for (int column = 0; getField(lines[0], column, begin, end); column++) {
+				std::string name(begin, end);
+				if (name == "TREE") {
+					treeColumn = column;
+				} else if (name == "WEIGHT") {
+					weightColumn = column;
+				}
+			}
+
+			if (treeColumn == -1) {
+				std::cerr<<"Gene tree files need a TREE column"<<std::endl;
+				return false;
+			}
+		}
+	}
+
+	int numTrees = lines.size() - firstLine;
+
+	std::vector<GeneTreeFile> chunks(std::max(1, std::min(getNumThreads(), numTrees)));
+	std::vector<int> failedLines(chunks.size(), 0);
+
+	int numChunks = parallelChunks(numTrees, [&](int chunk, int begin, int end) {
+		GeneTreeFile& part = chunks[chunk];
+		part.roots.reserve(end - begin);
+		part.weights.reserve(end - begin);
+
+		for (int i = begin; i < end; i++) {
+			const GeneTreeLine& line = lines[firstLine + i];
+			const char* fieldBegin;
+			const char* fieldEnd;
+
+			int32_t root;
+			if (!getField(line, treeColumn, fieldBegin, fieldEnd) || !parseTree(fieldBegin, fieldEnd, part.arena, root)) {
+				failedLines[chunk] = line.number;
+				return;
+			}
+
+			double weight = 1;
+			if (weightColumn != -1 && getField(line, weightColumn, fieldBegin, fieldEnd) && !parseDouble(fieldBegin, fieldEnd, weight)) {
+				failedLines[chunk] = line.number;
+				return;
+			}
+
+			part.roots.push_back(root);
+			part.weights.push_back(weight);
+		}
+	});
+
+	for (int chunk = 0; chunk < numChunks; chunk++) {
+		if (failedLines[chunk] != 0) {
+			std::cerr<<"Invalid gene tree on line "<<failedLines[chunk]<<std::endl;
+			return false;
+		}
+	}
+
+	result = GeneTreeFile();
+	result.roots.reserve(numTrees);
+	result.weights.reserve(numTrees);
+
+	for (int chunk = 0; chunk < numChunks; chunk++) {
+		int32_t offset = result.arena.append(chunks[chunk].arena);
+		for (int32_t root : chunks[chunk].roots) {
+			result.roots.push_back(root + offset);
+		}
+		result.weights.insert(result.weights.end(), chunks[chunk].weights.begin(), chunks[chunk].weights.end());
+	}
+
+	return true;
+}
+
+/**
+ * Load gene trees from a file, see loadGeneTrees above for the format.
+ */
+inline bool loadGeneTrees(const char* path, GeneTreeFile& result) {
+	MappedFile file;
+	if (!file.open(path)) {
+		std::cerr<<"Could not read "<<path<<std::endl;
+		return false;
+	}
+
+	return loadGeneTrees(file.data, file.size, result);
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+#include <algorithm>
+
+#include "prepared.h"
+#include "batch.h"
+#include "optimize.h"
+#include "parallel.h"
+#include "subtreecache.h"
+
+/**
+ * How hill climbing decides whether to move to the best candidate of a round.
+ */
+enum class AcceptanceRule : int32_t {
+	GREEDY = 0, // Only move if the candidate is better.
+	ANNEALING = 1, // Also move to worse candidates with probability exp(change / temperature).
+};
+
+/**
+ * Settings for hill climbing.
+ */
+struct HillClimbOptions {
+	int maxRounds = 100;
+	int candidatesPerRound = 8; // The number of moves proposed and evaluated together every round.
+	double maxDelta = 0.1; // A move changes one param by at most half of this either way, like randomNeighbor.m.
+	AcceptanceRule rule = AcceptanceRule::GREEDY;
+	double initialTemperature = 1; // In log likelihood units, only used for annealing.
+	double cooling = 0.95; // The temperature is multiplied by this after every round.
+	uint64_t seed = 0;
+};
+
+/**
+ * What hill climbing found.
+ */
+struct HillClimbResult {
+	std::vector<double> params; // The best params seen, which annealing may have moved away from.
+	double logLikelihood = 0; // The log likelihood at params.
+	int rounds = 0;
+	int evaluations = 0;
+	int accepted = 0; // The number of rounds that moved.
+	std::vector<double> trace; // The log likelihood of the current params at the start and after every round.
+};
+
+/**
+ * Maximize the log likelihood of a batch without derivatives by stochastic hill climbing.
+ * Every round proposes candidatesPerRound random moves of a single param, evaluates them in parallel and
+ * considers the best one for acceptance. All evaluations share one subtree cache, so a candidate only recomputes
+ * the species subtrees that use the param it changed.
+ * Lengths stay at least 0 and left probabilities between 0 and 1. The same seed gives the same result.
+ */
+inline HillClimbResult hillClimbLogLikelihood(const PreparedNetwork& network, const GeneTreeBatch& batch, const std::vector<double>& start, const HillClimbOptions& options = HillClimbOptions()) {
+	int numParams = network.numParams;
+
+	std::vector<double> lower;
+	std::vector<double> upper;
+	ParamMapping(getParamKinds(network), ParamTransform::NONE).getBounds(lower, upper);
+
+	std::mt19937_64 generator(options.seed);
+	std::uniform_int_distribution<int> paramChoice(0, std::max(0, numParams - 1));
+	std::uniform_real_distribution<double> uniform(0, 1);
+
+	SubtreeCache cache(network);
+
+	HillClimbResult result;
+	std::vector<double> current(start);
+	for (int i = 0; i < numParams; i++) {
+		current[i] = std::min(upper[i], std::max(lower[i], current[i]));
+	}
+
+	double currentValue = calcLogLikelihood(network, batch, current.data(), nullptr, &cache);
+	result.evaluations++;
+	result.trace.push_back(currentValue);
+
+	result.params = current;
+	result.logLikelihood = currentValue;
+
+	double temperature = options.initialTemperature;
+	int numCandidates = std::max(1, options.candidatesPerRound);
+
+	std::vector<std::vector<double>> candidates(numCandidates);
+	std::vector<double> values(numCandidates);
+
+	for (int round = 0; round < options.maxRounds && numParams > 0; round++) {
+		// Moves are drawn on this thread so they don't depend on how the evaluations are scheduled
+		for (auto&& candidate : candidates) {
+			candidate = current;
+
+			int index = paramChoice(generator);
+			double low = std::max(lower[index], current[index] - options.maxDelta / 2);
+			double high = std::min(upper[index], current[index] + options.maxDelta / 2);
+			candidate[index] = low + uniform(generator) * (high - low);
+		}
+
+		parallelTasks(numCandidates, [&](int i) {
+			values[i] = calcLogLikelihood(network, batch, candidates[i].data(), nullptr, &cache);
+		});
+		result.evaluations += numCandidates;
+
+		// Ties go to the first candidate, and NaN never wins
+		int best = -1;
+		for (int i = 0; i < numCandidates; i++) {
+			if (!std::isnan(values[i]) && (best == -1 || values[i] > values[best])) {
+				best = i;
+			}
+		}
+
+		double threshold = uniform(generator);
+		if (best != -1) {
+			double change = values[best] - currentValue;
+
+			bool accept = change > 0;
+			if (!accept && options.rule == AcceptanceRule::ANNEALING && temperature > 0) {
+				accept = threshold < std::exp(change / temperature);
+			}
+
+			if (accept) {
+				current.swap(candidates[best]);
+				currentValue = values[best];
+				result.accepted++;
+
+				if (currentValue > result.logLikelihood) {
+					result.params = current;
+					result.logLikelihood = currentValue;
+				}
+			}
+		}
+
+		temperature *= options.cooling;
+		result.rounds++;
+		result.trace.push_back(currentValue);
+	}
+
+	return result;
+}
@@ -0,0 +1,528 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "circuit.h"
+
+/**
+ * The signature of a generated kernel.
+ * It returns the probability and fills gradient when gradient is not nullptr.
+ */
+typedef double (*KernelFunction)(const double* params, double* gradient);
+
+/**
+ * Bump this whenever the generated code changes so old cached kernels are ignored.
+ */
+const int kernelVersion = 1;
+
+/**
+ * Compute a hash of everything in a circuit, and of target, which describes what it is compiled for.
+ * Two circuits with the same hash compute the same function, with code built for the same machine.
+ */
+inline uint64_t hashCircuit(const Circuit& circuit, const std::string& target = "") {
+	uint64_t hash = 14695981039346656037ULL;
+
+	auto mix = [&hash](uint64_t value) {
+		hash = (hash ^ value) * 1099511628211ULL;
+	};
+
+	mix(kernelVersion);
+	for (char c : target) {
+		mix((unsigned char) c);
+	}
+	mix(circuit.numParams);
+	mix(circuit.size);
+	mix(circuit.output);
+
+	for (double constant : circuit.constants) {
+		uint64_t bits;
+		std::memcpy(&bits, &constant, sizeof(double));
+		mix(bits);
+	}
+
+	for (const auto& runs : {circuit.leafRuns, circuit.runs}) {
+		for (const auto& run : runs) {
+			mix((uint64_t)run.op);
+			mix(run.begin);
+			mix(run.end);
+
+			for (int32_t i = run.begin; i < run.end; i++) {
+				mix(circuit.leafParams[i]);
+				mix(circuit.leafArgs[i]);
+				mix(circuit.operandA[i]);
+				mix(circuit.operandB[i]);
+			}
+		}
+	}
+
+	return hash;
+}
+
+/**
+ * Format a double so that it reads back exactly.
+ */
+inline std::string formatKernelConstant(double value) {
+	if (std::isinf(value)) {
+		return value > 0 ? "HUGE_VAL" : "-HUGE_VAL";
+	}
+	if (std::isnan(value)) {
+		return "NAN";
+	}
+
+	char buffer[64];
+	std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+	return buffer;
+}
+
+/**
+ * Generate C++ source for a fully unrolled version of a circuit.
+ * The source defines a single extern "C" function named networkprob_kernel.
+ */
+inline std::string generateKernelSource(const Circuit& circuit) {
+	std::ostringstream out;
+
+	out<<"// Generated by networkprob. Do not edit.\n";
+	out<<"#include <cmath>\n\n";
+	out<<"extern \"C\" double networkprob_kernel(const double* p, double* g) {\n";
+	out<<"\tstatic thread_local double v["<<circuit.size<<"];\n";
+	out<<"\tstatic thread_local double a["<<circuit.size<<"];\n\n";
+
+	for (unsigned int i = 0; i < circuit.constants.size(); i++) {
+		out<<"\tv["<<i<<"] = "<<formatKernelConstant(circuit.constants[i])<<";\n";
+	}
+
+	for (const auto& run : circuit.leafRuns) {
+		for (int32_t i = run.begin; i < run.end; i++) {
+			int32_t param = circuit.leafParams[i];
+			int32_t arg = circuit.leafArgs[i];
+
+			switch (run.op) {
+				case CircuitOp::DECAY:
+					out<<"\tv["<<i<<"] = std::exp(-"<<arg<<".0 * p["<<param<<"]);\n";
+					break;
+				case CircuitOp::LEFT_POWER:
+					out<<"\tv["<<i<<"] = std::pow(p["<<param<<"], "<<arg<<");\n";
+					break;
+				case CircuitOp::RIGHT_POWER:
+					out<<"\tv["<<i<<"] = std::pow(1 - p["<<param<<"], "<<arg<<");\n";
+					break;
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+	}
+
+	for (const auto& run : circuit.runs) {
+		for (int32_t i = run.begin; i < run.end; i++) {
+			int32_t a = circuit.operandA[i];
+			int32_t b = circuit.operandB[i];
+
+			switch (run.op) {
+				case CircuitOp::ADD:
+					out<<"\tv["<<i<<"] = v["<<a<<"] + v["<<b<<"];\n";
+					break;
+				case CircuitOp::MULTIPLY:
+					out<<"\tv["<<i<<"] = v["<<a<<"] * v["<<b<<"];\n";
+					break;
+				case CircuitOp::SQRT:
+					out<<"\tv["<<i<<"] = std::sqrt(v["<<a<<"]);\n";
+					break;
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+	}
+
+	out<<"\n\tif (g == 0) {\n";
+	out<<"\t\treturn v["<<circuit.output<<"];\n";
+	out<<"\t}\n\n";
+
+	out<<"\tfor (int i = 0; i < "<<circuit.size<<"; i++) {\n";
+	out<<"\t\ta[i] = 0;\n";
+	out<<"\t}\n";
+	out<<"\ta["<<circuit.output<<"] = 1;\n\n";
+
+	for (auto run = circuit.runs.rbegin(); run != circuit.runs.rend(); ++run) {
+		for (int32_t i = run->end - 1; i >= run->begin; i--) {
+			int32_t a = circuit.operandA[i];
+			int32_t b = circuit.operandB[i];
+
+			switch (run->op) {
+				case CircuitOp::ADD:
+					out<<"\ta["<<a<<"] += a["<<i<<"];\n";
+					out<<"\ta["<<b<<"] += a["<<i<<"];\n";
+					break;
+				case CircuitOp::MULTIPLY:
+					out<<"\ta["<<a<<"] += a["<<i<<"] * v["<<b<<"];\n";
+					out<<"\ta["<<b<<"] += a["<<i<<"] * v["<<a<<"];\n";
+					break;
+				case CircuitOp::SQRT:
+					out<<"\ta["<<a<<"] += v["<<i<<"] != 0 ? a["<<i<<"] * 0.5 / v["<<i<<"] : 0.0;\n";
+					break;
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+	}
+
+	out<<"\n\tfor (int i = 0; i < "<<circuit.numParams<<"; i++) {\n";
+	out<<"\t\tg[i] = 0;\n";
+	out<<"\t}\n";
+
+	for (const auto& run : circuit.leafRuns) {
+		for (int32_t i = run.begin; i < run.end; i++) {
+			int32_t param = circuit.leafParams[i];
+			int32_t arg = circuit.leafArgs[i];
+
+			switch (run.op) {
+				case CircuitOp::DECAY:
+					out<<"\tg["<<param<<"] -= a["<<i<<"] * "<<arg<<".0 * v["<<i<<"];\n";
+					break;
+				case CircuitOp::LEFT_POWER:
+					out<<"\tg["<<param<<"] += a["<<i<<"] * "<<arg<<".0 * std::pow(p["<<param<<"], "<<(arg - 1)<<");\n";
+					break;
+				case CircuitOp::RIGHT_POWER:
+					out<<"\tg["<<param<<"] -= a["<<i<<"] * "<<arg<<".0 * std::pow(1 - p["<<param<<"], "<<(arg - 1)<<");\n";
+					break;
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+	}
+
+	out<<"\n\treturn v["<<circuit.output<<"];\n";
+	out<<"}\n";
+
+	return out.str();
+}
+
+/**
+ * Get an environment variable, or a default if it isn't set.
+ */
+inline std::string getEnvironment(const char* name, const std::string& otherwise) {
+	const char* value = std::getenv(name);
+	if (value == nullptr || value[0] == '\0') {
+		return otherwise;
+	}
+	return value;
+}
+
+/**
+ * Get the compiler used for kernels.
+ * NETWORKPROB_CXX overrides CXX, which overrides the system c++.
+ */
+inline std::string getKernelCompiler() {
+	return getEnvironment("NETWORKPROB_CXX", getEnvironment("CXX", "c++"));
+}
+
+/**
+ * Get the directory where compiled kernels are cached.
+ * NETWORKPROB_KERNEL_CACHE overrides the per user cache in XDG_CACHE_HOME or ~/.cache.
+ */
+inline std::string getKernelCacheDirectory() {
+	std::string home = getEnvironment("HOME", "");
+	std::string cache = getEnvironment("XDG_CACHE_HOME", home.empty() ? "" : home + "/.cache");
+	return getEnvironment("NETWORKPROB_KERNEL_CACHE", cache.empty() ? "" : cache + "/networkprob-kernels");
+}
+
+/**
+ * Check that path is a directory only the current user can get into, so nobody else can plant kernels in it.
+ */
+inline bool isPrivateDirectory(const std::string& path) {
+	struct stat info;
+	return lstat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == getuid() && (info.st_mode & 0777) == 0700;
+}
+
+/**
+ * Check that path is a regular file of the current user that nobody else can write to.
+ */
+inline bool isOwnedFile(const std::string& path) {
+	struct stat info;
+	return lstat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode) && info.st_uid == getuid() && (info.st_mode & 0022) == 0;
+}
+
+/**
+ * Run a program without a shell, with arguments split on spaces. Its standard output goes to output if it is
+ * not nullptr, and everything else is discarded. Returns whether it ran and exited with 0.
+ */
+inline bool runProgram(const std::string& program, const std::vector<std::string>& arguments, std::string* output = nullptr) {
+	std::vector<std::string> words;
+	std::istringstream in(program);
+	std::string word;
+	while (in>>word) {
+		words.push_back(word);
+	}
+	if (words.empty()) {
+		return false;
+	}
+	words.insert(words.end(), arguments.begin(), arguments.end());
+
+	std::vector<char*> argv;
+	for (std::string& argument : words) {
+		argv.push_back(&argument[0]);
+	}
+	argv.push_back(nullptr);
+
+	int pipes[2] = {-1, -1};
+	if (output != nullptr && pipe(pipes) == -1) {
+		return false;
+	}
+
+	pid_t child = fork();
+	if (child == -1) {
+		if (output != nullptr) {
+			close(pipes[0]);
+			close(pipes[1]);
+		}
+		return false;
+	}
+
+	if (child == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if (null != -1) {
+			dup2(output != nullptr ? pipes[1] : null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+		}
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+
+	if (output != nullptr) {
+		close(pipes[1]);
+		output->clear();
+
+		char buffer[4096];
+		ssize_t count;
+		while ((count = read(pipes[0], buffer, sizeof(buffer))) != 0) {
+			if (count > 0) {
+				output->append(buffer, count);
+			} else if (errno != EINTR) {
+				break;
+			}
+		}
+		close(pipes[0]);
+	}
+
+	int status;
+	while (waitpid(child, &status, 0) == -1) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Check if the kernel compiler can be run at all.
+ */
+inline bool hasKernelCompiler() {
+	return runProgram(getKernelCompiler(), {"--version"});
+}
+
+/**
+ * Describe what the kernel compiler builds for on this host: its version, and the macros -march=native defines,
+ * which name the CPU features kernels may use. Hosts that share a cache only share kernels built for the same target.
+ * Returns an empty string if the compiler can't be run. Each compiler is only asked once per process.
+ */
+inline std::string getKernelTarget() {
+	static std::mutex mutex;
+	static std::map<std::string, std::string> targets;
+
+	std::string compiler = getKernelCompiler();
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = targets.find(compiler);
+	if (found != targets.end()) {
+		return found->second;
+	}
+
+	std::string version;
+	std::string macros;
+	std::string target;
+	if (runProgram(compiler, {"--version"}, &version) && runProgram(compiler, {"-march=native", "-dM", "-E", "-x", "c++", "/dev/null"}, &macros)) {
+		target = version + macros;
+	}
+	targets[compiler] = target;
+	return target;
+}
+
+/**
+ * Compile a circuit into a shared library at path.
+ * Returns false if the compiler is missing or fails.
+ */
+inline bool compileKernel(const Circuit& circuit, const std::string& path) {
+	std::string temporary = path + "." + std::to_string(getpid());
+	std::string source = temporary + ".cpp";
+
+	{
+		std::ofstream file(source);
+		file<<generateKernelSource(circuit);
+		if (!file) {
+			return false;
+		}
+	}
+
+	bool compiled = runProgram(getKernelCompiler(), {"-O2", "-march=native", "-shared", "-fPIC", "-o", temporary, source});
+	std::remove(source.c_str());
+
+	if (!compiled) {
+		std::remove(temporary.c_str());
+		return false;
+	}
+
+	// Rename so that other processes never see a partially written kernel
+	return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+/**
+ * A likelihood circuit that is evaluated by native code when possible.
+ * Native kernels are specialized for one circuit and cached on disk by the circuit's hash.
+ * Without a working compiler, the circuit is interpreted.
+ */
+class LikelihoodKernel {
+public:
+	/**
+	 * Create a kernel that interprets the circuit until loadNative is called.
+	 */
+	explicit LikelihoodKernel(Circuit a_circuit) : circuit(std::move(a_circuit)), handle(nullptr), function(nullptr) {}
+
+	LikelihoodKernel(const LikelihoodKernel&) = delete;
+	LikelihoodKernel& operator=(const LikelihoodKernel&) = delete;
+
+	~LikelihoodKernel() {
+		if (handle != nullptr) {
+			dlclose(handle);
+		}
+	}
+
+	/**
+	 * Load the native version of the circuit, compiling it if it isn't in the cache.
+	 * Returns whether native code is now in use.
+	 */
+	bool loadNative() {
+		if (function != nullptr) {
+			return true;
+		}
+
+		// Anything in the cache gets loaded into this process, so it has to be private
+		std::string directory = getKernelCacheDirectory();
+		if (directory.empty()) {
+			return false;
+		}
+		mkdir(directory.substr(0, directory.find_last_of('/')).c_str(), 0700);
+		mkdir(directory.c_str(), 0700);
+		if (!isPrivateDirectory(directory)) {
+			return false;
+		}
+
+		// Kernels are built with -march=native, so one built for another CPU could crash this one
+		std::string target = getKernelTarget();
+		if (target.empty()) {
+			return false;
+		}
+
+		char name[64];
+		std::snprintf(name, sizeof(name), "/kernel-%016llx.so", (unsigned long long) hashCircuit(circuit, target));
+		std::string path = directory + name;
+
+		if (tryLoad(path)) {
+			return true;
+		}
+
+		// A missing or stale kernel, so build it from scratch
+		std::remove(path.c_str());
+		return compileKernel(circuit, path) && tryLoad(path);
+	}
+
+	/**
+	 * Check if native code is in use.
+	 */
+	bool isNative() const {
+		return function != nullptr;
+	}
+
+	/**
+	 * Get the underlying circuit.
+	 */
+	const Circuit& getCircuit() const {
+		return circuit;
+	}
+
+	/**
+	 * Evaluate the probability, and the gradient if it is not nullptr.
+	 */
+	double evaluate(const double* params, double* gradient = nullptr) const {
+		if (function != nullptr) {
+			return function(params, gradient);
+		} else {
+			return circuit.evaluate(params, gradient);
+		}
+	}
+
+private:
+	/**
+	 * Try to load a kernel from path, checking that it agrees with the circuit.
+	 * Only kernels of the current user are loaded, since loading runs their code.
+	 */
+	bool tryLoad(const std::string& path) {
+		if (!isOwnedFile(path)) {
+			return false;
+		}
+
+		void* nextHandle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+		if (nextHandle == nullptr) {
+			return false;
+		}
+
+		KernelFunction nextFunction = (KernelFunction) dlsym(nextHandle, "networkprob_kernel");
+
+		if (nextFunction == nullptr || !agreesWithCircuit(nextFunction)) {
+			dlclose(nextHandle);
+			return false;
+		}
+
+		handle = nextHandle;
+		function = nextFunction;
+		return true;
+	}
+
+	/**
+	 * Spot check a native kernel against the interpreter.
+	 */
+	bool agreesWithCircuit(KernelFunction nextFunction) const {
+		std::vector<double> params(circuit.numParams);
+		for (unsigned int i = 0; i < params.size(); i++) {
+			params[i] = 0.25 + 0.5 * (i + 1) / (params.size() + 1);
+		}
+
+		double expected = circuit.evaluate(params.data());
+		double actual = nextFunction(params.data(), nullptr);
+
+		return std::abs(expected - actual) <= 1e-12 * std::abs(expected) || (std::isnan(expected) && std::isnan(actual));
+	}
+
+	Circuit circuit;
+
+	void* handle;
+	KernelFunction function;
+};
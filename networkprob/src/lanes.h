@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include "mathutils.h"
+#include "prepared.h"
+#include "parallel.h"
+
+/**
+ * The number of parameter vectors evaluated together, one per SIMD lane.
+ */
+const int laneWidth = 4;
+
+/**
+ * The SIMD vector behind Lanes. Its alignment is lowered so densemaps of lanes can live in ordinary vectors.
+ */
+typedef double LaneVector __attribute__((vector_size(laneWidth * sizeof(double)), aligned(sizeof(double))));
+
+/**
+ * One double for each of laneWidth parameter vectors.
+ * Using this as the value type of the prepared engine runs the same topology work once for every lane,
+ * with all of the arithmetic on the histories done lane by lane in SIMD registers.
+ */
+struct Lanes {
+	LaneVector values;
+
+	Lanes() : values{} {}
+
+	Lanes(double value) : values{} {
+		values += value;
+	}
+
+	explicit Lanes(LaneVector a_values) : values(a_values) {}
+
+	/**
+	 * Get the value for one lane.
+	 */
+	double operator[](int lane) const {
+		return values[lane];
+	}
+
+	/**
+	 * Set the value for one lane.
+	 */
+	void set(int lane, double value) {
+		values[lane] = value;
+	}
+
+	/**
+	 * Check if any lane is not zero, so that work is only skipped when every lane can skip it.
+	 */
+	bool operator!=(double value) const {
+		for (int i = 0; i < laneWidth; i++) {
+			if (values[i] != value) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	Lanes& operator+=(const Lanes& other) {
+		values += other.values;
+		return *this;
+	}
+};
+
+inline Lanes operator+(const Lanes& a, const Lanes& b) {
+	return Lanes(a.values + b.values);
+}
+
+inline Lanes operator-(const Lanes& a, const Lanes& b) {
+	return Lanes(a.values - b.values);
+}
+
+inline Lanes operator*(const Lanes& a, const Lanes& b) {
+	return Lanes(a.values * b.values);
+}
+
+inline Lanes operator/(const Lanes& a, const Lanes& b) {
+	return Lanes(a.values / b.values);
+}
+
+/**
+ * Take the square root of every lane.
+ */
+inline Lanes sqrt(const Lanes& a) {
+	Lanes result;
+	for (int i = 0; i < laneWidth; i++) {
+		result.set(i, std::sqrt(a[i]));
+	}
+	return result;
+}
+
+/**
+ * Compute the puv function for every lane.
+ */
+inline Lanes puv(int u, int v, const Lanes& length) {
+	Lanes result;
+	for (int i = 0; i < laneWidth; i++) {
+		result.set(i, puv(u, v, length[i]));
+	}
+	return result;
+}
+
+/**
+ * Compute the derivative of the puv function for every lane.
+ */
+inline Lanes derivatePuv(int u, int v, const Lanes& length) {
+	Lanes result;
+	for (int i = 0; i < laneWidth; i++) {
+		result.set(i, derivatePuv(u, v, length[i]));
+	}
+	return result;
+}
+
+/**
+ * Compute leftInheritance for every lane.
+ */
+inline Lanes leftInheritance(const Lanes& leftProbability, int numLineages) {
+	Lanes result;
+	for (int i = 0; i < laneWidth; i++) {
+		result.set(i, leftInheritance(leftProbability[i], numLineages));
+	}
+	return result;
+}
+
+/**
+ * Compute rightInheritance for every lane.
+ */
+inline Lanes rightInheritance(const Lanes& leftProbability, int numLineages) {
+	Lanes result;
+	for (int i = 0; i < laneWidth; i++) {
+		result.set(i, rightInheritance(leftProbability[i], numLineages));
+	}
+	return result;
+}
+
+/**
+ * Params for the prepared engine with one parameter vector per lane.
+ */
+struct LaneParams {
+	std::vector<Lanes> values; // The value of each param in every lane.
+
+	/**
+	 * Get the length of an edge, where -1 is the infinite root edge.
+	 */
+	Lanes length(int paramId) const {
+		return paramId < 0 ? Lanes(std::numeric_limits<double>::infinity()) : values[paramId];
+	}
+
+	/**
+	 * Get the left probability of a network node.
+	 */
+	const Lanes& inheritance(int paramId) const {
+		return values[paramId];
+	}
+
+	/**
+	 * Get the probability a leaf starts with.
+	 */
+	Lanes one() const {
+		return Lanes(1.0);
+	}
+};
+
+/**
+ * Compute the probability of one prepared gene tree at many parameter vectors, sharing all of the topology work.
+ * params is a row major numVectors by network.numParams matrix, and probabilities gets numVectors values.
+ * If derivatives is not nullptr, it gets a numVectors by network.numParams matrix of derivatives.
+ * Groups of laneWidth vectors are evaluated together, and the groups in parallel.
+ */
+inline void calcProbabilities(const PreparedNetwork& network, const PreparedGeneTree& tree, const double* params, int numVectors, double* probabilities, double* derivatives = nullptr) {
+	int numParams = network.numParams;
+	int numGroups = (numVectors + laneWidth - 1) / laneWidth;
+
+	parallelChunks(numGroups, [&](int, int begin, int end) {
+		static thread_local EvaluationContext<Lanes> context;
+		LaneParams lanes;
+		lanes.values.resize(numParams);
+		std::vector<Lanes> laneDerivatives;
+
+		for (int group = begin; group < end; group++) {
+			int first = group * laneWidth;
+			int numLanes = std::min(laneWidth, numVectors - first);
+
+			// The last group repeats its final vector in the lanes it doesn't need
+			for (int lane = 0; lane < laneWidth; lane++) {
+				const double* row = params + (size_t) (first + std::min(lane, numLanes - 1)) * numParams;
+				for (int j = 0; j < numParams; j++) {
+					lanes.values[j].set(lane, row[j]);
+				}
+			}
+
+			Lanes probability = calcProbability(network, tree, lanes, context, derivatives != nullptr ? &laneDerivatives : nullptr);
+
+			for (int lane = 0; lane < numLanes; lane++) {
+				probabilities[first + lane] = probability[lane];
+				if (derivatives != nullptr) {
+					for (int j = 0; j < numParams; j++) {
+						derivatives[(size_t) (first + lane) * numParams + j] = laneDerivatives[j][lane];
+					}
+				}
+			}
+		}
+	});
+}
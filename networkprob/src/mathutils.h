@@ -95,6 +95,20 @@ inline double derivatePuv(int u, int v, double T) {
 	return sum;
 }
 
+/**
+ * Compute the probability that numLineages lineages all take the left parent of a network node.
+ */
+inline double leftInheritance(double leftProbability, int numLineages) {
+	return std::pow(leftProbability, numLineages);
+}
+
+/**
+ * Compute the probability that numLineages lineages all take the right parent of a network node.
+ */
+inline double rightInheritance(double leftProbability, int numLineages) {
+	return std::pow(1 - leftProbability, numLineages);
+}
+
 static double numberOfOptionsArray[8][8] = {};
 
 /**
@@ -3,14 +3,52 @@
 #include "densemap.h"
 #include "netnode.h"
 #include "example.h"
+#include "arena.h"
+#include "newick.h"
+#include "genetrees.h"
+#include "topology.h"
+#include "batch.h"
+#include "subtreecache.h"
+#include "enumerate.h"
+#include "distribution.h"
+#include "prepared.h"
+#include "circuit.h"
+#include "kernel.h"
+#include "lanes.h"
+#include "optimize.h"
+#include "multistart.h"
+#include "hillclimb.h"
+#include "netsearch.h"
+#include "mcmc.h"
+#include "simulate.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <atomic>
+#include <limits>
+
+/**
+ * computeProbability keeps the last network it prepared from a buffer, along with the arena size and root
+ * it came from. Buffers only grow, so the same size and root means the same network, apart from its params.
+ * Every preparation gets a new id, so prepared gene trees can tell which network they were prepared for.
+ */
 struct NetworkBuffer {
-    std::vector<NetNode> data;
+    NetworkArena arena;
+
+    PreparedNetwork prepared;
+    int32_t preparedRoot = -1;
+    int32_t preparedSize = 0;
+    uint64_t preparedId = 0;
 };
 
+uint64_t nextPreparedId() {
+    static std::atomic<uint64_t> next(1);
+    return next++;
+}
+
 struct NetworkBuffer* allocNetworkBuffer(int size) {
     NetworkBuffer* result = new NetworkBuffer();
-    result->data.reserve(size);
+    result->arena.reserve(size);
     return result;
 }
 
@@ -18,32 +56,50 @@ void freeNetworkBuffer(struct NetworkBuffer* buffer) {
     delete buffer;
 }
 
+int saveNetworkBuffer(struct NetworkBuffer* buffer, const char* path) {
+    return buffer->arena.save(path) ? 1 : 0;
+}
+
+struct NetworkBuffer* loadNetworkBuffer(const char* path) {
+    NetworkBuffer* result = new NetworkBuffer();
+    if (!result->arena.load(path)) {
+        delete result;
+        return nullptr;
+    }
+    return result;
+}
+
 int createLeafNetNode(struct NetworkBuffer* buffer, const char* name) {
-    buffer->data.emplace_back(name);
-    return buffer->data.size() - 1;
+    return buffer->arena.addLeaf(name);
 }
 
-Edge<NetNode> createEdgeFromStruct(struct NetworkBuffer* buffer, NetworkEdge edge) {
-    return Edge<NetNode>(edge.index, buffer->data[edge.sourceNode], edge.distance, (EdgeType)edge.type);
+ArenaEdge createEdgeFromStruct(NetworkEdge edge) {
+    return {edge.distance, edge.sourceNode, edge.index, (EdgeType)edge.type, 0};
 }
 
 int createTreeNetNode(struct NetworkBuffer* buffer, const char* name, struct NetworkEdge leftEdge, struct NetworkEdge rightEdge) {
-    buffer->data.emplace_back(name, createEdgeFromStruct(buffer, leftEdge), createEdgeFromStruct(buffer, rightEdge));
-    return buffer->data.size() - 1;
+    return buffer->arena.addTree(name, createEdgeFromStruct(leftEdge), createEdgeFromStruct(rightEdge));
 }
 
 int createNetworkNetNode(struct NetworkBuffer* buffer, const char* name,  struct NetworkEdge bottomEdge, double leftProbability, int introgressionId) {
-    buffer->data.emplace_back(name, createEdgeFromStruct(buffer, bottomEdge), leftProbability, introgressionId);
-    return buffer->data.size() - 1;
+    return buffer->arena.addNetwork(name, createEdgeFromStruct(bottomEdge), leftProbability, introgressionId);
 }
 
+/**
+ * Like NetworkBuffer, keeps the gene tree computeProbability last prepared from it.
+ */
 struct TreeBuffer {
-    std::vector<TreeNode> data;
+    TreeArena arena;
+
+    PreparedGeneTree prepared;
+    int32_t preparedRoot = -1;
+    int32_t preparedSize = 0;
+    uint64_t preparedNetworkId = 0;
 };
 
 struct TreeBuffer* allocTreeBuffer(int size) {
     TreeBuffer* result = new TreeBuffer();
-    result->data.reserve(size);
+    result->arena.reserve(size);
     return result;
 }
 
@@ -51,26 +107,128 @@ void freeTreeBuffer(struct TreeBuffer* buffer) {
     delete buffer;
 }
 
+int saveTreeBuffer(struct TreeBuffer* buffer, const char* path) {
+    return buffer->arena.save(path) ? 1 : 0;
+}
+
+struct TreeBuffer* loadTreeBuffer(const char* path) {
+    TreeBuffer* result = new TreeBuffer();
+    if (!result->arena.load(path)) {
+        delete result;
+        return nullptr;
+    }
+    return result;
+}
+
 int createLeafTreeNode(struct TreeBuffer* buffer, const char* name) {
-    buffer->data.emplace_back(name);
-    return buffer->data.size() - 1;
+    return buffer->arena.addLeaf(name);
 }
 
 int createTreeTreeNode(struct TreeBuffer* buffer, const char* name, int leftDescendant, int rightDescendant) {
-    buffer->data.emplace_back(name, buffer->data[leftDescendant], buffer->data[rightDescendant]);
-    return buffer->data.size() - 1;
+    return buffer->arena.addTree(name, leftDescendant, rightDescendant);
+}
+
+Network createNetworkFromNewick(const char* newick, int* numParams) {
+    NetworkBuffer* buffer = new NetworkBuffer();
+
+    Network result = {buffer, -1};
+    int resultParams = 0;
+
+    if (!parseNetwork(newick, buffer->arena, result.rootNode, resultParams)) {
+        delete buffer;
+        result.buffer = nullptr;
+        result.rootNode = -1;
+    }
+
+    if (numParams != nullptr) {
+        *numParams = resultParams;
+    }
+
+    return result;
+}
+
+GeneTrees loadGeneTreeFile(const char* path) {
+    GeneTrees result = {nullptr, 0, nullptr, nullptr};
+
+    GeneTreeFile file;
+    if (!loadGeneTrees(path, file)) {
+        return result;
+    }
+
+    result.buffer = new TreeBuffer();
+    result.buffer->arena = std::move(file.arena);
+    result.numTrees = file.roots.size();
+
+    result.rootNodes = new int[result.numTrees];
+    std::copy(file.roots.begin(), file.roots.end(), result.rootNodes);
+
+    result.weights = new double[result.numTrees];
+    std::copy(file.weights.begin(), file.weights.end(), result.weights);
+
+    return result;
+}
+
+void freeGeneTrees(struct GeneTrees trees) {
+    delete trees.buffer;
+    delete[] trees.rootNodes;
+    delete[] trees.weights;
+}
+
+/**
+ * Get the prepared version of a network, preparing it again only if the buffer or root changed.
+ * The params are always read again, since changeParams and the optimizers change them in place.
+ */
+const PreparedNetwork& getPreparedNetwork(Network net) {
+    NetworkBuffer& buffer = *net.buffer;
+    if (buffer.preparedId == 0 || buffer.preparedRoot != net.rootNode || buffer.preparedSize != buffer.arena.size()) {
+        buffer.prepared = prepareNetwork(buffer.arena, net.rootNode);
+        buffer.preparedRoot = net.rootNode;
+        buffer.preparedSize = buffer.arena.size();
+        buffer.preparedId = nextPreparedId();
+    } else {
+        buffer.arena.getParams(net.rootNode, buffer.prepared.params.data());
+    }
+    return buffer.prepared;
+}
+
+/**
+ * Get the prepared version of a gene tree for the network getPreparedNetwork last prepared from net.
+ * Returns nullptr if the tree doesn't match the network.
+ */
+const PreparedGeneTree* getPreparedGeneTree(Network net, Tree tree) {
+    TreeBuffer& buffer = *tree.buffer;
+    if (buffer.preparedNetworkId != net.buffer->preparedId || buffer.preparedRoot != tree.rootNode || buffer.preparedSize != buffer.arena.size()) {
+        buffer.preparedNetworkId = 0;
+        if (!prepareGeneTree(net.buffer->prepared, buffer.arena, tree.rootNode, buffer.prepared)) {
+            return nullptr;
+        }
+        buffer.preparedRoot = tree.rootNode;
+        buffer.preparedSize = buffer.arena.size();
+        buffer.preparedNetworkId = net.buffer->preparedId;
+    }
+    return &buffer.prepared;
 }
 
 void changeParams(Network net, double* params) {
-    net.buffer->data[net.rootNode].setParams(params);
+    net.buffer->arena.setParams(net.rootNode, params);
 }
 
 double computeProbability(Network net, Tree tree, double* derivatives) {
+    static thread_local EvaluationContext<double> context;
+
+    const PreparedNetwork& network = getPreparedNetwork(net);
+    const PreparedGeneTree* gene = getPreparedGeneTree(net, tree);
+    if (gene == nullptr) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    DoubleParams values = {network.params.data()};
+
     if (derivatives == nullptr) {
-        return calcProbability(net.buffer->data[net.rootNode], tree.buffer->data[tree.rootNode], nullptr);
+        return calcProbability(network, *gene, values, context);
     } else {
         std::vector<double> derivativeResults;
-        double prob = calcProbability(net.buffer->data[net.rootNode], tree.buffer->data[tree.rootNode], &derivativeResults);
+        double prob = calcProbability(network, *gene, values, context, &derivativeResults);
 
         for (unsigned int i = 0; i < derivativeResults.size(); i++) {
             derivatives[i] = derivativeResults[i];
@@ -79,4 +237,584 @@ double computeProbability(Network net, Tree tree, double* derivatives) {
         return prob;
     }
 
-}
\ No newline at end of file
+}
+
+struct PreparedNetwork* createPreparedNetwork(Network net) {
+    return new PreparedNetwork(prepareNetwork(net.buffer->arena, net.rootNode));
+}
+
+void freePreparedNetwork(struct PreparedNetwork* network) {
+    delete network;
+}
+
+struct PreparedGeneTree* createPreparedGeneTree(struct PreparedNetwork* network, Tree tree) {
+    PreparedGeneTree* result = new PreparedGeneTree();
+    if (!prepareGeneTree(*network, tree.buffer->arena, tree.rootNode, *result)) {
+        delete result;
+        return nullptr;
+    }
+    return result;
+}
+
+void freePreparedGeneTree(struct PreparedGeneTree* tree) {
+    delete tree;
+}
+
+double computePreparedProbability(struct PreparedNetwork* network, struct PreparedGeneTree* tree, double* params, double* derivatives) {
+    static thread_local EvaluationContext<double> context;
+
+    DoubleParams values = {params != nullptr ? params : network->params.data()};
+
+    if (derivatives == nullptr) {
+        return calcProbability(*network, *tree, values, context);
+    } else {
+        std::vector<double> derivativeResults;
+        double prob = calcProbability(*network, *tree, values, context, &derivativeResults);
+
+        std::copy(derivativeResults.begin(), derivativeResults.end(), derivatives);
+
+        return prob;
+    }
+}
+
+void computePreparedProbabilities(struct PreparedNetwork* network, struct PreparedGeneTree* tree, int numVectors, double* params, double* probabilities, double* derivatives) {
+    calcProbabilities(*network, *tree, params, numVectors, probabilities, derivatives);
+}
+
+uint64_t getTreeTopologyHash(Tree tree) {
+    return getTopologyHash(tree.buffer->arena, tree.rootNode);
+}
+
+struct GeneTreeBatch* createGeneTreeBatch(struct PreparedNetwork* network, GeneTrees trees) {
+    std::vector<int32_t> roots(trees.rootNodes, trees.rootNodes + trees.numTrees);
+    std::vector<double> weights(trees.weights, trees.weights + trees.numTrees);
+
+    GeneTreeBatch* result = new GeneTreeBatch();
+    if (!prepareGeneTreeBatch(*network, trees.buffer->arena, roots, weights, *result)) {
+        delete result;
+        return nullptr;
+    }
+    return result;
+}
+
+void freeGeneTreeBatch(struct GeneTreeBatch* batch) {
+    delete batch;
+}
+
+int getNumUniqueGeneTrees(struct GeneTreeBatch* batch) {
+    return batch->trees.size();
+}
+
+struct SpeciesSubtreeCache {
+    explicit SpeciesSubtreeCache(const PreparedNetwork& network) : cache(network) {}
+
+    SubtreeCache cache;
+};
+
+struct SpeciesSubtreeCache* createSubtreeCache(struct PreparedNetwork* network) {
+    return new SpeciesSubtreeCache(*network);
+}
+
+void freeSubtreeCache(struct SpeciesSubtreeCache* cache) {
+    delete cache;
+}
+
+double computeBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, double* derivatives) {
+    return computeCachedBatchLogLikelihood(network, batch, nullptr, params, derivatives);
+}
+
+double computeCachedBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, struct SpeciesSubtreeCache* cache, double* params, double* derivatives) {
+    const double* values = params != nullptr ? params : network->params.data();
+    SubtreeCache* subtrees = cache != nullptr ? &cache->cache : nullptr;
+
+    if (derivatives == nullptr) {
+        return calcLogLikelihood(*network, *batch, values, nullptr, subtrees);
+    } else {
+        std::vector<double> derivativeResults;
+        double result = calcLogLikelihood(*network, *batch, values, &derivativeResults, subtrees);
+
+        std::copy(derivativeResults.begin(), derivativeResults.end(), derivatives);
+
+        return result;
+    }
+}
+
+double computeBatchLogLikelihoodInPrecision(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, double* derivatives, int singlePrecision, double tolerance, double* errorEstimate, int* usedSinglePrecision) {
+    const double* values = params != nullptr ? params : network->params.data();
+
+    PrecisionOptions precision;
+    precision.precision = singlePrecision ? HistoryPrecision::FLOAT : HistoryPrecision::DOUBLE;
+    precision.tolerance = tolerance;
+
+    PrecisionReport report;
+    std::vector<double> derivativeResults;
+    double result = calcLogLikelihood(*network, *batch, values, precision, &report, derivatives != nullptr ? &derivativeResults : nullptr);
+
+    if (derivatives != nullptr) {
+        std::copy(derivativeResults.begin(), derivativeResults.end(), derivatives);
+    }
+    if (errorEstimate != nullptr) {
+        *errorEstimate = report.errorEstimate;
+    }
+    if (usedSinglePrecision != nullptr) {
+        *usedSinglePrecision = report.precision == HistoryPrecision::FLOAT;
+    }
+
+    return result;
+}
+
+double computePrunedBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, double* derivatives, double pruneTolerance, double* treeProbabilities, double* pruneBound, int64_t* prunedHistories) {
+    const double* values = params != nullptr ? params : network->params.data();
+
+    std::vector<double> probabilities(treeProbabilities, treeProbabilities + batch->trees.size());
+    PrecisionOptions precision;
+    precision.pruneTolerance = pruneTolerance;
+    precision.treeProbabilities = &probabilities;
+
+    PrecisionReport report;
+    std::vector<double> derivativeResults;
+    double result = calcLogLikelihood(*network, *batch, values, precision, &report, derivatives != nullptr ? &derivativeResults : nullptr);
+    std::copy(probabilities.begin(), probabilities.end(), treeProbabilities);
+
+    if (derivatives != nullptr) {
+        std::copy(derivativeResults.begin(), derivativeResults.end(), derivatives);
+    }
+    if (pruneBound != nullptr) {
+        *pruneBound = report.pruneBound;
+    }
+    if (prunedHistories != nullptr) {
+        *prunedHistories = report.prunedHistories;
+    }
+
+    return result;
+}
+
+OptimizerSettings getDefaultOptimizerSettings() {
+    OptimizerOptions defaults;
+
+    OptimizerSettings result;
+    result.maxIterations = defaults.maxIterations;
+    result.memory = defaults.memory;
+    result.gradientTolerance = defaults.gradientTolerance;
+    result.functionTolerance = defaults.functionTolerance;
+    result.logTransform = defaults.transform == ParamTransform::LOG;
+    result.singlePrecision = defaults.precision.precision == HistoryPrecision::FLOAT;
+    result.precisionTolerance = defaults.precision.tolerance;
+    result.pruneTolerance = defaults.precision.pruneTolerance;
+    return result;
+}
+
+OptimizerOptions getOptimizerOptions(const OptimizerSettings& settings) {
+    OptimizerOptions options;
+    options.maxIterations = settings.maxIterations;
+    options.memory = settings.memory;
+    options.gradientTolerance = settings.gradientTolerance;
+    options.functionTolerance = settings.functionTolerance;
+    options.transform = settings.logTransform ? ParamTransform::LOG : ParamTransform::NONE;
+    options.precision.precision = settings.singlePrecision ? HistoryPrecision::FLOAT : HistoryPrecision::DOUBLE;
+    options.precision.tolerance = settings.precisionTolerance;
+    options.precision.pruneTolerance = settings.pruneTolerance;
+    return options;
+}
+
+OptimizerSummary getOptimizerSummary(const OptimizerResult& result) {
+    OptimizerSummary summary;
+    summary.logLikelihood = -result.value;
+    summary.iterations = result.iterations;
+    summary.evaluations = result.evaluations;
+    summary.converged = result.converged;
+    summary.abandoned = result.abandoned;
+    summary.fallbacks = result.fallbacks;
+    return summary;
+}
+
+OptimizerSummary optimizeBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, OptimizerSettings settings) {
+    std::vector<double> start(params, params + network->numParams);
+    OptimizerResult result = maximizeLogLikelihood(*network, *batch, start, getOptimizerOptions(settings));
+
+    std::copy(result.params.begin(), result.params.end(), params);
+
+    return getOptimizerSummary(result);
+}
+
+int optimizeBatchMultiStart(struct PreparedNetwork* network, struct GeneTreeBatch* batch, int numStarts, double* starts, OptimizerSettings settings, int abandonAfter, double abandonMargin, OptimizerSummary* summaries, double* traces) {
+    int numParams = network->numParams;
+
+    std::vector<std::vector<double>> startVectors(numStarts);
+    for (int i = 0; i < numStarts; i++) {
+        startVectors[i].assign(starts + i * numParams, starts + (i + 1) * numParams);
+    }
+
+    MultiStartOptions options;
+    options.optimizer = getOptimizerOptions(settings);
+    options.abandonAfter = abandonAfter;
+    options.abandonMargin = abandonMargin;
+
+    MultiStartResult result = maximizeLogLikelihoodMultiStart(*network, *batch, startVectors, options);
+
+    int traceLength = settings.maxIterations + 1;
+    for (int i = 0; i < numStarts; i++) {
+        const OptimizerResult& restart = result.restarts[i];
+        std::copy(restart.params.begin(), restart.params.end(), starts + i * numParams);
+
+        if (summaries != nullptr) {
+            summaries[i] = getOptimizerSummary(restart);
+        }
+
+        if (traces != nullptr) {
+            double* trace = traces + i * traceLength;
+            std::fill(trace, trace + traceLength, std::numeric_limits<double>::quiet_NaN());
+            for (unsigned int j = 0; j < restart.trace.size() && (int) j < traceLength; j++) {
+                trace[j] = -restart.trace[j];
+            }
+        }
+    }
+
+    return result.best;
+}
+
+HillClimbSettings getDefaultHillClimbSettings() {
+    HillClimbOptions defaults;
+
+    HillClimbSettings result;
+    result.maxRounds = defaults.maxRounds;
+    result.candidatesPerRound = defaults.candidatesPerRound;
+    result.maxDelta = defaults.maxDelta;
+    result.annealing = defaults.rule == AcceptanceRule::ANNEALING;
+    result.initialTemperature = defaults.initialTemperature;
+    result.cooling = defaults.cooling;
+    result.seed = defaults.seed;
+    return result;
+}
+
+OptimizerSummary hillClimbBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, HillClimbSettings settings, double* trace) {
+    HillClimbOptions options;
+    options.maxRounds = settings.maxRounds;
+    options.candidatesPerRound = settings.candidatesPerRound;
+    options.maxDelta = settings.maxDelta;
+    options.rule = settings.annealing ? AcceptanceRule::ANNEALING : AcceptanceRule::GREEDY;
+    options.initialTemperature = settings.initialTemperature;
+    options.cooling = settings.cooling;
+    options.seed = settings.seed;
+
+    std::vector<double> start(params, params + network->numParams);
+    HillClimbResult result = hillClimbLogLikelihood(*network, *batch, start, options);
+
+    std::copy(result.params.begin(), result.params.end(), params);
+    if (trace != nullptr) {
+        std::copy(result.trace.begin(), result.trace.end(), trace);
+    }
+
+    OptimizerSummary summary;
+    summary.logLikelihood = result.logLikelihood;
+    summary.iterations = result.rounds;
+    summary.evaluations = result.evaluations;
+    summary.converged = false;
+    summary.abandoned = false;
+    summary.fallbacks = 0;
+    return summary;
+}
+
+TopologySearchSettings getDefaultTopologySearchSettings() {
+    TopologySearchOptions defaults;
+
+    TopologySearchSettings result;
+    result.maxRounds = defaults.maxRounds;
+    result.candidatesPerRound = defaults.candidatesPerRound;
+    result.patience = defaults.patience;
+    result.maxReticulations = defaults.maxReticulations;
+    result.reticulationPenalty = defaults.reticulationPenalty;
+    result.optimizerIterations = defaults.optimizer.maxIterations;
+    result.seed = defaults.seed;
+    result.singlePrecision = defaults.optimizer.precision.precision == HistoryPrecision::FLOAT;
+    return result;
+}
+
+Network searchBatchNetworkTopology(struct Network start, struct GeneTreeBatch* batch, TopologySearchSettings settings, TopologySearchSummary* summary) {
+    TopologySearchOptions options;
+    options.maxRounds = settings.maxRounds;
+    options.candidatesPerRound = settings.candidatesPerRound;
+    options.patience = settings.patience;
+    options.maxReticulations = settings.maxReticulations;
+    options.reticulationPenalty = settings.reticulationPenalty;
+    options.optimizer.maxIterations = settings.optimizerIterations;
+    options.optimizer.precision.precision = settings.singlePrecision ? HistoryPrecision::FLOAT : HistoryPrecision::DOUBLE;
+    options.seed = settings.seed;
+
+    EditableNetwork editable = makeEditableNetwork(start.buffer->arena, start.rootNode);
+    TopologySearchResult result = searchNetworkTopology(editable, *batch, options);
+
+    if (summary != nullptr) {
+        summary->logLikelihood = result.best.logLikelihood;
+        summary->score = result.best.score;
+        summary->rounds = result.rounds;
+        summary->candidates = result.candidates;
+        summary->accepted = result.accepted;
+    }
+
+    NetworkBuffer* buffer = new NetworkBuffer();
+    Network network = {buffer, appendEditableNetwork(buffer->arena, result.best.network)};
+    return network;
+}
+
+int writeNetworkNewick(struct Network net, char* newick, int size) {
+    std::string result = writeNetwork(makeEditableNetwork(net.buffer->arena, net.rootNode));
+
+    if (size > 0) {
+        int length = std::min((int) result.size(), size - 1);
+        std::copy(result.begin(), result.begin() + length, newick);
+        newick[length] = '\0';
+    }
+
+    return result.size();
+}
+
+SamplerSettings getDefaultSamplerSettings() {
+    SamplerOptions defaults;
+
+    SamplerSettings result;
+    result.numChains = defaults.numChains;
+    result.burnIn = defaults.burnIn;
+    result.numSamples = defaults.numSamples;
+    result.thin = defaults.thin;
+    result.hamiltonian = defaults.method == SamplerMethod::HAMILTONIAN;
+    result.stepSize = defaults.stepSize;
+    result.leapfrogSteps = defaults.leapfrogSteps;
+    result.lengthPriorRate = defaults.lengthPriorRate;
+    result.seed = defaults.seed;
+    return result;
+}
+
+int sampleBatchPosterior(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, SamplerSettings settings, const char* tracePath, ChainSummary* summaries, double* means) {
+    SamplerOptions options;
+    options.method = settings.hamiltonian ? SamplerMethod::HAMILTONIAN : SamplerMethod::METROPOLIS;
+    options.numChains = settings.numChains;
+    options.burnIn = settings.burnIn;
+    options.numSamples = settings.numSamples;
+    options.thin = settings.thin;
+    options.stepSize = settings.stepSize;
+    options.leapfrogSteps = settings.leapfrogSteps;
+    options.lengthPriorRate = settings.lengthPriorRate;
+    options.seed = settings.seed;
+
+    std::vector<double> start(params, params + network->numParams);
+    std::vector<ChainResult> chains = sampleParams(*network, *batch, start, options, tracePath);
+    if (chains.empty() && options.numChains > 0) {
+        return -1;
+    }
+
+    if (summaries != nullptr) {
+        for (unsigned int i = 0; i < chains.size(); i++) {
+            summaries[i].proposals = chains[i].proposals;
+            summaries[i].accepted = chains[i].accepted;
+            summaries[i].lastLogPosterior = chains[i].lastLogPosterior;
+        }
+    }
+
+    // Every chain keeps the same number of samples, so the overall mean is the mean of the chain means
+    if (means != nullptr) {
+        std::fill(means, means + network->numParams, 0.0);
+        for (auto&& chain : chains) {
+            for (int i = 0; i < network->numParams; i++) {
+                means[i] += chain.means[i] / chains.size();
+            }
+        }
+    }
+
+    return chains.size();
+}
+
+GeneTrees enumerateGeneTrees(struct PreparedNetwork* network) {
+    GeneTrees result = {nullptr, 0, nullptr, nullptr};
+    if ((int) network->leafNames.size() > maxGeneTreeLeaves) {
+        return result;
+    }
+
+    result.buffer = new TreeBuffer();
+
+    std::vector<int32_t> roots = enumerateTopologies(network->leafNames, result.buffer->arena);
+    result.numTrees = roots.size();
+
+    result.rootNodes = new int[result.numTrees];
+    std::copy(roots.begin(), roots.end(), result.rootNodes);
+
+    result.weights = new double[result.numTrees];
+    std::fill(result.weights, result.weights + result.numTrees, 1.0);
+
+    return result;
+}
+
+int getNumGeneTreeTopologies(struct PreparedNetwork* network) {
+    if ((int) network->leafNames.size() > maxGeneTreeLeaves) {
+        return -1;
+    }
+    return countTopologies(network->leafNames.size());
+}
+
+int computeAllTopologyProbabilities(struct PreparedNetwork* network, double* params, double* probabilities) {
+    std::vector<double> results;
+    if (!calcAllTopologyProbabilities(*network, params != nullptr ? params : network->params.data(), results)) {
+        return -1;
+    }
+
+    std::copy(results.begin(), results.end(), probabilities);
+
+    return results.size();
+}
+
+int computeTopologyDistribution(struct PreparedNetwork* network, double* params, double* probabilities) {
+    std::vector<double> results;
+    if (!calcTopologyDistribution(*network, params != nullptr ? params : network->params.data(), results)) {
+        return -1;
+    }
+
+    std::copy(results.begin(), results.end(), probabilities);
+
+    return results.size();
+}
+
+GeneTrees simulateGeneTreeSample(struct PreparedNetwork* network, double* params, int numTrees, uint64_t seed) {
+    GeneTrees result = {nullptr, 0, nullptr, nullptr};
+    if (numTrees < 0) {
+        return result;
+    }
+
+    result.buffer = new TreeBuffer();
+
+    std::vector<int32_t> roots = simulateGeneTrees(*network, params != nullptr ? params : network->params.data(), numTrees, seed, result.buffer->arena);
+    result.numTrees = roots.size();
+
+    result.rootNodes = new int[result.numTrees];
+    std::copy(roots.begin(), roots.end(), result.rootNodes);
+
+    result.weights = new double[result.numTrees];
+    std::fill(result.weights, result.weights + result.numTrees, 1.0);
+
+    return result;
+}
+
+int writeSimulatedGeneTreeFile(struct PreparedNetwork* network, double* params, int numTrees, uint64_t seed, const char* path) {
+    if (numTrees < 0) {
+        return 0;
+    }
+
+    std::ofstream file(path);
+    if (!file) {
+        return 0;
+    }
+
+    writeSimulatedGeneTrees(*network, params != nullptr ? params : network->params.data(), numTrees, seed, file);
+    return (bool) file;
+}
+
+int estimateTopologyDistribution(struct PreparedNetwork* network, double* params, int numTrees, uint64_t seed, double* probabilities) {
+    std::unordered_map<Forest, double> distribution;
+    if (numTrees < 0 || !simulateTopologyDistribution(*network, params != nullptr ? params : network->params.data(), numTrees, seed, distribution)) {
+        return -1;
+    }
+
+    std::vector<double> results;
+    orderTopologyDistribution(*network, distribution, results);
+
+    std::copy(results.begin(), results.end(), probabilities);
+
+    return results.size();
+}
+
+int getEvaluationStats(struct EvaluationStats* stats) {
+    EvaluationCounters counters = getEvaluationCounters();
+
+    stats->evaluations = counters.evaluations;
+    for (int i = 0; i < numDensemapOperations; i++) {
+        const OperationCounters& counter = counters.operations[i];
+        OperationStats& result = stats->operations[i];
+        result.calls = counter.calls;
+        result.mapsIn = counter.mapsIn;
+        result.mapsOut = counter.mapsOut;
+        result.histories = counter.histories;
+        result.pairsChecked = counter.pairsChecked;
+        result.pairsCombined = counter.pairsCombined;
+        result.bytes = counter.bytes;
+        result.seconds = counter.seconds;
+    }
+
+    return areStatsEnabled() ? 1 : 0;
+}
+
+int getEvaluationNodeStats(struct NodeStats* nodes, int size) {
+    EvaluationCounters counters = getEvaluationCounters();
+
+    for (int i = 0; i < std::min(size, (int) counters.nodes.size()); i++) {
+        const NodeCounters& counter = counters.nodes[i];
+        nodes[i].mapsIn = counter.mapsIn;
+        nodes[i].mapsOut = counter.mapsOut;
+        nodes[i].histories = counter.histories;
+        nodes[i].seconds = counter.seconds;
+    }
+
+    return counters.nodes.size();
+}
+
+void resetEvaluationStats() {
+    resetEvaluationCounters();
+}
+
+const char* getEvaluationOperationName(int operation) {
+    return getOperationName(operation);
+}
+
+int formatEvaluationStats(char* text, int size) {
+    std::string result = formatEvaluationCounters(getEvaluationCounters());
+
+    if (size > 0) {
+        int length = std::min((int) result.size(), size - 1);
+        std::copy(result.begin(), result.begin() + length, text);
+        text[length] = '\0';
+    }
+
+    return result.size();
+}
+
+void startEvaluationTrace(int eventsPerThread) {
+    startTrace(eventsPerThread);
+}
+
+void stopEvaluationTrace() {
+    stopTrace();
+}
+
+int writeEvaluationTrace(const char* path) {
+    return writeChromeTraceFile(path) ? 1 : 0;
+}
+
+void setStreamingEvaluation(int enabled) {
+    getStreamingEvaluation().store(enabled != 0);
+}
+
+struct LikelihoodCircuit {
+    std::unique_ptr<LikelihoodKernel> kernel;
+};
+
+struct LikelihoodCircuit* compileLikelihoodCircuit(Network net, Tree tree) {
+    const PreparedNetwork& network = getPreparedNetwork(net);
+    const PreparedGeneTree* gene = getPreparedGeneTree(net, tree);
+    if (gene == nullptr) {
+        return nullptr;
+    }
+
+    LikelihoodCircuit* result = new LikelihoodCircuit();
+    result->kernel.reset(new LikelihoodKernel(compileCircuit(network, *gene)));
+    return result;
+}
+
+void freeLikelihoodCircuit(struct LikelihoodCircuit* circuit) {
+    delete circuit;
+}
+
+double evaluateLikelihoodCircuit(struct LikelihoodCircuit* circuit, double* params, double* derivatives) {
+    return circuit->kernel->evaluate(params, derivatives);
+}
+
+int loadNativeLikelihoodKernel(struct LikelihoodCircuit* circuit) {
+    return circuit->kernel->loadNative() ? 1 : 0;
+}
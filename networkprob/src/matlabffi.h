@@ -1,17 +1,27 @@
 #ifndef MATLAB_FFI_INCLUDED
 #define MATLAB_FFI_INCLUDED
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
     /**
      * A network buffer stores network nodes.
+     * Nodes link to each other by index, so size is only a hint.
      */
     struct NetworkBuffer;
     struct NetworkBuffer* allocNetworkBuffer(int size);
     void freeNetworkBuffer(struct NetworkBuffer* buffer);
 
+    /**
+     * Save a whole network buffer to a file, or load one back.
+     * Save returns 1 on success and load returns null on failure.
+     */
+    int saveNetworkBuffer(struct NetworkBuffer* buffer, const char* path);
+    struct NetworkBuffer* loadNetworkBuffer(const char* path);
+
     enum NetworkEdgeType {
         NORMAL = 0,
         LEFT = 1,
@@ -27,6 +37,7 @@ extern "C" {
 
     /**
      * Functions for creating network nodes.
+     * Edges must point to nodes that already exist, otherwise they return -1 and add nothing.
      */
     int createLeafNetNode(struct NetworkBuffer* buffer, const char* name);
     int createTreeNetNode(struct NetworkBuffer* buffer, const char* name, struct NetworkEdge leftEdge, struct NetworkEdge rightEdge);
@@ -34,13 +45,22 @@ extern "C" {
 
     /**
      * A tree buffer stores tree nodes.
+     * Nodes link to each other by index, so size is only a hint.
      */
     struct TreeBuffer;
     struct TreeBuffer* allocTreeBuffer(int size);
     void freeTreeBuffer(struct TreeBuffer* buffer);
 
+    /**
+     * Save a whole tree buffer to a file, or load one back.
+     * Save returns 1 on success and load returns null on failure.
+     */
+    int saveTreeBuffer(struct TreeBuffer* buffer, const char* path);
+    struct TreeBuffer* loadTreeBuffer(const char* path);
+
     /**
      * Functions for creating tree nodes.
+     * Descendants must already exist, otherwise they return -1 and add nothing.
      */
     int createLeafTreeNode(struct TreeBuffer* buffer, const char* name);
     int createTreeTreeNode(struct TreeBuffer* buffer, const char* name, int leftDescendant, int rightDescendant);
@@ -55,6 +75,33 @@ extern "C" {
         int rootNode;
     };
 
+    /**
+     * Parse an extended Newick network, such as ((A,(B)#H1::0.6),(C,#H1::0.4)); into a new network buffer.
+     * Edges get param indices in the order they appear, followed by one left probability per hybrid.
+     * The number of params is written to numParams if it is not null.
+     * On failure, the buffer of the result is null.
+     */
+    struct Network createNetworkFromNewick(const char* newick, int* numParams);
+
+    /**
+     * Gene trees loaded from a file, all sharing one tree buffer.
+     * Tree i is {buffer, rootNodes[i]} and has weight weights[i].
+     */
+    struct GeneTrees {
+        struct TreeBuffer* buffer;
+        int numTrees;
+        int* rootNodes;
+        double* weights;
+    };
+
+    /**
+     * Load every gene tree in a file, parsing them in parallel.
+     * The file is either a TSV with a TREE column and optional WEIGHT column, or one Newick tree per line.
+     * On failure, the buffer of the result is null.
+     */
+    struct GeneTrees loadGeneTreeFile(const char* path);
+    void freeGeneTrees(struct GeneTrees trees);
+
     /**
      * Change all the params for the given tree.
      */
@@ -63,9 +110,400 @@ extern "C" {
     /**
      * Compute the probability of a gene tree given a network.
      * If derivatives is non-null, then also computes the derivatives.
+     * Returns NaN if the gene tree doesn't match the network, like createPreparedGeneTree returning null.
+     * The network and tree are prepared once and kept in their buffers until either gets new nodes.
      */
     double computeProbability(struct Network net, struct Tree tree, double* derivatives);
 
+    /**
+     * A prepared network is a network flattened once for repeated evaluation.
+     * It reads params instead of the values set by changeParams.
+     */
+    struct PreparedNetwork;
+    struct PreparedNetwork* createPreparedNetwork(struct Network net);
+    void freePreparedNetwork(struct PreparedNetwork* network);
+
+    /**
+     * A prepared gene tree has its taxa, events and lookup tables resolved against one prepared network.
+     * Returns null if the tree doesn't match the network.
+     */
+    struct PreparedGeneTree;
+    struct PreparedGeneTree* createPreparedGeneTree(struct PreparedNetwork* network, struct Tree tree);
+    void freePreparedGeneTree(struct PreparedGeneTree* tree);
+
+    /**
+     * Compute the probability of a prepared gene tree given a prepared network.
+     * If params is null, the params of the network when it was prepared are used.
+     * If derivatives is non-null, then also computes the derivatives.
+     */
+    double computePreparedProbability(struct PreparedNetwork* network, struct PreparedGeneTree* tree, double* params, double* derivatives);
+
+    /**
+     * Compute the probability of a prepared gene tree at many param vectors at once, several per SIMD register.
+     * params holds numVectors param vectors one after another, so a numParams by numVectors matrix in MATLAB.
+     * probabilities needs room for numVectors values. If derivatives is non-null, it gets the derivatives laid out like params.
+     */
+    void computePreparedProbabilities(struct PreparedNetwork* network, struct PreparedGeneTree* tree, int numVectors, double* params, double* probabilities, double* derivatives);
+
+    /**
+     * Get a hash of the rooted topology of a tree that ignores the order of children.
+     */
+    uint64_t getTreeTopologyHash(struct Tree tree);
+
+    /**
+     * A gene tree batch is a set of weighted gene trees prepared against one network.
+     * Trees with the same rooted topology are evaluated once, with their weights summed.
+     * Returns null if any tree doesn't match the network.
+     */
+    struct GeneTreeBatch;
+    struct GeneTreeBatch* createGeneTreeBatch(struct PreparedNetwork* network, struct GeneTrees trees);
+    void freeGeneTreeBatch(struct GeneTreeBatch* batch);
+
+    /**
+     * Get the number of unique topologies in a batch.
+     */
+    int getNumUniqueGeneTrees(struct GeneTreeBatch* batch);
+
+    /**
+     * Compute the sum of weight * log(probability) over a batch, evaluating topologies in parallel.
+     * If params is null, the params of the network when it was prepared are used.
+     * If derivatives is non-null, then also computes the derivatives.
+     */
+    double computeBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, double* derivatives);
+
+    /**
+     * A subtree cache keeps the densemaps of species subtrees so gene trees with the same events inside them share the work.
+     * It belongs to one prepared network. Entries are keyed by the params inside each subtree, so after changing one param
+     * only the subtrees that use it are computed again.
+     */
+    struct SpeciesSubtreeCache;
+    struct SpeciesSubtreeCache* createSubtreeCache(struct PreparedNetwork* network);
+    void freeSubtreeCache(struct SpeciesSubtreeCache* cache);
+
+    /**
+     * The same as computeBatchLogLikelihood, reusing and filling a subtree cache.
+     */
+    double computeCachedBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, struct SpeciesSubtreeCache* cache, double* params, double* derivatives);
+
+    /**
+     * The same as computeBatchLogLikelihood, keeping histories in float if singlePrecision is 1.
+     * A float result whose estimated error exceeds tolerance is computed again in double.
+     * If errorEstimate is non-null it gets the estimated error of the log likelihood that was returned.
+     * Returns the log likelihood, and sets usedSinglePrecision, if non-null, to whether it was computed in float.
+     */
+    double computeBatchLogLikelihoodInPrecision(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, double* derivatives, int singlePrecision, double tolerance, double* errorEstimate, int* usedSinglePrecision);
+
+    /**
+     * The same as computeBatchLogLikelihood, dropping histories that can't change the probability of a tree
+     * by more than pruneTolerance times it. Trees that would lose more are computed again without pruning.
+     * What is dropped is measured against treeProbabilities, getNumUniqueGeneTrees of them, which should hold
+     * what each tree's probability is expected to be, and get the probabilities that were computed. Passing
+     * the same array from one call to the next at nearby params lets them prune. Trees at 0 aren't pruned,
+     * so start it at zeros. If pruneBound is non-null it gets how much pruning can have lowered the log likelihood,
+     * at most, and prunedHistories gets how many histories were dropped.
+     */
+    double computePrunedBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, double* derivatives, double pruneTolerance, double* treeProbabilities, double* pruneBound, int64_t* prunedHistories);
+
+    /**
+     * Settings for optimizeBatchLogLikelihood, see getDefaultOptimizerSettings for the defaults.
+     * With logTransform, lengths are optimized as log(length) and left probabilities as logit(p),
+     * otherwise they are kept inside their bounds directly.
+     * With singlePrecision, the optimizer steps by likelihoods computed in float, see computeBatchLogLikelihoodInPrecision,
+     * and the log likelihood it reports is computed again in double. The same goes for pruneTolerance above 0,
+     * see computePrunedBatchLogLikelihood.
+     */
+    struct OptimizerSettings {
+        int maxIterations;
+        int memory; // The number of correction pairs L-BFGS keeps.
+        double gradientTolerance;
+        double functionTolerance;
+        int logTransform;
+        int singlePrecision;
+        double precisionTolerance;
+        double pruneTolerance;
+    };
+
+    struct OptimizerSettings getDefaultOptimizerSettings();
+
+    /**
+     * The outcome of optimizeBatchLogLikelihood.
+     */
+    struct OptimizerSummary {
+        double logLikelihood;
+        int iterations;
+        int evaluations;
+        int converged;
+        int abandoned; // Stopped early by multi-start for trailing the best restart.
+        int fallbacks; // Float evaluations computed again in double.
+    };
+
+    /**
+     * Maximize the log likelihood of a batch over the params of a prepared network with bounded L-BFGS,
+     * keeping lengths at least 0 and left probabilities between 0 and 1.
+     * params holds the starting point and is overwritten with the best params found.
+     */
+    struct OptimizerSummary optimizeBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, struct OptimizerSettings settings);
+
+    /**
+     * Run optimizeBatchLogLikelihood from numStarts starting points concurrently.
+     * starts holds the param vectors one after another, and each is overwritten with what its restart found.
+     * A restart trailing the best log likelihood so far by more than abandonMargin after abandonAfter iterations is abandoned.
+     * If summaries is non-null it gets one summary per restart. If traces is non-null it gets the log likelihood
+     * at the start and after every iteration of each restart, maxIterations + 1 values per restart padded with NaN.
+     * Returns the index of the best restart.
+     */
+    int optimizeBatchMultiStart(struct PreparedNetwork* network, struct GeneTreeBatch* batch, int numStarts, double* starts, struct OptimizerSettings settings, int abandonAfter, double abandonMargin, struct OptimizerSummary* summaries, double* traces);
+
+    /**
+     * Settings for hillClimbBatchLogLikelihood, see getDefaultHillClimbSettings for the defaults.
+     * Every round proposes candidatesPerRound moves that each change one param by at most maxDelta / 2.
+     * With annealing, worse moves are taken with probability exp(change / temperature), where the temperature
+     * starts at initialTemperature and is multiplied by cooling every round. Otherwise only better moves are taken.
+     */
+    struct HillClimbSettings {
+        int maxRounds;
+        int candidatesPerRound;
+        double maxDelta;
+        int annealing;
+        double initialTemperature;
+        double cooling;
+        uint64_t seed;
+    };
+
+    struct HillClimbSettings getDefaultHillClimbSettings();
+
+    /**
+     * Maximize the log likelihood of a batch without derivatives by stochastic hill climbing,
+     * evaluating the candidates of every round in parallel.
+     * params holds the starting point and is overwritten with the best params found.
+     * If trace is non-null it gets the log likelihood of the current params at the start and after every round,
+     * maxRounds + 1 values. The same seed gives the same result.
+     * The summary counts rounds as iterations and never reports convergence.
+     */
+    struct OptimizerSummary hillClimbBatchLogLikelihood(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, struct HillClimbSettings settings, double* trace);
+
+    /**
+     * Settings for searchBatchNetworkTopology, see getDefaultTopologySearchSettings for the defaults.
+     * The search stops after maxRounds rounds, or after patience rounds in a row without a better network.
+     * Networks are compared by log likelihood less reticulationPenalty per reticulation.
+     * The branch lengths next to every move get optimizerIterations iterations of L-BFGS, in float with singlePrecision,
+     * but networks are always compared by their log likelihood in double.
+     */
+    struct TopologySearchSettings {
+        int maxRounds;
+        int candidatesPerRound;
+        int patience;
+        int maxReticulations;
+        double reticulationPenalty;
+        int optimizerIterations;
+        uint64_t seed;
+        int singlePrecision;
+    };
+
+    struct TopologySearchSettings getDefaultTopologySearchSettings();
+
+    /**
+     * The outcome of searchBatchNetworkTopology.
+     */
+    struct TopologySearchSummary {
+        double logLikelihood;
+        double score; // The log likelihood less the reticulation penalty.
+        int rounds;
+        int candidates; // The number of networks scored.
+        int accepted;
+    };
+
+    /**
+     * Search for the network that best explains a batch by rearranging start with NNI, SPR and reticulation moves,
+     * scoring the candidates of every round in parallel. The batch must be created against createPreparedNetwork(start).
+     * Returns the best network in a new buffer with its params set, numbering its edges first and its left probabilities last.
+     * If summary is non-null it gets the outcome. The same seed gives the same result.
+     */
+    struct Network searchBatchNetworkTopology(struct Network start, struct GeneTreeBatch* batch, struct TopologySearchSettings settings, struct TopologySearchSummary* summary);
+
+    /**
+     * Write a network as extended Newick into newick, which has room for size characters including the final null.
+     * Returns the length of the Newick string, so calling it with size 0 gives the room needed.
+     */
+    int writeNetworkNewick(struct Network net, char* newick, int size);
+
+    /**
+     * Settings for sampleBatchPosterior, see getDefaultSamplerSettings for the defaults.
+     * Lengths have an exponential prior with rate lengthPriorRate and left probabilities a uniform one.
+     * With hamiltonian set every iteration follows leapfrogSteps gradient steps of size stepSize,
+     * otherwise it changes one param by a normal step with standard deviation stepSize.
+     */
+    struct SamplerSettings {
+        int numChains;
+        int burnIn;
+        int numSamples; // Per chain, after the burn in.
+        int thin;
+        int hamiltonian;
+        double stepSize;
+        int leapfrogSteps;
+        double lengthPriorRate;
+        uint64_t seed;
+    };
+
+    struct SamplerSettings getDefaultSamplerSettings();
+
+    /**
+     * The outcome of one chain of sampleBatchPosterior.
+     */
+    struct ChainSummary {
+        int proposals;
+        int accepted;
+        double lastLogPosterior;
+    };
+
+    /**
+     * Sample the posterior of the params of a prepared network given a batch, running numChains chains concurrently
+     * from params. If tracePath is non-null every kept sample is written to it as the chains run.
+     * If summaries is non-null it gets one summary per chain, and if means is non-null it gets the posterior
+     * mean of the params over all chains. The same seed gives the same samples.
+     * Returns the number of chains run, or -1 if the trace file can't be written.
+     */
+    int sampleBatchPosterior(struct PreparedNetwork* network, struct GeneTreeBatch* batch, double* params, struct SamplerSettings settings, const char* tracePath, struct ChainSummary* summaries, double* means);
+
+    /**
+     * Create every rooted gene tree topology over the leaves of a prepared network, in one shared buffer.
+     * The trees are in the same order as computeAllTopologyProbabilities, and all have weight 1.
+     * If the network has more than 7 leaves, the result has no trees and its buffers are null.
+     */
+    struct GeneTrees enumerateGeneTrees(struct PreparedNetwork* network);
+
+    /**
+     * Get the number of rooted gene tree topologies over the leaves of a prepared network, or -1 if it has more than 7 leaves.
+     */
+    int getNumGeneTreeTopologies(struct PreparedNetwork* network);
+
+    /**
+     * Compute the probability of every rooted gene tree topology given a prepared network, in parallel.
+     * If params is null, the params of the network when it was prepared are used.
+     * probabilities needs room for getNumGeneTreeTopologies values. Returns the number written,
+     * or -1 if the network has more than 7 leaves.
+     */
+    int computeAllTopologyProbabilities(struct PreparedNetwork* network, double* params, double* probabilities);
+
+    /**
+     * Compute the same probabilities as computeAllTopologyProbabilities in a single pass over the network,
+     * sharing the work between topologies. Returns the number written, or -1 if the network has more than 8 leaves.
+     */
+    int computeTopologyDistribution(struct PreparedNetwork* network, double* params, double* probabilities);
+
+    /**
+     * Simulate numTrees gene trees under the coalescent given a prepared network, in parallel, into one shared buffer.
+     * If params is null, the params of the network when it was prepared are used.
+     * All trees have weight 1, and the same seed gives the same trees on any number of threads.
+     * If numTrees is negative, the buffer of the result is null.
+     */
+    struct GeneTrees simulateGeneTreeSample(struct PreparedNetwork* network, double* params, int numTrees, uint64_t seed);
+
+    /**
+     * Simulate numTrees gene trees like simulateGeneTreeSample and write them to a file as Newick, one per line.
+     * Returns 1 on success or 0 if the file can't be written or numTrees is negative.
+     */
+    int writeSimulatedGeneTreeFile(struct PreparedNetwork* network, double* params, int numTrees, uint64_t seed, const char* path);
+
+    /**
+     * Estimate the probabilities of computeTopologyDistribution from the frequencies of numTrees simulated gene trees,
+     * without building the trees. Returns the number written, or -1 if the network has more than 8 leaves
+     * or numTrees is negative.
+     */
+    int estimateTopologyDistribution(struct PreparedNetwork* network, double* params, int numTrees, uint64_t seed, double* probabilities);
+
+    /**
+     * What one kind of densemap operation did, summed over evaluations.
+     * Operations are update, combine, split, derivativeUpdate, combineDerivatives and splitDerivatives, in that order.
+     */
+    struct OperationStats {
+        int64_t calls;
+        int64_t mapsIn;
+        int64_t mapsOut;
+        int64_t histories;
+        int64_t pairsChecked;
+        int64_t pairsCombined;
+        int64_t bytes;
+        double seconds;
+    };
+
+    struct EvaluationStats {
+        int64_t evaluations;
+        struct OperationStats operations[6];
+    };
+
+    /**
+     * What was computed for one node of a prepared network, by its index in the network.
+     */
+    struct NodeStats {
+        int64_t mapsIn;
+        int64_t mapsOut;
+        int64_t histories;
+        double seconds;
+    };
+
+    /**
+     * Get what every evaluation did since the last reset, over all threads.
+     * Returns 1, or 0 with everything zero if the library was built without NETWORKPROB_STATS.
+     * Only call the stats functions while nothing is being evaluated.
+     */
+    int getEvaluationStats(struct EvaluationStats* stats);
+
+    /**
+     * Get the per node stats of prepared network evaluations. Writes at most size nodes and returns the number of nodes.
+     */
+    int getEvaluationNodeStats(struct NodeStats* nodes, int size);
+
+    void resetEvaluationStats();
+
+    const char* getEvaluationOperationName(int operation);
+
+    /**
+     * Write the stats as a table. Returns the length of the table, which was truncated if it is at least size.
+     */
+    int formatEvaluationStats(char* text, int size);
+
+    /**
+     * Start recording a timeline of evaluations: preparing, every node and densemap operation, and every gene tree of a batch.
+     * Each thread keeps its last eventsPerThread spans, and earlier recordings are dropped.
+     * Only start, stop or write the timeline while nothing is being evaluated.
+     */
+    void startEvaluationTrace(int eventsPerThread);
+
+    void stopEvaluationTrace();
+
+    /**
+     * Write the timeline as Chrome trace JSON, for chrome://tracing or Perfetto.
+     * Returns 1 on success or 0 if the file can't be written.
+     */
+    int writeEvaluationTrace(const char* path);
+
+    /**
+     * Set to 1 to have evaluations free the output of each node as soon as its parent has used it, which keeps
+     * less in memory at once on big networks. It can also be turned on with the NETWORKPROB_STREAMING environment variable.
+     */
+    void setStreamingEvaluation(int enabled);
+
+    /**
+     * A likelihood circuit is computeProbability for one network and tree, recorded once as straight line arithmetic.
+     * It reads the same params as changeParams. Returns null if the gene tree doesn't match the network.
+     */
+    struct LikelihoodCircuit;
+    struct LikelihoodCircuit* compileLikelihoodCircuit(struct Network net, struct Tree tree);
+    void freeLikelihoodCircuit(struct LikelihoodCircuit* circuit);
+
+    /**
+     * Evaluate a likelihood circuit at the given params.
+     * If derivatives is non-null, then also computes the derivatives.
+     */
+    double evaluateLikelihoodCircuit(struct LikelihoodCircuit* circuit, double* params, double* derivatives);
+
+    /**
+     * Switch a likelihood circuit to native code, compiling it with the system compiler if it isn't cached.
+     * Returns 1 if native code is in use, or 0 if the circuit is still interpreted.
+     */
+    int loadNativeLikelihoodKernel(struct LikelihoodCircuit* circuit);
+
 #ifdef __cplusplus
 }
 #endif
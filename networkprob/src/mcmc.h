@@ -0,0 +1,373 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#include "prepared.h"
+#include "batch.h"
+#include "optimize.h"
+#include "parallel.h"
+#include "subtreecache.h"
+
+/**
+ * How the sampler proposes new params.
+ */
+enum class SamplerMethod : int32_t {
+	METROPOLIS = 0, // Change one param at a time with a reflected random walk, recomputing only the subtrees that use it.
+	HAMILTONIAN = 1, // Move every param at once along leapfrog trajectories that follow the gradient.
+};
+
+/**
+ * Settings for the sampler.
+ */
+struct SamplerOptions {
+	SamplerMethod method = SamplerMethod::METROPOLIS;
+	int numChains = 4;
+	int burnIn = 1000; // Iterations dropped at the start of every chain.
+	int numSamples = 10000; // Samples kept per chain after the burn in.
+	int thin = 1; // Keep every thin-th iteration.
+	double stepSize = 0.05; // The standard deviation of a random walk step, or the leapfrog step size.
+	int leapfrogSteps = 10;
+	double lengthPriorRate = 1; // Lengths have an exponential prior with this rate, left probabilities a uniform one.
+	uint64_t seed = 0;
+};
+
+/**
+ * One kept sample, as stored in a trace file after the params.
+ */
+struct SampleRecord {
+	int32_t chain;
+	int32_t iteration; // Counting from the end of the burn in.
+	double logPosterior; // Up to a constant.
+	double logLikelihood;
+};
+
+/**
+ * What one chain did. Means and variances are over the kept samples.
+ */
+struct ChainResult {
+	int proposals = 0;
+	int accepted = 0;
+	std::vector<double> means;
+	std::vector<double> variances;
+	std::vector<double> last; // The params at the end of the chain.
+	double lastLogPosterior = 0;
+};
+
+/**
+ * Streams samples from any number of chains into one binary file.
+ * The file starts with a header and then holds a SampleRecord followed by the params for every sample, in the order
+ * the chains produced them.
+ */
+class SampleTraceWriter {
+public:
+	/**
+	 * Open a trace file for samples with numParams params. Check isOpen before using it.
+	 */
+	SampleTraceWriter(const char* path, int a_numParams) : file(path, std::ios::binary), numParams(a_numParams) {
+		Header header = {magic, version, (uint32_t) numParams};
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	}
+
+	/**
+	 * Check if the file could be opened and written.
+	 */
+	bool isOpen() const {
+		return (bool) file;
+	}
+
+	/**
+	 * Add a sample. Safe to call from several threads.
+	 */
+	void write(const SampleRecord& record, const double* params) {
+		std::lock_guard<std::mutex> lock(mutex);
+		file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+		file.write(reinterpret_cast<const char*>(params), numParams * sizeof(double));
+	}
+
+	/**
+	 * Read every sample of a trace file. Returns false if the file is not a valid trace.
+	 */
+	static bool read(const char* path, int& numParams, std::vector<SampleRecord>& records, std::vector<double>& params) {
+		std::ifstream file(path, std::ios::binary);
+		Header header;
+		if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != magic || header.version != version) {
+			return false;
+		}
+
+		numParams = header.numParams;
+		records.clear();
+		params.clear();
+
+		SampleRecord record;
+		std::vector<double> values(numParams);
+		while (file.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+			if (!file.read(reinterpret_cast<char*>(values.data()), numParams * sizeof(double))) {
+				return false;
+			}
+			records.push_back(record);
+			params.insert(params.end(), values.begin(), values.end());
+		}
+
+		return file.eof();
+	}
+
+private:
+	/**
+	 * The start of trace files.
+	 */
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t numParams;
+	};
+
+	static const uint32_t magic = 0x4e50534d;
+	static const uint32_t version = 1;
+
+	std::ofstream file;
+	int numParams;
+	std::mutex mutex;
+};
+
+/**
+ * The log posterior of a network's params given a batch, up to a constant, along with the pieces it needs.
+ */
+class PosteriorDensity {
+public:
+	/**
+	 * Create the density for a network and batch.
+	 */
+	PosteriorDensity(const PreparedNetwork& a_network, const GeneTreeBatch& a_batch, double a_lengthPriorRate) : network(a_network), batch(a_batch), kinds(getParamKinds(a_network)), lengthPriorRate(a_lengthPriorRate) {}
+
+	/**
+	 * Check if params are inside the support of the prior.
+	 */
+	bool isInside(int i, double value) const {
+		return value >= 0 && (kinds[i] == ParamKind::LENGTH || value <= 1);
+	}
+
+	/**
+	 * Get the log prior of params that are inside the support.
+	 */
+	double logPrior(const std::vector<double>& params) const {
+		double result = 0;
+		for (unsigned int i = 0; i < kinds.size(); i++) {
+			if (kinds[i] == ParamKind::LENGTH) {
+				result -= lengthPriorRate * params[i];
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * Get the log likelihood through a cache, so only the subtrees using changed params are computed again.
+	 */
+	double logLikelihood(const std::vector<double>& params, SubtreeCache& cache) const {
+		return calcLogLikelihood(network, batch, params.data(), nullptr, &cache);
+	}
+
+	/**
+	 * Get the log density of the unconstrained variables HMC moves, where lengths are log(length) and
+	 * left probabilities logit(p), along with its gradient. The Jacobian of the transform is included.
+	 */
+	double logDensity(const ParamMapping& mapping, const std::vector<double>& variables, std::vector<double>& params, double& logLikelihood, std::vector<double>& gradient) const {
+		params = mapping.toParams(variables);
+		logLikelihood = calcLogLikelihood(network, batch, params.data(), &gradient);
+
+		double result = logLikelihood + logPrior(params);
+		for (unsigned int i = 0; i < kinds.size(); i++) {
+			if (kinds[i] == ParamKind::LENGTH) {
+				gradient[i] -= lengthPriorRate;
+			}
+		}
+		mapping.chainDerivatives(params, gradient);
+
+		for (unsigned int i = 0; i < kinds.size(); i++) {
+			if (kinds[i] == ParamKind::LENGTH) {
+				result += variables[i];
+				gradient[i] += 1;
+			} else {
+				result += std::log(params[i] * (1 - params[i]));
+				gradient[i] += 1 - 2 * params[i];
+			}
+		}
+		return result;
+	}
+
+	const PreparedNetwork& network;
+	const GeneTreeBatch& batch;
+	std::vector<ParamKind> kinds;
+	double lengthPriorRate;
+};
+
+/**
+ * Run one chain of the sampler from start, writing its kept samples to trace if it is not nullptr.
+ */
+inline ChainResult runChain(const PosteriorDensity& density, int chain, const std::vector<double>& start, const SamplerOptions& options, SampleTraceWriter* trace) {
+	int numParams = start.size();
+
+	// Every chain gets its own stream from the seed and its index
+	std::seed_seq seeds = {(uint32_t) options.seed, (uint32_t) (options.seed >> 32), (uint32_t) chain};
+	std::mt19937_64 generator(seeds);
+	std::normal_distribution<double> normal(0, 1);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	std::uniform_int_distribution<int> paramChoice(0, std::max(0, numParams - 1));
+
+	ParamMapping mapping(density.kinds, ParamTransform::LOG);
+	SubtreeCache cache(density.network, 1 << 12);
+
+	ChainResult result;
+	result.means.assign(numParams, 0);
+	result.variances.assign(numParams, 0);
+
+	std::vector<double> params = mapping.toParams(mapping.toVariables(start));
+	std::vector<double> variables = mapping.toVariables(params);
+	std::vector<double> gradient(numParams);
+	double logLikelihood;
+	double logPosterior;
+
+	if (options.method == SamplerMethod::METROPOLIS) {
+		logLikelihood = density.logLikelihood(params, cache);
+		logPosterior = logLikelihood + density.logPrior(params);
+	} else {
+		logPosterior = density.logDensity(mapping, variables, params, logLikelihood, gradient);
+	}
+
+	std::vector<double> proposal;
+	std::vector<double> proposalParams;
+	std::vector<double> proposalGradient(numParams);
+	std::vector<double> momentum(numParams);
+	int numKept = 0;
+
+	// The chain stops on its last kept sample
+	int numIterations = options.numSamples > 0 ? options.burnIn + (options.numSamples - 1) * std::max(1, options.thin) + 1 : 0;
+	for (int iteration = 0; iteration < numIterations && numParams > 0; iteration++) {
+		result.proposals++;
+
+		if (options.method == SamplerMethod::METROPOLIS) {
+			int i = paramChoice(generator);
+			double value = params[i] + options.stepSize * normal(generator);
+
+			// Reflect off the bounds so the proposal stays symmetric
+			double upper = density.kinds[i] == ParamKind::LENGTH ? std::numeric_limits<double>::infinity() : 1;
+			while (!density.isInside(i, value)) {
+				value = value < 0 ? -value : 2 * upper - value;
+			}
+
+			proposalParams = params;
+			proposalParams[i] = value;
+
+			double proposalLogLikelihood = density.logLikelihood(proposalParams, cache);
+			double proposalLogPosterior = proposalLogLikelihood + density.logPrior(proposalParams);
+
+			if (std::log(uniform(generator)) < proposalLogPosterior - logPosterior) {
+				params.swap(proposalParams);
+				logLikelihood = proposalLogLikelihood;
+				logPosterior = proposalLogPosterior;
+				result.accepted++;
+			}
+		} else {
+			for (double& p : momentum) {
+				p = normal(generator);
+			}
+
+			double kinetic = 0;
+			for (double p : momentum) {
+				kinetic += p * p / 2;
+			}
+
+			proposal = variables;
+			proposalGradient = gradient;
+			double proposalLogLikelihood = logLikelihood;
+			double proposalLogPosterior = logPosterior;
+
+			for (int step = 0; step < options.leapfrogSteps && std::isfinite(proposalLogPosterior); step++) {
+				for (int j = 0; j < numParams; j++) {
+					momentum[j] += options.stepSize / 2 * proposalGradient[j];
+					proposal[j] += options.stepSize * momentum[j];
+				}
+				proposalLogPosterior = density.logDensity(mapping, proposal, proposalParams, proposalLogLikelihood, proposalGradient);
+				for (int j = 0; j < numParams; j++) {
+					momentum[j] += options.stepSize / 2 * proposalGradient[j];
+				}
+			}
+
+			double proposalKinetic = 0;
+			for (double p : momentum) {
+				proposalKinetic += p * p / 2;
+			}
+
+			double logRatio = proposalLogPosterior - proposalKinetic - logPosterior + kinetic;
+			if (std::isfinite(logRatio) && std::log(uniform(generator)) < logRatio) {
+				variables.swap(proposal);
+				gradient.swap(proposalGradient);
+				params = proposalParams;
+				logLikelihood = proposalLogLikelihood;
+				logPosterior = proposalLogPosterior;
+				result.accepted++;
+			}
+		}
+
+		int kept = iteration - options.burnIn;
+		if (kept < 0 || kept % std::max(1, options.thin) != 0) {
+			continue;
+		}
+
+		// Welford's update, with the variances summed up for now
+		numKept++;
+		for (int j = 0; j < numParams; j++) {
+			double delta = params[j] - result.means[j];
+			result.means[j] += delta / numKept;
+			result.variances[j] += delta * (params[j] - result.means[j]);
+		}
+
+		if (trace != nullptr) {
+			SampleRecord record = {chain, kept, logPosterior, logLikelihood};
+			trace->write(record, params.data());
+		}
+	}
+
+	for (double& variance : result.variances) {
+		variance = numKept > 1 ? variance / (numKept - 1) : 0;
+	}
+
+	result.last = params;
+	result.lastLogPosterior = logPosterior;
+	return result;
+}
+
+/**
+ * Sample the posterior of the params of a network given a batch with several independent chains,
+ * one per thread, all starting from start. If tracePath is not nullptr, every kept sample is streamed to it
+ * as the chains run. Returns an empty result, after printing why, if the trace file can't be written.
+ */
+inline std::vector<ChainResult> sampleParams(const PreparedNetwork& network, const GeneTreeBatch& batch, const std::vector<double>& start, const SamplerOptions& options = SamplerOptions(), const char* tracePath = nullptr) {
+	std::unique_ptr<SampleTraceWriter> trace;
+	if (tracePath != nullptr) {
+		trace.reset(new SampleTraceWriter(tracePath, network.numParams));
+		if (!trace->isOpen()) {
+			std::cerr<<"Can't write the trace file "<<tracePath<<std::endl;
+			return {};
+		}
+	}
+
+	PosteriorDensity density(network, batch, options.lengthPriorRate);
+
+	std::vector<ChainResult> result(std::max(0, options.numChains));
+	parallelTasks(result.size(), [&](int chain) {
+		result[chain] = runChain(density, chain, start, options, trace.get());
+	});
+
+	return result;
+}
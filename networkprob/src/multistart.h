@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "prepared.h"
+#include "batch.h"
+#include "optimize.h"
+#include "parallel.h"
+
+/**
+ * Settings for multi-start optimization.
+ */
+struct MultiStartOptions {
+	OptimizerOptions optimizer;
+	int abandonAfter = 5; // Restarts are only abandoned after this many iterations.
+	double abandonMargin = 10; // Abandon a restart once its log likelihood is this much below the best so far.
+};
+
+/**
+ * What multi-start optimization found. Every restart keeps its own trace.
+ */
+struct MultiStartResult {
+	std::vector<OptimizerResult> restarts;
+	int best = -1; // The index of the restart with the highest log likelihood.
+};
+
+/**
+ * Draw random starting params for a network, every param uniform in [0, 1) like MATLAB's rand.
+ */
+inline std::vector<std::vector<double>> makeRandomStarts(const PreparedNetwork& network, int numStarts, uint64_t seed) {
+	std::mt19937_64 generator(seed);
+	std::uniform_real_distribution<double> uniform(0, 1);
+
+	std::vector<std::vector<double>> result(numStarts, std::vector<double>(network.numParams));
+	for (auto&& start : result) {
+		for (double& value : start) {
+			value = uniform(generator);
+		}
+	}
+	return result;
+}
+
+/**
+ * Maximize the log likelihood of a batch from several starting points at once.
+ * Restarts run concurrently, one per thread, and each evaluates its likelihoods on its own thread.
+ * A restart whose log likelihood trails the best any restart has reached by more than abandonMargin
+ * after abandonAfter iterations is abandoned.
+ */
+inline MultiStartResult maximizeLogLikelihoodMultiStart(const PreparedNetwork& network, const GeneTreeBatch& batch, const std::vector<std::vector<double>>& starts, const MultiStartOptions& options = MultiStartOptions()) {
+	MultiStartResult result;
+	result.restarts.resize(starts.size());
+
+	std::mutex bestMutex;
+	double bestValue = std::numeric_limits<double>::infinity();
+
+	parallelTasks(starts.size(), [&](int i) {
+		OptimizerMonitor monitor = [&](int iterations, double value) {
+			std::lock_guard<std::mutex> lock(bestMutex);
+			bestValue = std::min(bestValue, value);
+			return iterations < options.abandonAfter || value <= bestValue + options.abandonMargin;
+		};
+
+		result.restarts[i] = maximizeLogLikelihood(network, batch, starts[i], options.optimizer, monitor);
+
+		std::lock_guard<std::mutex> lock(bestMutex);
+		bestValue = std::min(bestValue, result.restarts[i].value);
+	});
+
+	for (unsigned int i = 0; i < result.restarts.size(); i++) {
+		if (result.best == -1 || result.restarts[i].value < result.restarts[result.best].value) {
+			result.best = i;
+		}
+	}
+
+	return result;
+}
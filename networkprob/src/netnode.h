@@ -3,27 +3,26 @@
 #include <string>
 #include <memory>
 #include <map>
-#include <bitset>
 #include <experimental/optional>
 #include <vector>
 #include <limits>
+#include <cstdint>
 
 #include "densemap.h"
 #include "mathutils.h"
 #include "treenode.h"
+#include "stats.h"
 
 template<class T>
 using optional = std::experimental::optional<T>;
 
-const bool debug = false;
-
-enum class NodeType {
+enum class NodeType : int32_t {
 	LEAF = 0,
 	TREE = 1,
 	NETWORK = 2,
 };
 
-enum class EdgeType {
+enum class EdgeType : int32_t {
 	NORMAL = 0,
 	LEFT = 1,
 	RIGHT = 2,
@@ -44,27 +43,12 @@ public:
 	 * Get the data associated with the edge.
 	 */
 	std::vector<densemap> getData(const std::map<std::string, int>& netNodes, const std::map<std::string, int>& taxa, const std::vector<int>& events, int numDerivativeParams) {
-		auto result = update(toNode.getData(type, netNodes, taxa, events, numDerivativeParams), events, distance);
-
-		if (debug) {
-			std::cout<<"------------------------------------"<<std::endl;
-			std::cout<<"From node: "<<toNode.name<<std::endl;
-
-			for (auto&& map : result) {
-				std::cout<<"next: "<<std::bitset<8>(map.getTaxaBits()>>6)<<' ';
-				for (unsigned int i =0; i < map.choices.size(); i++) {
-					std::cout<<map.choices[i]<<' ';
-				}
-				std::cout<<std::endl;
-				for (int i = 0; i < 1<<6; i++){
-					double thingy = map.getHistory(i);
+		const std::vector<densemap>& child = toNode.getData(type, netNodes, taxa, events, numDerivativeParams);
 
-					if (thingy != 0) {
-						std::cout<<std::bitset<8>(i)<<' '<<thingy<<std::endl;
-					}
-				}
-			}
-		}
+		StatsRecorder& stats = getThreadStatsRecorder();
+		auto started = stats.start();
+		auto result = update(child, events, distance);
+		stats.record(DensemapOperation::UPDATE, -1, child.size(), result, 0, started);
 
 		return result;
 	}
@@ -76,36 +60,18 @@ public:
 		std::vector<std::vector<densemap>> result;
 		auto derivative = toNode.getDataDerivative(type, netNodes, taxa, events, numDerivativeParams);
 
+		StatsRecorder& stats = getThreadStatsRecorder();
 		for (unsigned int i = 0; i < derivative.size(); i++) {
+			auto started = stats.start();
 			if (i == id) {
-				// std::cout<<"Got one! at " <<i <<std::endl;
 				// That means that I need to originate the derivative
-				result.push_back(derivativeUpdate(toNode.getData(type, netNodes, taxa, events, numDerivativeParams), events, distance));
+				const std::vector<densemap>& child = toNode.getData(type, netNodes, taxa, events, numDerivativeParams);
+				result.push_back(derivativeUpdate(child, events, distance));
+				stats.record(DensemapOperation::DERIVATIVE_UPDATE, -1, child.size(), result.back(), 0, started);
 			} else {
 				// This means that the derivative is hopefully farther down the line
 				result.push_back(update(derivative[i], events, distance));
-			}
-		}
-
-		if (debug) {
-			std::cout<<"------------------------------------"<<std::endl;
-			std::cout<<"From node: "<<toNode.name<<std::endl;
-
-			for (unsigned int i = 0; i < result.size() ;i++) {
-				for (auto&& map : result[i]) {
-					std::cout<<"next: "<<std::bitset<8>(map.getTaxaBits()>>6)<<' ';
-					for (unsigned int i =0; i < map.choices.size(); i++) {
-						std::cout<<map.choices[i]<<' ';
-					}
-					std::cout<<std::endl;
-					for (int i = 0; i < 1<<6; i++){
-						double thingy = map.getHistory(i);
-
-						if (thingy != 0) {
-							std::cout<<std::bitset<8>(i)<<' '<<thingy<<std::endl;
-						}
-					}
-				}
+				stats.record(DensemapOperation::DERIVATIVE_UPDATE, -1, derivative[i].size(), result.back(), 0, started);
 			}
 		}
 
@@ -141,6 +107,14 @@ public:
 		toNode.setParams(params);
 	}
 
+	/**
+	 * Get the parameters.
+	 */
+	void getParams(double* params) const {
+		params[id] = distance;
+		toNode.getParams(params);
+	}
+
 	unsigned int id; // The index for the edge.
 	Node& toNode; // The node it points to.
 	double distance; // The length of the edge.
@@ -208,6 +182,30 @@ public:
 		}
 	}
 
+	/**
+	 * Get the parameters, the inverse of setParams.
+	 */
+	void getParams(double* params) const {
+		switch (type) {
+			case NodeType::LEAF:
+				break;
+
+			case NodeType::TREE:
+				leftEdge->getParams(params);
+				rightEdge->getParams(params);
+				break;
+
+			case NodeType::NETWORK:
+				params[introgressionId] = leftProbability;
+				childEdge->getParams(params);
+				break;
+
+			default:
+				std::cerr<<"Unknown type"<<std::endl;
+				exit(-1);
+		}
+	}
+
 	/**
 	 * Get the maximum parameter index.
 	 */
@@ -316,36 +314,20 @@ public:
 			std::vector<densemap> left = leftEdge->getData(netNodes, taxa, events, numDerivativeParams);
 			std::vector<densemap> right = rightEdge->getData(netNodes, taxa, events, numDerivativeParams);
 
+			StatsRecorder& stats = getThreadStatsRecorder();
+			auto started = stats.start();
 			currentData = combine(left, right);
+			stats.record(DensemapOperation::COMBINE, -1, left.size() + right.size(), currentData, left.size() * right.size(), started);
 
 			auto leftDerivatives = leftEdge->getDataDerivative(netNodes, taxa, events, numDerivativeParams);
 			auto rightDerivatives = rightEdge->getDataDerivative(netNodes, taxa, events, numDerivativeParams);
 
 			derivatives.resize(leftDerivatives.size());
 			for (unsigned int i = 0; i < leftDerivatives.size(); i++) {
+				started = stats.start();
 				derivatives[i] = combineDerivatives(left, leftDerivatives[i], right, rightDerivatives[i]);
+				stats.record(DensemapOperation::COMBINE_DERIVATIVES, -1, leftDerivatives[i].size() + rightDerivatives[i].size(), derivatives[i], left.size() * right.size(), started);
 			}
-
-			if (debug) {
-				std::cout<<"---------------------------------"<<std::endl;
-				std::cout<<"Computed node: "<<name<<std::endl;
-
-				for (auto&& map : currentData) {
-					std::cout<<"next: "<<std::bitset<8>(map.getTaxaBits()>>6)<<' ';
-					for (unsigned int i =0; i < map.choices.size(); i++) {
-						std::cout<<map.choices[i]<<' ';
-					}
-					std::cout<<std::endl;
-					for (int i = 0; i < 1<<6; i++){
-						double thingy = map.getHistory(i);
-
-						if (thingy != 0) {
-							std::cout<<std::bitset<8>(i)<<' '<<thingy<<std::endl;
-						}
-					}
-				}
-			}
-
 		} else if (type == NodeType::NETWORK) {
 			std::vector<densemap> child = childEdge->getData(netNodes, taxa, events, numDerivativeParams);
 
@@ -353,54 +335,22 @@ public:
 
 			int netNodeId = netNodes.find(name)->second;
 
+			StatsRecorder& stats = getThreadStatsRecorder();
+			auto started = stats.start();
 			std::tie(leftData, rightData) = split(child, netNodeId, events, leftProbability);
+			stats.record(DensemapOperation::SPLIT, -1, child.size(), leftData, rightData, started);
 
 			leftDerivatives.resize(childDerivatives.size());
 			rightDerivatives.resize(childDerivatives.size());
 
 			for (unsigned int i = 0; i < childDerivatives.size() ; i++) {
+				started = stats.start();
 				if (i == introgressionId) {
 					std::tie(leftDerivatives[i], rightDerivatives[i]) = splitDerivativeHere(child, netNodeId, events, leftProbability);
 				} else {
 					std::tie(leftDerivatives[i], rightDerivatives[i]) = splitDerivatives(childDerivatives[i], child, netNodeId, events, leftProbability);
 				}
-			}
-
-			if (debug) {
-				std::cout<<"---------------------------------"<<std::endl;
-				std::cout<<"Computed node: "<<name<<std::endl;
-
-				std::cout<<"Left"<<std::endl;
-				for (auto&& map : leftData) {
-					std::cout<<"next: "<<std::bitset<8>(map.getTaxaBits()>>6)<<' ';
-					for (unsigned int i =0; i < map.choices.size(); i++) {
-						std::cout<<std::bitset<64>(map.choices[i])<<' ';
-					}
-					std::cout<<std::endl;
-					for (int i = 0; i < 1<<6; i++){
-						double thingy = map.getHistory(i);
-
-						if (thingy != 0) {
-							std::cout<<std::bitset<8>(i)<<' '<<thingy<<std::endl;
-						}
-					}
-				}
-
-				std::cout<<"Right"<<std::endl;
-				for (auto&& map : rightData) {
-					std::cout<<"next: "<<std::bitset<8>(map.getTaxaBits()>>6)<<' ';
-					for (unsigned int i =0; i < map.choices.size(); i++) {
-						std::cout<<map.choices[i]<<' ';
-					}
-					std::cout<<std::endl;
-					for (int i = 0; i < 1<<6; i++){
-						double thingy = map.getHistory(i);
-
-						if (thingy != 0) {
-							std::cout<<std::bitset<8>(i)<<' '<<thingy<<std::endl;
-						}
-					}
-				}
+				stats.record(DensemapOperation::SPLIT_DERIVATIVES, -1, childDerivatives[i].size(), leftDerivatives[i], rightDerivatives[i], started);
 			}
 		}
 	}
@@ -471,12 +421,7 @@ inline double calcProbability(NetNode& species, TreeNode& geneTree, std::vector<
 	auto taxa = getTaxa(geneTree);
 	auto events = getEvents(geneTree, taxa);
 
-	if (debug) {
-		for (int event : events) {
-			std::cout<<std::bitset<16>(event)<<',';
-		}
-		std::cout<<std::endl;
-	}
+	getThreadStatsRecorder().startEvaluation();
 
 	auto netNodes = getNetNodes(species);
 	auto rootEdge = Edge<NetNode>(-1, species, std::numeric_limits<double>::infinity());
@@ -485,15 +430,7 @@ inline double calcProbability(NetNode& species, TreeNode& geneTree, std::vector<
 
 	const std::vector<densemap>& root = rootEdge.getData(netNodes, taxa, events, (derivatives != nullptr) ?  numDerivativeParams : 0 );
 
-	int maxTaxa = 0;
-	for (const auto& entry: taxa) {
-		maxTaxa = std::max(maxTaxa, entry.second);
-	}
-
-	uint16_t targetTaxaBits = 0;
-	for (int i = 6; i <= maxTaxa; i++) {
-		targetTaxaBits |= 1 << i;
-	}
+	uint16_t targetTaxaBits = getTargetTaxaBits(taxa);
 
 	double probability = 0.0;
 
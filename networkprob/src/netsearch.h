@@ -0,0 +1,823 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "arena.h"
+#include "prepared.h"
+#include "batch.h"
+#include "optimize.h"
+#include "parallel.h"
+#include "subtreecache.h"
+
+/**
+ * A node of a network that is being rearranged. Nodes link to both their children and their parents.
+ */
+struct EditableNode {
+	NodeType type;
+	std::string name;
+	int children[2]; // Tree nodes use both, network nodes only the first, and unused ones are -1.
+	double lengths[2]; // The length of the edge to each child.
+	int parents[2]; // Network nodes have a left and a right parent, other nodes only the first, and unused ones are -1.
+	double leftProbability; // For network nodes.
+};
+
+/**
+ * A network in a form that is easy to rearrange. Nodes are in no particular order, except that leaves keep theirs.
+ */
+struct EditableNetwork {
+	std::vector<EditableNode> nodes;
+	int root = -1;
+};
+
+/**
+ * An edge of an editable network, as the parent and which of its children.
+ */
+struct EditableEdge {
+	int parent;
+	int slot;
+};
+
+/**
+ * Make an editable copy of the network at root in an arena.
+ */
+inline EditableNetwork makeEditableNetwork(const NetworkArena& arena, int32_t root) {
+	std::vector<bool> reachable = arena.getReachable(root);
+	std::vector<int> indices(root + 1, -1);
+
+	EditableNetwork result;
+	for (int32_t i = 0; i <= root; i++) {
+		if (reachable[i]) {
+			indices[i] = result.nodes.size();
+			result.nodes.push_back({arena.nodes[i].type, arena.getName(i), {-1, -1}, {0, 0}, {-1, -1}, arena.nodes[i].leftProbability});
+		}
+	}
+
+	for (int32_t i = 0; i <= root; i++) {
+		if (!reachable[i]) {
+			continue;
+		}
+
+		const ArenaNetNode& node = arena.nodes[i];
+		EditableNode& editable = result.nodes[indices[i]];
+
+		for (int j = 0; j < node.getNumEdges(); j++) {
+			const ArenaEdge& edge = node.edges[j];
+			editable.children[j] = indices[edge.node];
+			editable.lengths[j] = edge.distance;
+			result.nodes[indices[edge.node]].parents[edge.type == EdgeType::RIGHT ? 1 : 0] = indices[i];
+		}
+	}
+
+	result.root = indices[root];
+	return result;
+}
+
+/**
+ * Add an editable network to an arena, returning the index of its root.
+ * Leaves come first in the order of the editable network, so every network with the same leaves prepares them
+ * in the same order, and the rest follows in post-order. Edges get params in the order they are added,
+ * followed by one left probability per network node.
+ * If indices is not nullptr, it gets the arena index of every node, or -1 for nodes that can't be reached.
+ */
+inline int32_t appendEditableNetwork(NetworkArena& arena, const EditableNetwork& network, std::vector<int32_t>* indices = nullptr) {
+	int numNodes = network.nodes.size();
+	std::vector<int32_t> added(numNodes, -1);
+
+	for (int i = 0; i < numNodes; i++) {
+		const EditableNode& node = network.nodes[i];
+		if (node.type == NodeType::LEAF && (node.parents[0] != -1 || i == network.root)) {
+			added[i] = arena.addLeaf(node.name.c_str());
+		}
+	}
+
+	int numEdges = 0;
+	std::vector<int> networkNodes;
+
+	std::function<int32_t(int)> append = [&](int index) {
+		if (added[index] != -1) {
+			return added[index];
+		}
+
+		const EditableNode& node = network.nodes[index];
+		ArenaEdge edges[2];
+
+		int numChildren = node.type == NodeType::TREE ? 2 : 1;
+		for (int j = 0; j < numChildren; j++) {
+			int child = node.children[j];
+			EdgeType type = EdgeType::NORMAL;
+			if (network.nodes[child].type == NodeType::NETWORK) {
+				type = network.nodes[child].parents[0] == index ? EdgeType::LEFT : EdgeType::RIGHT;
+			}
+
+			int32_t childIndex = append(child);
+			edges[j] = {node.lengths[j], childIndex, numEdges++, type, 0};
+		}
+
+		if (node.type == NodeType::TREE) {
+			added[index] = arena.addTree(node.name.c_str(), edges[0], edges[1]);
+		} else {
+			// The left probability gets its real param once every edge has one
+			added[index] = arena.addNetwork(node.name.c_str(), edges[0], node.leftProbability, 0);
+			networkNodes.push_back(added[index]);
+		}
+		return added[index];
+	};
+
+	int32_t root = append(network.root);
+
+	for (int32_t index : networkNodes) {
+		arena.nodes[index].introgressionId = numEdges++;
+	}
+
+	if (indices != nullptr) {
+		*indices = std::move(added);
+	}
+	return root;
+}
+
+/**
+ * Write an editable network as extended Newick, in the format parseNetwork reads.
+ * Every appearance of a hybrid gives the inheritance probability of its own parent.
+ */
+inline std::string writeNetwork(const EditableNetwork& network) {
+	std::ostringstream result;
+	result.precision(12);
+
+	std::vector<int> tags(network.nodes.size(), 0);
+	int numTags = 0;
+
+	std::function<void(int, int, double)> write = [&](int index, int parent, double length) {
+		const EditableNode& node = network.nodes[index];
+		bool written = tags[index] != 0;
+
+		if (node.type == NodeType::NETWORK && tags[index] == 0) {
+			tags[index] = ++numTags;
+		}
+
+		if (!written && node.type != NodeType::LEAF) {
+			result<<'(';
+			int numChildren = node.type == NodeType::TREE ? 2 : 1;
+			for (int j = 0; j < numChildren; j++) {
+				if (j > 0) {
+					result<<',';
+				}
+				write(node.children[j], index, node.lengths[j]);
+			}
+			result<<')';
+		}
+
+		if (!written) {
+			result<<node.name;
+		}
+
+		if (node.type == NodeType::NETWORK) {
+			double probability = node.parents[0] == parent ? node.leftProbability : 1 - node.leftProbability;
+			result<<"#H"<<tags[index]<<':'<<length<<"::"<<probability;
+		} else if (parent != -1) {
+			result<<':'<<length;
+		}
+	};
+
+	write(network.root, -1, 0);
+	result<<';';
+	return result.str();
+}
+
+/**
+ * Check if b can be reached from a by going down, including a itself.
+ */
+inline bool isBelow(const EditableNetwork& network, int a, int b) {
+	std::vector<char> seen(network.nodes.size(), false);
+	std::vector<int> stack = {a};
+
+	while (!stack.empty()) {
+		int index = stack.back();
+		stack.pop_back();
+
+		if (index == b) {
+			return true;
+		}
+		if (seen[index]) {
+			continue;
+		}
+		seen[index] = true;
+
+		for (int child : network.nodes[index].children) {
+			if (child != -1) {
+				stack.push_back(child);
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * Get the number of network nodes that can be reached from the root.
+ */
+inline int getNumReticulations(const EditableNetwork& network) {
+	int result = 0;
+	for (unsigned int i = 0; i < network.nodes.size(); i++) {
+		if (network.nodes[i].type == NodeType::NETWORK && isBelow(network, network.root, i)) {
+			result++;
+		}
+	}
+	return result;
+}
+
+/**
+ * Check that an editable network is one the engine can evaluate: links agree in both directions, the root is a tree node,
+ * no node has the same child or parent twice, there are no cycles and every leaf can be reached.
+ */
+inline bool isValidNetwork(const EditableNetwork& network) {
+	int numNodes = network.nodes.size();
+	if (network.root < 0 || network.root >= numNodes || network.nodes[network.root].type != NodeType::TREE || network.nodes[network.root].parents[0] != -1) {
+		return false;
+	}
+
+	// 0 is unseen, 1 is on the current path and 2 is done
+	std::vector<char> state(numNodes, 0);
+	std::function<bool(int)> visit = [&](int index) {
+		if (state[index] != 0) {
+			return state[index] == 2;
+		}
+		state[index] = 1;
+
+		const EditableNode& node = network.nodes[index];
+		int numChildren = node.type == NodeType::TREE ? 2 : (node.type == NodeType::NETWORK ? 1 : 0);
+		int numParents = node.type == NodeType::NETWORK ? 2 : 1;
+
+		if (node.type == NodeType::TREE && node.children[0] == node.children[1]) {
+			return false;
+		}
+		if (node.type == NodeType::NETWORK && (node.parents[0] == -1 || node.parents[1] == -1 || node.parents[0] == node.parents[1])) {
+			return false;
+		}
+
+		for (int j = 0; j < numParents; j++) {
+			int parent = node.parents[j];
+			if (parent != -1 && network.nodes[parent].children[0] != index && network.nodes[parent].children[1] != index) {
+				return false;
+			}
+		}
+
+		for (int j = 0; j < numChildren; j++) {
+			int child = node.children[j];
+			if (child < 0 || child >= numNodes) {
+				return false;
+			}
+
+			const EditableNode& childNode = network.nodes[child];
+			if (childNode.parents[0] != index && childNode.parents[1] != index) {
+				return false;
+			}
+			if (!visit(child)) {
+				return false;
+			}
+		}
+
+		state[index] = 2;
+		return true;
+	};
+
+	if (!visit(network.root)) {
+		return false;
+	}
+
+	for (int i = 0; i < numNodes; i++) {
+		if (network.nodes[i].type == NodeType::LEAF && state[i] != 2) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Point a node at a new parent in place of an old one, keeping whether it is the left or right parent.
+ */
+inline void replaceParent(EditableNetwork& network, int index, int oldParent, int newParent) {
+	int* parents = network.nodes[index].parents;
+	parents[parents[0] == oldParent ? 0 : 1] = newParent;
+}
+
+/**
+ * Put a new node in the middle of an edge, splitting its length in half. The new node has the old child as its first child.
+ * Returns the index of the new node.
+ */
+inline int splitEdge(EditableNetwork& network, EditableEdge edge, NodeType type) {
+	int child = network.nodes[edge.parent].children[edge.slot];
+	double length = network.nodes[edge.parent].lengths[edge.slot] / 2;
+
+	int index = network.nodes.size();
+	network.nodes.push_back({type, "", {child, -1}, {length, 0}, {edge.parent, -1}, 0.5});
+
+	network.nodes[edge.parent].children[edge.slot] = index;
+	network.nodes[edge.parent].lengths[edge.slot] = length;
+	replaceParent(network, child, edge.parent, index);
+
+	return index;
+}
+
+/**
+ * Remove a node that has one parent and one child left, joining the two edges.
+ * Returns false if the node is the root and its child can't be one.
+ */
+inline bool suppressNode(EditableNetwork& network, int index) {
+	EditableNode& node = network.nodes[index];
+	int slot = node.children[0] != -1 ? 0 : 1;
+	int child = node.children[slot];
+	int parent = node.parents[0] != -1 ? node.parents[0] : node.parents[1];
+
+	if (parent == -1) {
+		if (network.nodes[child].type != NodeType::TREE) {
+			return false;
+		}
+		network.root = child;
+		replaceParent(network, child, index, -1);
+	} else {
+		EditableNode& parentNode = network.nodes[parent];
+		int parentSlot = parentNode.children[0] == index ? 0 : 1;
+		parentNode.children[parentSlot] = child;
+		parentNode.lengths[parentSlot] += node.lengths[slot];
+		replaceParent(network, child, index, parent);
+	}
+
+	node.children[0] = node.children[1] = -1;
+	node.parents[0] = node.parents[1] = -1;
+	return true;
+}
+
+/**
+ * Drop the nodes that can't be reached from the root, keeping the order of the rest.
+ * Every entry of indices that refers to a node is renumbered, or set to -1 if the node was dropped.
+ */
+inline void compactNetwork(EditableNetwork& network, std::vector<int>& indices) {
+	int numNodes = network.nodes.size();
+	std::vector<int> renumbered(numNodes, -1);
+
+	int next = 0;
+	for (int i = 0; i < numNodes; i++) {
+		if (isBelow(network, network.root, i)) {
+			renumbered[i] = next++;
+		}
+	}
+
+	auto renumber = [&renumbered](int index) {
+		return index == -1 ? -1 : renumbered[index];
+	};
+
+	std::vector<EditableNode> nodes;
+	nodes.reserve(next);
+	for (int i = 0; i < numNodes; i++) {
+		if (renumbered[i] != -1) {
+			EditableNode node = network.nodes[i];
+			for (int j = 0; j < 2; j++) {
+				node.children[j] = renumber(node.children[j]);
+				node.parents[j] = renumber(node.parents[j]);
+			}
+			nodes.push_back(std::move(node));
+		}
+	}
+
+	network.nodes = std::move(nodes);
+	network.root = renumbered[network.root];
+	for (int& index : indices) {
+		index = renumber(index);
+	}
+}
+
+/**
+ * The kinds of rearrangements the topology search tries.
+ */
+enum class NetworkMove : int32_t {
+	NNI = 0, // Swap a subtree across a tree edge.
+	SPR = 1, // Prune a subtree and regraft it onto another edge.
+	ADD_RETICULATION = 2, // Add an edge between two edges, creating a hybrid.
+	REMOVE_RETICULATION = 3, // Remove one parent edge of a hybrid.
+	MOVE_RETICULATION = 4, // Move one parent edge of a hybrid to another edge.
+};
+
+/**
+ * Get every edge of an editable network.
+ */
+inline std::vector<EditableEdge> getEdges(const EditableNetwork& network) {
+	std::vector<EditableEdge> result;
+	for (unsigned int i = 0; i < network.nodes.size(); i++) {
+		const EditableNode& node = network.nodes[i];
+		int numChildren = node.type == NodeType::TREE ? 2 : (node.type == NodeType::NETWORK ? 1 : 0);
+		for (int j = 0; j < numChildren; j++) {
+			if (node.children[j] != -1) {
+				result.push_back({(int) i, j});
+			}
+		}
+	}
+	return result;
+}
+
+/**
+ * Try one random rearrangement of a network, in place. touched gets the nodes next to every edge that changed.
+ * Returns false if the move didn't give a valid network, in which case network is left in an unknown state.
+ */
+template<typename Generator>
+bool applyRandomMove(EditableNetwork& network, NetworkMove move, Generator& generator, std::vector<int>& touched) {
+	auto pick = [&generator](int n) {
+		return std::uniform_int_distribution<int>(0, n - 1)(generator);
+	};
+
+	std::vector<int> hybrids;
+	for (unsigned int i = 0; i < network.nodes.size(); i++) {
+		if (network.nodes[i].type == NodeType::NETWORK) {
+			hybrids.push_back(i);
+		}
+	}
+
+	std::vector<EditableEdge> edges = getEdges(network);
+	touched.clear();
+
+	switch (move) {
+		case NetworkMove::NNI: {
+			// A tree edge u -> v between two tree nodes swaps a child of v with the other child of u
+			EditableEdge edge = edges[pick(edges.size())];
+			int u = edge.parent;
+			int v = network.nodes[u].children[edge.slot];
+			if (network.nodes[u].type != NodeType::TREE || network.nodes[v].type != NodeType::TREE) {
+				return false;
+			}
+
+			int slot = pick(2);
+			int x = network.nodes[v].children[slot];
+			int y = network.nodes[u].children[1 - edge.slot];
+			if (x == y) {
+				return false;
+			}
+
+			std::swap(network.nodes[v].children[slot], network.nodes[u].children[1 - edge.slot]);
+			std::swap(network.nodes[v].lengths[slot], network.nodes[u].lengths[1 - edge.slot]);
+			replaceParent(network, x, v, u);
+			replaceParent(network, y, u, v);
+
+			touched = {u, v, x, y};
+			break;
+		}
+
+		case NetworkMove::SPR: {
+			// Prune the subtree below c along with its parent p, then put p back on another edge
+			int c = pick(network.nodes.size());
+			int p = network.nodes[c].parents[0];
+			if (network.nodes[c].type == NodeType::NETWORK || p == -1 || network.nodes[p].type != NodeType::TREE) {
+				return false;
+			}
+
+			int slot = network.nodes[p].children[0] == c ? 0 : 1;
+			int sibling = network.nodes[p].children[1 - slot];
+			int grandparent = network.nodes[p].parents[0];
+
+			network.nodes[p].children[slot] = -1;
+			if (!suppressNode(network, p)) {
+				return false;
+			}
+
+			std::vector<EditableEdge> targets;
+			for (EditableEdge target : getEdges(network)) {
+				int child = network.nodes[target.parent].children[target.slot];
+				bool same = target.parent == grandparent && child == sibling;
+				if (!same && target.parent != p && !isBelow(network, c, child) && !isBelow(network, c, target.parent)) {
+					targets.push_back(target);
+				}
+			}
+			if (targets.empty()) {
+				return false;
+			}
+
+			EditableEdge target = targets[pick(targets.size())];
+			int child = network.nodes[target.parent].children[target.slot];
+			double length = network.nodes[target.parent].lengths[target.slot] / 2;
+
+			EditableNode& node = network.nodes[p];
+			node.children[slot] = c;
+			node.children[1 - slot] = child;
+			node.lengths[1 - slot] = length;
+			node.parents[0] = target.parent;
+
+			network.nodes[target.parent].children[target.slot] = p;
+			network.nodes[target.parent].lengths[target.slot] = length;
+			replaceParent(network, child, target.parent, p);
+
+			touched = {c, p, sibling, target.parent, child};
+			if (grandparent != -1) {
+				touched.push_back(grandparent);
+			}
+			break;
+		}
+
+		case NetworkMove::ADD_RETICULATION: {
+			// A new tree node s on one edge gets a new hybrid h on another edge as its second child
+			EditableEdge from = edges[pick(edges.size())];
+			EditableEdge to = edges[pick(edges.size())];
+			int toChild = network.nodes[to.parent].children[to.slot];
+			if ((from.parent == to.parent && from.slot == to.slot) || isBelow(network, toChild, from.parent)) {
+				return false;
+			}
+
+			int fromChild = network.nodes[from.parent].children[from.slot];
+			int s = splitEdge(network, from, NodeType::TREE);
+			int h = splitEdge(network, to, NodeType::NETWORK);
+
+			network.nodes[s].children[1] = h;
+			network.nodes[s].lengths[1] = network.nodes[s].lengths[0];
+			network.nodes[h].parents[1] = s;
+
+			touched = {from.parent, fromChild, to.parent, toChild, s, h};
+			break;
+		}
+
+		case NetworkMove::REMOVE_RETICULATION:
+		case NetworkMove::MOVE_RETICULATION: {
+			if (hybrids.empty()) {
+				return false;
+			}
+
+			// Detach h from one of its parents q, which then only has one child left
+			int h = hybrids[pick(hybrids.size())];
+			int which = pick(2);
+			int q = network.nodes[h].parents[which];
+			int other = network.nodes[h].parents[1 - which];
+			if (network.nodes[q].type != NodeType::TREE) {
+				return false;
+			}
+
+			int slot = network.nodes[q].children[0] == h ? 0 : 1;
+			double length = network.nodes[q].lengths[slot];
+			int qParent = network.nodes[q].parents[0];
+			int qChild = network.nodes[q].children[1 - slot];
+
+			network.nodes[q].children[slot] = -1;
+			network.nodes[h].parents[which] = -1;
+			if (!suppressNode(network, q)) {
+				return false;
+			}
+
+			touched = {qChild, other, h};
+			if (qParent != -1) {
+				touched.push_back(qParent);
+			}
+
+			if (move == NetworkMove::REMOVE_RETICULATION) {
+				int hChild = network.nodes[h].children[0];
+				touched.push_back(hChild);
+				if (!suppressNode(network, h)) {
+					return false;
+				}
+				break;
+			}
+
+			// Attach h to a new node on another edge that isn't below it
+			std::vector<EditableEdge> targets;
+			for (EditableEdge target : getEdges(network)) {
+				int child = network.nodes[target.parent].children[target.slot];
+				if (target.parent != q && child != h && !isBelow(network, h, target.parent)) {
+					targets.push_back(target);
+				}
+			}
+			if (targets.empty()) {
+				return false;
+			}
+
+			EditableEdge target = targets[pick(targets.size())];
+			touched.push_back(target.parent);
+			touched.push_back(network.nodes[target.parent].children[target.slot]);
+
+			int s = splitEdge(network, target, NodeType::TREE);
+			network.nodes[s].children[1] = h;
+			network.nodes[s].lengths[1] = length;
+			network.nodes[h].parents[which] = s;
+			touched.push_back(s);
+			break;
+		}
+
+		default:
+			return false;
+	}
+
+	if (!isValidNetwork(network)) {
+		return false;
+	}
+
+	compactNetwork(network, touched);
+	touched.erase(std::remove(touched.begin(), touched.end(), -1), touched.end());
+	return true;
+}
+
+/**
+ * Settings for the topology search.
+ */
+struct TopologySearchOptions {
+	int maxRounds = 20;
+	int candidatesPerRound = 16; // The number of rearranged networks scored together every round.
+	int patience = 3; // Stop after this many rounds in a row without a better network.
+	int maxReticulations = 2;
+	double reticulationPenalty = 0; // Subtracted from the log likelihood for every reticulation when comparing networks.
+	OptimizerOptions optimizer = quickOptimizerOptions(); // For the branch lengths of the start and of every candidate.
+	uint64_t seed = 0;
+
+	/**
+	 * The default optimizer settings for the search, which only polish the lengths near each move.
+	 */
+	static OptimizerOptions quickOptimizerOptions() {
+		OptimizerOptions result;
+		result.maxIterations = 10;
+		result.functionTolerance = 1e-8;
+		return result;
+	}
+};
+
+/**
+ * A network found by the topology search, with its optimized params.
+ */
+struct ScoredNetwork {
+	EditableNetwork network;
+	double logLikelihood = -std::numeric_limits<double>::infinity();
+	double score = -std::numeric_limits<double>::infinity(); // The log likelihood less the reticulation penalty.
+};
+
+/**
+ * What the topology search found.
+ */
+struct TopologySearchResult {
+	ScoredNetwork best;
+	int rounds = 0;
+	int candidates = 0; // The number of networks scored.
+	int accepted = 0;
+	std::vector<double> trace; // The score of the current network at the start and after every round.
+};
+
+/**
+ * Optimize some of the params of a network for a batch, holding the rest, and score it.
+ * Only the params of the edges next to the given nodes, and the left probabilities of those that are hybrids,
+ * are optimized, or every param if all is true. cache must be shared with a network over the same leaves.
+ */
+inline ScoredNetwork scoreNetwork(const EditableNetwork& network, const std::vector<int>& touched, bool all, const GeneTreeBatch& batch, const SubtreeCache& sharedCache, const TopologySearchOptions& options) {
+	NetworkArena arena;
+	std::vector<int32_t> indices;
+	int32_t root = appendEditableNetwork(arena, network, &indices);
+
+	PreparedNetwork prepared = prepareNetwork(arena, root);
+	SubtreeCache cache(prepared, sharedCache);
+
+	std::vector<bool> isTouched(arena.size(), all);
+	for (int index : touched) {
+		isTouched[indices[index]] = true;
+	}
+
+	std::vector<ParamKind> kinds = getParamKinds(prepared);
+	std::vector<int> free;
+	std::vector<bool> isFree(prepared.numParams, false);
+	for (int32_t i = 0; i <= root; i++) {
+		const ArenaNetNode& node = arena.nodes[i];
+		for (int j = 0; j < node.getNumEdges(); j++) {
+			if (isTouched[i] || isTouched[node.edges[j].node]) {
+				isFree[node.edges[j].paramId] = true;
+			}
+		}
+		if (node.type == NodeType::NETWORK && isTouched[i]) {
+			isFree[node.introgressionId] = true;
+		}
+	}
+	for (int i = 0; i < prepared.numParams; i++) {
+		if (isFree[i]) {
+			free.push_back(i);
+		}
+	}
+
+	std::vector<double> params = prepared.params;
+	std::vector<double> lower(free.size(), 0);
+	std::vector<double> upper(free.size(), std::numeric_limits<double>::infinity());
+	std::vector<double> start(free.size());
+	for (unsigned int i = 0; i < free.size(); i++) {
+		start[i] = params[free[i]];
+		if (kinds[free[i]] == ParamKind::INHERITANCE) {
+			upper[i] = 1;
+		}
+	}
+
+	// Candidates are scored in parallel, so each prunes against the probabilities of its own last step
+	PrecisionOptions precision = options.optimizer.precision;
+	std::vector<double> treeProbabilities;
+	precision.treeProbabilities = &treeProbabilities;
+
+	std::vector<double> derivatives;
+	Objective objective = [&](const std::vector<double>& x, std::vector<double>& gradient) {
+		std::vector<double> values = params;
+		for (unsigned int i = 0; i < free.size(); i++) {
+			values[free[i]] = x[i];
+		}
+
+		double logLikelihood = calcLogLikelihood(prepared, batch, values.data(), precision, nullptr, &derivatives, &cache);
+		for (unsigned int i = 0; i < free.size(); i++) {
+			gradient[i] = -derivatives[free[i]];
+		}
+		return -logLikelihood;
+	};
+
+	OptimizerResult optimized = minimizeBounded(objective, start, lower, upper, options.optimizer);
+	for (unsigned int i = 0; i < free.size(); i++) {
+		params[free[i]] = optimized.params[i];
+	}
+	arena.setParams(root, params.data());
+
+	ScoredNetwork result;
+	result.network = makeEditableNetwork(arena, root);
+	result.logLikelihood = -optimized.value;
+	if (options.optimizer.precision.precision != HistoryPrecision::DOUBLE || options.optimizer.precision.pruneTolerance > 0) {
+		// Candidates are screened in float or with pruning, but networks are compared exactly in double
+		result.logLikelihood = calcLogLikelihood(prepared, batch, params.data(), nullptr, &cache);
+	}
+	result.score = result.logLikelihood - options.reticulationPenalty * getNumReticulations(result.network);
+	return result;
+}
+
+/**
+ * Search for the network that best explains a batch of gene trees by hill climbing over topologies.
+ * Every round proposes candidatesPerRound random NNI, SPR and reticulation moves of the current network,
+ * optimizes the branch lengths next to each move while holding the rest, and scores the candidates in parallel.
+ * The best candidate is taken if it beats the current network. The batch must be prepared against a network with
+ * the same leaves in the same order as start, and the candidates share one subtree cache, so species subtrees
+ * a move didn't change are not computed again. The same seed gives the same result.
+ */
+inline TopologySearchResult searchNetworkTopology(const EditableNetwork& start, const GeneTreeBatch& batch, const TopologySearchOptions& options = TopologySearchOptions()) {
+	std::mt19937_64 generator(options.seed);
+
+	NetworkArena startArena;
+	PreparedNetwork startPrepared = prepareNetwork(startArena, appendEditableNetwork(startArena, start));
+	SubtreeCache sharedCache(startPrepared);
+
+	TopologySearchResult result;
+	ScoredNetwork current = scoreNetwork(start, {}, true, batch, sharedCache, options);
+	result.candidates++;
+	result.trace.push_back(current.score);
+
+	int numCandidates = std::max(1, options.candidatesPerRound);
+	int roundsWithoutImprovement = 0;
+
+	for (int round = 0; round < options.maxRounds && roundsWithoutImprovement < options.patience; round++) {
+		// Moves are drawn on this thread so they don't depend on how the candidates are scheduled
+		std::vector<EditableNetwork> candidates;
+		std::vector<std::vector<int>> touched;
+
+		int numReticulations = getNumReticulations(current.network);
+		std::vector<NetworkMove> moves = {NetworkMove::NNI, NetworkMove::SPR};
+		if (numReticulations < options.maxReticulations) {
+			moves.push_back(NetworkMove::ADD_RETICULATION);
+		}
+		if (numReticulations > 0) {
+			moves.push_back(NetworkMove::REMOVE_RETICULATION);
+			moves.push_back(NetworkMove::MOVE_RETICULATION);
+		}
+
+		for (int attempt = 0; attempt < 20 * numCandidates && (int) candidates.size() < numCandidates; attempt++) {
+			EditableNetwork candidate = current.network;
+			std::vector<int> candidateTouched;
+
+			NetworkMove move = moves[std::uniform_int_distribution<int>(0, moves.size() - 1)(generator)];
+			if (applyRandomMove(candidate, move, generator, candidateTouched)) {
+				candidates.push_back(std::move(candidate));
+				touched.push_back(std::move(candidateTouched));
+			}
+		}
+
+		std::vector<ScoredNetwork> scored(candidates.size());
+		parallelTasks(candidates.size(), [&](int i) {
+			scored[i] = scoreNetwork(candidates[i], touched[i], false, batch, sharedCache, options);
+		});
+		result.candidates += candidates.size();
+
+		// Ties go to the first candidate, and NaN never wins
+		int best = -1;
+		for (unsigned int i = 0; i < scored.size(); i++) {
+			if (scored[i].score > current.score && (best == -1 || scored[i].score > scored[best].score)) {
+				best = i;
+			}
+		}
+
+		if (best != -1) {
+			current = std::move(scored[best]);
+			result.accepted++;
+			roundsWithoutImprovement = 0;
+		} else {
+			roundsWithoutImprovement++;
+		}
+
+		result.rounds++;
+		result.trace.push_back(current.score);
+	}
+
+	result.best = std::move(current);
+	return result;
+}
@@ -0,0 +1,594 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "arena.h"
+
+/**
+ * Parse all of [begin, end) as a number.
+ */
+inline bool parseDouble(const char* begin, const char* end, double& value) {
+	// Copy out so that strtod stops at end, even without a null terminator
+	char text[64];
+	size_t length = end - begin;
+	if (length == 0 || length >= sizeof(text)) {
+		return false;
+	}
+	std::memcpy(text, begin, length);
+	text[length] = '\0';
+
+	char* parsedEnd;
+	value = std::strtod(text, &parsedEnd);
+	return *parsedEnd == '\0';
+}
+
+/**
+ * Reads the tokens shared by Newick trees and extended Newick networks.
+ */
+class NewickReader {
+public:
+	/**
+	 * Read from the characters in [begin, end).
+	 */
+	NewickReader(const char* a_begin, const char* a_end) : begin(a_begin), current(a_begin), end(a_end) {}
+
+	/**
+	 * Skip whitespace and [comments].
+	 */
+	void skipSpace() {
+		while (current != end) {
+			if (*current == '[') {
+				while (current != end && *current != ']') {
+					current++;
+				}
+				if (current != end) {
+					current++;
+				}
+			} else if (*current == ' ' || *current == '\t' || *current == '\n' || *current == '\r') {
+				current++;
+			} else {
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Look at the next character, or '\0' at the end.
+	 */
+	char peek() {
+		skipSpace();
+		return current != end ? *current : '\0';
+	}
+
+	/**
+	 * Consume c if it is next.
+	 */
+	bool accept(char c) {
+		if (peek() == c) {
+			current++;
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Consume c, failing if it is not next.
+	 */
+	bool expect(char c) {
+		if (!accept(c)) {
+			return fail(std::string("Expected '") + c + "'");
+		}
+		return true;
+	}
+
+	/**
+	 * Read a possibly empty label, which may be quoted, appending it to label.
+	 */
+	bool readLabel(std::string& label) {
+		if (peek() == '\'') {
+			current++;
+			while (true) {
+				if (current == end) {
+					return fail("Unterminated quoted label");
+				}
+				if (*current == '\'') {
+					// Two quotes in a row are an escaped quote
+					if (current + 1 != end && current[1] == '\'') {
+						label += '\'';
+						current += 2;
+						continue;
+					}
+					current++;
+					return true;
+				}
+				label += *current++;
+			}
+		}
+
+		const char* start = current;
+		while (current != end && !isSpecial(*current)) {
+			current++;
+		}
+		label.append(start, current);
+		return true;
+	}
+
+	/**
+	 * Read a number if there is one, leaving value alone otherwise. present gets whether there was one.
+	 */
+	bool readOptionalNumber(double& value, bool& present) {
+		present = false;
+		char next = peek();
+		if (next == ':' || next == ',' || next == ')' || next == ';' || next == '\0') {
+			return true;
+		}
+
+		const char* start = current;
+		while (current != end && !isSpecial(*current)) {
+			current++;
+		}
+
+		if (!parseDouble(start, current, value)) {
+			current = start;
+			return fail("Expected a number");
+		}
+		present = true;
+		return true;
+	}
+
+	/**
+	 * Check if everything has been read.
+	 */
+	bool atEnd() {
+		return peek() == '\0';
+	}
+
+	/**
+	 * Print an error along with where it happened.
+	 */
+	bool fail(const std::string& message) const {
+		std::cerr<<message<<" at character "<<(current - begin)<<" of the Newick string"<<std::endl;
+		return false;
+	}
+
+private:
+	/**
+	 * Check if a character ends a label.
+	 */
+	static bool isSpecial(char c) {
+		switch (c) {
+			case '(':
+			case ')':
+			case ',':
+			case ':':
+			case ';':
+			case '#':
+			case '[':
+			case ' ':
+			case '\t':
+			case '\n':
+			case '\r':
+				return true;
+
+			default:
+				return false;
+		}
+	}
+
+	const char* begin;
+	const char* current;
+	const char* end;
+};
+
+/**
+ * Parses PhyloNet style extended Newick networks, such as ((A,(B)#H1::0.6),(C,#H1::0.4));
+ * A hybrid node appears twice with the same #tag, and one of the appearances holds its children.
+ * The first appearance in the string is the left parent, and ::gamma gives the inheritance probability.
+ */
+class NetworkParser {
+public:
+	/**
+	 * Create a parser that adds networks to arena.
+	 */
+	explicit NetworkParser(NetworkArena& a_arena) : arena(a_arena) {}
+
+	/**
+	 * Parse a network, adding it to the arena.
+	 * Edges are given param indices in the order they appear, then any edges under hybrids with two children,
+	 * and finally one left probability per hybrid in the order the hybrids first appear.
+	 * Returns false, after printing why, if the string is not a valid network.
+	 */
+	bool parse(const char* newick, size_t length, int32_t& root, int& numParams) {
+		NewickReader reader(newick, newick + length);
+		occurrences.clear();
+		hybrids.clear();
+		names.clear();
+		numEdges = 0;
+
+		// Binary nodes mean about two occurrences per comma
+		occurrences.reserve(2 * std::count(newick, newick + length, ',') + 2);
+		names.reserve(length);
+
+		int32_t top;
+		if (!parseSubtree(reader, top) || !reader.expect(';') || !reader.atEnd()) {
+			return false;
+		}
+
+		if (occurrences[top].hybrid != -1) {
+			return reader.fail("The root can't be a hybrid");
+		}
+
+		for (const Hybrid& hybrid : hybrids) {
+			if (hybrid.numOccurrences != 2) {
+				return reader.fail("Hybrid #" + hybrid.tag + " must appear exactly twice");
+			}
+			if (hybrid.definition == -1) {
+				return reader.fail("Hybrid #" + hybrid.tag + " has no children");
+			}
+		}
+
+		numBodyEdges = 0;
+		for (const Hybrid& hybrid : hybrids) {
+			if (occurrences[hybrid.definition].numChildren == 2) {
+				numBodyEdges++;
+			}
+		}
+
+		nextBodyEdge = numEdges;
+		nodeIndices.assign(occurrences.size(), -1);
+		hybridIndices.assign(hybrids.size(), -1);
+
+		if (!emitOccurrence(reader, top, root)) {
+			return false;
+		}
+
+		numParams = numEdges + numBodyEdges + hybrids.size();
+		return true;
+	}
+
+private:
+	/**
+	 * One appearance of a node in the string, along with the edge above it.
+	 */
+	struct Occurrence {
+		int32_t name; // The offset of the name in names.
+		int32_t hybrid; // The index in hybrids, or -1.
+		int numChildren;
+		int32_t children[2];
+
+		double length;
+		bool hasGamma;
+		double gamma;
+		int32_t edgeId;
+	};
+
+	/**
+	 * Every appearance of one hybrid tag.
+	 */
+	struct Hybrid {
+		std::string tag;
+		int numOccurrences;
+		int32_t occurrences[2];
+		int32_t definition; // The occurrence with children, or -1.
+	};
+
+	/**
+	 * Find or create the hybrid for a tag.
+	 */
+	int32_t getHybrid(const std::string& tag) {
+		for (unsigned int i = 0; i < hybrids.size(); i++) {
+			if (hybrids[i].tag == tag) {
+				return i;
+			}
+		}
+
+		hybrids.push_back({tag, 0, {-1, -1}, -1});
+		return hybrids.size() - 1;
+	}
+
+	/**
+	 * Parse a node along with the edge above it.
+	 */
+	bool parseSubtree(NewickReader& reader, int32_t& result) {
+		Occurrence occurrence = {-1, -1, 0, {-1, -1}, 1.0, false, 0.0, -1};
+
+		if (reader.accept('(')) {
+			do {
+				if (occurrence.numChildren == 2) {
+					return reader.fail("Nodes can have at most two children");
+				}
+
+				int32_t child;
+				if (!parseSubtree(reader, child)) {
+					return false;
+				}
+				occurrences[child].edgeId = numEdges++;
+				occurrence.children[occurrence.numChildren++] = child;
+			} while (reader.accept(','));
+
+			if (!reader.expect(')')) {
+				return false;
+			}
+		}
+
+		occurrence.name = names.size();
+		if (!reader.readLabel(names)) {
+			return false;
+		}
+		bool hasName = (int32_t) names.size() != occurrence.name;
+		names += '\0';
+
+		if (reader.accept('#')) {
+			std::string tag;
+			if (!reader.readLabel(tag)) {
+				return false;
+			}
+			if (tag.empty()) {
+				return reader.fail("Missing hybrid tag");
+			}
+			occurrence.hybrid = getHybrid(tag);
+		}
+
+		if (occurrence.numChildren == 1 && occurrence.hybrid == -1) {
+			return reader.fail("Only hybrids can have a single child");
+		}
+
+		if (occurrence.numChildren == 0 && occurrence.hybrid == -1 && !hasName) {
+			return reader.fail("Leaves need names");
+		}
+
+		// The fields are length:gamma or length:support:gamma, and any of them can be empty
+		double fields[3] = {0, 0, 0};
+		bool present[3] = {false, false, false};
+		int numFields = 0;
+		while (numFields < 3 && reader.accept(':')) {
+			if (!reader.readOptionalNumber(fields[numFields], present[numFields])) {
+				return false;
+			}
+			numFields++;
+
+			if (numFields == 1 && present[0] && !(fields[0] >= 0)) {
+				return reader.fail("Branch lengths can't be negative");
+			}
+		}
+
+		if (present[0]) {
+			occurrence.length = fields[0];
+		}
+
+		if (numFields >= 2 && present[numFields - 1]) {
+			double gamma = fields[numFields - 1];
+			if (occurrence.hybrid == -1) {
+				return reader.fail("Only hybrid edges have inheritance probabilities");
+			}
+			if (!(gamma >= 0 && gamma <= 1)) {
+				return reader.fail("Inheritance probabilities must be between 0 and 1");
+			}
+			occurrence.hasGamma = true;
+			occurrence.gamma = gamma;
+		}
+
+		result = occurrences.size();
+
+		if (occurrence.hybrid != -1) {
+			Hybrid& hybrid = hybrids[occurrence.hybrid];
+			if (hybrid.numOccurrences == 2) {
+				return reader.fail("Hybrid #" + hybrid.tag + " must appear exactly twice");
+			}
+			hybrid.occurrences[hybrid.numOccurrences++] = result;
+
+			if (occurrence.numChildren != 0) {
+				if (hybrid.definition != -1) {
+					return reader.fail("Hybrid #" + hybrid.tag + " has children in both places");
+				}
+				hybrid.definition = result;
+			}
+		}
+
+		occurrences.push_back(std::move(occurrence));
+		return true;
+	}
+
+	/**
+	 * Get the name of an occurrence.
+	 */
+	const char* getName(const Occurrence& occurrence) const {
+		return names.c_str() + occurrence.name;
+	}
+
+	/**
+	 * Add the node for an occurrence to the arena, after everything below it.
+	 */
+	bool emitOccurrence(NewickReader& reader, int32_t index, int32_t& result) {
+		const Occurrence& occurrence = occurrences[index];
+
+		if (occurrence.hybrid != -1) {
+			return emitHybrid(reader, occurrence.hybrid, result);
+		}
+
+		if (nodeIndices[index] != -1) {
+			result = nodeIndices[index];
+			return true;
+		}
+
+		if (occurrence.numChildren == 0) {
+			result = arena.addLeaf(getName(occurrence));
+		} else {
+			ArenaEdge edges[2];
+			if (!emitChildEdges(reader, occurrence, edges)) {
+				return false;
+			}
+			result = arena.addTree(getName(occurrence), edges[0], edges[1]);
+		}
+
+		nodeIndices[index] = result;
+		return true;
+	}
+
+	/**
+	 * Add the nodes below an occurrence, creating the edges to them.
+	 */
+	bool emitChildEdges(NewickReader& reader, const Occurrence& occurrence, ArenaEdge* edges) {
+		for (int i = 0; i < occurrence.numChildren; i++) {
+			const Occurrence& child = occurrences[occurrence.children[i]];
+
+			int32_t childIndex;
+			if (!emitOccurrence(reader, occurrence.children[i], childIndex)) {
+				return false;
+			}
+
+			EdgeType type = EdgeType::NORMAL;
+			if (child.hybrid != -1) {
+				type = hybrids[child.hybrid].occurrences[0] == occurrence.children[i] ? EdgeType::LEFT : EdgeType::RIGHT;
+			}
+
+			edges[i] = {child.length, childIndex, child.edgeId, type, 0};
+		}
+		return true;
+	}
+
+	/**
+	 * Add the network node for a hybrid, once.
+	 */
+	bool emitHybrid(NewickReader& reader, int32_t index, int32_t& result) {
+		if (hybridIndices[index] == -2) {
+			return reader.fail("Hybrid #" + hybrids[index].tag + " is below itself");
+		}
+		if (hybridIndices[index] != -1) {
+			result = hybridIndices[index];
+			return true;
+		}
+		hybridIndices[index] = -2;
+
+		const Hybrid& hybrid = hybrids[index];
+		const Occurrence& definition = occurrences[hybrid.definition];
+
+		ArenaEdge edges[2];
+		if (!emitChildEdges(reader, definition, edges)) {
+			return false;
+		}
+
+		ArenaEdge childEdge = edges[0];
+		if (definition.numChildren == 2) {
+			// Network nodes have one child, so put the children under a tree node with a zero length edge
+			int32_t body = arena.addTree(getName(definition), edges[0], edges[1]);
+			childEdge = {0.0, body, nextBodyEdge++, EdgeType::NORMAL, 0};
+		}
+
+		const Occurrence& left = occurrences[hybrid.occurrences[0]];
+		const Occurrence& right = occurrences[hybrid.occurrences[1]];
+
+		double leftProbability = 0.5;
+		if (left.hasGamma) {
+			leftProbability = left.gamma;
+		} else if (right.hasGamma) {
+			leftProbability = 1 - right.gamma;
+		}
+
+		int32_t introgressionId = numEdges + numBodyEdges + index;
+		result = arena.addNetwork(getName(definition), childEdge, leftProbability, introgressionId);
+
+		hybridIndices[index] = result;
+		return true;
+	}
+
+	NetworkArena& arena;
+
+	std::vector<Occurrence> occurrences;
+	std::vector<Hybrid> hybrids;
+	std::string names; // The null terminated names of all the occurrences.
+	int numEdges;
+	int numBodyEdges;
+	int nextBodyEdge;
+
+	std::vector<int32_t> nodeIndices; // The arena index for each occurrence.
+	std::vector<int32_t> hybridIndices; // The arena index for each hybrid, or -2 while it is being added.
+};
+
+/**
+ * Parse an extended Newick network into an arena.
+ * Returns false, after printing why, if the string is not a valid network.
+ */
+inline bool parseNetwork(const std::string& newick, NetworkArena& arena, int32_t& root, int& numParams) {
+	NetworkParser parser(arena);
+	return parser.parse(newick.data(), newick.size(), root, numParams);
+}
+
+/**
+ * Parse a gene tree node along with the edge above it, ignoring any lengths.
+ */
+inline bool parseTreeNode(NewickReader& reader, TreeArena& arena, std::string& name, int32_t& result) {
+	if (reader.accept('(')) {
+		int32_t left;
+		int32_t right;
+		if (!parseTreeNode(reader, arena, name, left) || !reader.expect(',') || !parseTreeNode(reader, arena, name, right)) {
+			return false;
+		}
+
+		if (reader.peek() == ',') {
+			return reader.fail("Gene trees must be binary");
+		}
+		if (!reader.expect(')')) {
+			return false;
+		}
+
+		name.clear();
+		if (!reader.readLabel(name)) {
+			return false;
+		}
+		result = arena.addTree(name.c_str(), left, right);
+	} else {
+		name.clear();
+		if (!reader.readLabel(name)) {
+			return false;
+		}
+		if (name.empty()) {
+			return reader.fail("Leaves need names");
+		}
+		result = arena.addLeaf(name.c_str());
+	}
+
+	double ignored;
+	bool present;
+	for (int i = 0; i < 3 && reader.accept(':'); i++) {
+		if (!reader.readOptionalNumber(ignored, present)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Parse a binary Newick gene tree from [begin, end) into an arena. The final ';' is optional.
+ * Returns false, after printing why, if the string is not a valid gene tree.
+ */
+inline bool parseTree(const char* begin, const char* end, TreeArena& arena, int32_t& root) {
+	NewickReader reader(begin, end);
+	std::string name;
+
+	if (!parseTreeNode(reader, arena, name, root)) {
+		return false;
+	}
+
+	reader.accept(';');
+
+	if (!reader.atEnd()) {
+		return reader.fail("Expected the end of the tree");
+	}
+
+	return true;
+}
+
+/**
+ * Parse a binary Newick gene tree into an arena.
+ */
+inline bool parseTree(const std::string& newick, TreeArena& arena, int32_t& root) {
+	return parseTree(newick.data(), newick.data() + newick.size(), arena, root);
+}
@@ -0,0 +1,390 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "prepared.h"
+#include "batch.h"
+
+/**
+ * What a param of a prepared network controls, which decides its bounds.
+ */
+enum class ParamKind : int32_t {
+	LENGTH = 0, // A branch length, at least 0.
+	INHERITANCE = 1, // A left probability, between 0 and 1.
+};
+
+/**
+ * Get the kind of every param of a prepared network. Params no node uses count as lengths.
+ */
+inline std::vector<ParamKind> getParamKinds(const PreparedNetwork& network) {
+	std::vector<ParamKind> result(network.numParams, ParamKind::LENGTH);
+	for (auto&& node : network.nodes) {
+		if (node.type == NodeType::NETWORK) {
+			result[node.introgressionId] = ParamKind::INHERITANCE;
+		}
+	}
+	return result;
+}
+
+/**
+ * How params are seen by the optimizer.
+ */
+enum class ParamTransform : int32_t {
+	NONE = 0, // Params are optimized directly, inside their bounds.
+	LOG = 1, // Lengths are optimized as log(length) and left probabilities as logit(p), with no bounds.
+};
+
+/**
+ * Settings for the optimizer.
+ */
+struct OptimizerOptions {
+	int maxIterations = 200;
+	int memory = 10; // The number of correction pairs L-BFGS keeps.
+	double gradientTolerance = 1e-6; // Stop once every projected gradient entry is this small.
+	double functionTolerance = 1e-12; // Stop once an iteration improves the objective by this fraction or less.
+	ParamTransform transform = ParamTransform::NONE;
+	PrecisionOptions precision; // For the likelihoods the optimizer steps by. The optimum it reports is always exact in double.
+};
+
+/**
+ * What the optimizer found.
+ */
+struct OptimizerResult {
+	std::vector<double> params;
+	double value = 0; // The objective at params.
+	int iterations = 0;
+	int evaluations = 0;
+	bool converged = false;
+	bool abandoned = false; // Stopped early by the monitor.
+	int fallbacks = 0; // Float evaluations done again in double because their error estimate was too large.
+	std::vector<double> trace; // The objective at the start and after every iteration.
+};
+
+/**
+ * An objective to minimize, returning its value and filling in its gradient.
+ */
+using Objective = std::function<double(const std::vector<double>& x, std::vector<double>& gradient)>;
+
+/**
+ * Called after every iteration with the number of iterations done and the objective, returning false to stop.
+ */
+using OptimizerMonitor = std::function<bool(int iterations, double value)>;
+
+/**
+ * Minimize a function inside a box with projected L-BFGS.
+ * Variables at a bound with the gradient pushing outwards are held fixed for the step, the rest take an L-BFGS step,
+ * and a backtracking line search along the projected path enforces the Armijo condition.
+ * Non finite values count as failed steps, so the objective may return them outside its domain.
+ * Bounds may be infinite. If monitor is set, it can stop the optimizer after any iteration.
+ */
+inline OptimizerResult minimizeBounded(const Objective& objective, std::vector<double> x, const std::vector<double>& lower, const std::vector<double>& upper, const OptimizerOptions& options, const OptimizerMonitor& monitor = nullptr) {
+	int n = x.size();
+
+	auto project = [&](std::vector<double>& point) {
+		for (int i = 0; i < n; i++) {
+			point[i] = std::min(upper[i], std::max(lower[i], point[i]));
+		}
+	};
+
+	// Is a variable stuck at a bound with the gradient pushing it out?
+	auto isActive = [&](const std::vector<double>& point, const std::vector<double>& gradient, int i) {
+		return (point[i] <= lower[i] && gradient[i] > 0) || (point[i] >= upper[i] && gradient[i] < 0);
+	};
+
+	auto dot = [n](const std::vector<double>& a, const std::vector<double>& b) {
+		double sum = 0;
+		for (int i = 0; i < n; i++) {
+			sum += a[i] * b[i];
+		}
+		return sum;
+	};
+
+	OptimizerResult result;
+	project(x);
+
+	std::vector<double> gradient(n);
+	double value = objective(x, gradient);
+	result.evaluations++;
+	result.trace.push_back(value);
+
+	std::vector<std::vector<double>> s;
+	std::vector<std::vector<double>> y;
+	std::vector<double> rho;
+
+	std::vector<double> direction(n);
+	std::vector<double> alphas;
+	std::vector<double> next(n);
+	std::vector<double> nextGradient(n);
+
+	while (result.iterations < options.maxIterations && std::isfinite(value)) {
+		double largestGradient = 0;
+		for (int i = 0; i < n; i++) {
+			if (!isActive(x, gradient, i)) {
+				largestGradient = std::max(largestGradient, std::abs(gradient[i]));
+			}
+		}
+		if (largestGradient <= options.gradientTolerance) {
+			result.converged = true;
+			break;
+		}
+
+		// The L-BFGS two loop recursion over the free variables
+		for (int i = 0; i < n; i++) {
+			direction[i] = isActive(x, gradient, i) ? 0 : -gradient[i];
+		}
+
+		alphas.assign(s.size(), 0.0);
+		for (int k = s.size() - 1; k >= 0; k--) {
+			alphas[k] = rho[k] * dot(s[k], direction);
+			for (int i = 0; i < n; i++) {
+				direction[i] -= alphas[k] * y[k][i];
+			}
+		}
+
+		double scale = 1;
+		if (!s.empty()) {
+			scale = dot(s.back(), y.back()) / dot(y.back(), y.back());
+		}
+		for (int i = 0; i < n; i++) {
+			direction[i] *= scale;
+		}
+
+		for (unsigned int k = 0; k < s.size(); k++) {
+			double beta = rho[k] * dot(y[k], direction);
+			for (int i = 0; i < n; i++) {
+				direction[i] += (alphas[k] - beta) * s[k][i];
+			}
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (isActive(x, gradient, i)) {
+				direction[i] = 0;
+			}
+		}
+
+		// Fall back to steepest descent if the curvature information points uphill
+		if (dot(direction, gradient) >= 0) {
+			s.clear();
+			y.clear();
+			rho.clear();
+			for (int i = 0; i < n; i++) {
+				direction[i] = isActive(x, gradient, i) ? 0 : -gradient[i];
+			}
+		}
+
+		// Without any curvature yet, start with a step of length one
+		double step = s.empty() ? 1 / std::sqrt(dot(direction, direction)) : 1;
+		double nextValue = std::numeric_limits<double>::infinity();
+		bool accepted = false;
+
+		for (int attempt = 0; attempt < 40; attempt++) {
+			for (int i = 0; i < n; i++) {
+				next[i] = x[i] + step * direction[i];
+			}
+			project(next);
+
+			double decrease = 0;
+			for (int i = 0; i < n; i++) {
+				decrease += gradient[i] * (next[i] - x[i]);
+			}
+
+			nextValue = objective(next, nextGradient);
+			result.evaluations++;
+
+			bool finite = std::isfinite(nextValue) && std::all_of(nextGradient.begin(), nextGradient.end(), [](double g) { return std::isfinite(g); });
+			if (finite && nextValue <= value + 1e-4 * decrease) {
+				accepted = true;
+				break;
+			}
+			step /= 2;
+		}
+
+		if (!accepted) {
+			// Even tiny steps don't help, so this is as good as it gets
+			result.converged = s.empty();
+			if (!s.empty()) {
+				s.clear();
+				y.clear();
+				rho.clear();
+				continue;
+			}
+			break;
+		}
+
+		std::vector<double> sk(n);
+		std::vector<double> yk(n);
+		for (int i = 0; i < n; i++) {
+			sk[i] = next[i] - x[i];
+			yk[i] = nextGradient[i] - gradient[i];
+		}
+
+		double curvature = dot(sk, yk);
+		if (curvature > 1e-10 * dot(yk, yk)) {
+			if ((int) s.size() == options.memory) {
+				s.erase(s.begin());
+				y.erase(y.begin());
+				rho.erase(rho.begin());
+			}
+			s.push_back(std::move(sk));
+			y.push_back(std::move(yk));
+			rho.push_back(1 / curvature);
+		}
+
+		double improvement = value - nextValue;
+
+		x.swap(next);
+		gradient.swap(nextGradient);
+		value = nextValue;
+
+		result.iterations++;
+		result.trace.push_back(value);
+
+		if (improvement <= options.functionTolerance * std::max({std::abs(value), std::abs(value + improvement), 1.0})) {
+			result.converged = true;
+			break;
+		}
+
+		if (monitor && !monitor(result.iterations, value)) {
+			result.abandoned = true;
+			break;
+		}
+	}
+
+	result.params = std::move(x);
+	result.value = value;
+	return result;
+}
+
+/**
+ * Maps the params of a network to the variables an optimizer sees and back.
+ */
+class ParamMapping {
+public:
+	/**
+	 * Create a mapping for params of the given kinds.
+	 */
+	ParamMapping(std::vector<ParamKind> a_kinds, ParamTransform a_transform) : kinds(std::move(a_kinds)), transform(a_transform) {}
+
+	/**
+	 * Get the bounds of the variables.
+	 */
+	void getBounds(std::vector<double>& lower, std::vector<double>& upper) const {
+		double infinity = std::numeric_limits<double>::infinity();
+		lower.assign(kinds.size(), -infinity);
+		upper.assign(kinds.size(), infinity);
+
+		if (transform == ParamTransform::NONE) {
+			for (unsigned int i = 0; i < kinds.size(); i++) {
+				lower[i] = 0;
+				if (kinds[i] == ParamKind::INHERITANCE) {
+					upper[i] = 1;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Convert params to variables. Params on the edge of their bounds are moved slightly inside for the log transform.
+	 */
+	std::vector<double> toVariables(const std::vector<double>& params) const {
+		std::vector<double> result(params);
+		if (transform == ParamTransform::LOG) {
+			const double margin = 1e-8;
+			for (unsigned int i = 0; i < kinds.size(); i++) {
+				if (kinds[i] == ParamKind::LENGTH) {
+					result[i] = std::log(std::max(params[i], margin));
+				} else {
+					double p = std::min(1 - margin, std::max(margin, params[i]));
+					result[i] = std::log(p / (1 - p));
+				}
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * Convert variables to params.
+	 */
+	std::vector<double> toParams(const std::vector<double>& variables) const {
+		std::vector<double> result(variables);
+		if (transform == ParamTransform::LOG) {
+			for (unsigned int i = 0; i < kinds.size(); i++) {
+				if (kinds[i] == ParamKind::LENGTH) {
+					result[i] = std::exp(variables[i]);
+				} else {
+					result[i] = 1 / (1 + std::exp(-variables[i]));
+				}
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * Turn derivatives with respect to params into derivatives with respect to the variables, in place.
+	 */
+	void chainDerivatives(const std::vector<double>& params, std::vector<double>& derivatives) const {
+		if (transform == ParamTransform::LOG) {
+			for (unsigned int i = 0; i < kinds.size(); i++) {
+				if (kinds[i] == ParamKind::LENGTH) {
+					derivatives[i] *= params[i];
+				} else {
+					derivatives[i] *= params[i] * (1 - params[i]);
+				}
+			}
+		}
+	}
+
+private:
+	std::vector<ParamKind> kinds;
+	ParamTransform transform;
+};
+
+/**
+ * Find the params of a network that maximize the weighted log likelihood of a batch of gene trees, starting from start.
+ * Lengths stay at least 0 and left probabilities between 0 and 1, either as bounds or through the log transform.
+ * The result holds the best params, with value being the negative log likelihood there.
+ * If monitor is set, it sees the negative log likelihood after every iteration and can stop early.
+ * With float histories the search runs in float, and then the value at the best params is computed again in double.
+ */
+inline OptimizerResult maximizeLogLikelihood(const PreparedNetwork& network, const GeneTreeBatch& batch, const std::vector<double>& start, const OptimizerOptions& options = OptimizerOptions(), const OptimizerMonitor& monitor = nullptr) {
+	ParamMapping mapping(getParamKinds(network), options.transform);
+
+	std::vector<double> lower;
+	std::vector<double> upper;
+	mapping.getBounds(lower, upper);
+
+	// Each step prunes against the probabilities of the last one
+	PrecisionOptions precision = options.precision;
+	std::vector<double> treeProbabilities;
+	if (precision.treeProbabilities == nullptr) {
+		precision.treeProbabilities = &treeProbabilities;
+	}
+
+	int fallbacks = 0;
+	Objective objective = [&](const std::vector<double>& variables, std::vector<double>& gradient) {
+		std::vector<double> params = mapping.toParams(variables);
+
+		PrecisionReport report;
+		double logLikelihood = calcLogLikelihood(network, batch, params.data(), precision, &report, &gradient);
+		fallbacks += report.fellBack;
+
+		mapping.chainDerivatives(params, gradient);
+		for (double& derivative : gradient) {
+			derivative = -derivative;
+		}
+		return -logLikelihood;
+	};
+
+	OptimizerResult result = minimizeBounded(objective, mapping.toVariables(start), lower, upper, options, monitor);
+	result.params = mapping.toParams(result.params);
+	result.fallbacks = fallbacks;
+
+	if (options.precision.precision != HistoryPrecision::DOUBLE || options.precision.pruneTolerance > 0) {
+		result.value = -calcLogLikelihood(network, batch, result.params.data());
+	}
+	return result;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cstdlib>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+/**
+ * Get the number of threads to use for parallel work.
+ * NETWORKPROB_THREADS overrides the number of cores.
+ */
+inline int getNumThreads() {
+	const char* value = std::getenv("NETWORKPROB_THREADS");
+	if (value != nullptr && std::atoi(value) > 0) {
+		return std::atoi(value);
+	}
+
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Check if the current thread is already doing parallel work.
+ * Parallel helpers called from inside parallel work run on the calling thread, so nesting never oversubscribes the cores.
+ */
+inline bool& isInsideParallel() {
+	static thread_local bool inside = false;
+	return inside;
+}
+
+/**
+ * Worker threads that live as long as the process, so parallel work doesn't pay for starting threads every call.
+ * It starts empty and gains workers as calls need them, up to one less than the most tasks run at once.
+ */
+class ThreadPool {
+public:
+	/**
+	 * Get the pool shared by every parallel helper.
+	 */
+	static ThreadPool& getInstance() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		available.notify_all();
+
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	/**
+	 * Call task(i) for every i in [0, numTasks), doing task 0 on the calling thread and the rest on workers.
+	 * Returns once every task is done.
+	 */
+	void run(int numTasks, const std::function<void(int)>& task) {
+		int remaining = numTasks - 1;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			while ((int) workers.size() < numTasks - 1) {
+				workers.emplace_back([this]() {
+					work();
+				});
+			}
+
+			for (int i = 1; i < numTasks; i++) {
+				queue.push_back([this, &task, &remaining, i]() {
+					task(i);
+
+					std::lock_guard<std::mutex> lock(mutex);
+					if (--remaining == 0) {
+						finished.notify_all();
+					}
+				});
+			}
+		}
+		available.notify_all();
+
+		task(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [&remaining]() {
+			return remaining <= 0;
+		});
+	}
+
+	/**
+	 * Get the number of worker threads started so far.
+	 */
+	int getNumWorkers() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return workers.size();
+	}
+
+private:
+	ThreadPool() : stopping(false) {}
+
+	/**
+	 * Take tasks off the queue until the pool is destroyed.
+	 */
+	void work() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			available.wait(lock, [this]() {
+				return stopping || !queue.empty();
+			});
+			if (queue.empty()) {
+				return;
+			}
+
+			std::function<void()> next = std::move(queue.front());
+			queue.pop_front();
+
+			lock.unlock();
+			next();
+			lock.lock();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable available; // Signalled when tasks are queued or the pool stops.
+	std::condition_variable finished; // Signalled when the last task of a run is done.
+	std::deque<std::function<void()>> queue;
+	std::vector<std::thread> workers;
+	bool stopping;
+};
+
+/**
+ * Split [0, n) into one contiguous chunk per thread and call f(thread, begin, end) for each.
+ * Chunks are in order, so results collected per thread can be joined in order.
+ * Returns the number of chunks.
+ */
+template<typename F>
+int parallelChunks(int n, F f) {
+	int numChunks = isInsideParallel() ? 1 : std::max(1, std::min(getNumThreads(), n));
+
+	auto runChunk = [&f, n, numChunks](int chunk) {
+		bool wasInside = isInsideParallel();
+		isInsideParallel() = numChunks > 1 || wasInside;
+		f(chunk, (int) ((long long) n * chunk / numChunks), (int) ((long long) n * (chunk + 1) / numChunks));
+		isInsideParallel() = wasInside;
+	};
+
+	// The calling thread does the first chunk itself, and the pool's workers do the rest
+	if (numChunks == 1) {
+		runChunk(0);
+	} else {
+		ThreadPool::getInstance().run(numChunks, runChunk);
+	}
+
+	return numChunks;
+}
+
+/**
+ * Call f(i) for every i in [0, n) across threads.
+ */
+template<typename F>
+void parallelFor(int n, F f) {
+	parallelChunks(n, [&f](int, int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			f(i);
+		}
+	});
+}
+
+/**
+ * Call f(i) for every i in [0, n), with threads taking the next task as soon as they finish one.
+ * Better than parallelFor when tasks take very different amounts of time.
+ */
+template<typename F>
+void parallelTasks(int n, F f) {
+	std::atomic<int> nextTask(0);
+
+	parallelChunks(std::min(n, getNumThreads()), [&](int, int, int) {
+		for (int i = nextTask++; i < n; i = nextTask++) {
+			f(i);
+		}
+	});
+}
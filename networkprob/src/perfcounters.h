@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * The hardware events PerfCounters can count.
+ */
+enum class PerfCounter : int32_t {
+	CYCLES = 0,
+	INSTRUCTIONS = 1,
+	L1_MISSES = 2,
+	LLC_MISSES = 3,
+	BRANCH_MISSES = 4,
+};
+
+const int numPerfCounters = 5;
+
+/**
+ * Get the name of a counter for printing.
+ */
+inline const char* getPerfCounterName(int counter) {
+	static const char* names[numPerfCounters] = {"cycles", "instructions", "l1_misses", "llc_misses", "branch_misses"};
+	return counter >= 0 && counter < numPerfCounters ? names[counter] : "unknown";
+}
+
+/**
+ * Counts hardware events on the calling thread, and threads it starts, with Linux perf_event_open.
+ * Each counter is opened on its own, so a machine that lacks one still gets the rest.
+ * When perf events aren't permitted, or off Linux, nothing is available and every value is -1.
+ */
+class PerfCounters {
+public:
+	PerfCounters() {
+		fds.fill(-1);
+
+#ifdef __linux__
+		const uint64_t l1ReadMiss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		const uint32_t types[numPerfCounters] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+		const uint64_t configs[numPerfCounters] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, l1ReadMiss, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+		for (int i = 0; i < numPerfCounters; i++) {
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+			if (fds[i] < 0 && error.empty()) {
+				error = std::string(getPerfCounterName(i)) + ": " + std::strerror(errno);
+			}
+		}
+#else
+		error = "perf events need Linux";
+#endif
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	~PerfCounters() {
+#ifdef __linux__
+		for (int fd : fds) {
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+#endif
+	}
+
+	/**
+	 * Check if a counter could be opened.
+	 */
+	bool isAvailable(int counter) const {
+		return fds[counter] >= 0;
+	}
+
+	/**
+	 * Check if any counter could be opened.
+	 */
+	bool isAnyAvailable() const {
+		for (int i = 0; i < numPerfCounters; i++) {
+			if (isAvailable(i)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Get why the first counter that failed couldn't be opened, or an empty string.
+	 */
+	const std::string& getError() const {
+		return error;
+	}
+
+	/**
+	 * Reset every counter and start counting.
+	 */
+	void start() {
+#ifdef __linux__
+		for (int fd : fds) {
+			if (fd >= 0) {
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	/**
+	 * Stop counting and get the count of every event since start, or -1 for counters that aren't available.
+	 * Counts are scaled up when the kernel had to share the hardware between events.
+	 */
+	std::array<double, numPerfCounters> stop() {
+		std::array<double, numPerfCounters> result;
+		result.fill(-1);
+
+#ifdef __linux__
+		for (int fd : fds) {
+			if (fd >= 0) {
+				ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			}
+		}
+
+		for (int i = 0; i < numPerfCounters; i++) {
+			uint64_t values[3]; // The count, the time enabled and the time running
+			if (fds[i] >= 0 && read(fds[i], values, sizeof(values)) == sizeof(values) && values[2] > 0) {
+				result[i] = (double) values[0] * values[1] / values[2];
+			}
+		}
+#endif
+
+		return result;
+	}
+
+private:
+	std::array<int, numPerfCounters> fds;
+	std::string error;
+};
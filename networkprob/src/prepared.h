@@ -0,0 +1,1434 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <iostream>
+#include <array>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+
+#include "densemap.h"
+#include "mathutils.h"
+#include "netnode.h"
+#include "treenode.h"
+#include "arena.h"
+#include "bumparena.h"
+#include "stats.h"
+#include "trace.h"
+
+/**
+ * An edge in a prepared network.
+ */
+struct PreparedEdge {
+	int node; // The index of the node it points to.
+	int paramId; // The index in the params vector for the length, or -1 for an infinite edge.
+	EdgeType type; // Which output of the node it reads.
+};
+
+/**
+ * A node in a prepared network.
+ */
+struct PreparedNetNode {
+	NodeType type;
+	int leafIndex; // For leaves, the index in leafNames.
+	int netNodeIndex; // For network nodes, the index in the choices.
+	int introgressionId; // For network nodes, the index in the params vector for the left probability.
+	PreparedEdge edges[2]; // Tree nodes use both, network nodes only use the first.
+};
+
+/**
+ * A network flattened once for repeated evaluation.
+ * Children always come before their parents and the root is last.
+ */
+struct PreparedNetwork {
+	std::vector<PreparedNetNode> nodes;
+	std::vector<std::string> leafNames;
+	int numNetNodes = 0;
+	int numParams = 0;
+	std::vector<double> params; // The params the network had when it was prepared.
+	std::vector<int> streamingOrder; // The order streaming evaluations compute the nodes in, see computeStreamingOrder.
+	std::vector<char> closed; // For each node, if its outputs are whole probabilities, see computeClosedNodes.
+};
+
+/**
+ * Find the nodes whose outputs are whole probabilities. A split leaves half of each history on either side,
+ * so a node is only closed if every network node below it has both of its parents below it too.
+ * A history at a closed node is the probability of everything below it, and can't add more than that to the root.
+ */
+inline std::vector<char> computeClosedNodes(const PreparedNetwork& network) {
+	int numNodes = network.nodes.size();
+	std::vector<std::vector<int>> parents(numNodes);
+	std::vector<std::vector<bool>> below(numNodes, std::vector<bool>(numNodes, false));
+
+	for (int i = 0; i < numNodes; i++) {
+		const PreparedNetNode& node = network.nodes[i];
+		int numEdges = node.type == NodeType::TREE ? 2 : node.type == NodeType::NETWORK ? 1 : 0;
+
+		below[i][i] = true;
+		for (int j = 0; j < numEdges; j++) {
+			int child = node.edges[j].node;
+			parents[child].push_back(i);
+			for (int k = 0; k < numNodes; k++) {
+				if (below[child][k]) {
+					below[i][k] = true;
+				}
+			}
+		}
+	}
+
+	std::vector<char> result(numNodes, false);
+	for (int i = 0; i < numNodes; i++) {
+		result[i] = network.nodes[i].type != NodeType::NETWORK;
+		for (int k = 0; k < numNodes && result[i]; k++) {
+			if (below[i][k] && network.nodes[k].type == NodeType::NETWORK) {
+				for (int parent : parents[k]) {
+					result[i] = result[i] && below[i][parent];
+				}
+			}
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Order the nodes of a prepared network to keep few outputs alive when each is released as soon as it is consumed.
+ * Like Sethi-Ullman numbering, the child of a tree node that needs more outputs alive at once goes first,
+ * while nothing else is waiting. Network nodes shared by two parents are counted under both, so it is a heuristic.
+ */
+inline std::vector<int> computeStreamingOrder(const PreparedNetwork& network) {
+	std::vector<int> needs(network.nodes.size());
+	for (unsigned int i = 0; i < network.nodes.size(); i++) {
+		const PreparedNetNode& node = network.nodes[i];
+		switch (node.type) {
+			case NodeType::LEAF:
+				needs[i] = 1;
+				break;
+
+			case NodeType::TREE: {
+				int first = needs[node.edges[0].node];
+				int second = needs[node.edges[1].node];
+				needs[i] = std::max(std::max(first, second), std::min(first, second) + 1);
+				break;
+			}
+
+			case NodeType::NETWORK:
+				needs[i] = std::max(needs[node.edges[0].node], 2);
+				break;
+
+			default:
+				std::cerr<<"Unknown type"<<std::endl;
+				exit(-1);
+		}
+	}
+
+	// Post-order from the root, with the bigger child of each tree node first
+	std::vector<int> result;
+	std::vector<bool> visited(network.nodes.size());
+	std::vector<std::pair<int, bool>> stack = {{(int) network.nodes.size() - 1, false}};
+	while (!stack.empty()) {
+		int index = stack.back().first;
+		bool expanded = stack.back().second;
+		stack.pop_back();
+
+		if (expanded) {
+			result.push_back(index);
+			continue;
+		}
+		if (visited[index]) {
+			continue;
+		}
+		visited[index] = true;
+		stack.push_back({index, true});
+
+		const PreparedNetNode& node = network.nodes[index];
+		if (node.type == NodeType::TREE) {
+			bool leftFirst = needs[node.edges[0].node] >= needs[node.edges[1].node];
+			stack.push_back({node.edges[leftFirst ? 1 : 0].node, false});
+			stack.push_back({node.edges[leftFirst ? 0 : 1].node, false});
+		} else if (node.type == NodeType::NETWORK) {
+			stack.push_back({node.edges[0].node, false});
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Prepare the network at root in an arena for repeated evaluation.
+ */
+inline PreparedNetwork prepareNetwork(const NetworkArena& arena, int32_t root) {
+	TraceSpan span("prepareNetwork");
+	PreparedNetwork result;
+	std::vector<bool> reachable = arena.getReachable(root);
+	std::vector<int> indices(root + 1, -1);
+
+	auto prepareEdge = [&indices](const ArenaEdge& edge) {
+		PreparedEdge prepared = {indices[edge.node], edge.paramId, edge.type};
+		return prepared;
+	};
+
+	// The arena is already in post-order, so only the unreachable nodes need to be dropped
+	for (int32_t i = 0; i <= root; i++) {
+		if (!reachable[i]) {
+			continue;
+		}
+
+		const ArenaNetNode& node = arena.nodes[i];
+		PreparedNetNode prepared = {node.type, -1, -1, -1, {{-1, -1, EdgeType::NORMAL}, {-1, -1, EdgeType::NORMAL}}};
+
+		switch (node.type) {
+			case NodeType::LEAF:
+				prepared.leafIndex = result.leafNames.size();
+				result.leafNames.push_back(arena.getName(i));
+				break;
+
+			case NodeType::TREE:
+				prepared.edges[0] = prepareEdge(node.edges[0]);
+				prepared.edges[1] = prepareEdge(node.edges[1]);
+				break;
+
+			case NodeType::NETWORK:
+				prepared.netNodeIndex = result.numNetNodes++;
+				prepared.introgressionId = node.introgressionId;
+				prepared.edges[0] = prepareEdge(node.edges[0]);
+				break;
+
+			default:
+				std::cerr<<"Unknown type"<<std::endl;
+				exit(-1);
+		}
+
+		indices[i] = result.nodes.size();
+		result.nodes.push_back(prepared);
+	}
+
+	result.numParams = arena.getMaximumParamId(root) + 1;
+	result.params.resize(result.numParams);
+	arena.getParams(root, result.params.data());
+
+	result.streamingOrder = computeStreamingOrder(result);
+
+	result.closed = computeClosedNodes(result);
+
+	return result;
+}
+
+/**
+ * Prepare a network for repeated evaluation.
+ */
+inline PreparedNetwork prepareNetwork(const NetNode& species) {
+	NetworkArena arena;
+	int32_t root = appendNetwork(arena, species);
+	return prepareNetwork(arena, root);
+}
+
+/**
+ * A precomputed step of the BFS in update.
+ */
+struct PreparedTransition {
+	uint8_t reachable; // The history that is reached.
+	uint8_t startingCount; // The number of lineages at the start.
+	uint8_t finalCount; // The number of lineages at the end.
+	double weight; // The number of ways to reach it over the number of options.
+};
+
+/**
+ * The most taxa a gene tree can have, since its events index the 64 histories of a densemap.
+ */
+const int maxGeneTreeLeaves = 7;
+
+/**
+ * A gene tree resolved against a prepared network.
+ * Taxa bits follow the order of the network leaves, and events are numbered like getEvents.
+ */
+struct PreparedGeneTree {
+	std::vector<int> events;
+	std::vector<uint16_t> leafBits; // The taxa bit for each network leaf.
+	uint16_t targetTaxaBits = 0;
+	int numLeaves = 0;
+
+	uint16_t closure[16] = {}; // Each bit along with every bit below it in the gene tree.
+	uint16_t consumed[1 << 6] = {}; // The lineages that are coalesced away in each history.
+
+	// The transitions for a taxa bits and history start at transitionStarts[getTransitionIndex(taxaBits, history)].
+	std::vector<uint32_t> transitionStarts;
+	std::vector<PreparedTransition> transitions;
+
+	/**
+	 * Get the lineages along with every bit below them.
+	 */
+	uint16_t getClosure(uint16_t lineages) const {
+		uint16_t result = 0;
+		while (lineages != 0) {
+			int bit = 31 - __builtin_clz(lineages);
+			lineages ^= (1 << bit);
+			result |= closure[bit];
+		}
+		return result;
+	}
+
+	/**
+	 * Get the index into transitionStarts.
+	 */
+	int getTransitionIndex(uint16_t taxaBits, int history) const {
+		return ((taxaBits >> 6) << events.size()) | history;
+	}
+
+	/**
+	 * Get the first transition from a history.
+	 */
+	const PreparedTransition* beginTransitions(uint16_t taxaBits, int history) const {
+		return transitions.data() + transitionStarts[getTransitionIndex(taxaBits, history)];
+	}
+
+	/**
+	 * Get the end of the transitions from a history.
+	 */
+	const PreparedTransition* endTransitions(uint16_t taxaBits, int history) const {
+		return transitions.data() + transitionStarts[getTransitionIndex(taxaBits, history) + 1];
+	}
+};
+
+/**
+ * Check if a history can occur with the given taxa.
+ * Every event in it must have all of its taxa and all the events below it.
+ */
+inline bool isPossibleHistory(const PreparedGeneTree& tree, uint16_t taxaBits, int history) {
+	for (unsigned int i = 0; i < tree.events.size(); i++) {
+		if ((history & (1 << i)) != 0) {
+			uint16_t below = tree.closure[i];
+			if ((below & 0b0000000000111111 & ~history) != 0 || (below & 0b1111111111000000 & ~taxaBits) != 0) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Fill in the closure, consumed and transition tables of a prepared gene tree.
+ */
+inline void computeTables(PreparedGeneTree& tree) {
+	int numEvents = tree.events.size();
+
+	for (int bit = 6; bit < 16; bit++) {
+		tree.closure[bit] = 1 << bit;
+	}
+
+	// Events are numbered parents first, so go backwards to see the children first
+	for (int i = numEvents - 1; i >= 0; i--) {
+		tree.closure[i] = (1 << i) | tree.getClosure(tree.events[i]);
+	}
+
+	for (int history = 0; history < (1 << numEvents); history++) {
+		for (int i = 0; i < numEvents; i++) {
+			if ((history & (1 << i)) != 0) {
+				tree.consumed[history] |= tree.events[i];
+			}
+		}
+	}
+
+	tree.transitionStarts.clear();
+	tree.transitions.clear();
+
+	for (int leaves = 0; leaves < (1 << tree.numLeaves); leaves++) {
+		uint16_t taxaBits = leaves << 6;
+
+		for (int history = 0; history < (1 << numEvents); history++) {
+			tree.transitionStarts.push_back(tree.transitions.size());
+
+			if (!isPossibleHistory(tree, taxaBits, history)) {
+				continue;
+			}
+
+			std::array<int, 1<<6> numberOfWaysToReach = {};
+			uint64_t numberOfWaysBitset = 0;
+
+			std::tie(numberOfWaysToReach, numberOfWaysBitset) = performBFS(history, taxaBits, tree.events);
+
+			while (numberOfWaysBitset != 0) {
+				int reachable = 63 - __builtin_clzll(numberOfWaysBitset);
+				numberOfWaysBitset ^= (1LL << reachable);
+
+				int startingCount = __builtin_popcount(taxaBits) - __builtin_popcount(history);
+				int finalCount = __builtin_popcount(taxaBits) - __builtin_popcount(reachable);
+
+				double weight = (double) numberOfWaysToReach[reachable] / getNumberOfOptions(startingCount, finalCount);
+
+				tree.transitions.push_back({(uint8_t) reachable, (uint8_t) startingCount, (uint8_t) finalCount, weight});
+			}
+		}
+	}
+
+	tree.transitionStarts.push_back(tree.transitions.size());
+}
+
+/**
+ * Give every node in a gene tree its bit, internal nodes in preorder first.
+ * Leaves that are not in the network get bits after the network leaves.
+ */
+inline void assignGeneTreeBits(const TreeArena& arena, int32_t index, const std::map<std::string, int>& networkLeaves, std::vector<int>& bits, int& nextEvent, int& nextExtraLeaf) {
+	const ArenaTreeNode& node = arena.nodes[index];
+
+	if (node.isLeaf()) {
+		auto found = networkLeaves.find(arena.getName(index));
+		if (found != networkLeaves.end()) {
+			bits[index] = 6 + found->second;
+		} else {
+			bits[index] = 6 + nextExtraLeaf++;
+		}
+	} else {
+		bits[index] = nextEvent++;
+		assignGeneTreeBits(arena, node.leftChild, networkLeaves, bits, nextEvent, nextExtraLeaf);
+		assignGeneTreeBits(arena, node.rightChild, networkLeaves, bits, nextEvent, nextExtraLeaf);
+	}
+}
+
+/**
+ * Prepare the gene tree at root in an arena for repeated evaluation against a prepared network.
+ * Returns false, after printing why, if the gene tree can't be evaluated against the network.
+ */
+inline bool prepareGeneTree(const PreparedNetwork& network, const TreeArena& arena, int32_t root, PreparedGeneTree& result) {
+	TraceSpan span("prepareGeneTree");
+	std::map<std::string, int> networkLeaves;
+	for (unsigned int i = 0; i < network.leafNames.size(); i++) {
+		networkLeaves[network.leafNames[i]] = i;
+	}
+
+	std::vector<int> bits(root + 1, -1);
+	int numEvents = 0;
+	int numLeaves = network.leafNames.size();
+	assignGeneTreeBits(arena, root, networkLeaves, bits, numEvents, numLeaves);
+
+	if (numLeaves > maxGeneTreeLeaves) {
+		std::cerr<<"Gene trees and networks can have at most "<<maxGeneTreeLeaves<<" taxa"<<std::endl;
+		return false;
+	}
+
+	result = PreparedGeneTree();
+	result.numLeaves = numLeaves;
+	result.leafBits.assign(network.leafNames.size(), 0);
+	result.events.assign(numEvents, 0);
+
+	for (int32_t i = 0; i <= root; i++) {
+		const ArenaTreeNode& node = arena.nodes[i];
+		int bit = bits[i];
+
+		if (bit == -1) {
+			continue;
+		}
+
+		if (node.isLeaf()) {
+			result.targetTaxaBits |= 1 << bit;
+			if (bit - 6 < (int) network.leafNames.size()) {
+				result.leafBits[bit - 6] = 1 << bit;
+			}
+		} else {
+			result.events[bit] = (1 << bits[node.leftChild]) | (1 << bits[node.rightChild]);
+		}
+	}
+
+	for (unsigned int i = 0; i < network.leafNames.size(); i++) {
+		if (result.leafBits[i] == 0) {
+			std::cerr<<"Network leaf "<<network.leafNames[i]<<" is missing from the gene tree"<<std::endl;
+			return false;
+		}
+	}
+
+	computeTables(result);
+
+	return true;
+}
+
+/**
+ * Prepare a gene tree for repeated evaluation against a prepared network.
+ * Returns false, after printing why, if the gene tree can't be evaluated against the network.
+ */
+inline bool prepareGeneTree(const PreparedNetwork& network, const TreeNode& gene, PreparedGeneTree& result) {
+	TreeArena arena;
+	int32_t root = appendTree(arena, gene);
+	return prepareGeneTree(network, arena, root, result);
+}
+
+/**
+ * The puv values for one edge, computed as they are needed.
+ * If Derivative is true, then the cache holds derivatePuv instead.
+ */
+template<typename Length, bool Derivative>
+class PuvCache {
+public:
+	using Value = decltype(puv(0, 0, std::declval<Length>()));
+
+	/**
+	 * Create a cache for an edge of the given length.
+	 */
+	explicit PuvCache(const Length& a_length) : length(a_length), computed(0) {}
+
+	/**
+	 * Get the value for starting and final lineage counts.
+	 */
+	const Value& get(int startingCount, int finalCount) {
+		int index = startingCount * 8 + finalCount;
+		if ((computed & (1ULL << index)) == 0) {
+			computed |= 1ULL << index;
+			values[index] = compute(startingCount, finalCount, std::integral_constant<bool, Derivative>());
+		}
+		return values[index];
+	}
+
+private:
+	Value compute(int startingCount, int finalCount, std::false_type) const {
+		return puv(startingCount, finalCount, length);
+	}
+
+	Value compute(int startingCount, int finalCount, std::true_type) const {
+		return derivatePuv(startingCount, finalCount, length);
+	}
+
+	const Length& length;
+	uint64_t computed;
+	Value values[8 * 8];
+};
+
+/**
+ * Update a list of densemaps along an edge using the precomputed transitions of a gene tree.
+ */
+template<bool Derivative, typename T, typename A, typename L, typename Length>
+std::vector<basic_densemap<T, A>, L> updateWith(const std::vector<basic_densemap<T, A>, L>& current, const PreparedGeneTree& tree, const Length& length) {
+	PuvCache<Length, Derivative> puvs(length);
+
+	std::vector<basic_densemap<T, A>, L> result(current.get_allocator());
+	result.reserve(current.size());
+
+	for (auto&& map : current) {
+		result.emplace_back();
+		basic_densemap<T, A>& next = result.back();
+		next.init(map.getTaxaBits(), map.choices);
+
+		uint64_t bitset = map.getHistoryBitset();
+		while (bitset != 0) {
+			int history = 63 - __builtin_clzll(bitset);
+			bitset ^= (1LL << history);
+
+			const PreparedTransition* end = tree.endTransitions(map.getTaxaBits(), history);
+
+			for (const PreparedTransition* transition = tree.beginTransitions(map.getTaxaBits(), history); transition != end; ++transition) {
+				T total = map.getHistory(history) * transition->weight * puvs.get(transition->startingCount, transition->finalCount);
+
+				if (total != 0) {
+					next.addToHistory(transition->reachable, total);
+				}
+			}
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Update a list of densemaps along an edge using the precomputed transitions of a gene tree.
+ */
+template<typename T, typename A, typename L, typename Length>
+std::vector<basic_densemap<T, A>, L> update(const std::vector<basic_densemap<T, A>, L>& current, const PreparedGeneTree& tree, const Length& length) {
+	return updateWith<false>(current, tree, length);
+}
+
+/**
+ * Update densemaps where the derivative is taken with respect to the length of the edge.
+ */
+template<typename T, typename A, typename L, typename Length>
+std::vector<basic_densemap<T, A>, L> derivativeUpdate(const std::vector<basic_densemap<T, A>, L>& current, const PreparedGeneTree& tree, const Length& length) {
+	return updateWith<true>(current, tree, length);
+}
+
+/**
+ * What pruning dropped from an evaluation.
+ */
+struct PruneCounters {
+	int64_t histories = 0;
+	int64_t maps = 0;
+	double mass = 0; // The summed probability of every dropped history, which bounds how much the result lost.
+	bool fellBack = false; // Pruning dropped too much, so the result was computed again without it.
+};
+
+/**
+ * Remove the maps of a list whose entry in keep is false.
+ */
+template<typename Maps>
+void removeUnkept(Maps& maps, const std::vector<char>& keep) {
+	unsigned int next = 0;
+	for (unsigned int i = 0; i < maps.size(); i++) {
+		if (keep[i]) {
+			if (next != i) {
+				maps[next] = std::move(maps[i]);
+			}
+			next++;
+		}
+	}
+	maps.erase(maps.begin() + next, maps.end());
+}
+
+/**
+ * Find the value below which the smallest of values add up to at most budget, so dropping everything below it
+ * drops at most budget. Each value comes with the mass dropping it costs. Never drops the largest value.
+ * Sorts values.
+ */
+inline double findPruneThreshold(std::vector<std::pair<double, double>>& values, double budget) {
+	std::sort(values.begin(), values.end());
+
+	double dropped = 0;
+	for (auto&& value : values) {
+		dropped += value.second;
+		if (dropped > budget) {
+			return value.first;
+		}
+	}
+	return values.empty() ? 0 : values.back().first;
+}
+
+/**
+ * Drop the smallest histories of a list of densemaps that together hold at most budget,
+ * along with the maps left without any. keep gets whether each map was kept, or stays empty if none can be dropped.
+ */
+template<typename T, typename A, typename L>
+void prune(std::vector<basic_densemap<T, A>, L>& maps, double budget, std::vector<char>& keep, PruneCounters& counters) {
+	static thread_local std::vector<std::pair<double, double>> values;
+	values.clear();
+
+	double smallest = std::numeric_limits<double>::infinity();
+	for (auto&& map : maps) {
+		uint64_t bitset = map.getHistoryBitset();
+		while (bitset != 0) {
+			int history = 63 - __builtin_clzll(bitset);
+			bitset ^= (1LL << history);
+
+			double value = map.getHistory(history);
+			values.emplace_back(value, value);
+			smallest = std::min(smallest, value);
+		}
+	}
+
+	if (!(smallest <= budget)) {
+		return;
+	}
+
+	keep.assign(maps.size(), true);
+	double threshold = findPruneThreshold(values, budget);
+	for (unsigned int i = 0; i < maps.size(); i++) {
+		uint64_t bitset = maps[i].getHistoryBitset();
+		while (bitset != 0) {
+			int history = 63 - __builtin_clzll(bitset);
+			bitset ^= (1LL << history);
+
+			double value = maps[i].getHistory(history);
+			if (value < threshold) {
+				maps[i].removeHistory(history);
+				counters.histories++;
+				counters.mass += value;
+			}
+		}
+		keep[i] = maps[i].getHistoryBitset() != 0;
+	}
+
+	removeUnkept(maps, keep);
+	counters.maps += std::count(keep.begin(), keep.end(), false);
+}
+
+/**
+ * Keeps every result of a split.
+ */
+struct KeepSplitResults {
+	std::pair<bool, bool> operator()(int, int, int, int) const {
+		return {true, true};
+	}
+
+	KeepSplitResults withoutCounting() const {
+		return *this;
+	}
+};
+
+/**
+ * Drops the results of a split whose pair, the left and right results that meet again above it, is negligible.
+ * A pair holds the history times the chance its lineages split that way, so the pairs of a history add up to it.
+ * Dropping either result of a pair loses it, so every dropped result counts its whole pair, and the smallest
+ * pairs go while that adds up to at most budget. Only use it where the histories are whole probabilities.
+ * Counts what it drops if counters is not nullptr.
+ */
+template<typename Maps>
+class SplitPruner {
+public:
+	SplitPruner(const Maps& a_current, const PreparedGeneTree& tree, double a_leftProbability, double budget, PruneCounters* a_counters) : current(a_current), leftProbability(a_leftProbability), threshold(0), counters(a_counters) {
+		if (budget <= 0) {
+			return;
+		}
+
+		// Every subset of the lineages of a history goes left once, so there are choose(lineages, numLeft) pairs of each size
+		static thread_local std::vector<std::pair<double, double>> pairs;
+		pairs.clear();
+
+		double smallest = std::numeric_limits<double>::infinity();
+		for (auto&& map : current) {
+			uint64_t bitset = map.getHistoryBitset();
+			while (bitset != 0) {
+				int history = 63 - __builtin_clzll(bitset);
+				bitset ^= (1LL << history);
+
+				double value = map.getHistory(history);
+				int numLineages = __builtin_popcount((uint16_t) ((map.getTaxaBits() | history) & ~tree.consumed[history]));
+				double count = 1;
+				for (int numLeft = 0; numLeft <= numLineages; numLeft++) {
+					double pair = getPair(value, numLeft, numLineages);
+					pairs.emplace_back(pair, 2 * pair * count);
+					smallest = std::min(smallest, pair);
+					count = count * (numLineages - numLeft) / (numLeft + 1);
+				}
+			}
+		}
+
+		if (smallest <= budget) {
+			threshold = findPruneThreshold(pairs, budget);
+		}
+	}
+
+	/**
+	 * Get a pruner that drops the same results without counting them, for splitting the derivatives.
+	 */
+	SplitPruner withoutCounting() const {
+		SplitPruner result = *this;
+		result.counters = nullptr;
+		return result;
+	}
+
+	/**
+	 * Check if the left and right results for numLeft of numLineages lineages going left are kept.
+	 * The right result made alongside a left one pairs with the left result of the other lineages.
+	 */
+	std::pair<bool, bool> operator()(int mapIndex, int history, int numLeft, int numLineages) {
+		if (threshold == 0) {
+			return {true, true};
+		}
+
+		double value = current[mapIndex].getHistory(history);
+		double leftPair = getPair(value, numLeft, numLineages);
+		double rightPair = getPair(value, numLineages - numLeft, numLineages);
+
+		std::pair<bool, bool> result(leftPair >= threshold, rightPair >= threshold);
+		if (counters != nullptr) {
+			if (!result.first) {
+				counters->histories++;
+				counters->mass += leftPair;
+			}
+			if (!result.second) {
+				counters->histories++;
+				counters->mass += rightPair;
+			}
+		}
+		return result;
+	}
+
+private:
+	/**
+	 * Get the pair of a history where numLeft of its numLineages lineages go left.
+	 */
+	double getPair(double value, int numLeft, int numLineages) const {
+		return value * leftInheritance(leftProbability, numLeft) * rightInheritance(leftProbability, numLineages - numLeft);
+	}
+
+	const Maps& current;
+	double leftProbability;
+	double threshold;
+	PruneCounters* counters;
+};
+
+/**
+ * Split densemaps at a network node using the precomputed closures of a gene tree.
+ * factors(mapIndex, history, numLeft) gives the values for the left and right results.
+ * Choices record which lineages went left, so the matching left and right results share a choice.
+ * keep(mapIndex, history, numLeft, numLineages) says which of the two results to add.
+ */
+template<typename T, typename A, typename L, typename Factors, typename Keep = KeepSplitResults>
+std::pair<std::vector<basic_densemap<T, A>, L>, std::vector<basic_densemap<T, A>, L>> splitWith(const std::vector<basic_densemap<T, A>, L>& current, int nodeIndex, const PreparedGeneTree& tree, Factors factors, Keep keep = Keep()) {
+	std::vector<basic_densemap<T, A>, L> leftResults(current.get_allocator());
+	std::vector<basic_densemap<T, A>, L> rightResults(current.get_allocator());
+
+	for (unsigned int mapIndex = 0; mapIndex < current.size(); mapIndex++) {
+		const basic_densemap<T, A>& map = current[mapIndex];
+
+		uint64_t bitset = map.getHistoryBitset();
+		while (bitset != 0) {
+			int history = 63 - __builtin_clzll(bitset);
+			bitset ^= (1LL << history);
+
+			int64_t state = map.getTaxaBits() | history;
+			uint16_t lineages = state & ~tree.consumed[history];
+
+			uint16_t subset = lineages;
+			while (true) {
+				uint16_t finalSubset = tree.getClosure(subset);
+				uint16_t taxaBits = finalSubset    & 0b1111111111000000;
+				uint16_t historyBits = finalSubset & 0b0000000000111111;
+
+				int64_t leftChoiceId = state | ((int64_t) subset << 16) | ((int64_t) lineages << 32);
+				int64_t rightChoiceId = state | ((int64_t) (lineages ^ subset) << 16) | ((int64_t) lineages << 32);
+
+				int numLeft = __builtin_popcount(subset);
+				auto values = factors(mapIndex, history, numLeft);
+				std::pair<bool, bool> kept = keep(mapIndex, history, numLeft, __builtin_popcount(lineages));
+				if (kept.first) {
+					addResult(map, leftResults, nodeIndex, taxaBits, historyBits, leftChoiceId, values.first);
+				}
+				if (kept.second) {
+					addResult(map, rightResults, nodeIndex, taxaBits, historyBits, rightChoiceId, values.second);
+				}
+
+				if (subset == 0) {
+					break;
+				}
+				subset = (subset - 1) & lineages;
+			}
+		}
+	}
+
+	return { std::move(leftResults), std::move(rightResults) };
+}
+
+/**
+ * Split densemaps at a network node using the precomputed closures of a gene tree.
+ */
+template<typename T, typename A, typename L, typename Probability, typename Keep = KeepSplitResults>
+std::pair<std::vector<basic_densemap<T, A>, L>, std::vector<basic_densemap<T, A>, L>> split(const std::vector<basic_densemap<T, A>, L>& current, int nodeIndex, const PreparedGeneTree& tree, const Probability& leftProbability, Keep keep = Keep()) {
+	return splitWith(current, nodeIndex, tree, [&](int mapIndex, int history, int numLeft) {
+		using std::sqrt;
+		T root = sqrt(current[mapIndex].getHistory(history));
+		return std::make_pair(T(root * leftInheritance(leftProbability, numLeft)), T(root * rightInheritance(leftProbability, numLeft)));
+	}, keep);
+}
+
+/**
+ * Split the derivatives of densemaps at a network node using the precomputed closures of a gene tree.
+ */
+template<typename T, typename A, typename L, typename Probability, typename Keep = KeepSplitResults>
+std::pair<std::vector<basic_densemap<T, A>, L>, std::vector<basic_densemap<T, A>, L>> splitDerivatives(const std::vector<basic_densemap<T, A>, L>& currentDerivatives, const std::vector<basic_densemap<T, A>, L>& current, int nodeIndex, const PreparedGeneTree& tree, const Probability& leftProbability, Keep keep = Keep()) {
+	return splitWith(current, nodeIndex, tree, [&](int mapIndex, int history, int numLeft) {
+		using std::sqrt;
+		T scale = currentDerivatives[mapIndex].getHistory(history) / (2 * sqrt(current[mapIndex].getHistory(history)));
+		return std::make_pair(T(scale * leftInheritance(leftProbability, numLeft)), T(scale * rightInheritance(leftProbability, numLeft)));
+	}, keep);
+}
+
+/**
+ * Split densemaps where the derivative is taken with respect to the left probability.
+ */
+template<typename T, typename A, typename L, typename Probability, typename Keep = KeepSplitResults>
+std::pair<std::vector<basic_densemap<T, A>, L>, std::vector<basic_densemap<T, A>, L>> splitDerivativeHere(const std::vector<basic_densemap<T, A>, L>& current, int nodeIndex, const PreparedGeneTree& tree, const Probability& leftProbability, Keep keep = Keep()) {
+	return splitWith(current, nodeIndex, tree, [&](int mapIndex, int history, int numLeft) {
+		using std::sqrt;
+		T root = sqrt(current[mapIndex].getHistory(history));
+		return std::make_pair(T(root * leftInheritance(leftProbability, numLeft - 1) * numLeft), T(root * rightInheritance(leftProbability, numLeft - 1) * -numLeft));
+	}, keep);
+}
+
+/**
+ * Params for evaluating a prepared network in double precision.
+ */
+struct DoubleParams {
+	const double* values;
+
+	/**
+	 * Get the length of an edge, where -1 is the infinite root edge.
+	 */
+	double length(int paramId) const {
+		return paramId < 0 ? std::numeric_limits<double>::infinity() : values[paramId];
+	}
+
+	/**
+	 * Get the left probability of a network node.
+	 */
+	double inheritance(int paramId) const {
+		return values[paramId];
+	}
+
+	/**
+	 * Get the probability a leaf starts with.
+	 */
+	double one() const {
+		return 1.0;
+	}
+};
+
+/**
+ * The densemaps of the prepared engine, which live in the arena of their evaluation context.
+ * Maps built without an arena, like cached ones, use the heap.
+ */
+template<typename T>
+using PreparedMap = basic_densemap<T, ArenaAllocator<int64_t>>;
+
+template<typename T>
+using PreparedMaps = std::vector<PreparedMap<T>, ArenaAllocator<PreparedMap<T>>>;
+
+/**
+ * One list of densemaps per param, for derivatives.
+ */
+template<typename T>
+using PreparedMapSets = std::vector<PreparedMaps<T>, ArenaAllocator<PreparedMaps<T>>>;
+
+/**
+ * Everything computed for one node of a prepared network.
+ */
+template<typename T>
+struct PreparedNodeData {
+	/**
+	 * Create empty data on the heap.
+	 */
+	PreparedNodeData() {}
+
+	/**
+	 * Create empty data that allocates with allocator.
+	 */
+	explicit PreparedNodeData(const ArenaAllocator<int64_t>& allocator) : currentData(allocator), derivatives(allocator), leftData(allocator), rightData(allocator), leftDerivatives(allocator), rightDerivatives(allocator) {}
+
+	PreparedMaps<T> currentData;
+	PreparedMapSets<T> derivatives;
+
+	PreparedMaps<T> leftData;
+	PreparedMaps<T> rightData;
+
+	PreparedMapSets<T> leftDerivatives;
+	PreparedMapSets<T> rightDerivatives;
+
+	/**
+	 * Get the data flowing out along an edge of the given type.
+	 */
+	const PreparedMaps<T>& getData(EdgeType type) const {
+		switch (type) {
+			case EdgeType::NORMAL:
+				return currentData;
+			case EdgeType::LEFT:
+				return leftData;
+			case EdgeType::RIGHT:
+				return rightData;
+
+			default:
+				std::cerr<<"Unknown type"<<std::endl;
+				exit(-1);
+		}
+	}
+
+	/**
+	 * Get the derivatives flowing out along an edge of the given type.
+	 */
+	const PreparedMapSets<T>& getDataDerivative(EdgeType type) const {
+		switch (type) {
+			case EdgeType::NORMAL:
+				return derivatives;
+			case EdgeType::LEFT:
+				return leftDerivatives;
+			case EdgeType::RIGHT:
+				return rightDerivatives;
+
+			default:
+				std::cerr<<"Unknown type"<<std::endl;
+				exit(-1);
+		}
+	}
+
+	/**
+	 * Count the maps held in every output and its derivatives.
+	 */
+	size_t countMaps() const {
+		size_t result = currentData.size() + leftData.size() + rightData.size();
+		for (const PreparedMapSets<T>* sets : {&derivatives, &leftDerivatives, &rightDerivatives}) {
+			for (auto&& maps : *sets) {
+				result += maps.size();
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * Free the output along an edge of the given type, and its derivatives, once its parent is done with them.
+	 */
+	void release(EdgeType type) {
+		switch (type) {
+			case EdgeType::NORMAL:
+				release(currentData, derivatives);
+				break;
+			case EdgeType::LEFT:
+				release(leftData, leftDerivatives);
+				break;
+			case EdgeType::RIGHT:
+				release(rightData, rightDerivatives);
+				break;
+
+			default:
+				std::cerr<<"Unknown type"<<std::endl;
+				exit(-1);
+		}
+	}
+
+private:
+	/**
+	 * Free an output and its derivatives, capacity included.
+	 */
+	static void release(PreparedMaps<T>& data, PreparedMapSets<T>& derivative) {
+		PreparedMaps<T>(data.get_allocator()).swap(data);
+		PreparedMapSets<T>(derivative.get_allocator()).swap(derivative);
+	}
+};
+
+/**
+ * Check if evaluations stream by default, releasing every node output as soon as it is consumed.
+ * NETWORKPROB_STREAMING=1 turns it on at startup.
+ */
+inline std::atomic<bool>& getStreamingEvaluation() {
+	static std::atomic<bool> streaming(std::getenv("NETWORKPROB_STREAMING") != nullptr && std::atoi(std::getenv("NETWORKPROB_STREAMING")) > 0);
+	return streaming;
+}
+
+/**
+ * Reusable storage for evaluating prepared networks.
+ * Each thread needs its own context.
+ */
+template<typename T>
+struct EvaluationContext {
+	BumpArena arena; // Holds every densemap of the current evaluation. It comes first so the nodes go before it.
+	std::vector<PreparedNodeData<T>> nodes;
+	StatsRecorder stats; // Counts what evaluations with this context do when NETWORKPROB_STATS is set.
+
+	// Streaming evaluations free every node output once its parents are done with it, and compute the nodes
+	// in the network's streamingOrder. They use the heap instead of the arena so freed memory is reused right away.
+	bool streaming = false;
+
+	size_t liveMaps = 0; // The maps held in node outputs right now.
+	size_t peakLiveMaps = 0; // The most maps held in node outputs at once during the last evaluation.
+
+	// When both are above 0, evaluations drop histories that together can't change the probability by more than
+	// pruneTolerance times it. pruneScale is what the probability is expected to be, usually the last one computed
+	// for the same gene tree, and the histories are dropped against it, so if it is much too high the evaluation
+	// drops too much and has to be done again without pruning. pruned gets what the last evaluation dropped.
+	double pruneTolerance = 0;
+	double pruneScale = 0;
+	PruneCounters pruned;
+
+	/**
+	 * Drop everything from the last evaluation and get empty data for numNodes nodes.
+	 */
+	void reset(int numNodes) {
+		nodes.clear();
+		arena.reset();
+		liveMaps = 0;
+		peakLiveMaps = 0;
+		pruned = PruneCounters();
+
+		for (int i = 0; i < numNodes; i++) {
+			nodes.emplace_back(getAllocator());
+		}
+	}
+
+	/**
+	 * Check if the current evaluation streams, because this context or the process asks for it.
+	 */
+	bool isStreaming() const {
+		return streaming || getStreamingEvaluation().load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Get an allocator for the arena, or for the heap when streaming.
+	 */
+	ArenaAllocator<int64_t> getAllocator() {
+		return isStreaming() ? ArenaAllocator<int64_t>() : ArenaAllocator<int64_t>(&arena);
+	}
+
+	/**
+	 * Account for maps that node outputs gained, or lost if negative.
+	 */
+	void addLiveMaps(ptrdiff_t count) {
+		liveMaps += count;
+		peakLiveMaps = std::max(peakLiveMaps, liveMaps);
+	}
+};
+
+/**
+ * Evaluates a prepared gene tree against a prepared network in a single pass over the nodes.
+ * Params supplies edge lengths, left probabilities and the starting value of leaves.
+ * Derivative code is only instantiated when Derivatives is true, so T only needs derivatives support then.
+ */
+template<typename T, typename Params, bool Derivatives>
+class PreparedEvaluator {
+public:
+	using DerivativeTag = std::integral_constant<bool, Derivatives>;
+	using PruneTag = std::integral_constant<bool, std::is_floating_point<T>::value>; // Only plain numbers can be compared to prune.
+
+	/**
+	 * Create an evaluator.
+	 */
+	PreparedEvaluator(const PreparedNetwork& a_network, const PreparedGeneTree& a_tree, const Params& a_params, EvaluationContext<T>& a_context) : network(a_network), tree(a_tree), params(a_params), context(a_context), numDerivativeParams(Derivatives ? a_network.numParams : 0) {}
+
+	/**
+	 * Compute the probability, and the derivatives if Derivatives is true.
+	 */
+	T run(std::vector<T>* derivatives) {
+		pruning = PruneTag::value && context.pruneTolerance > 0 && context.pruneScale > 0;
+		T result = computeAll(derivatives);
+
+		// The dropped mass bounds the error, so if it is too much compared to the result do it all again without pruning
+		if (pruning && isPrunedTooMuch(result, PruneTag())) {
+			pruning = false;
+			result = computeAll(derivatives);
+			context.pruned.fellBack = true;
+		}
+
+		return result;
+	}
+
+	/**
+	 * Get the context ready for computing nodes one at a time.
+	 */
+	void start() {
+		context.reset(network.nodes.size());
+		context.stats.startEvaluation();
+	}
+
+	/**
+	 * Compute the values for a node, assuming its children are already done.
+	 */
+	void computeNode(int index) {
+		computeDenseMap(index);
+	}
+
+	/**
+	 * Compute the probability from the root, and the derivatives if Derivatives is true.
+	 * Every child of the root must be done.
+	 */
+	T finish(std::vector<T>* derivatives) {
+		PreparedEdge rootEdge = {(int) network.nodes.size() - 1, -1, EdgeType::NORMAL};
+		PreparedMaps<T> root = getEdgeData(rootEdge, rootEdge.node);
+
+		T probability = T();
+		for (auto&& map : root) {
+			if (map.getTaxaBits() == tree.targetTaxaBits) {
+				probability += map.getHistory(getFinalHistory());
+			}
+		}
+
+		computeRootDerivatives(rootEdge, derivatives, DerivativeTag());
+
+		return probability;
+	}
+
+private:
+	/**
+	 * Compute every node and then the probability.
+	 */
+	T computeAll(std::vector<T>* derivatives) {
+		start();
+
+		if (context.isStreaming()) {
+			for (int index : network.streamingOrder) {
+				computeDenseMap(index);
+				releaseInputs(index);
+			}
+		} else {
+			for (unsigned int i = 0; i < network.nodes.size(); i++) {
+				computeDenseMap(i);
+			}
+		}
+
+		return finish(derivatives);
+	}
+
+	bool isPrunedTooMuch(const T&, std::false_type) const {
+		return false;
+	}
+
+	/**
+	 * Check if the mass pruning dropped is more than the tolerance allows for the result.
+	 */
+	bool isPrunedTooMuch(const T& result, std::true_type) const {
+		return context.pruned.mass > context.pruneTolerance * result;
+	}
+
+	/**
+	 * Get how much more mass pruning can drop. Half the tolerance is spent, so an evaluation only falls back when
+	 * the probability comes out below half of pruneScale.
+	 */
+	double getPruneBudget() const {
+		return context.pruneTolerance * context.pruneScale / 2 - context.pruned.mass;
+	}
+
+	void pruneEdgeData(const PreparedEdge&, int, PreparedMaps<T>&, std::vector<char>&, std::false_type) {}
+
+	/**
+	 * Prune the data flowing up through an edge if its child is closed, from what is left of the budget.
+	 * keep gets which maps were kept, or stays empty if nothing was pruned.
+	 */
+	void pruneEdgeData(const PreparedEdge& edge, int parent, PreparedMaps<T>& data, std::vector<char>& keep, std::true_type) {
+		if (!pruning || !network.closed[edge.node]) {
+			return;
+		}
+
+		TraceSpan span("prune", parent);
+		size_t before = data.size();
+		prune(data, getPruneBudget(), keep, context.pruned);
+		if (data.size() == before) {
+			keep.clear();
+		}
+	}
+
+	template<typename Probability>
+	KeepSplitResults makeSplitPruner(const PreparedNetNode&, const PreparedMaps<T>&, const Probability&, std::false_type) {
+		return KeepSplitResults();
+	}
+
+	/**
+	 * Get what drops the negligible results of splitting child at a network node, which is nothing unless child is closed.
+	 */
+	SplitPruner<PreparedMaps<T>> makeSplitPruner(const PreparedNetNode& node, const PreparedMaps<T>& child, double leftProbability, std::true_type) {
+		double budget = pruning && network.closed[node.edges[0].node] ? getPruneBudget() : 0;
+		return SplitPruner<PreparedMaps<T>>(child, tree, leftProbability, budget, &context.pruned);
+	}
+
+	/**
+	 * Free the outputs a node read from its children, which nothing else reads.
+	 */
+	void releaseInputs(int index) {
+		const PreparedNetNode& node = network.nodes[index];
+		int numEdges = node.type == NodeType::TREE ? 2 : node.type == NodeType::NETWORK ? 1 : 0;
+
+		for (int i = 0; i < numEdges; i++) {
+			PreparedNodeData<T>& child = context.nodes[node.edges[i].node];
+			size_t before = child.countMaps();
+			child.release(node.edges[i].type);
+			context.addLiveMaps((ptrdiff_t) child.countMaps() - (ptrdiff_t) before);
+		}
+	}
+
+	/**
+	 * Get the history where every event has happened.
+	 */
+	int getFinalHistory() const {
+		return (1 << tree.events.size()) - 1;
+	}
+
+	/**
+	 * Get the data flowing up through an edge into the node with index parent.
+	 */
+	PreparedMaps<T> getEdgeData(const PreparedEdge& edge, int parent) {
+		const PreparedMaps<T>& child = context.nodes[edge.node].getData(edge.type);
+
+		TraceSpan span("update", parent);
+		auto started = context.stats.start();
+		PreparedMaps<T> result = update(child, tree, params.length(edge.paramId));
+		context.stats.record(DensemapOperation::UPDATE, parent, child.size(), result, 0, started);
+
+		return result;
+	}
+
+	/**
+	 * Get the derivatives flowing up through an edge into the node with index parent.
+	 */
+	PreparedMapSets<T> getEdgeDerivatives(const PreparedEdge& edge, int parent) {
+		const PreparedNodeData<T>& node = context.nodes[edge.node];
+		auto length = params.length(edge.paramId);
+
+		TraceSpan span("derivativeUpdate", parent);
+		PreparedMapSets<T> result(numDerivativeParams, context.getAllocator());
+		for (int i = 0; i < numDerivativeParams; i++) {
+			auto started = context.stats.start();
+			if (i == edge.paramId) {
+				// The derivative originates here
+				result[i] = derivativeUpdate(node.getData(edge.type), tree, length);
+				context.stats.record(DensemapOperation::DERIVATIVE_UPDATE, parent, node.getData(edge.type).size(), result[i], 0, started);
+			} else {
+				result[i] = update(node.getDataDerivative(edge.type)[i], tree, length);
+				context.stats.record(DensemapOperation::DERIVATIVE_UPDATE, parent, node.getDataDerivative(edge.type)[i].size(), result[i], 0, started);
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * Compute the values for a node, assuming its children are already done.
+	 */
+	void computeDenseMap(int index) {
+		TraceSpan span("node", index);
+		const PreparedNetNode& node = network.nodes[index];
+		PreparedNodeData<T>& data = context.nodes[index];
+		size_t before = data.countMaps();
+
+		if (node.type == NodeType::LEAF) {
+			data.currentData.resize(1);
+			data.currentData[0].initLeaf(tree.leafBits[node.leafIndex], network.numNetNodes);
+			data.currentData[0].setHistory(0, params.one());
+
+			computeLeafDerivatives(node, data, DerivativeTag());
+		} else if (node.type == NodeType::TREE) {
+			PreparedMaps<T> left = getEdgeData(node.edges[0], index);
+			PreparedMaps<T> right = getEdgeData(node.edges[1], index);
+
+			std::vector<char> leftKeep;
+			std::vector<char> rightKeep;
+			pruneEdgeData(node.edges[0], index, left, leftKeep, PruneTag());
+			pruneEdgeData(node.edges[1], index, right, rightKeep, PruneTag());
+
+			TraceSpan combineSpan("combine", index);
+			auto started = context.stats.start();
+			data.currentData = combine(left, right);
+			context.stats.record(DensemapOperation::COMBINE, index, left.size() + right.size(), data.currentData, left.size() * right.size(), started);
+			combineSpan.end();
+
+			computeTreeDerivatives(index, node, data, left, right, leftKeep, rightKeep, DerivativeTag());
+		} else if (node.type == NodeType::NETWORK) {
+			PreparedMaps<T> child = getEdgeData(node.edges[0], index);
+			std::vector<char> childKeep;
+			pruneEdgeData(node.edges[0], index, child, childKeep, PruneTag());
+
+			auto leftProbability = params.inheritance(node.introgressionId);
+
+			TraceSpan splitSpan("split", index);
+			auto started = context.stats.start();
+			auto pruner = makeSplitPruner(node, child, leftProbability, PruneTag());
+			std::tie(data.leftData, data.rightData) = split(child, node.netNodeIndex, tree, leftProbability, pruner);
+			context.stats.record(DensemapOperation::SPLIT, index, child.size(), data.leftData, data.rightData, started);
+			splitSpan.end();
+
+			computeNetworkDerivatives(index, node, data, child, childKeep, leftProbability, pruner.withoutCounting(), DerivativeTag());
+		}
+
+		context.addLiveMaps((ptrdiff_t) data.countMaps() - (ptrdiff_t) before);
+	}
+
+	void computeRootDerivatives(const PreparedEdge&, std::vector<T>*, std::false_type) {}
+
+	/**
+	 * Sum up the derivatives flowing out of the root.
+	 */
+	void computeRootDerivatives(const PreparedEdge& rootEdge, std::vector<T>* derivatives, std::true_type) {
+		auto derivativeRoot = getEdgeDerivatives(rootEdge, rootEdge.node);
+
+		derivatives->assign(numDerivativeParams, T());
+		for (int i = 0; i < numDerivativeParams; i++) {
+			for (auto&& map : derivativeRoot[i]) {
+				if (map.getTaxaBits() == tree.targetTaxaBits) {
+					(*derivatives)[i] += map.getHistory(getFinalHistory());
+				}
+			}
+		}
+	}
+
+	void computeLeafDerivatives(const PreparedNetNode&, PreparedNodeData<T>&, std::false_type) {}
+
+	/**
+	 * Leaves don't depend on any params, so their derivatives are empty.
+	 */
+	void computeLeafDerivatives(const PreparedNetNode& node, PreparedNodeData<T>& data, std::true_type) {
+		data.derivatives.resize(numDerivativeParams);
+		for (int i = 0; i < numDerivativeParams; i++) {
+			data.derivatives[i].resize(1);
+			data.derivatives[i][0].initLeaf(tree.leafBits[node.leafIndex], network.numNetNodes);
+		}
+	}
+
+	void computeTreeDerivatives(int, const PreparedNetNode&, PreparedNodeData<T>&, const PreparedMaps<T>&, const PreparedMaps<T>&, const std::vector<char>&, const std::vector<char>&, std::false_type) {}
+
+	/**
+	 * Combine the derivatives of both children of a tree node, dropping the maps pruning dropped from them.
+	 */
+	void computeTreeDerivatives(int index, const PreparedNetNode& node, PreparedNodeData<T>& data, const PreparedMaps<T>& left, const PreparedMaps<T>& right, const std::vector<char>& leftKeep, const std::vector<char>& rightKeep, std::true_type) {
+		auto leftDerivatives = getEdgeDerivatives(node.edges[0], index);
+		auto rightDerivatives = getEdgeDerivatives(node.edges[1], index);
+		removePruned(leftDerivatives, leftKeep);
+		removePruned(rightDerivatives, rightKeep);
+
+		TraceSpan span("combineDerivatives", index);
+		data.derivatives.resize(numDerivativeParams);
+		for (int i = 0; i < numDerivativeParams; i++) {
+			auto started = context.stats.start();
+			data.derivatives[i] = combineDerivatives(left, leftDerivatives[i], right, rightDerivatives[i]);
+			context.stats.record(DensemapOperation::COMBINE_DERIVATIVES, index, leftDerivatives[i].size() + rightDerivatives[i].size(), data.derivatives[i], left.size() * right.size(), started);
+		}
+	}
+
+	template<typename Probability, typename Keep>
+	void computeNetworkDerivatives(int, const PreparedNetNode&, PreparedNodeData<T>&, const PreparedMaps<T>&, const std::vector<char>&, const Probability&, const Keep&, std::false_type) {}
+
+	/**
+	 * Split the derivatives of the child of a network node, dropping the maps pruning dropped from it
+	 * and the split results keep dropped from its data.
+	 */
+	template<typename Probability, typename Keep>
+	void computeNetworkDerivatives(int index, const PreparedNetNode& node, PreparedNodeData<T>& data, const PreparedMaps<T>& child, const std::vector<char>& childKeep, const Probability& leftProbability, const Keep& keep, std::true_type) {
+		auto childDerivatives = getEdgeDerivatives(node.edges[0], index);
+		removePruned(childDerivatives, childKeep);
+
+		TraceSpan span("splitDerivatives", index);
+		data.leftDerivatives.resize(numDerivativeParams);
+		data.rightDerivatives.resize(numDerivativeParams);
+
+		for (int i = 0; i < numDerivativeParams; i++) {
+			auto started = context.stats.start();
+			if (i == node.introgressionId) {
+				std::tie(data.leftDerivatives[i], data.rightDerivatives[i]) = splitDerivativeHere(child, node.netNodeIndex, tree, leftProbability, keep);
+			} else {
+				std::tie(data.leftDerivatives[i], data.rightDerivatives[i]) = splitDerivatives(childDerivatives[i], child, node.netNodeIndex, tree, leftProbability, keep);
+			}
+			context.stats.record(DensemapOperation::SPLIT_DERIVATIVES, index, childDerivatives[i].size(), data.leftDerivatives[i], data.rightDerivatives[i], started);
+		}
+	}
+
+	/**
+	 * Remove the maps pruning dropped from the data of an edge from its derivatives, so they stay in step.
+	 * The derivatives of dropped histories stay, but every operation only visits the histories of the data.
+	 */
+	void removePruned(PreparedMapSets<T>& derivatives, const std::vector<char>& keep) {
+		if (!keep.empty()) {
+			for (auto&& maps : derivatives) {
+				removeUnkept(maps, keep);
+			}
+		}
+	}
+
+	const PreparedNetwork& network;
+	const PreparedGeneTree& tree;
+	const Params& params;
+	EvaluationContext<T>& context;
+	int numDerivativeParams;
+	bool pruning = false;
+};
+
+/**
+ * Compute the probability of a prepared gene tree given a prepared network.
+ */
+template<typename T, typename Params>
+T calcProbability(const PreparedNetwork& network, const PreparedGeneTree& tree, const Params& params, EvaluationContext<T>& context) {
+	return PreparedEvaluator<T, Params, false>(network, tree, params, context).run(nullptr);
+}
+
+/**
+ * Compute the probability of a prepared gene tree given a prepared network.
+ * Also computes the derivatives if it is not nullptr.
+ */
+template<typename T, typename Params>
+T calcProbability(const PreparedNetwork& network, const PreparedGeneTree& tree, const Params& params, EvaluationContext<T>& context, std::vector<T>* derivatives) {
+	if (derivatives == nullptr) {
+		return calcProbability(network, tree, params, context);
+	}
+	return PreparedEvaluator<T, Params, true>(network, tree, params, context).run(derivatives);
+}
+
+/**
+ * Compute the probability of a prepared gene tree given a prepared network at the given params.
+ * Also computes the derivatives if it is not nullptr.
+ */
+inline double calcProbability(const PreparedNetwork& network, const PreparedGeneTree& tree, const double* params, std::vector<double>* derivatives = nullptr) {
+	EvaluationContext<double> context;
+	return calcProbability(network, tree, DoubleParams{params}, context, derivatives);
+}
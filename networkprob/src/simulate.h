@@ -0,0 +1,312 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+
+#include "arena.h"
+#include "prepared.h"
+#include "parallel.h"
+#include "distribution.h"
+
+/**
+ * Samples gene trees under the multispecies network coalescent, one lineage per network leaf.
+ * Lineages coalesce at rate 1 per pair along every edge, and at a network node each lineage independently
+ * goes left with the left probability. A simulator keeps scratch space, so each thread needs its own.
+ */
+class GeneTreeSimulator {
+public:
+	/**
+	 * Create a simulator for a prepared network with the given params.
+	 */
+	GeneTreeSimulator(const PreparedNetwork& a_network, const double* params) : network(a_network), outputs(a_network.nodes.size()) {
+		for (const PreparedNetNode& node : network.nodes) {
+			NodeInfo info;
+			info.leftProbability = node.type == NodeType::NETWORK ? params[node.introgressionId] : 0;
+			for (int i = 0; i < 2; i++) {
+				info.lengths[i] = node.edges[i].paramId < 0 ? std::numeric_limits<double>::infinity() : params[node.edges[i].paramId];
+			}
+			infos.push_back(info);
+		}
+	}
+
+	/**
+	 * Sample one gene tree. leaves holds the handle of every network leaf, and merge(a, b) joins two lineages
+	 * into a new handle. Returns the handle of the root.
+	 */
+	template<typename Merge>
+	int32_t simulate(std::mt19937_64& generator, const int32_t* leaves, Merge merge) {
+		for (unsigned int i = 0; i < network.nodes.size(); i++) {
+			const PreparedNetNode& node = network.nodes[i];
+			const NodeInfo& info = infos[i];
+			std::vector<int32_t>& current = outputs[i][0];
+			current.clear();
+
+			switch (node.type) {
+				case NodeType::LEAF:
+					current.push_back(leaves[node.leafIndex]);
+					break;
+
+				case NodeType::TREE:
+					for (int j = 0; j < 2; j++) {
+						std::vector<int32_t>& lineages = getOutput(node.edges[j]);
+						coalesce(lineages, info.lengths[j], generator, merge);
+						current.insert(current.end(), lineages.begin(), lineages.end());
+					}
+					break;
+
+				case NodeType::NETWORK: {
+					std::vector<int32_t>& lineages = getOutput(node.edges[0]);
+					coalesce(lineages, info.lengths[0], generator, merge);
+
+					std::vector<int32_t>& right = outputs[i][1];
+					right.clear();
+					for (int32_t lineage : lineages) {
+						(uniform(generator) < info.leftProbability ? current : right).push_back(lineage);
+					}
+					break;
+				}
+
+				default:
+					std::cerr<<"Unknown type"<<std::endl;
+					exit(-1);
+			}
+		}
+
+		// Everything left coalesces above the root
+		std::vector<int32_t>& root = outputs.back()[0];
+		coalesce(root, std::numeric_limits<double>::infinity(), generator, merge);
+		return root[0];
+	}
+
+	/**
+	 * Sample one gene tree into an arena, with leaves named after the network leaves. Returns its root.
+	 */
+	int32_t simulate(std::mt19937_64& generator, TreeArena& arena) {
+		leafHandles.resize(network.leafNames.size());
+		for (unsigned int i = 0; i < leafHandles.size(); i++) {
+			leafHandles[i] = arena.addLeaf(network.leafNames[i].c_str());
+		}
+
+		return simulate(generator, leafHandles.data(), [&arena](int32_t a, int32_t b) {
+			return arena.addTree("", a, b);
+		});
+	}
+
+	/**
+	 * Sample the topology of one gene tree as a forest, without building it. Needs at most maxDistributionLeaves leaves.
+	 */
+	Forest simulateForest(std::mt19937_64& generator) {
+		leafHandles.resize(network.leafNames.size());
+		for (unsigned int i = 0; i < leafHandles.size(); i++) {
+			leafHandles[i] = 1 << i;
+		}
+
+		uint8_t clades[maxDistributionLeaves];
+		int numClades = 0;
+
+		int32_t taxa = simulate(generator, leafHandles.data(), [&](int32_t a, int32_t b) {
+			clades[numClades++] = a | b;
+			return a | b;
+		});
+
+		return makeForest(taxa, clades, numClades);
+	}
+
+private:
+	/**
+	 * What the simulator needs from a node, read once from the params.
+	 */
+	struct NodeInfo {
+		double lengths[2];
+		double leftProbability;
+	};
+
+	/**
+	 * Get the lineages leaving a node along an edge.
+	 */
+	std::vector<int32_t>& getOutput(const PreparedEdge& edge) {
+		return outputs[edge.node][edge.type == EdgeType::RIGHT ? 1 : 0];
+	}
+
+	/**
+	 * Run the coalescent on lineages along an edge of the given length, in place.
+	 */
+	template<typename Merge>
+	void coalesce(std::vector<int32_t>& lineages, double length, std::mt19937_64& generator, Merge& merge) {
+		int count = lineages.size();
+		while (count > 1) {
+			length += std::log(1 - uniform(generator)) * 2 / (count * (count - 1));
+			if (length < 0) {
+				break;
+			}
+
+			int a = pick(generator, count);
+			int b = pick(generator, count - 1);
+			if (b >= a) {
+				b++;
+			}
+
+			lineages[a] = merge(lineages[a], lineages[b]);
+			lineages[b] = lineages[--count];
+		}
+		lineages.resize(count);
+	}
+
+	/**
+	 * Draw a uniform double in [0, 1).
+	 */
+	static double uniform(std::mt19937_64& generator) {
+		return (generator() >> 11) * (1.0 / (1ULL << 53));
+	}
+
+	/**
+	 * Draw a uniform integer in [0, n).
+	 */
+	static int pick(std::mt19937_64& generator, int n) {
+		return (int) (uniform(generator) * n);
+	}
+
+	const PreparedNetwork& network;
+	std::vector<NodeInfo> infos;
+	std::vector<std::array<std::vector<int32_t>, 2>> outputs; // The lineages leaving each node, left and right for network nodes.
+	std::vector<int32_t> leafHandles;
+};
+
+/**
+ * The number of trees each random stream produces, so results don't depend on the number of threads.
+ */
+const int simulationBlockSize = 1 << 12;
+
+/**
+ * Get the random stream for a block of simulated trees.
+ */
+inline std::mt19937_64 makeSimulationGenerator(uint64_t seed, int block) {
+	std::seed_seq seeds = {(uint32_t) seed, (uint32_t) (seed >> 32), (uint32_t) block};
+	return std::mt19937_64(seeds);
+}
+
+/**
+ * Simulate numTrees gene trees in parallel and add them to an arena. Returns their roots.
+ * The same seed gives the same trees on any number of threads.
+ */
+inline std::vector<int32_t> simulateGeneTrees(const PreparedNetwork& network, const double* params, int numTrees, uint64_t seed, TreeArena& arena) {
+	int numBlocks = (numTrees + simulationBlockSize - 1) / simulationBlockSize;
+	std::vector<TreeArena> arenas(numBlocks);
+	std::vector<std::vector<int32_t>> blockRoots(numBlocks);
+
+	parallelTasks(numBlocks, [&](int block) {
+		GeneTreeSimulator simulator(network, params);
+		std::mt19937_64 generator = makeSimulationGenerator(seed, block);
+
+		int size = std::min(simulationBlockSize, numTrees - block * simulationBlockSize);
+		arenas[block].reserve(size * (2 * network.leafNames.size() - 1));
+		for (int i = 0; i < size; i++) {
+			blockRoots[block].push_back(simulator.simulate(generator, arenas[block]));
+		}
+	});
+
+	std::vector<int32_t> result;
+	result.reserve(numTrees);
+	arena.reserve(arena.size() + numTrees * (2 * network.leafNames.size() - 1));
+	for (int block = 0; block < numBlocks; block++) {
+		int32_t offset = arena.append(arenas[block]);
+		for (int32_t root : blockRoots[block]) {
+			result.push_back(root + offset);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Add the Newick string for the tree below a node to result, without lengths or the final semicolon.
+ */
+inline void appendTreeNewick(const TreeArena& arena, int32_t index, std::string& result) {
+	const ArenaTreeNode& node = arena.nodes[index];
+	if (node.isLeaf()) {
+		result += arena.getName(index);
+		return;
+	}
+
+	result += '(';
+	appendTreeNewick(arena, node.leftChild, result);
+	result += ',';
+	appendTreeNewick(arena, node.rightChild, result);
+	result += ')';
+}
+
+/**
+ * Simulate numTrees gene trees in parallel and write them to out as Newick, one per line.
+ * Trees are written in the same order as simulateGeneTrees with the same seed.
+ */
+inline void writeSimulatedGeneTrees(const PreparedNetwork& network, const double* params, int numTrees, uint64_t seed, std::ostream& out) {
+	int numBlocks = (numTrees + simulationBlockSize - 1) / simulationBlockSize;
+	int numThreads = getNumThreads();
+
+	// Blocks are written out in rounds so only a few are held in memory at once
+	std::vector<std::string> texts(numThreads);
+	for (int first = 0; first < numBlocks; first += numThreads) {
+		int count = std::min(numThreads, numBlocks - first);
+
+		parallelTasks(count, [&](int i) {
+			int block = first + i;
+			GeneTreeSimulator simulator(network, params);
+			std::mt19937_64 generator = makeSimulationGenerator(seed, block);
+
+			TreeArena arena;
+			std::string& text = texts[i];
+			text.clear();
+
+			int size = std::min(simulationBlockSize, numTrees - block * simulationBlockSize);
+			for (int j = 0; j < size; j++) {
+				arena.clear();
+				appendTreeNewick(arena, simulator.simulate(generator, arena), text);
+				text += ";\n";
+			}
+		});
+
+		for (int i = 0; i < count; i++) {
+			out<<texts[i];
+		}
+	}
+}
+
+/**
+ * Estimate the probability of every rooted topology over the leaves of a network from numTrees simulated gene trees,
+ * keyed by forest like calcTopologyDistribution. Returns false if the network has more than maxDistributionLeaves leaves.
+ */
+inline bool simulateTopologyDistribution(const PreparedNetwork& network, const double* params, int numTrees, uint64_t seed, std::unordered_map<Forest, double>& result) {
+	if (!canComputeDistribution(network)) {
+		return false;
+	}
+
+	int numBlocks = (numTrees + simulationBlockSize - 1) / simulationBlockSize;
+	std::vector<std::unordered_map<Forest, int>> counts(numBlocks);
+
+	parallelTasks(numBlocks, [&](int block) {
+		GeneTreeSimulator simulator(network, params);
+		std::mt19937_64 generator = makeSimulationGenerator(seed, block);
+
+		int size = std::min(simulationBlockSize, numTrees - block * simulationBlockSize);
+		for (int i = 0; i < size; i++) {
+			counts[block][simulator.simulateForest(generator)]++;
+		}
+	});
+
+	result.clear();
+	for (auto&& blockCounts : counts) {
+		for (auto&& count : blockCounts) {
+			result[count.first] += (double) count.second / numTrees;
+		}
+	}
+
+	return true;
+}
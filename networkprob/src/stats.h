@@ -0,0 +1,367 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/**
+ * Set NETWORKPROB_STATS to 1 to count what every evaluation does. When it is 0, recording compiles to nothing.
+ */
+#ifndef NETWORKPROB_STATS
+#define NETWORKPROB_STATS 0
+#endif
+
+/**
+ * The densemap operations that evaluations count.
+ */
+enum class DensemapOperation : int32_t {
+	UPDATE = 0,
+	COMBINE = 1,
+	SPLIT = 2,
+	DERIVATIVE_UPDATE = 3,
+	COMBINE_DERIVATIVES = 4,
+	SPLIT_DERIVATIVES = 5,
+};
+
+const int numDensemapOperations = 6;
+
+/**
+ * Get the name of an operation for printing.
+ */
+inline const char* getOperationName(int operation) {
+	static const char* names[numDensemapOperations] = {"update", "combine", "split", "derivativeUpdate", "combineDerivatives", "splitDerivatives"};
+	return operation >= 0 && operation < numDensemapOperations ? names[operation] : "unknown";
+}
+
+/**
+ * What one kind of operation did.
+ */
+struct OperationCounters {
+	int64_t calls = 0;
+	int64_t mapsIn = 0;
+	int64_t mapsOut = 0;
+	int64_t histories = 0; // Populated histories in the output maps.
+	int64_t pairsChecked = 0; // For combines, the pairs of maps checked for compatible choices.
+	int64_t pairsCombined = 0; // For combines, the pairs that were compatible.
+	int64_t bytes = 0; // Bytes allocated for the output maps.
+	double seconds = 0;
+
+	/**
+	 * Add another set of counters to these.
+	 */
+	void add(const OperationCounters& other) {
+		calls += other.calls;
+		mapsIn += other.mapsIn;
+		mapsOut += other.mapsOut;
+		histories += other.histories;
+		pairsChecked += other.pairsChecked;
+		pairsCombined += other.pairsCombined;
+		bytes += other.bytes;
+		seconds += other.seconds;
+	}
+};
+
+/**
+ * What was computed for one node of a network, over every operation.
+ */
+struct NodeCounters {
+	int64_t mapsIn = 0;
+	int64_t mapsOut = 0;
+	int64_t histories = 0;
+	double seconds = 0;
+
+	/**
+	 * Add another set of counters to these.
+	 */
+	void add(const NodeCounters& other) {
+		mapsIn += other.mapsIn;
+		mapsOut += other.mapsOut;
+		histories += other.histories;
+		seconds += other.seconds;
+	}
+};
+
+/**
+ * Everything counted for a set of evaluations. Nodes are by their index in the prepared network.
+ */
+struct EvaluationCounters {
+	int64_t evaluations = 0;
+	std::array<OperationCounters, numDensemapOperations> operations;
+	std::vector<NodeCounters> nodes;
+
+	/**
+	 * Add another set of counters to these.
+	 */
+	void add(const EvaluationCounters& other) {
+		evaluations += other.evaluations;
+		for (int i = 0; i < numDensemapOperations; i++) {
+			operations[i].add(other.operations[i]);
+		}
+
+		nodes.resize(std::max(nodes.size(), other.nodes.size()));
+		for (unsigned int i = 0; i < other.nodes.size(); i++) {
+			nodes[i].add(other.nodes[i]);
+		}
+	}
+
+	/**
+	 * Reset every counter.
+	 */
+	void clear() {
+		*this = EvaluationCounters();
+	}
+};
+
+/**
+ * Count the populated histories of a list of densemaps.
+ */
+template<typename Maps>
+int64_t countHistories(const Maps& maps) {
+	int64_t result = 0;
+	for (auto&& map : maps) {
+		result += __builtin_popcountll(map.getHistoryBitset());
+	}
+	return result;
+}
+
+/**
+ * Estimate the bytes allocated for a list of densemaps, counting each map and its choices.
+ */
+template<typename Maps>
+int64_t countBytes(const Maps& maps) {
+	int64_t result = maps.capacity() * sizeof(typename Maps::value_type);
+	for (auto&& map : maps) {
+		result += map.choices.capacity() * sizeof(int64_t);
+	}
+	return result;
+}
+
+#if NETWORKPROB_STATS
+
+class StatsRecorder;
+
+/**
+ * Keeps track of every recorder, so the counters of all threads can be read together.
+ * Counters of recorders that are gone are kept in retired.
+ */
+struct StatsRegistry {
+	std::mutex mutex;
+	std::set<StatsRecorder*> recorders;
+	EvaluationCounters retired;
+
+	/**
+	 * Get the registry of the process. It is never destroyed, since the workers of the thread pool only exit
+	 * during static destruction and still give back what they hold.
+	 */
+	static StatsRegistry& get() {
+		static StatsRegistry* registry = new StatsRegistry();
+		return *registry;
+	}
+};
+
+/**
+ * Records what the evaluations using one context do. Each context, and so each thread, has its own.
+ */
+class StatsRecorder {
+public:
+	using Started = std::chrono::steady_clock::time_point;
+
+	StatsRecorder() {
+		std::lock_guard<std::mutex> lock(StatsRegistry::get().mutex);
+		StatsRegistry::get().recorders.insert(this);
+	}
+
+	StatsRecorder(const StatsRecorder& other) : StatsRecorder() {
+		counters = other.counters;
+	}
+
+	StatsRecorder& operator=(const StatsRecorder& other) {
+		counters = other.counters;
+		return *this;
+	}
+
+	~StatsRecorder() {
+		std::lock_guard<std::mutex> lock(StatsRegistry::get().mutex);
+		StatsRegistry::get().retired.add(counters);
+		StatsRegistry::get().recorders.erase(this);
+	}
+
+	/**
+	 * Count the start of an evaluation.
+	 */
+	void startEvaluation() {
+		counters.evaluations++;
+	}
+
+	/**
+	 * Get the time an operation starts.
+	 */
+	Started start() const {
+		return std::chrono::steady_clock::now();
+	}
+
+	/**
+	 * Count an operation done for node, or -1 if nodes aren't tracked, that started at started.
+	 * Combines check pairs of maps, and every output map is one compatible pair.
+	 */
+	template<typename Maps>
+	void record(DensemapOperation operation, int node, int64_t mapsIn, const Maps& out, int64_t pairsChecked, Started started) {
+		add(operation, node, mapsIn, out.size(), countHistories(out), countBytes(out), pairsChecked, started);
+	}
+
+	/**
+	 * Count a split, which has two lists of output maps.
+	 */
+	template<typename Maps>
+	void record(DensemapOperation operation, int node, int64_t mapsIn, const Maps& left, const Maps& right, Started started) {
+		add(operation, node, mapsIn, left.size() + right.size(), countHistories(left) + countHistories(right), countBytes(left) + countBytes(right), 0, started);
+	}
+
+	EvaluationCounters counters;
+
+private:
+	/**
+	 * Add one operation to the counters.
+	 */
+	void add(DensemapOperation operation, int node, int64_t mapsIn, int64_t mapsOut, int64_t histories, int64_t bytes, int64_t pairsChecked, Started started) {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		OperationCounters& counter = counters.operations[(int) operation];
+		counter.calls++;
+		counter.mapsIn += mapsIn;
+		counter.mapsOut += mapsOut;
+		counter.histories += histories;
+		counter.bytes += bytes;
+		counter.seconds += seconds;
+		if (pairsChecked > 0) {
+			counter.pairsChecked += pairsChecked;
+			counter.pairsCombined += mapsOut;
+		}
+
+		if (node >= 0) {
+			if ((int) counters.nodes.size() <= node) {
+				counters.nodes.resize(node + 1);
+			}
+			NodeCounters& nodeCounter = counters.nodes[node];
+			nodeCounter.mapsIn += mapsIn;
+			nodeCounter.mapsOut += mapsOut;
+			nodeCounter.histories += histories;
+			nodeCounter.seconds += seconds;
+		}
+	}
+};
+
+/**
+ * Check if evaluations are counted.
+ */
+constexpr bool areStatsEnabled() {
+	return true;
+}
+
+/**
+ * Get the counters of every evaluation so far, summed over all threads.
+ * Only call it while nothing is being evaluated.
+ */
+inline EvaluationCounters getEvaluationCounters() {
+	StatsRegistry& registry = StatsRegistry::get();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	EvaluationCounters result = registry.retired;
+	for (StatsRecorder* recorder : registry.recorders) {
+		result.add(recorder->counters);
+	}
+	return result;
+}
+
+/**
+ * Reset the counters of every thread. Only call it while nothing is being evaluated.
+ */
+inline void resetEvaluationCounters() {
+	StatsRegistry& registry = StatsRegistry::get();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	registry.retired.clear();
+	for (StatsRecorder* recorder : registry.recorders) {
+		recorder->counters.clear();
+	}
+}
+
+#else
+
+/**
+ * Stands in for the recorder when counting is compiled out. Every call does nothing.
+ */
+class StatsRecorder {
+public:
+	struct Started {};
+
+	void startEvaluation() {}
+
+	Started start() const {
+		return Started();
+	}
+
+	template<typename Maps>
+	void record(DensemapOperation, int, int64_t, const Maps&, int64_t, Started) {}
+
+	template<typename Maps>
+	void record(DensemapOperation, int, int64_t, const Maps&, const Maps&, Started) {}
+};
+
+constexpr bool areStatsEnabled() {
+	return false;
+}
+
+inline EvaluationCounters getEvaluationCounters() {
+	return EvaluationCounters();
+}
+
+inline void resetEvaluationCounters() {}
+
+#endif
+
+/**
+ * Get the recorder for evaluations that have no context, like calcProbability on a NetNode.
+ */
+inline StatsRecorder& getThreadStatsRecorder() {
+	static thread_local StatsRecorder recorder;
+	return recorder;
+}
+
+/**
+ * Write counters as a table, one line per operation and then one per node.
+ */
+inline std::string formatEvaluationCounters(const EvaluationCounters& counters) {
+	std::string result;
+	char line[256];
+
+	snprintf(line, sizeof(line), "evaluations: %lld\n", (long long) counters.evaluations);
+	result += line;
+
+	snprintf(line, sizeof(line), "%-20s %10s %12s %12s %12s %14s %14s %14s %10s\n", "operation", "calls", "maps in", "maps out", "histories", "pairs checked", "pairs combined", "bytes", "ms");
+	result += line;
+	for (int i = 0; i < numDensemapOperations; i++) {
+		const OperationCounters& counter = counters.operations[i];
+		snprintf(line, sizeof(line), "%-20s %10lld %12lld %12lld %12lld %14lld %14lld %14lld %10.3f\n", getOperationName(i), (long long) counter.calls, (long long) counter.mapsIn, (long long) counter.mapsOut,
+			(long long) counter.histories, (long long) counter.pairsChecked, (long long) counter.pairsCombined, (long long) counter.bytes, counter.seconds * 1000);
+		result += line;
+	}
+
+	if (!counters.nodes.empty()) {
+		snprintf(line, sizeof(line), "\n%-20s %12s %12s %12s %10s\n", "node", "maps in", "maps out", "histories", "ms");
+		result += line;
+		for (unsigned int i = 0; i < counters.nodes.size(); i++) {
+			const NodeCounters& counter = counters.nodes[i];
+			snprintf(line, sizeof(line), "%-20u %12lld %12lld %12lld %10.3f\n", i, (long long) counter.mapsIn, (long long) counter.mapsOut, (long long) counter.histories, counter.seconds * 1000);
+			result += line;
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,504 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+
+#include "densemap.h"
+#include "prepared.h"
+#include "topology.h"
+
+/**
+ * What the densemaps of a species subtree depend on for one gene tree.
+ * Only the events with every taxon inside the subtree can happen below it, so those events,
+ * identified by their taxa and sorted, are enough to tell gene trees apart.
+ * The shape describes the subtree itself, so networks with the same leaves can share subtrees.
+ */
+struct SubtreeKey {
+	std::shared_ptr<const std::vector<int32_t>> shape;
+	uint64_t shapeHash;
+	bool derivatives;
+	std::array<uint16_t, 6> clusters; // The taxa bits of each event inside the subtree, sorted and padded with zeros.
+	std::vector<double> params; // The values of the params used inside the subtree.
+
+	bool operator==(const SubtreeKey& other) const {
+		return shapeHash == other.shapeHash && derivatives == other.derivatives && clusters == other.clusters && params == other.params && *shape == *other.shape;
+	}
+};
+
+/**
+ * Hash a SubtreeKey.
+ */
+struct SubtreeKeyHash {
+	size_t operator()(const SubtreeKey& key) const {
+		uint64_t hash = mixHash((key.shapeHash << 1) | key.derivatives);
+		for (uint16_t cluster : key.clusters) {
+			hash = mixHash(hash * 31 + cluster);
+		}
+		for (double param : key.params) {
+			uint64_t bits;
+			std::memcpy(&bits, &param, sizeof(bits));
+			hash = mixHash(hash * 31 + bits);
+		}
+		return hash;
+	}
+};
+
+/**
+ * Renumber the histories and choices of densemaps. permutation maps each old history to the new one,
+ * and the choice at fromChoices[i] moves to toChoices[i] of numChoices new choices.
+ */
+template<typename T>
+void renumberMaps(PreparedMaps<T>& maps, const std::array<uint8_t, 1 << 6>& permutation, const std::vector<int>& fromChoices, const std::vector<int>& toChoices, int numChoices) {
+	std::vector<int64_t> choices(numChoices);
+
+	for (auto&& map : maps) {
+		std::fill(choices.begin(), choices.end(), -1);
+		for (unsigned int i = 0; i < fromChoices.size(); i++) {
+			choices[toChoices[i]] = map.choices[fromChoices[i]];
+		}
+
+		PreparedMap<T> result(std::allocator_arg, map.get_allocator());
+		result.init(map.getTaxaBits(), choices);
+
+		uint64_t bitset = map.getHistoryBitset();
+		while (bitset != 0) {
+			int history = 63 - __builtin_clzll(bitset);
+			bitset ^= (1LL << history);
+
+			result.setHistory(permutation[history], map.getHistory(history));
+		}
+
+		map = std::move(result);
+	}
+}
+
+/**
+ * A thread safe cache of the densemaps computed below species subtrees, shared between gene trees.
+ * Entries are stored with the events numbered by their sorted taxa, so any gene tree with the same events
+ * inside a subtree can use them, whatever its own numbering.
+ *
+ * Only subtrees that nothing outside of reaches into are cached. Their network nodes are split and rejoined inside,
+ * so the choice ids of the cached densemaps are never compared against densemaps from another gene tree.
+ *
+ * Entries are keyed by the values of the params inside the subtree, so changing a param only misses for the subtrees
+ * that use it, and evaluations at different params can share the cache at the same time.
+ * They are also keyed by the shape of the subtree rather than its place in the network, with the network nodes and
+ * params inside numbered locally, so caches for different networks over the same leaves can share their entries.
+ */
+class SubtreeCache {
+public:
+	/**
+	 * Create an empty cache for a network. Once it holds about maxEntries entries, old ones are dropped.
+	 */
+	explicit SubtreeCache(const PreparedNetwork& a_network, size_t maxEntries = 1 << 16) : SubtreeCache(a_network, std::make_shared<Store>(maxEntries)) {}
+
+	/**
+	 * Create a cache for another network with the same leaves in the same order, sharing the entries of other.
+	 */
+	SubtreeCache(const PreparedNetwork& a_network, const SubtreeCache& other) : SubtreeCache(a_network, other.store) {
+		if (network.leafNames != other.network.leafNames) {
+			std::cerr<<"Subtree caches can only be shared between networks with the same leaves"<<std::endl;
+			exit(-1);
+		}
+	}
+
+	/**
+	 * Check if the subtree below a node can be cached.
+	 */
+	bool isCacheable(int node) const {
+		return subtrees[node].shape != nullptr;
+	}
+
+	/**
+	 * Get the nodes below a cacheable node, not including itself.
+	 */
+	const std::vector<int>& getDescendants(int node) const {
+		return subtrees[node].descendants;
+	}
+
+	/**
+	 * Get the key of a cacheable node for a gene tree at the given params.
+	 * toCanonical and fromCanonical are filled in to convert between the histories of the gene tree and of the cache.
+	 */
+	SubtreeKey getKey(const PreparedGeneTree& tree, int node, bool derivatives, const double* params, std::array<uint8_t, 1 << 6>& toCanonical, std::array<uint8_t, 1 << 6>& fromCanonical) const {
+		const Subtree& subtree = subtrees[node];
+		SubtreeKey key = {subtree.shape, subtree.shapeHash, derivatives, {}, {}};
+
+		key.params.reserve(subtree.params.size());
+		for (int paramId : subtree.params) {
+			key.params.push_back(params[paramId]);
+		}
+
+		std::array<int, 6> events;
+		int numEvents = 0;
+		for (unsigned int i = 0; i < tree.events.size(); i++) {
+			uint16_t cluster = tree.closure[i] & 0b1111111111000000;
+			if ((cluster & ~leafTaxa[node]) == 0) {
+				events[numEvents++] = i;
+			}
+		}
+
+		std::sort(events.begin(), events.begin() + numEvents, [&](int a, int b) {
+			return tree.closure[a] < tree.closure[b];
+		});
+
+		for (int i = 0; i < numEvents; i++) {
+			key.clusters[i] = tree.closure[events[i]] & 0b1111111111000000;
+		}
+
+		// Only histories made of the events inside can happen below the node
+		toCanonical.fill(0);
+		fromCanonical.fill(0);
+		for (int canonical = 0; canonical < (1 << numEvents); canonical++) {
+			int history = 0;
+			for (int i = 0; i < numEvents; i++) {
+				if ((canonical & (1 << i)) != 0) {
+					history |= 1 << events[i];
+				}
+			}
+			toCanonical[history] = canonical;
+			fromCanonical[canonical] = history;
+		}
+
+		return key;
+	}
+
+	/**
+	 * Look up an entry and copy it into data in the numbering of this network and a gene tree.
+	 * Returns false if there is none.
+	 */
+	bool find(const SubtreeKey& key, int node, const std::array<uint8_t, 1 << 6>& fromCanonical, PreparedNodeData<double>& data) {
+		std::shared_ptr<const PreparedNodeData<double>> entry;
+		{
+			Shard& shard = getShard(key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+
+			auto found = shard.entries.find(key);
+			if (found == shard.entries.end()) {
+				store->misses++;
+				return false;
+			}
+
+			store->hits++;
+			entry = found->second;
+		}
+
+		const Subtree& subtree = subtrees[node];
+
+		auto expand = [&](const PreparedMaps<double>& local, PreparedMaps<double>& result) {
+			result = local;
+			renumberMaps(result, fromCanonical, subtree.localNetNodes, subtree.netNodes, network.numNetNodes);
+		};
+
+		auto expandDerivatives = [&](const PreparedMapSets<double>& local, PreparedMapSets<double>& result) {
+			// Params outside the subtree all get the same zero derivatives, which are stored once after the local ones
+			result.resize(network.numParams);
+			for (int i = 0; i < network.numParams; i++) {
+				int localIndex = subtree.localParams[i];
+				expand(local[localIndex != -1 ? localIndex : local.size() - 1], result[i]);
+			}
+		};
+
+		// Only the outputs the node has are stored, since the rest of the context may be left over from other networks
+		if (network.nodes[node].type == NodeType::NETWORK) {
+			expand(entry->leftData, data.leftData);
+			expand(entry->rightData, data.rightData);
+			if (key.derivatives) {
+				expandDerivatives(entry->leftDerivatives, data.leftDerivatives);
+				expandDerivatives(entry->rightDerivatives, data.rightDerivatives);
+			}
+		} else {
+			expand(entry->currentData, data.currentData);
+			if (key.derivatives) {
+				expandDerivatives(entry->derivatives, data.derivatives);
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Add what was computed for a node to the cache. If another thread got there first, its entry is kept.
+	 * A full shard is emptied first, which keeps memory bounded when params keep changing.
+	 */
+	void insert(const SubtreeKey& key, int node, const std::array<uint8_t, 1 << 6>& toCanonical, const PreparedNodeData<double>& data) {
+		const Subtree& subtree = subtrees[node];
+		int numLocalNetNodes = subtree.netNodes.size();
+
+		std::shared_ptr<PreparedNodeData<double>> entry = std::make_shared<PreparedNodeData<double>>();
+
+		auto compress = [&](const PreparedMaps<double>& full, PreparedMaps<double>& result) {
+			result = full;
+			renumberMaps(result, toCanonical, subtree.netNodes, subtree.localNetNodes, numLocalNetNodes);
+		};
+
+		auto compressDerivatives = [&](const PreparedMapSets<double>& full, PreparedMapSets<double>& result) {
+			result.resize(subtree.params.size() + (subtree.outsideParam != -1));
+			for (unsigned int i = 0; i < subtree.params.size(); i++) {
+				compress(full[subtree.params[i]], result[i]);
+			}
+			if (subtree.outsideParam != -1) {
+				compress(full[subtree.outsideParam], result.back());
+			}
+		};
+
+		if (network.nodes[node].type == NodeType::NETWORK) {
+			compress(data.leftData, entry->leftData);
+			compress(data.rightData, entry->rightData);
+			if (key.derivatives) {
+				compressDerivatives(data.leftDerivatives, entry->leftDerivatives);
+				compressDerivatives(data.rightDerivatives, entry->rightDerivatives);
+			}
+		} else {
+			compress(data.currentData, entry->currentData);
+			if (key.derivatives) {
+				compressDerivatives(data.derivatives, entry->derivatives);
+			}
+		}
+
+		Shard& shard = getShard(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		if (shard.entries.size() * store->shards.size() >= store->maxEntries) {
+			shard.entries.clear();
+		}
+		shard.entries.insert({key, std::move(entry)});
+	}
+
+	/**
+	 * Get the number of lookups that found an entry, over every cache sharing the entries.
+	 */
+	uint64_t getHits() const {
+		return store->hits;
+	}
+
+	/**
+	 * Get the number of lookups that didn't find an entry, over every cache sharing the entries.
+	 */
+	uint64_t getMisses() const {
+		return store->misses;
+	}
+
+private:
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<SubtreeKey, std::shared_ptr<const PreparedNodeData<double>>, SubtreeKeyHash> entries;
+	};
+
+	/**
+	 * The entries, which can be shared between the caches of several networks.
+	 */
+	struct Store {
+		explicit Store(size_t a_maxEntries) : maxEntries(a_maxEntries), hits(0), misses(0) {}
+
+		size_t maxEntries;
+		std::array<Shard, 16> shards;
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+	};
+
+	/**
+	 * The layout of a cacheable subtree.
+	 */
+	struct Subtree {
+		std::vector<int> descendants;
+		std::vector<int> netNodes; // The choice index of each network node inside, in local order.
+		std::vector<int> localNetNodes; // 0, 1, 2, ... up to the number of network nodes inside.
+		std::vector<int> params; // The params used inside, in local order.
+		std::vector<int> localParams; // The local index of every param of the network, or -1 if it isn't used inside.
+		int outsideParam = -1; // Some param that isn't used inside, or -1.
+		std::shared_ptr<const std::vector<int32_t>> shape; // Null unless the subtree is cacheable.
+		uint64_t shapeHash = 0;
+	};
+
+	/**
+	 * Work out which subtrees can be cached and describe them.
+	 */
+	SubtreeCache(const PreparedNetwork& a_network, std::shared_ptr<Store> a_store) : network(a_network), store(std::move(a_store)) {
+		int numNodes = network.nodes.size();
+
+		std::vector<std::vector<int>> parents(numNodes);
+		std::vector<std::vector<bool>> below(numNodes, std::vector<bool>(numNodes, false));
+		leafTaxa.assign(numNodes, 0);
+		subtrees.resize(numNodes);
+
+		for (int i = 0; i < numNodes; i++) {
+			const PreparedNetNode& node = network.nodes[i];
+			below[i][i] = true;
+
+			if (node.type == NodeType::LEAF) {
+				leafTaxa[i] = 1 << (6 + node.leafIndex);
+				continue;
+			}
+
+			int numEdges = node.type == NodeType::TREE ? 2 : 1;
+			for (int j = 0; j < numEdges; j++) {
+				int child = node.edges[j].node;
+				parents[child].push_back(i);
+				leafTaxa[i] |= leafTaxa[child];
+				for (int k = 0; k < numNodes; k++) {
+					if (below[child][k]) {
+						below[i][k] = true;
+					}
+				}
+			}
+		}
+
+		// The root is never cached, since its key would be the whole gene tree
+		for (int i = 0; i < numNodes - 1; i++) {
+			if (network.nodes[i].type == NodeType::LEAF) {
+				continue;
+			}
+
+			Subtree& subtree = subtrees[i];
+			bool closed = true;
+			for (int k = 0; k < numNodes; k++) {
+				if (below[i][k] && k != i) {
+					subtree.descendants.push_back(k);
+					for (int parent : parents[k]) {
+						closed = closed && below[i][parent];
+					}
+				}
+			}
+
+			if (closed) {
+				describeSubtree(i, subtree);
+			}
+		}
+	}
+
+	/**
+	 * Number the network nodes and params inside a closed subtree locally and record its shape.
+	 * Nodes are taken in network order, which is the same for the same subtree in networks built the same way.
+	 */
+	void describeSubtree(int index, Subtree& subtree) {
+		std::vector<int> nodes = subtree.descendants;
+		nodes.push_back(index);
+
+		std::vector<int> localNodes(network.nodes.size(), -1);
+		for (unsigned int i = 0; i < nodes.size(); i++) {
+			localNodes[nodes[i]] = i;
+		}
+
+		subtree.localParams.assign(network.numParams, -1);
+		auto addParam = [&subtree](int paramId) {
+			if (subtree.localParams[paramId] == -1) {
+				subtree.localParams[paramId] = subtree.params.size();
+				subtree.params.push_back(paramId);
+			}
+			return subtree.localParams[paramId];
+		};
+
+		std::vector<int32_t> shape;
+		for (int node : nodes) {
+			const PreparedNetNode& prepared = network.nodes[node];
+			shape.push_back((int32_t) prepared.type);
+
+			if (prepared.type == NodeType::LEAF) {
+				shape.push_back(prepared.leafIndex);
+				continue;
+			}
+
+			int numEdges = prepared.type == NodeType::TREE ? 2 : 1;
+			for (int j = 0; j < numEdges; j++) {
+				shape.push_back(localNodes[prepared.edges[j].node]);
+				shape.push_back((int32_t) prepared.edges[j].type);
+				shape.push_back(addParam(prepared.edges[j].paramId));
+			}
+
+			if (prepared.type == NodeType::NETWORK) {
+				subtree.localNetNodes.push_back(subtree.netNodes.size());
+				subtree.netNodes.push_back(prepared.netNodeIndex);
+				shape.push_back(addParam(prepared.introgressionId));
+			}
+		}
+
+		for (int i = 0; i < network.numParams && subtree.outsideParam == -1; i++) {
+			if (subtree.localParams[i] == -1) {
+				subtree.outsideParam = i;
+			}
+		}
+
+		subtree.shapeHash = mixHash(shape.size());
+		for (int32_t value : shape) {
+			subtree.shapeHash = mixHash(subtree.shapeHash * 31 + (uint32_t) value);
+		}
+		subtree.shape = std::make_shared<const std::vector<int32_t>>(std::move(shape));
+	}
+
+	/**
+	 * Get the shard holding a key.
+	 */
+	Shard& getShard(const SubtreeKey& key) {
+		return store->shards[(SubtreeKeyHash()(key) >> 32) % store->shards.size()];
+	}
+
+	const PreparedNetwork& network;
+	std::shared_ptr<Store> store;
+
+	std::vector<uint16_t> leafTaxa; // The taxa bits of the network leaves below each node.
+	std::vector<Subtree> subtrees;
+};
+
+/**
+ * Compute the probability of a prepared gene tree given a prepared network, reusing the subtrees that other gene trees
+ * or other params left in the cache and adding the ones computed here.
+ * Also computes the derivatives if it is not nullptr.
+ */
+template<bool Derivatives>
+double calcProbabilityCached(const PreparedNetwork& network, const PreparedGeneTree& tree, const double* params, EvaluationContext<double>& context, std::vector<double>* derivatives, SubtreeCache& cache) {
+	DoubleParams values = {params};
+	PreparedEvaluator<double, DoubleParams, Derivatives> evaluator(network, tree, values, context);
+	evaluator.start();
+
+	int numNodes = network.nodes.size();
+	std::vector<char> done(numNodes, false);
+	std::array<uint8_t, 1 << 6> toCanonical;
+	std::array<uint8_t, 1 << 6> fromCanonical;
+
+	// Go down from the root so that the biggest subtrees are found first
+	for (int i = numNodes - 1; i >= 0; i--) {
+		if (done[i] || !cache.isCacheable(i)) {
+			continue;
+		}
+
+		if (cache.find(cache.getKey(tree, i, Derivatives, params, toCanonical, fromCanonical), i, fromCanonical, context.nodes[i])) {
+			done[i] = true;
+			for (int descendant : cache.getDescendants(i)) {
+				done[descendant] = true;
+			}
+		}
+	}
+
+	for (int i = 0; i < numNodes; i++) {
+		if (done[i]) {
+			continue;
+		}
+
+		evaluator.computeNode(i);
+
+		if (cache.isCacheable(i)) {
+			cache.insert(cache.getKey(tree, i, Derivatives, params, toCanonical, fromCanonical), i, toCanonical, context.nodes[i]);
+		}
+	}
+
+	return evaluator.finish(derivatives);
+}
+
+/**
+ * Compute the probability of a prepared gene tree given a prepared network using a subtree cache, see above.
+ */
+inline double calcProbability(const PreparedNetwork& network, const PreparedGeneTree& tree, const double* params, EvaluationContext<double>& context, std::vector<double>* derivatives, SubtreeCache& cache) {
+	if (derivatives == nullptr) {
+		return calcProbabilityCached<false>(network, tree, params, context, derivatives, cache);
+	}
+	return calcProbabilityCached<true>(network, tree, params, context, derivatives, cache);
+}
@@ -1,7 +1,31 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "catch.h"
 
+#include <sstream>
+
 #include "example.h"
+#include "arena.h"
+#include "prepared.h"
+#include "newick.h"
+#include "genetrees.h"
+#include "topology.h"
+#include "batch.h"
+#include "subtreecache.h"
+#include "enumerate.h"
+#include "distribution.h"
+#include "circuit.h"
+#include "kernel.h"
+#include "lanes.h"
+#include "optimize.h"
+#include "multistart.h"
+#include "hillclimb.h"
+#include "netsearch.h"
+#include "mcmc.h"
+#include "simulate.h"
+#include "stats.h"
+#include "trace.h"
+#include "bumparena.h"
+#include <ftw.h>
 
 TEST_CASE( "Simple 7 taxa tree case", "[tree]" ) {
 
@@ -138,4 +162,1496 @@ TEST_CASE( "Test that split works properly", "[split]" ) {
 
     REQUIRE(afterSplit.second[5].getHistory(0) == Approx {0.3411734961});
     REQUIRE(afterSplit.second[5].getHistory(1) == Approx {0});
-}
\ No newline at end of file
+}
+
+TEST_CASE( "Circuit matches calcProbability", "[circuit]" ) {
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+
+	NetNode& network = createSpeciesWithIntro(species);
+	TreeNode& gene = createGene(genes);
+
+	std::vector<double> expectedDerivatives;
+	double expected = calcProbability(network, gene, &expectedDerivatives);
+
+	Circuit circuit = compileCircuit(network, gene);
+	REQUIRE(circuit.getNumParams() == (int)expectedDerivatives.size());
+
+	std::vector<double> params(circuit.getNumParams());
+	network.getParams(params.data());
+
+	std::vector<double> derivatives(circuit.getNumParams());
+	REQUIRE(circuit.evaluate(params.data()) == Approx(expected));
+	REQUIRE(circuit.evaluate(params.data(), derivatives.data()) == Approx(expected));
+
+	for (unsigned int i = 0; i < derivatives.size(); i++) {
+		REQUIRE(derivatives[i] == Approx(expectedDerivatives[i]));
+	}
+}
+
+TEST_CASE( "Circuit can be reevaluated at new params", "[circuitparams]" ) {
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	NetNode& network = createSimpleSpecies(species, params);
+	TreeNode& gene = createSimpleGene(genes);
+
+	Circuit circuit = compileCircuit(network, gene);
+
+	double otherParams[] = {0.1, 2, 0.3, 1.5, 0.2, 1, 3, 0.4};
+	network.setParams(otherParams);
+
+	REQUIRE(circuit.evaluate(otherParams) == Approx(calcProbability(network, gene)));
+}
+
+/**
+ * Remove a directory made by a test and everything in it.
+ */
+void removeDirectory(const char* path) {
+	nftw(path, [](const char* file, const struct stat*, int, struct FTW*) {
+		return std::remove(file);
+	}, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Count the compiled kernels in a cache directory.
+ */
+int countKernels(const char* path) {
+	static int count;
+	count = 0;
+	nftw(path, [](const char* file, const struct stat*, int, struct FTW*) {
+		std::string name = file;
+		count += name.size() > 3 && name.compare(name.size() - 3, 3, ".so") == 0;
+		return 0;
+	}, 16, FTW_PHYS);
+	return count;
+}
+
+TEST_CASE( "Native kernels match the circuit", "[kernel]" ) {
+	if (!hasKernelCompiler()) {
+		WARN("Skipping native kernels, since " + getKernelCompiler() + " can't be run");
+		return;
+	}
+
+	char directory[] = "/tmp/networkprob-test-XXXXXX";
+	REQUIRE(mkdtemp(directory) != nullptr);
+	setenv("NETWORKPROB_KERNEL_CACHE", directory, 1);
+
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+
+	NetNode& network = createSpeciesWithIntro(species);
+	Circuit circuit = compileCircuit(network, createGene(genes));
+
+	std::vector<double> params(circuit.getNumParams());
+	network.getParams(params.data());
+
+	std::vector<double> expectedDerivatives(circuit.getNumParams());
+	double expected = circuit.evaluate(params.data(), expectedDerivatives.data());
+
+	LikelihoodKernel kernel(circuit);
+	REQUIRE(kernel.loadNative());
+	REQUIRE(kernel.isNative());
+
+	std::vector<double> derivatives(circuit.getNumParams());
+	REQUIRE(kernel.evaluate(params.data()) == Approx(expected));
+	REQUIRE(kernel.evaluate(params.data(), derivatives.data()) == Approx(expected));
+
+	for (unsigned int i = 0; i < derivatives.size(); i++) {
+		REQUIRE(derivatives[i] == Approx(expectedDerivatives[i]));
+	}
+
+	// The second kernel comes straight from the cache
+	LikelihoodKernel cached(circuit);
+	REQUIRE(cached.loadNative());
+	REQUIRE(cached.evaluate(params.data()) == Approx(expected));
+	REQUIRE(countKernels(directory) == 1);
+
+	// Kernels are only shared with the same compiler and CPU, so a broken compiler can't load them
+	setenv("NETWORKPROB_CXX", "/nonexistent/compiler", 1);
+	LikelihoodKernel otherCompiler(circuit);
+	REQUIRE_FALSE(otherCompiler.loadNative());
+	unsetenv("NETWORKPROB_CXX");
+	REQUIRE(hashCircuit(circuit, getKernelTarget()) != hashCircuit(circuit, getKernelTarget() + "-mavx512f"));
+
+	// Kernels are only loaded from a directory nobody else can write to
+	REQUIRE(chmod(directory, 0777) == 0);
+	LikelihoodKernel shared(circuit);
+	REQUIRE_FALSE(shared.loadNative());
+	REQUIRE(chmod(directory, 0700) == 0);
+
+	unsetenv("NETWORKPROB_KERNEL_CACHE");
+	removeDirectory(directory);
+}
+
+TEST_CASE( "Kernels fall back to the interpreter without a compiler", "[kernelfallback]" ) {
+	char directory[] = "/tmp/networkprob-test-XXXXXX";
+	REQUIRE(mkdtemp(directory) != nullptr);
+	setenv("NETWORKPROB_KERNEL_CACHE", directory, 1);
+	setenv("NETWORKPROB_CXX", "/nonexistent/compiler", 1);
+
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+
+	NetNode& network = createSpecies(species);
+	TreeNode& gene = createGene(genes);
+
+	LikelihoodKernel kernel(compileCircuit(network, gene));
+	REQUIRE_FALSE(kernel.loadNative());
+
+	std::vector<double> params(kernel.getCircuit().getNumParams());
+	network.getParams(params.data());
+	REQUIRE(kernel.evaluate(params.data()) == Approx(calcProbability(network, gene)));
+
+	unsetenv("NETWORKPROB_CXX");
+	unsetenv("NETWORKPROB_KERNEL_CACHE");
+	removeDirectory(directory);
+}
+
+TEST_CASE( "Prepared networks match calcProbability", "[prepared]" ) {
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+	std::vector<NetNode> trivialSpecies;
+	std::vector<NetNode> introSpecies;
+
+	TreeNode& gene = createGene(genes);
+
+	for (NetNode* network : {&createSpecies(species), &createSpeciesWithTrivialIntro(trivialSpecies), &createSpeciesWithIntro(introSpecies)}) {
+		std::vector<double> expectedDerivatives;
+		double expected = calcProbability(*network, gene, &expectedDerivatives);
+
+		PreparedNetwork prepared = prepareNetwork(*network);
+		PreparedGeneTree preparedGene;
+		REQUIRE(prepareGeneTree(prepared, gene, preparedGene));
+
+		std::vector<double> derivatives;
+		REQUIRE(calcProbability(prepared, preparedGene, prepared.params.data()) == Approx(expected));
+		REQUIRE(calcProbability(prepared, preparedGene, prepared.params.data(), &derivatives) == Approx(expected));
+
+		REQUIRE(derivatives.size() == expectedDerivatives.size());
+		for (unsigned int i = 0; i < derivatives.size(); i++) {
+			if (std::isnan(expectedDerivatives[i])) {
+				// Inheritance derivatives are undefined when a split side is empty
+				REQUIRE(std::isnan(derivatives[i]));
+			} else {
+				REQUIRE(derivatives[i] == Approx(expectedDerivatives[i]));
+			}
+		}
+	}
+}
+
+TEST_CASE( "Prepared gene trees can be reused across params", "[preparedparams]" ) {
+	std::vector<NetNode> species;
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+
+	PreparedNetwork prepared = prepareNetwork(createSimpleSpecies(species, params));
+	EvaluationContext<double> context;
+
+	std::vector<std::vector<TreeNode>> genes(3);
+	std::vector<PreparedGeneTree> preparedGenes(3);
+	REQUIRE(prepareGeneTree(prepared, createSimpleGene(genes[0]), preparedGenes[0]));
+	REQUIRE(prepareGeneTree(prepared, createSimpleGeneTwo(genes[1]), preparedGenes[1]));
+	REQUIRE(prepareGeneTree(prepared, createSimpleGeneThree(genes[2]), preparedGenes[2]));
+
+	double otherParams[] = {0.1, 2, 0.3, 1.5, 0.2, 1, 3, 0.4};
+
+	double total = 0;
+	for (int i = 0; i < 3; i++) {
+		// Legacy networks cache their results, so each gene tree needs a fresh one
+		std::vector<NetNode> otherSpecies;
+		NetNode& network = createSimpleSpecies(otherSpecies, otherParams);
+
+		double prob = calcProbability(prepared, preparedGenes[i], DoubleParams{otherParams}, context);
+		REQUIRE(prob == Approx(calcProbability(network, genes[i].back())));
+		total += prob;
+	}
+
+	REQUIRE(total == Approx(1.0));
+}
+
+TEST_CASE( "Prepared gene trees need every network leaf", "[preparedmissing]" ) {
+	std::vector<NetNode> species;
+	std::vector<TreeNode> genes;
+
+	PreparedNetwork prepared = prepareNetwork(createSpecies(species));
+	PreparedGeneTree preparedGene;
+
+	REQUIRE_FALSE(prepareGeneTree(prepared, createSimpleGene(genes), preparedGene));
+}
+
+TEST_CASE( "Arenas match the linked networks", "[arena]" ) {
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+
+	NetNode& network = createSpeciesWithIntro(species);
+	TreeNode& gene = createGene(genes);
+
+	NetworkArena networkArena;
+	int32_t networkRoot = appendNetwork(networkArena, network);
+
+	TreeArena treeArena;
+	int32_t treeRoot = appendTree(treeArena, gene);
+
+	REQUIRE(networkRoot == networkArena.size() - 1);
+	REQUIRE(std::string(networkArena.getName(networkRoot)) == network.name);
+	REQUIRE(networkArena.getMaximumParamId(networkRoot) == network.getMaximumParamId());
+
+	PreparedNetwork prepared = prepareNetwork(networkArena, networkRoot);
+	PreparedGeneTree preparedGene;
+	REQUIRE(prepareGeneTree(prepared, treeArena, treeRoot, preparedGene));
+
+	REQUIRE(calcProbability(prepared, preparedGene, prepared.params.data()) == Approx(calcProbability(network, gene)));
+
+	// Links to nodes that don't exist yet are refused instead of ending the process
+	int32_t size = treeArena.size();
+	REQUIRE(treeArena.addTree("broken", treeRoot, size + 1) == -1);
+	REQUIRE(treeArena.size() == size);
+}
+
+TEST_CASE( "Arenas can change their params", "[arenaparams]" ) {
+	std::vector<NetNode> species;
+	std::vector<NetNode> otherSpecies;
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	double otherParams[] = {0.1, 2, 0.3, 1.5, 0.2, 1, 3, 0.4};
+
+	NetworkArena arena;
+	int32_t root = appendNetwork(arena, createSimpleSpecies(species, params));
+	arena.setParams(root, otherParams);
+
+	NetworkArena expected;
+	int32_t expectedRoot = appendNetwork(expected, createSimpleSpecies(otherSpecies, otherParams));
+
+	REQUIRE(arena.serialize() == expected.serialize());
+
+	double result[8];
+	arena.getParams(root, result);
+	for (int i = 0; i < 8; i++) {
+		REQUIRE(result[i] == otherParams[i]);
+	}
+
+	REQUIRE(prepareNetwork(arena, root).params == prepareNetwork(expected, expectedRoot).params);
+}
+
+TEST_CASE( "Arenas serialize as one block", "[arenaserialize]" ) {
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+	std::vector<NetNode> otherSpecies;
+
+	NetworkArena arena;
+	int32_t first = appendNetwork(arena, createSpecies(species));
+	int32_t second = appendNetwork(arena, createSpeciesWithTrivialIntro(otherSpecies));
+
+	std::vector<char> bytes = arena.serialize();
+
+	NetworkArena copy;
+	REQUIRE(copy.deserialize(bytes.data(), bytes.size()));
+	REQUIRE(copy.serialize() == bytes);
+
+	for (int32_t root : {first, second}) {
+		REQUIRE(std::string(copy.getName(root)) == arena.getName(root));
+		REQUIRE(prepareNetwork(copy, root).nodes.size() == prepareNetwork(arena, root).nodes.size());
+	}
+
+	REQUIRE_FALSE(copy.deserialize(bytes.data(), bytes.size() - 1));
+
+	// A node that links to a later node is rejected, skipping the 16 byte header
+	std::vector<char> corrupted = bytes;
+	int32_t badLink = arena.size();
+	std::memcpy(corrupted.data() + 16 + sizeof(ArenaNetNode) * second + offsetof(ArenaNetNode, edges) + offsetof(ArenaEdge, node), &badLink, sizeof(int32_t));
+	REQUIRE_FALSE(copy.deserialize(corrupted.data(), corrupted.size()));
+
+	TreeArena trees;
+	int32_t treeRoot = appendTree(trees, createGene(genes));
+	std::vector<char> treeBytes = trees.serialize();
+
+	REQUIRE_FALSE(copy.deserialize(treeBytes.data(), treeBytes.size()));
+
+	TreeArena treeCopy;
+	REQUIRE(treeCopy.deserialize(treeBytes.data(), treeBytes.size()));
+	REQUIRE(treeCopy.getReachable(treeRoot) == trees.getReachable(treeRoot));
+}
+
+TEST_CASE( "Extended Newick networks match the hand built ones", "[newick]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+
+	std::ostringstream newick;
+	newick<<"((A:"<<params[1]<<",(B:"<<params[0]<<")BIntrogressed#H1:"<<params[2]<<"::"<<params[7]<<")one:"<<params[5];
+	newick<<",(#H1:"<<params[3]<<",C:"<<params[4]<<")two:"<<params[6]<<")three;";
+
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork(newick.str(), arena, root, numParams));
+	REQUIRE(numParams == 8);
+	REQUIRE(std::string(arena.getName(root)) == "three");
+
+	PreparedNetwork prepared = prepareNetwork(arena, root);
+	REQUIRE(prepared.numParams == 8);
+	REQUIRE(prepared.numNetNodes == 1);
+
+	std::vector<std::vector<TreeNode>> genes(3);
+	TreeNode* geneRoots[] = {&createSimpleGene(genes[0]), &createSimpleGeneTwo(genes[1]), &createSimpleGeneThree(genes[2])};
+
+	for (TreeNode* gene : geneRoots) {
+		std::vector<NetNode> species;
+		NetNode& network = createSimpleSpecies(species, params);
+
+		PreparedGeneTree preparedGene;
+		REQUIRE(prepareGeneTree(prepared, *gene, preparedGene));
+		REQUIRE(calcProbability(prepared, preparedGene, prepared.params.data()) == Approx(calcProbability(network, *gene)));
+	}
+}
+
+TEST_CASE( "Extended Newick parses the migration network", "[newickmigration]" ) {
+	const char* newick = "((SPRETUS2:0.9104578515297839,(SPRETUS1:2.0195704679518434)I2#H1:0.16283989808281535::0.6278519129107153)I6:2.0779118863817883,"
+		"((BACKGROUND:1.146879871230814,VARIABLE:2.0600082939688695)I1:2.707813370597956,I2#H1:1.2805138209067635::0.3721480870892847)I3:0.509260077469016)I0;";
+
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork(newick, arena, root, numParams));
+	REQUIRE(numParams == 10);
+	REQUIRE(arena.size() == 9);
+
+	PreparedNetwork prepared = prepareNetwork(arena, root);
+	REQUIRE(prepared.leafNames.size() == 4);
+	REQUIRE(prepared.params[2] == 0.16283989808281535);
+	REQUIRE(prepared.params[9] == 0.6278519129107153);
+
+	// Hybrids with two children get an extra edge before the inheritance params
+	REQUIRE(parseNetwork("((A,(B,C)#H1),(#H1,D));", arena, root, numParams));
+	REQUIRE(numParams == 10);
+	REQUIRE(prepareNetwork(arena, root).params[8] == 0);
+	REQUIRE(prepareNetwork(arena, root).params[9] == 0.5);
+}
+
+TEST_CASE( "Extended Newick rejects invalid networks", "[newickinvalid]" ) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+
+	REQUIRE_FALSE(parseNetwork("((A,B);", arena, root, numParams));
+	REQUIRE_FALSE(parseNetwork("((A,B),C)", arena, root, numParams));
+	REQUIRE_FALSE(parseNetwork("(A,B,C);", arena, root, numParams));
+	REQUIRE_FALSE(parseNetwork("(A,#H1);", arena, root, numParams));
+	REQUIRE_FALSE(parseNetwork("((A)#H1,(#H1,B)#H1);", arena, root, numParams));
+	REQUIRE_FALSE(parseNetwork("((A)#H1::2,(#H1,B));", arena, root, numParams));
+	REQUIRE_FALSE(parseNetwork("((A:x,B),C);", arena, root, numParams));
+	REQUIRE_FALSE(parseNetwork("((A:-0.5,B),C);", arena, root, numParams));
+	REQUIRE_FALSE(parseNetwork("((A:1::0.5,B),C);", arena, root, numParams));
+}
+
+/**
+ * Write a tree as Newick, giving the leaves lengths that should be ignored.
+ */
+void writeNewick(const TreeNode& node, std::ostream& out) {
+	if (node.isLeaf) {
+		out<<node.name<<":1.5";
+	} else {
+		out<<'(';
+		writeNewick(*node.leftChild, out);
+		out<<',';
+		writeNewick(*node.rightChild, out);
+		out<<')'<<node.name;
+	}
+}
+
+TEST_CASE( "Newick gene trees match the hand built ones", "[newicktree]" ) {
+	std::vector<TreeNode> genes;
+	TreeNode& gene = createGene(genes);
+
+	TreeArena expected;
+	appendTree(expected, gene);
+
+	std::ostringstream newick;
+	writeNewick(gene, newick);
+	newick<<';';
+
+	TreeArena arena;
+	int32_t root;
+	REQUIRE(parseTree(newick.str(), arena, root));
+	REQUIRE(arena.serialize() == expected.serialize());
+
+	REQUIRE_FALSE(parseTree("((A,B,C),D);", arena, root));
+	REQUIRE_FALSE(parseTree("((A),B);", arena, root));
+	REQUIRE_FALSE(parseTree("(A,B);(C,D);", arena, root));
+}
+
+TEST_CASE( "Gene tree files load in order", "[genetrees]" ) {
+	std::string weights = "TREE\tWEIGHT\n((A,B),C)\t0.25\n\n(A,(B,C));\t0.75\r\n";
+
+	GeneTreeFile file;
+	REQUIRE(loadGeneTrees(weights.data(), weights.size(), file));
+	REQUIRE(file.roots.size() == 2);
+	REQUIRE(file.weights == std::vector<double>({0.25, 0.75}));
+	REQUIRE(std::string(file.arena.getName(file.roots[1] - 2)) == "C");
+
+	// Enough trees to be split across threads, with the weight column first
+	std::ostringstream many;
+	many<<"WEIGHT\tTREE\n";
+	for (int i = 0; i < 1000; i++) {
+		many<<i<<"\t((A"<<i<<",B),C)\n";
+	}
+	std::string manyText = many.str();
+
+	REQUIRE(loadGeneTrees(manyText.data(), manyText.size(), file));
+	REQUIRE(file.roots.size() == 1000);
+	for (int i = 0; i < 1000; i++) {
+		REQUIRE(file.weights[i] == i);
+		REQUIRE(file.roots[i] == 5 * i + 4);
+		REQUIRE(std::string(file.arena.getName(5 * i)) == "A" + std::to_string(i));
+	}
+
+	std::string plain = "((A,B),C);\n(A,(B,C));\n";
+	REQUIRE(loadGeneTrees(plain.data(), plain.size(), file));
+	REQUIRE(file.weights == std::vector<double>({1, 1}));
+
+	std::string invalid = "TREE\tWEIGHT\n((A,B),C)\t0.25\n(A,(B,C)\t0.75\n";
+	REQUIRE_FALSE(loadGeneTrees(invalid.data(), invalid.size(), file));
+}
+
+/**
+ * Get the canonical Newick string for the topology below a node.
+ * Children are ordered by their own canonical strings, so rotations give the same string.
+ */
+std::string getCanonicalNewick(const TreeArena& arena, int32_t index) {
+	const ArenaTreeNode& node = arena.nodes[index];
+
+	if (node.isLeaf()) {
+		return arena.getName(index);
+	}
+
+	std::string left = getCanonicalNewick(arena, node.leftChild);
+	std::string right = getCanonicalNewick(arena, node.rightChild);
+	if (right < left) {
+		std::swap(left, right);
+	}
+
+	return "(" + left + "," + right + ")";
+}
+
+TEST_CASE( "Topology hashes ignore the order of children", "[topology]" ) {
+	TreeArena arena;
+	int32_t roots[4];
+	REQUIRE(parseTree("((A,B),(C,D));", arena, roots[0]));
+	REQUIRE(parseTree("((D,C),(B,A));", arena, roots[1]));
+	REQUIRE(parseTree("((A,C),(B,D));", arena, roots[2]));
+	REQUIRE(parseTree("(((A,B),C),D);", arena, roots[3]));
+
+	REQUIRE(getTopologyHash(arena, roots[0]) == getTopologyHash(arena, roots[1]));
+	REQUIRE(isSameTopology(arena, roots[0], arena, roots[1]));
+	REQUIRE(getCanonicalNewick(arena, roots[1]) == "((A,B),(C,D))");
+
+	for (int i = 1; i < 4; i++) {
+		for (int j = i + 1; j < 4; j++) {
+			REQUIRE(getTopologyHash(arena, roots[i]) != getTopologyHash(arena, roots[j]));
+			REQUIRE_FALSE(isSameTopology(arena, roots[i], arena, roots[j]));
+		}
+	}
+
+	UniqueGeneTrees unique = findUniqueGeneTrees(arena, {roots[0], roots[2], roots[1], roots[3]}, {0.25, 0.5, 0.125, 1});
+	REQUIRE(unique.roots == std::vector<int32_t>({roots[0], roots[2], roots[3]}));
+	REQUIRE(unique.weights == std::vector<double>({0.375, 0.5, 1}));
+	REQUIRE(unique.uniqueIndices == std::vector<int32_t>({0, 1, 0, 2}));
+}
+
+TEST_CASE( "Batches match evaluating every tree", "[batch]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<NetNode> species;
+	PreparedNetwork network = prepareNetwork(createSimpleSpecies(species, params));
+
+	std::string text = "((A,B),C)\t2\n(C,(B,A))\t1\n((A,C),B)\t0.5\n(A,(B,C))\t3\n";
+	GeneTreeFile file;
+	REQUIRE(loadGeneTrees(text.data(), text.size(), file));
+
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, file.arena, file.roots, file.weights, batch));
+	REQUIRE(batch.trees.size() == 3);
+
+	double expected = 0;
+	std::vector<double> expectedDerivatives(8, 0.0);
+
+	for (unsigned int i = 0; i < file.roots.size(); i++) {
+		PreparedGeneTree tree;
+		REQUIRE(prepareGeneTree(network, file.arena, file.roots[i], tree));
+
+		std::vector<double> derivatives;
+		double probability = calcProbability(network, tree, params, &derivatives);
+
+		expected += file.weights[i] * std::log(probability);
+		for (int j = 0; j < 8; j++) {
+			expectedDerivatives[j] += file.weights[i] * derivatives[j] / probability;
+		}
+	}
+
+	std::vector<double> derivatives;
+	REQUIRE(calcLogLikelihood(network, batch, params) == Approx(expected));
+	REQUIRE(calcLogLikelihood(network, batch, params, &derivatives) == Approx(expected));
+
+	for (int j = 0; j < 8; j++) {
+		REQUIRE(derivatives[j] == Approx(expectedDerivatives[j]));
+	}
+}
+
+TEST_CASE( "Cached subtrees give the same likelihood", "[subtreecache]" ) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("((((A:0.2,(B:0.1)#H1:0.2::0.3):0.1,(#H1:0.1,C:0.3):0.2):0.3,D:0.5):0.2,(E:0.4,F:0.3):0.6);", arena, root, numParams));
+
+	PreparedNetwork network = prepareNetwork(arena, root);
+
+	TreeArena trees;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, trees);
+	std::vector<double> weights;
+	for (unsigned int i = 0; i < roots.size(); i++) {
+		weights.push_back(1 + i % 3);
+	}
+
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, trees, roots, weights, batch));
+
+	SubtreeCache cache(network);
+	std::vector<double> params = network.params;
+
+	for (int round = 0; round < 2; round++) {
+		std::vector<double> expectedDerivatives;
+		double expected = calcLogLikelihood(network, batch, params.data(), &expectedDerivatives);
+
+		std::vector<double> derivatives;
+		REQUIRE(calcLogLikelihood(network, batch, params.data(), &derivatives, &cache) == Approx(expected));
+		REQUIRE(calcLogLikelihood(network, batch, params.data(), nullptr, &cache) == Approx(expected));
+
+		for (int j = 0; j < numParams; j++) {
+			REQUIRE(derivatives[j] == Approx(expectedDerivatives[j]));
+		}
+
+		params[0] *= 2;
+	}
+
+	REQUIRE(cache.getHits() > cache.getMisses());
+}
+
+TEST_CASE( "Every rooted topology is enumerated once", "[enumerate]" ) {
+	std::vector<std::string> leaves = {"A", "B", "C", "D", "E", "F"};
+
+	for (int numLeaves = 1; numLeaves <= 6; numLeaves++) {
+		std::vector<std::string> names(leaves.begin(), leaves.begin() + numLeaves);
+
+		TreeArena arena;
+		std::vector<int32_t> roots = enumerateTopologies(names, arena);
+		REQUIRE(roots.size() == countTopologies(numLeaves));
+
+		UniqueGeneTrees unique = findUniqueGeneTrees(arena, roots, std::vector<double>(roots.size(), 1.0));
+		REQUIRE(unique.roots.size() == roots.size());
+
+		// Streaming a range gives the same trees
+		TreeArena part;
+		TopologyIterator iterator(names, roots.size() / 2, roots.size());
+		int32_t root;
+		for (unsigned int i = roots.size() / 2; i < roots.size(); i++) {
+			part.clear();
+			REQUIRE(iterator.next(part, root));
+			REQUIRE(isSameTopology(part, root, arena, roots[i]));
+		}
+		REQUIRE_FALSE(iterator.next(part, root));
+	}
+
+	REQUIRE(countTopologies(7) == 10395);
+}
+
+TEST_CASE( "Topology probabilities add up to one", "[alltopologies]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<NetNode> species;
+	PreparedNetwork network = prepareNetwork(createSimpleSpecies(species, params));
+
+	std::vector<double> probabilities;
+	calcAllTopologyProbabilities(network, params, probabilities);
+	REQUIRE(probabilities.size() == 3);
+
+	TreeArena arena;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, arena);
+
+	double total = 0;
+	for (unsigned int i = 0; i < roots.size(); i++) {
+		PreparedGeneTree tree;
+		REQUIRE(prepareGeneTree(network, arena, roots[i], tree));
+		REQUIRE(probabilities[i] == Approx(calcProbability(network, tree, params)));
+		total += probabilities[i];
+	}
+	REQUIRE(total == Approx(1.0));
+
+	NetworkArena bigger;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("(((A:0.5,(B:0.2)#H1:0.3::0.4):0.4,E:1):0.2,((C:0.3,#H1:0.1):0.5,D:1):0.3);", bigger, root, numParams));
+
+	PreparedNetwork biggerNetwork = prepareNetwork(bigger, root);
+	std::vector<std::vector<double>> derivatives;
+	calcAllTopologyProbabilities(biggerNetwork, biggerNetwork.params.data(), probabilities, &derivatives);
+	REQUIRE(probabilities.size() == 105);
+
+	total = 0;
+	std::vector<double> totalDerivatives(numParams, 0.0);
+	for (unsigned int i = 0; i < probabilities.size(); i++) {
+		total += probabilities[i];
+		for (int j = 0; j < numParams; j++) {
+			totalDerivatives[j] += derivatives[i][j];
+		}
+	}
+	REQUIRE(total == Approx(1.0));
+	for (int j = 0; j < numParams; j++) {
+		REQUIRE(std::abs(totalDerivatives[j]) < 1e-9);
+	}
+
+	// Gene trees can't have eight leaves, so neither can the topologies
+	NetworkArena tooBig;
+	REQUIRE(parseNetwork("(((A:1,B:1):1,(C:1,D:1):1):1,((E:1,F:1):1,(G:1,H:1):1):1);", tooBig, root, numParams));
+	REQUIRE_FALSE(calcAllTopologyProbabilities(prepareNetwork(tooBig, root), nullptr, probabilities));
+}
+
+TEST_CASE( "The topology distribution matches each topology on its own", "[distribution]" ) {
+	const char* networks[] = {
+		"((A:1,B:1):0.5,C:2);",
+		"(((A:0.5,(B:0.2)#H1:0.3::0.4):0.4,E:1):0.2,((C:0.3,#H1:0.1):0.5,D:1):0.3);",
+		"(((((A:0.2,B:0.3):0.1)#H1:0.2::0.3,(C:0.4,D:0.1):0.2):0.3,((#H1:0.1,E:0.6):0.2,(F:0.3)#H2:0.1::0.6):0.1):0.2,(#H2:0.2,G:0.5):0.4);",
+	};
+
+	for (const char* newick : networks) {
+		NetworkArena arena;
+		int32_t root;
+		int numParams;
+		REQUIRE(parseNetwork(newick, arena, root, numParams));
+
+		PreparedNetwork network = prepareNetwork(arena, root);
+
+		std::vector<double> expected;
+		calcAllTopologyProbabilities(network, network.params.data(), expected);
+
+		std::vector<double> probabilities;
+		REQUIRE(calcTopologyDistribution(network, network.params.data(), probabilities));
+		REQUIRE(probabilities.size() == expected.size());
+
+		double total = 0;
+		for (unsigned int i = 0; i < probabilities.size(); i++) {
+			REQUIRE(probabilities[i] == Approx(expected[i]));
+			total += probabilities[i];
+		}
+		REQUIRE(total == Approx(1.0));
+	}
+
+	// Forests only hold 8 leaves, so bigger networks are refused
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("((((A:1,B:1):1,(C:1,D:1):1):1,((E:1,F:1):1,(G:1,H:1):1):1):1,I:1);", arena, root, numParams));
+	PreparedNetwork large = prepareNetwork(arena, root);
+	std::vector<double> probabilities;
+	REQUIRE_FALSE(calcTopologyDistribution(large, large.params.data(), probabilities));
+}
+
+TEST_CASE( "Lanes match evaluating each param vector", "[lanes]" ) {
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+
+	PreparedNetwork network = prepareNetwork(createSpeciesWithIntro(species));
+	PreparedGeneTree tree;
+	REQUIRE(prepareGeneTree(network, createGene(genes), tree));
+
+	int numParams = network.numParams;
+	int numVectors = 7;
+
+	std::vector<double> params;
+	for (int i = 0; i < numVectors; i++) {
+		for (int j = 0; j < numParams; j++) {
+			params.push_back(network.params[j] * (1 + 0.1 * i));
+		}
+	}
+
+	std::vector<double> probabilities(numVectors);
+	std::vector<double> derivatives(numVectors * numParams);
+	calcProbabilities(network, tree, params.data(), numVectors, probabilities.data(), derivatives.data());
+
+	for (int i = 0; i < numVectors; i++) {
+		std::vector<double> expectedDerivatives;
+		double expected = calcProbability(network, tree, &params[i * numParams], &expectedDerivatives);
+		REQUIRE(probabilities[i] == Approx(expected));
+
+		for (int j = 0; j < numParams; j++) {
+			double derivative = derivatives[i * numParams + j];
+			if (std::isnan(expectedDerivatives[j])) {
+				REQUIRE(std::isnan(derivative));
+			} else {
+				REQUIRE(derivative == Approx(expectedDerivatives[j]));
+			}
+		}
+	}
+}
+
+TEST_CASE( "The optimizer finds the best params inside the bounds", "[optimize]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<NetNode> species;
+	PreparedNetwork network = prepareNetwork(createSimpleSpecies(species, params));
+
+	TreeArena arena;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, arena);
+
+	std::vector<double> weights;
+	for (int32_t root : roots) {
+		PreparedGeneTree tree;
+		REQUIRE(prepareGeneTree(network, arena, root, tree));
+		weights.push_back(1000 * calcProbability(network, tree, params));
+	}
+
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, arena, roots, weights, batch));
+	double best = calcLogLikelihood(network, batch, params);
+
+	std::vector<ParamKind> kinds = getParamKinds(network);
+	REQUIRE(kinds[7] == ParamKind::INHERITANCE);
+
+	for (ParamTransform transform : {ParamTransform::NONE, ParamTransform::LOG}) {
+		OptimizerOptions options;
+		options.transform = transform;
+
+		std::vector<double> start(8, 0.3);
+		OptimizerResult result = maximizeLogLikelihood(network, batch, start, options);
+
+		REQUIRE(result.iterations > 0);
+		REQUIRE(-result.value >= best - 1e-3);
+		REQUIRE(result.trace.back() <= result.trace.front());
+		REQUIRE(-result.value == Approx(calcLogLikelihood(network, batch, result.params.data())));
+
+		for (int i = 0; i < 8; i++) {
+			REQUIRE(result.params[i] >= 0);
+		}
+		REQUIRE(result.params[7] <= 1);
+	}
+}
+
+TEST_CASE( "Parallel helpers reuse the same worker threads", "[threadpool]" ) {
+	const int n = 1000;
+	std::vector<int> counts(n, 0);
+
+	parallelFor(n, [&](int i) {
+		counts[i]++;
+	});
+	int numWorkers = ThreadPool::getInstance().getNumWorkers();
+	REQUIRE(numWorkers < getNumThreads());
+
+	// Later calls run on the workers the first one started
+	for (int call = 0; call < 20; call++) {
+		parallelTasks(n, [&](int i) {
+			counts[i]++;
+		});
+	}
+	REQUIRE(ThreadPool::getInstance().getNumWorkers() == numWorkers);
+	REQUIRE(std::count(counts.begin(), counts.end(), 21) == n);
+}
+
+TEST_CASE( "Multi-start optimization keeps the best restart", "[multistart]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<NetNode> species;
+	PreparedNetwork network = prepareNetwork(createSimpleSpecies(species, params));
+
+	TreeArena arena;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, arena);
+	std::vector<double> weights;
+	calcAllTopologyProbabilities(network, params, weights);
+	for (double& weight : weights) {
+		weight *= 1000;
+	}
+
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, arena, roots, weights, batch));
+
+	MultiStartOptions options;
+	options.abandonAfter = 1;
+	options.abandonMargin = 0;
+
+	std::vector<std::vector<double>> starts = makeRandomStarts(network, 6, 42);
+	REQUIRE(starts == makeRandomStarts(network, 6, 42));
+
+	MultiStartResult result = maximizeLogLikelihoodMultiStart(network, batch, starts, options);
+	REQUIRE(result.restarts.size() == 6);
+
+	const OptimizerResult& best = result.restarts[result.best];
+	REQUIRE_FALSE(best.abandoned);
+
+	REQUIRE(-best.value >= calcLogLikelihood(network, batch, params) - 1e-3);
+
+	for (auto&& restart : result.restarts) {
+		REQUIRE(restart.value >= best.value);
+		REQUIRE(restart.trace.size() == (unsigned int) restart.iterations + 1);
+		if (restart.abandoned) {
+			REQUIRE(restart.iterations >= options.abandonAfter);
+		}
+	}
+}
+
+TEST_CASE( "Hill climbing improves the likelihood reproducibly", "[hillclimb]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<NetNode> species;
+	PreparedNetwork network = prepareNetwork(createSimpleSpecies(species, params));
+
+	TreeArena arena;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, arena);
+	std::vector<double> weights;
+	calcAllTopologyProbabilities(network, params, weights);
+	for (double& weight : weights) {
+		weight *= 1000;
+	}
+
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, arena, roots, weights, batch));
+
+	std::vector<double> start(network.numParams, 0.3);
+	double startValue = calcLogLikelihood(network, batch, start.data());
+
+	HillClimbOptions options;
+	options.maxRounds = 30;
+	options.seed = 7;
+
+	HillClimbResult greedy = hillClimbLogLikelihood(network, batch, start, options);
+	REQUIRE(greedy.logLikelihood > startValue);
+	REQUIRE(greedy.logLikelihood == Approx(calcLogLikelihood(network, batch, greedy.params.data())));
+	REQUIRE(greedy.evaluations == 1 + options.maxRounds * options.candidatesPerRound);
+	REQUIRE(greedy.trace.size() == (unsigned int) options.maxRounds + 1);
+
+	for (unsigned int i = 1; i < greedy.trace.size(); i++) {
+		REQUIRE(greedy.trace[i] >= greedy.trace[i - 1]);
+	}
+
+	HillClimbResult again = hillClimbLogLikelihood(network, batch, start, options);
+	REQUIRE(again.params == greedy.params);
+	REQUIRE(again.trace == greedy.trace);
+
+	options.rule = AcceptanceRule::ANNEALING;
+	options.initialTemperature = 100;
+	HillClimbResult annealed = hillClimbLogLikelihood(network, batch, start, options);
+	REQUIRE(annealed.accepted == options.maxRounds);
+	REQUIRE(annealed.logLikelihood >= annealed.trace.back());
+	for (int i = 0; i < network.numParams; i++) {
+		REQUIRE(annealed.params[i] >= 0);
+	}
+}
+
+TEST_CASE( "Posterior sampling streams reproducible chains", "[mcmc]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<NetNode> species;
+	PreparedNetwork network = prepareNetwork(createSimpleSpecies(species, params));
+
+	TreeArena arena;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, arena);
+	std::vector<double> weights;
+	calcAllTopologyProbabilities(network, params, weights);
+	for (double& weight : weights) {
+		weight *= 1000;
+	}
+
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, arena, roots, weights, batch));
+
+	char directory[] = "/tmp/networkprob-test-XXXXXX";
+	REQUIRE(mkdtemp(directory) != nullptr);
+	std::string path = std::string(directory) + "/trace.bin";
+
+	std::vector<double> start(params, params + network.numParams);
+
+	SamplerOptions options;
+	options.numChains = 2;
+	options.burnIn = 20;
+	options.numSamples = 100;
+	options.thin = 2;
+	options.seed = 3;
+
+	std::vector<ChainResult> chains = sampleParams(network, batch, start, options, path.c_str());
+	REQUIRE(chains.size() == 2);
+
+	for (auto&& chain : chains) {
+		REQUIRE(chain.proposals == options.burnIn + (options.numSamples - 1) * options.thin + 1);
+		REQUIRE(chain.accepted > 0);
+		REQUIRE(chain.accepted < chain.proposals);
+		for (int i = 0; i < network.numParams; i++) {
+			REQUIRE(chain.last[i] >= 0);
+			REQUIRE(chain.variances[i] >= 0);
+		}
+	}
+
+	int numParams;
+	std::vector<SampleRecord> records;
+	std::vector<double> samples;
+	REQUIRE(SampleTraceWriter::read(path.c_str(), numParams, records, samples));
+	REQUIRE(numParams == network.numParams);
+	REQUIRE(records.size() == (unsigned int) options.numChains * options.numSamples);
+	REQUIRE(samples.size() == records.size() * numParams);
+
+	// The last sample of every chain is its final state
+	for (int chain = 0; chain < options.numChains; chain++) {
+		int last = -1;
+		for (unsigned int i = 0; i < records.size(); i++) {
+			if (records[i].chain == chain) {
+				last = i;
+			}
+		}
+		REQUIRE(last != -1);
+		REQUIRE(records[last].iteration == (options.numSamples - 1) * options.thin);
+		REQUIRE(records[last].logPosterior == Approx(chains[chain].lastLogPosterior));
+		REQUIRE(std::equal(chains[chain].last.begin(), chains[chain].last.end(), samples.begin() + last * numParams));
+	}
+
+	std::vector<ChainResult> again = sampleParams(network, batch, start, options);
+	for (int chain = 0; chain < options.numChains; chain++) {
+		REQUIRE(again[chain].last == chains[chain].last);
+		REQUIRE(again[chain].means == chains[chain].means);
+	}
+
+	options.method = SamplerMethod::HAMILTONIAN;
+	options.stepSize = 0.02;
+	options.leapfrogSteps = 5;
+	options.numChains = 1;
+	options.burnIn = 5;
+	options.numSamples = 20;
+	options.thin = 1;
+
+	std::vector<ChainResult> hamiltonian = sampleParams(network, batch, start, options);
+	REQUIRE(hamiltonian.size() == 1);
+	REQUIRE(hamiltonian[0].accepted > 0);
+	REQUIRE(std::isfinite(hamiltonian[0].lastLogPosterior));
+
+	removeDirectory(directory);
+}
+
+TEST_CASE( "Simulated gene trees match the exact topology distribution", "[simulate]" ) {
+	NetworkArena networkArena;
+	int32_t networkRoot;
+	int numParams;
+	REQUIRE(parseNetwork("((((A:0.5,(B:0.3)#H1:0.2::0.4):0.4,(#H1:0.3,C:0.6):0.3):0.5,D:1.4):0.3,E:0.8);", networkArena, networkRoot, numParams));
+	PreparedNetwork network = prepareNetwork(networkArena, networkRoot);
+
+	std::unordered_map<Forest, double> exact;
+	REQUIRE(calcTopologyDistribution(network, network.params.data(), exact));
+
+	const int numTrees = 200000;
+	std::unordered_map<Forest, double> estimate;
+	REQUIRE(simulateTopologyDistribution(network, network.params.data(), numTrees, 11, estimate));
+
+	double total = 0;
+	for (auto&& entry : estimate) {
+		REQUIRE(exact.count(entry.first) == 1);
+		total += entry.second;
+	}
+	REQUIRE(total == Approx(1));
+
+	// Every frequency is within five standard errors of the exact probability
+	for (auto&& entry : exact) {
+		double frequency = estimate.count(entry.first) ? estimate[entry.first] : 0;
+		double error = std::sqrt(entry.second * (1 - entry.second) / numTrees);
+		REQUIRE(std::fabs(frequency - entry.second) <= 5 * error + 1e-9);
+	}
+
+	TreeArena arena;
+	std::vector<int32_t> roots = simulateGeneTrees(network, network.params.data(), 1000, 3, arena);
+	REQUIRE(roots.size() == 1000);
+
+	std::ostringstream out;
+	writeSimulatedGeneTrees(network, network.params.data(), 1000, 3, out);
+
+	// The arena and the Newick stream hold the same trees, and every tree is complete
+	std::istringstream in(out.str());
+	std::string line;
+	for (int32_t root : roots) {
+		REQUIRE(std::getline(in, line));
+
+		TreeArena parsed;
+		int32_t parsedRoot;
+		REQUIRE(parseTree(line, parsed, parsedRoot));
+		REQUIRE(isSameTopology(arena, root, parsed, parsedRoot));
+		REQUIRE(getTopologyForest(network, arena, root) != 0);
+	}
+	REQUIRE_FALSE(std::getline(in, line));
+
+	TreeArena again;
+	std::vector<int32_t> againRoots = simulateGeneTrees(network, network.params.data(), 1000, 3, again);
+	for (unsigned int i = 0; i < roots.size(); i++) {
+		REQUIRE(getTopologyHash(again, againRoots[i]) == getTopologyHash(arena, roots[i]));
+	}
+
+	// Forests only hold 8 leaves, so bigger networks are refused
+	NetworkArena largeArena;
+	int32_t largeRoot;
+	REQUIRE(parseNetwork("((((A:1,B:1):1,(C:1,D:1):1):1,((E:1,F:1):1,(G:1,H:1):1):1):1,I:1);", largeArena, largeRoot, numParams));
+	PreparedNetwork large = prepareNetwork(largeArena, largeRoot);
+	REQUIRE_FALSE(simulateTopologyDistribution(large, large.params.data(), 100, 11, estimate));
+}
+
+TEST_CASE( "Editable networks survive a round trip and random moves", "[netsearch]" ) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("((((A:0.2,(B:0.1)#H1:0.2::0.3):0.1,(#H1:0.1,C:0.3):0.2):0.3,D:0.5):0.2,(E:0.4,F:0.3):0.6);", arena, root, numParams));
+
+	PreparedNetwork network = prepareNetwork(arena, root);
+	EditableNetwork editable = makeEditableNetwork(arena, root);
+	REQUIRE(isValidNetwork(editable));
+	REQUIRE(getNumReticulations(editable) == 1);
+
+	std::vector<double> probabilities;
+	REQUIRE(calcTopologyDistribution(network, network.params.data(), probabilities));
+
+	// Writing the network out and reading it back gives the same distribution
+	NetworkArena written;
+	int32_t writtenRoot;
+	REQUIRE(parseNetwork(writeNetwork(editable), written, writtenRoot, numParams));
+	PreparedNetwork rewritten = prepareNetwork(written, writtenRoot);
+	REQUIRE(rewritten.leafNames == network.leafNames);
+
+	std::vector<double> rewrittenProbabilities;
+	REQUIRE(calcTopologyDistribution(rewritten, rewritten.params.data(), rewrittenProbabilities));
+	for (unsigned int i = 0; i < probabilities.size(); i++) {
+		REQUIRE(rewrittenProbabilities[i] == Approx(probabilities[i]));
+	}
+
+	std::mt19937_64 generator(3);
+	for (int move = 0; move <= (int) NetworkMove::MOVE_RETICULATION; move++) {
+		int applied = 0;
+		for (int attempt = 0; attempt < 20; attempt++) {
+			EditableNetwork moved = editable;
+			std::vector<int> touched;
+			if (!applyRandomMove(moved, (NetworkMove) move, generator, touched)) {
+				continue;
+			}
+			applied++;
+
+			REQUIRE(isValidNetwork(moved));
+			REQUIRE_FALSE(touched.empty());
+
+			NetworkArena movedArena;
+			PreparedNetwork prepared = prepareNetwork(movedArena, appendEditableNetwork(movedArena, moved));
+			REQUIRE(prepared.leafNames == network.leafNames);
+
+			// The probabilities of every topology still add up to one
+			std::vector<double> movedProbabilities;
+			REQUIRE(calcTopologyDistribution(prepared, prepared.params.data(), movedProbabilities));
+			double total = 0;
+			for (double probability : movedProbabilities) {
+				total += probability;
+			}
+			REQUIRE(total == Approx(1));
+		}
+		REQUIRE(applied > 0);
+	}
+}
+
+TEST_CASE( "Topology search finds a better network", "[netsearch]" ) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("(((A:0.5,(B:0.3)#H1:0.2::0.4):0.4,(#H1:0.3,C:0.6):0.3):0.5,D:1.4);", arena, root, numParams));
+	PreparedNetwork truth = prepareNetwork(arena, root);
+
+	TreeArena trees;
+	std::vector<int32_t> roots = enumerateTopologies(truth.leafNames, trees);
+	std::vector<double> weights;
+	calcAllTopologyProbabilities(truth, truth.params.data(), weights);
+	for (double& weight : weights) {
+		weight *= 1000;
+	}
+
+	// Start from a tree with the leaves in the same order but the wrong shape
+	NetworkArena startArena;
+	int32_t startRoot;
+	REQUIRE(parseNetwork("(A:1,((B:0.3,C:0.3):0.3,D:0.6):0.4);", startArena, startRoot, numParams));
+	PreparedNetwork startNetwork = prepareNetwork(startArena, startRoot);
+	REQUIRE(startNetwork.leafNames == truth.leafNames);
+
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(startNetwork, trees, roots, weights, batch));
+
+	TopologySearchOptions options;
+	options.maxRounds = 8;
+	options.candidatesPerRound = 6;
+	options.maxReticulations = 1;
+	options.seed = 11;
+
+	EditableNetwork start = makeEditableNetwork(startArena, startRoot);
+	TopologySearchResult result = searchNetworkTopology(start, batch, options);
+
+	REQUIRE(result.accepted > 0);
+	REQUIRE(result.best.score > result.trace.front());
+	REQUIRE(result.trace.size() == (unsigned int) result.rounds + 1);
+	for (unsigned int i = 1; i < result.trace.size(); i++) {
+		REQUIRE(result.trace[i] >= result.trace[i - 1]);
+	}
+
+	// The score matches a fresh evaluation of the network that was found
+	NetworkArena bestArena;
+	PreparedNetwork best = prepareNetwork(bestArena, appendEditableNetwork(bestArena, result.best.network));
+	REQUIRE(calcLogLikelihood(best, batch, best.params.data()) == Approx(result.best.logLikelihood));
+
+	TopologySearchResult again = searchNetworkTopology(start, batch, options);
+	REQUIRE(again.trace == result.trace);
+}
+
+TEST_CASE( "Evaluation stats count the densemap work", "[stats]" ) {
+	REQUIRE(areStatsEnabled());
+
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+	TreeNode& gene = createGene(genes);
+	NetNode& network = createSpeciesWithIntro(species);
+
+	PreparedNetwork prepared = prepareNetwork(network);
+	PreparedGeneTree preparedGene;
+	REQUIRE(prepareGeneTree(prepared, gene, preparedGene));
+
+	resetEvaluationCounters();
+	std::vector<double> derivatives;
+	calcProbability(prepared, preparedGene, prepared.params.data(), &derivatives);
+
+	EvaluationCounters counters = getEvaluationCounters();
+	REQUIRE(counters.evaluations == 1);
+	REQUIRE(counters.nodes.size() == prepared.nodes.size());
+	for (DensemapOperation operation : {DensemapOperation::UPDATE, DensemapOperation::COMBINE, DensemapOperation::SPLIT, DensemapOperation::COMBINE_DERIVATIVES}) {
+		REQUIRE(counters.operations[(int) operation].calls > 0);
+	}
+
+	const OperationCounters& combine = counters.operations[(int) DensemapOperation::COMBINE];
+	REQUIRE(combine.pairsCombined == combine.mapsOut);
+	REQUIRE(combine.pairsCombined <= combine.pairsChecked);
+
+	int64_t nodeMapsOut = 0;
+	for (const NodeCounters& node : counters.nodes) {
+		nodeMapsOut += node.mapsOut;
+	}
+	int64_t operationMapsOut = 0;
+	for (const OperationCounters& operation : counters.operations) {
+		operationMapsOut += operation.mapsOut;
+	}
+	REQUIRE(nodeMapsOut == operationMapsOut);
+
+	// The legacy engine counts the same operations, without nodes
+	resetEvaluationCounters();
+	calcProbability(network, gene);
+
+	EvaluationCounters legacy = getEvaluationCounters();
+	REQUIRE(legacy.evaluations == 1);
+	REQUIRE(legacy.nodes.empty());
+	REQUIRE(legacy.operations[(int) DensemapOperation::COMBINE].mapsOut == combine.mapsOut);
+
+	REQUIRE(formatEvaluationCounters(legacy).find("combine") != std::string::npos);
+}
+
+TEST_CASE( "Evaluation traces record a span for every tree and node", "[trace]" ) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("(((A:0.5,(B:0.3)#H1:0.2::0.4):0.4,(#H1:0.3,C:0.6):0.3):0.5,D:1.4);", arena, root, numParams));
+
+	startTrace(1 << 16);
+	PreparedNetwork network = prepareNetwork(arena, root);
+
+	TreeArena trees;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, trees);
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, trees, roots, std::vector<double>(roots.size(), 1.0), batch));
+
+	calcLogLikelihood(network, batch, network.params.data());
+	stopTrace();
+
+	// Nothing is recorded once the trace stops
+	calcLogLikelihood(network, batch, network.params.data());
+
+	std::ostringstream out;
+	int64_t written = writeChromeTrace(out);
+	std::string json = out.str();
+
+	// One span per tree and per node of every tree, plus the operations inside them
+	int64_t numTrees = batch.trees.size();
+	REQUIRE(written > numTrees * (int64_t) (network.nodes.size() + 1));
+	REQUIRE(json.find("{\"traceEvents\":[") == 0);
+	REQUIRE(json.find("\"name\":\"tree\"") != std::string::npos);
+	REQUIRE(json.find("\"name\":\"combine\"") != std::string::npos);
+	REQUIRE(json.find("\"name\":\"split\"") != std::string::npos);
+	REQUIRE(json.find("\"name\":\"prepareNetwork\"") != std::string::npos);
+	REQUIRE(json.find("\"droppedEvents\":0}") != std::string::npos);
+
+	// A small ring keeps only the latest spans of each thread
+	startTrace(16);
+	calcLogLikelihood(network, batch, network.params.data());
+	stopTrace();
+
+	std::ostringstream small;
+	written = writeChromeTrace(small);
+	REQUIRE(written <= 16 * (int64_t) TraceRegistry::get().buffers.size());
+	REQUIRE(small.str().find("\"droppedEvents\":0}") == std::string::npos);
+}
+
+TEST_CASE( "Traces started after the thread pool exists give every buffer back", "[trace]" ) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("(((A:0.5,(B:0.3)#H1:0.2::0.4):0.4,(#H1:0.3,C:0.6):0.3):0.5,D:1.4);", arena, root, numParams));
+	PreparedNetwork network = prepareNetwork(arena, root);
+
+	TreeArena trees;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, trees);
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, trees, roots, std::vector<double>(roots.size(), 1.0), batch));
+
+	// The pool, and so its workers, exist before the registries are first used
+	double expected = calcLogLikelihood(network, batch, network.params.data());
+	int numWorkers = ThreadPool::getInstance().getNumWorkers();
+
+	TraceRegistry& registry = TraceRegistry::get();
+	startTrace(1 << 10);
+	REQUIRE(calcLogLikelihood(network, batch, network.params.data()) == expected);
+	stopTrace();
+	REQUIRE(registry.buffers.size() <= (size_t) numWorkers + 2);
+
+	// The workers only exit during static destruction, after every function local static, so the registries
+	// must still be there when they give their buffers and counters back
+	REQUIRE(&TraceRegistry::get() == &registry);
+	size_t inUse = registry.buffers.size() - registry.freeBuffers.size();
+	std::thread([&]() {
+		startTrace(1 << 10);
+		TraceSpan span("exiting");
+		span.end();
+		stopTrace();
+	}).join();
+	REQUIRE(registry.buffers.size() - registry.freeBuffers.size() == inUse);
+}
+
+TEST_CASE( "Evaluations draw their densemaps from a reusable arena", "[bumparena]" ) {
+	BumpArena arena(64);
+	ArenaAllocator<int64_t> allocator(&arena);
+
+	// Maps in an arena list keep their choices in the arena, and copies of the list go to the heap
+	PreparedMaps<double> maps(allocator);
+	maps.resize(3);
+	maps[0].initLeaf(0b1000000, 4);
+	REQUIRE(maps[0].get_allocator() == allocator);
+	REQUIRE(arena.getBytesUsed() >= 3 * sizeof(PreparedMap<double>) + 4 * sizeof(int64_t));
+
+	PreparedMaps<double> copy(maps);
+	REQUIRE(copy.get_allocator().getArena() == nullptr);
+	REQUIRE(copy[0].get_allocator().getArena() == nullptr);
+	REQUIRE(copy[0].choices == maps[0].choices);
+
+	std::vector<TreeNode> genes;
+	std::vector<NetNode> species;
+	TreeNode& gene = createGene(genes);
+	PreparedNetwork network = prepareNetwork(createSpeciesWithIntro(species));
+	PreparedGeneTree preparedGene;
+	REQUIRE(prepareGeneTree(network, gene, preparedGene));
+
+	// Streaming evaluations use the heap, so keep NETWORKPROB_STREAMING from turning it on
+	bool streaming = getStreamingEvaluation().exchange(false);
+
+	EvaluationContext<double> context;
+	std::vector<double> derivatives;
+	double expected = calcProbability(network, preparedGene, network.params.data(), &derivatives);
+
+	// The first evaluation grows the arena and later ones reuse it without growing
+	std::vector<double> contextDerivatives;
+	REQUIRE(calcProbability(network, preparedGene, DoubleParams{network.params.data()}, context, &contextDerivatives) == Approx(expected));
+	size_t capacity = context.arena.getCapacity();
+	size_t used = context.arena.getBytesUsed();
+	REQUIRE(used > 0);
+
+	for (int i = 0; i < 3; i++) {
+		REQUIRE(calcProbability(network, preparedGene, DoubleParams{network.params.data()}, context, &contextDerivatives) == Approx(expected));
+		REQUIRE(context.arena.getCapacity() == capacity);
+		REQUIRE(context.arena.getBytesUsed() == used);
+	}
+	REQUIRE(contextDerivatives.size() == derivatives.size());
+	getStreamingEvaluation().store(streaming);
+}
+
+TEST_CASE( "Streaming evaluations free node outputs as they are consumed", "[streaming]" ) {
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("((((A:0.2,(B:0.1)#H1:0.2::0.3):0.1,(#H1:0.1,C:0.3):0.2):0.3,D:0.5):0.2,(E:0.4,(F:0.3,G:0.2):0.1):0.6);", arena, root, numParams));
+	PreparedNetwork network = prepareNetwork(arena, root);
+
+	// The order is a post-order of every node
+	std::vector<int> positions(network.nodes.size(), -1);
+	for (unsigned int i = 0; i < network.streamingOrder.size(); i++) {
+		REQUIRE(positions[network.streamingOrder[i]] == -1);
+		positions[network.streamingOrder[i]] = i;
+	}
+	for (unsigned int i = 0; i < network.nodes.size(); i++) {
+		const PreparedNetNode& node = network.nodes[i];
+		int numEdges = node.type == NodeType::TREE ? 2 : node.type == NodeType::NETWORK ? 1 : 0;
+		for (int j = 0; j < numEdges; j++) {
+			REQUIRE(positions[node.edges[j].node] < positions[i]);
+		}
+	}
+	REQUIRE(network.streamingOrder.back() == (int) network.nodes.size() - 1);
+
+	TreeArena trees;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, trees);
+
+	// Only the second context streams, even if NETWORKPROB_STREAMING is set
+	bool streaming = getStreamingEvaluation().exchange(false);
+	EvaluationContext<double> retained;
+	EvaluationContext<double> streamed;
+	streamed.streaming = true;
+
+	for (int i = 0; i < 20; i++) {
+		PreparedGeneTree gene;
+		REQUIRE(prepareGeneTree(network, trees, roots[i * 499], gene));
+
+		std::vector<double> expectedDerivatives;
+		std::vector<double> derivatives;
+		double expected = calcProbability(network, gene, DoubleParams{network.params.data()}, retained, &expectedDerivatives);
+		REQUIRE(calcProbability(network, gene, DoubleParams{network.params.data()}, streamed, &derivatives) == Approx(expected));
+
+		REQUIRE(derivatives.size() == expectedDerivatives.size());
+		for (unsigned int j = 0; j < derivatives.size(); j++) {
+			REQUIRE(derivatives[j] == Approx(expectedDerivatives[j]));
+		}
+
+		// Only the root output is left, and fewer maps were alive at once
+		REQUIRE(streamed.liveMaps == streamed.nodes.back().countMaps());
+		REQUIRE(streamed.peakLiveMaps < retained.peakLiveMaps);
+	}
+	getStreamingEvaluation().store(streaming);
+}
+
+TEST_CASE( "Float histories estimate their error and fall back to double", "[precision]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<NetNode> species;
+	PreparedNetwork network = prepareNetwork(createSimpleSpecies(species, params));
+
+	TreeArena arena;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, arena);
+
+	std::vector<double> weights;
+	for (int32_t root : roots) {
+		PreparedGeneTree tree;
+		REQUIRE(prepareGeneTree(network, arena, root, tree));
+		weights.push_back(1000 * calcProbability(network, tree, params));
+	}
+
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, arena, roots, weights, batch));
+
+	std::vector<double> expectedDerivatives;
+	double expected = calcLogLikelihood(network, batch, params, &expectedDerivatives);
+
+	// Float stays within its estimate, which is far looser than the estimate for double
+	PrecisionOptions precision;
+	precision.precision = HistoryPrecision::FLOAT;
+
+	PrecisionReport single;
+	std::vector<double> derivatives;
+	double value = calcLogLikelihood(network, batch, params, precision, &single, &derivatives);
+	REQUIRE(single.precision == HistoryPrecision::FLOAT);
+	REQUIRE(!single.fellBack);
+	REQUIRE(std::abs(value - expected) <= single.errorEstimate);
+	for (int j = 0; j < network.numParams; j++) {
+		REQUIRE(derivatives[j] == Approx(expectedDerivatives[j]).epsilon(1e-3));
+	}
+
+	PrecisionReport full;
+	REQUIRE(calcLogLikelihood(network, batch, params, PrecisionOptions(), &full) == expected);
+	REQUIRE(full.errorEstimate < single.errorEstimate * 1e-6);
+
+	// Past the tolerance the batch is computed again in double
+	precision.tolerance = single.errorEstimate / 2;
+	PrecisionReport fallback;
+	REQUIRE(calcLogLikelihood(network, batch, params, precision, &fallback) == expected);
+	REQUIRE(fallback.precision == HistoryPrecision::DOUBLE);
+	REQUIRE(fallback.fellBack);
+
+	// The optimizer steps in float but reports its optimum in double
+	OptimizerOptions options;
+	options.precision.precision = HistoryPrecision::FLOAT;
+	OptimizerResult result = maximizeLogLikelihood(network, batch, std::vector<double>(8, 0.3), options);
+	REQUIRE(result.fallbacks == 0);
+	REQUIRE(-result.value == calcLogLikelihood(network, batch, result.params.data()));
+	REQUIRE(-result.value >= expected - 1e-2);
+}
+
+TEST_CASE( "Pruning drops negligible histories within its bound", "[pruning]" ) {
+	double params[] = {0.5, 1, 0.5, 0.5, 1, 4, 1, 0.7};
+	std::vector<NetNode> species;
+	PreparedNetwork simple = prepareNetwork(createSimpleSpecies(species, params));
+
+	// Only the leaves and the root have both parents of the network node below them
+	REQUIRE(simple.closed.back());
+	for (unsigned int i = 0; i < simple.nodes.size(); i++) {
+		REQUIRE((bool) simple.closed[i] == (simple.nodes[i].type == NodeType::LEAF || i == simple.nodes.size() - 1));
+	}
+
+	// With p near 1 and both lineages going left, only the right result, the pair of both going right, is negligible
+	std::vector<densemap> child(1);
+	child[0].initLeaf(0b11000000, 1);
+	child[0].setHistory(0, 0.5);
+	PreparedGeneTree tree;
+	PruneCounters counters;
+	SplitPruner<std::vector<densemap>> pruner(child, tree, 0.999, 2e-6, &counters);
+	REQUIRE(pruner(0, 0, 2, 2) == std::make_pair(true, false));
+	REQUIRE(counters.histories == 1);
+	REQUIRE(counters.mass == Approx(0.5 * 0.001 * 0.001));
+	REQUIRE(pruner(0, 0, 1, 2) == std::make_pair(true, true));
+
+	// Every dropped result counts its whole pair, and results are dropped twice per pair, so the bound holds
+	REQUIRE(pruner(0, 0, 0, 2) == std::make_pair(false, true));
+	REQUIRE(counters.mass == Approx(2 * 0.5 * 0.001 * 0.001));
+	REQUIRE(counters.mass <= 2e-6);
+
+	// A long branch leaves histories that are far less likely than the rest
+	NetworkArena arena;
+	int32_t root;
+	int numParams;
+	REQUIRE(parseNetwork("((((A:0.5,B:0.5):0.2,C:0.7):6,(D:0.3)#H1:0.5::0.4):1,(#H1:0.4,E:1):1);", arena, root, numParams));
+	PreparedNetwork network = prepareNetwork(arena, root);
+
+	TreeArena trees;
+	std::vector<int32_t> roots = enumerateTopologies(network.leafNames, trees);
+	GeneTreeBatch batch;
+	REQUIRE(prepareGeneTreeBatch(network, trees, roots, std::vector<double>(roots.size(), 1), batch));
+
+	std::vector<double> expectedDerivatives;
+	double expected = calcLogLikelihood(network, batch, network.params.data(), &expectedDerivatives);
+
+	// Without the probabilities of a last evaluation there is nothing to measure against, so nothing is dropped
+	PrecisionOptions precision;
+	precision.pruneTolerance = 1e-3;
+	PrecisionReport report;
+	std::vector<double> derivatives;
+	REQUIRE(calcLogLikelihood(network, batch, network.params.data(), precision, &report, &derivatives) == Approx(expected));
+	REQUIRE(report.prunedHistories == 0);
+
+	std::vector<double> treeProbabilities;
+	precision.treeProbabilities = &treeProbabilities;
+	REQUIRE(calcLogLikelihood(network, batch, network.params.data(), precision, &report, &derivatives) == Approx(expected));
+	REQUIRE(report.prunedHistories == 0);
+	REQUIRE(treeProbabilities.size() == roots.size());
+
+	// Against the exact probabilities only half the tolerance is spent, so no tree falls back
+	double value = calcLogLikelihood(network, batch, network.params.data(), precision, &report, &derivatives);
+	REQUIRE(report.prunedHistories > 0);
+	REQUIRE(report.pruneFallbacks == 0);
+	REQUIRE(expected >= value);
+	REQUIRE(expected - value <= report.pruneBound);
+	REQUIRE(report.pruneBound <= roots.size() * precision.pruneTolerance);
+	for (int j = 0; j < network.numParams; j++) {
+		REQUIRE(derivatives[j] == Approx(expectedDerivatives[j]).epsilon(1e-2));
+	}
+
+	// Expecting every tree to be four times likelier than it is lets pruning drop too much, and then it falls back
+	std::vector<double> tooHigh = treeProbabilities;
+	for (double& probability : tooHigh) {
+		probability *= 4;
+	}
+	precision.treeProbabilities = &tooHigh;
+	value = calcLogLikelihood(network, batch, network.params.data(), precision, &report);
+	REQUIRE(report.pruneFallbacks > 0);
+	REQUIRE(expected >= value);
+	REQUIRE(expected - value <= report.pruneBound);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "arena.h"
+#include "parallel.h"
+
+/**
+ * Scramble the bits of a hash, the finalizer of splitmix64.
+ */
+inline uint64_t mixHash(uint64_t hash) {
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+/**
+ * Get a 64-bit hash of the rooted topology below a node.
+ * Only leaf names and the shape matter, so swapping the children of any node gives the same hash.
+ */
+inline uint64_t getTopologyHash(const TreeArena& arena, int32_t index) {
+	const ArenaTreeNode& node = arena.nodes[index];
+
+	if (node.isLeaf()) {
+		uint64_t hash = 14695981039346656037ULL;
+		for (const char* c = arena.getName(index); *c != '\0'; c++) {
+			hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+		}
+		return mixHash(hash);
+	}
+
+	uint64_t left = getTopologyHash(arena, node.leftChild);
+	uint64_t right = getTopologyHash(arena, node.rightChild);
+
+	// Sorting the children is what makes the hash rotation invariant
+	return mixHash(std::min(left, right) * 31 + mixHash(std::max(left, right) ^ 0x9e3779b97f4a7c15ULL));
+}
+
+/**
+ * Check if two nodes have the same rooted topology below them, ignoring the order of children.
+ */
+inline bool isSameTopology(const TreeArena& arenaA, int32_t a, const TreeArena& arenaB, int32_t b) {
+	const ArenaTreeNode& nodeA = arenaA.nodes[a];
+	const ArenaTreeNode& nodeB = arenaB.nodes[b];
+
+	if (nodeA.isLeaf() || nodeB.isLeaf()) {
+		return nodeA.isLeaf() && nodeB.isLeaf() && std::strcmp(arenaA.getName(a), arenaB.getName(b)) == 0;
+	}
+
+	return (isSameTopology(arenaA, nodeA.leftChild, arenaB, nodeB.leftChild) && isSameTopology(arenaA, nodeA.rightChild, arenaB, nodeB.rightChild))
+		|| (isSameTopology(arenaA, nodeA.leftChild, arenaB, nodeB.rightChild) && isSameTopology(arenaA, nodeA.rightChild, arenaB, nodeB.leftChild));
+}
+
+/**
+ * Gene trees with duplicate topologies collapsed together.
+ */
+struct UniqueGeneTrees {
+	std::vector<int32_t> roots; // The first tree with each topology.
+	std::vector<double> weights; // The summed weight of each topology.
+	std::vector<int32_t> uniqueIndices; // For every input tree, the index of its topology.
+};
+
+/**
+ * Collapse gene trees with the same rooted topology, summing their weights.
+ * Topologies are kept in the order they first appear.
+ */
+inline UniqueGeneTrees findUniqueGeneTrees(const TreeArena& arena, const std::vector<int32_t>& roots, const std::vector<double>& weights) {
+	std::vector<uint64_t> hashes(roots.size());
+	parallelFor(roots.size(), [&](int i) {
+		hashes[i] = getTopologyHash(arena, roots[i]);
+	});
+
+	UniqueGeneTrees result;
+	result.uniqueIndices.resize(roots.size());
+
+	// Hashes only pick the bucket, and every match is checked for real
+	std::unordered_map<uint64_t, std::vector<int32_t>> buckets;
+
+	for (unsigned int i = 0; i < roots.size(); i++) {
+		std::vector<int32_t>& bucket = buckets[hashes[i]];
+
+		int32_t unique = -1;
+		for (int32_t candidate : bucket) {
+			if (isSameTopology(arena, result.roots[candidate], arena, roots[i])) {
+				unique = candidate;
+				break;
+			}
+		}
+
+		if (unique == -1) {
+			unique = result.roots.size();
+			result.roots.push_back(roots[i]);
+			result.weights.push_back(0);
+			bucket.push_back(unique);
+		}
+
+		result.weights[unique] += weights[i];
+		result.uniqueIndices[i] = unique;
+	}
+
+	return result;
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <algorithm>
+
+/**
+ * One finished span, with times in microseconds since the trace started.
+ * Names must be string literals, since only the pointer is kept.
+ */
+struct TraceEvent {
+	const char* name;
+	int32_t index; // The node or gene tree the span was for, or -1.
+	double start;
+	double duration;
+};
+
+/**
+ * A ring of the most recent events of one thread. Only the owning thread writes, so recording needs no locks.
+ * When it is full the oldest events are overwritten.
+ */
+class TraceBuffer {
+public:
+	/**
+	 * Create an empty buffer for the trace thread id.
+	 */
+	TraceBuffer(int a_id, int capacity) : id(a_id), head(0) {
+		resize(capacity);
+	}
+
+	/**
+	 * Drop every event and make room for capacity events, rounded up to a power of two.
+	 */
+	void resize(int capacity) {
+		int size = 1;
+		while (size < capacity) {
+			size *= 2;
+		}
+		events.assign(size, TraceEvent());
+		head.store(0, std::memory_order_release);
+	}
+
+	/**
+	 * Add an event, overwriting the oldest one if the buffer is full.
+	 */
+	void push(const TraceEvent& event) {
+		uint64_t index = head.load(std::memory_order_relaxed);
+		events[index & (events.size() - 1)] = event;
+		head.store(index + 1, std::memory_order_release);
+	}
+
+	/**
+	 * Get the number of events ever pushed since the last resize.
+	 */
+	uint64_t getNumPushed() const {
+		return head.load(std::memory_order_acquire);
+	}
+
+	int id;
+	std::vector<TraceEvent> events;
+
+private:
+	std::atomic<uint64_t> head;
+};
+
+/**
+ * Owns the buffers of every thread. Threads take a buffer the first time they record and give it back when they exit,
+ * so each worker of the thread pool keeps one buffer, which is its lane of the timeline.
+ */
+struct TraceRegistry {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<TraceBuffer>> buffers;
+	std::vector<TraceBuffer*> freeBuffers;
+	int capacity = 0;
+	std::chrono::steady_clock::time_point started;
+
+	/**
+	 * Get the registry of the process. It is never destroyed, since the workers of the thread pool only exit
+	 * during static destruction and still give back what they hold.
+	 */
+	static TraceRegistry& get() {
+		static TraceRegistry* registry = new TraceRegistry();
+		return *registry;
+	}
+
+	/**
+	 * Get a buffer for a thread that doesn't have one.
+	 */
+	TraceBuffer* acquire() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!freeBuffers.empty()) {
+			TraceBuffer* result = freeBuffers.back();
+			freeBuffers.pop_back();
+			return result;
+		}
+
+		buffers.emplace_back(new TraceBuffer(buffers.size(), capacity));
+		return buffers.back().get();
+	}
+
+	/**
+	 * Give back the buffer of a thread that is exiting.
+	 */
+	void release(TraceBuffer* buffer) {
+		std::lock_guard<std::mutex> lock(mutex);
+		freeBuffers.push_back(buffer);
+	}
+};
+
+/**
+ * The buffer of the current thread, given back when the thread exits.
+ */
+struct TraceThread {
+	TraceBuffer* buffer = nullptr;
+
+	~TraceThread() {
+		if (buffer != nullptr) {
+			TraceRegistry::get().release(buffer);
+		}
+	}
+
+	/**
+	 * Get the buffer of the current thread.
+	 */
+	static TraceBuffer& getBuffer() {
+		static thread_local TraceThread thread;
+		if (thread.buffer == nullptr) {
+			thread.buffer = TraceRegistry::get().acquire();
+		}
+		return *thread.buffer;
+	}
+};
+
+/**
+ * Get the flag for whether spans are being recorded. It is constant initialized, so checking it is a plain load.
+ */
+inline std::atomic<bool>& getTraceEnabled() {
+	static std::atomic<bool> enabled(false);
+	return enabled;
+}
+
+/**
+ * Check if spans are being recorded.
+ */
+inline bool isTracing() {
+	return getTraceEnabled().load(std::memory_order_relaxed);
+}
+
+/**
+ * Get the time since the trace started in microseconds.
+ */
+inline double getTraceTime() {
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - TraceRegistry::get().started).count();
+}
+
+/**
+ * Start recording spans, dropping any earlier ones. Each thread keeps its last eventsPerThread spans.
+ * Only call it while nothing is being evaluated.
+ */
+inline void startTrace(int eventsPerThread) {
+	TraceRegistry& registry = TraceRegistry::get();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	registry.capacity = std::max(1, eventsPerThread);
+	for (auto&& buffer : registry.buffers) {
+		buffer->resize(registry.capacity);
+	}
+	registry.started = std::chrono::steady_clock::now();
+	getTraceEnabled().store(true, std::memory_order_release);
+}
+
+/**
+ * Stop recording spans. What was recorded is kept until the next startTrace.
+ */
+inline void stopTrace() {
+	getTraceEnabled().store(false, std::memory_order_release);
+}
+
+/**
+ * Records the time between its creation and end, or its destruction, if a trace is running when it is created.
+ */
+class TraceSpan {
+public:
+	TraceSpan(const char* a_name, int a_index = -1) : name(a_name), index(a_index), active(isTracing()), start(active ? getTraceTime() : 0) {}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+	~TraceSpan() {
+		end();
+	}
+
+	/**
+	 * End the span before it goes out of scope.
+	 */
+	void end() {
+		if (active) {
+			active = false;
+			TraceThread::getBuffer().push({name, index, start, getTraceTime() - start});
+		}
+	}
+
+private:
+	const char* name;
+	int32_t index;
+	bool active;
+	double start;
+};
+
+/**
+ * Write every recorded span as Chrome trace JSON, which chrome://tracing and Perfetto both open.
+ * Each buffer is one thread of the timeline. Only call it while nothing is being evaluated.
+ * Returns the number of spans written.
+ */
+inline int64_t writeChromeTrace(std::ostream& out) {
+	TraceRegistry& registry = TraceRegistry::get();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	int64_t written = 0;
+	uint64_t dropped = 0;
+	char line[256];
+	bool first = true;
+
+	out<<"{\"traceEvents\":[";
+	for (auto&& buffer : registry.buffers) {
+		uint64_t pushed = buffer->getNumPushed();
+		uint64_t size = buffer->events.size();
+		uint64_t begin = pushed > size ? pushed - size : 0;
+		dropped += begin;
+
+		snprintf(line, sizeof(line), "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"lane %d\"}}", first ? "" : ",", buffer->id + 1, buffer->id);
+		out<<line;
+		first = false;
+
+		for (uint64_t i = begin; i < pushed; i++) {
+			const TraceEvent& event = buffer->events[i & (size - 1)];
+			snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"networkprob\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"index\":%d}}",
+				event.name, buffer->id + 1, event.start, event.duration, event.index);
+			out<<line;
+			written++;
+		}
+	}
+	out<<"\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":"<<dropped<<"}}\n";
+
+	return written;
+}
+
+/**
+ * Write the trace to a file. Returns false if it can't be written.
+ */
+inline bool writeChromeTraceFile(const char* path) {
+	std::ofstream file(path);
+	if (!file) {
+		return false;
+	}
+
+	writeChromeTrace(file);
+	return (bool) file;
+}
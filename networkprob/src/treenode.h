@@ -6,6 +6,8 @@
 #include <map>
 #include <experimental/optional>
 #include <iostream>
+#include <cstdint>
+#include <algorithm>
 
 template<class T>
 using optional = std::experimental::optional<T>;
@@ -111,4 +113,21 @@ inline std::vector<int> getEvents(const TreeNode& gene, const std::map<std::stri
 	std::vector<int> current;
 	processEvents(gene, taxa, current);
 	return current;
+}
+
+/**
+ * Get the taxa bits that a complete gene tree covers.
+ */
+inline uint16_t getTargetTaxaBits(const std::map<std::string, int>& taxa) {
+	int maxTaxa = 0;
+	for (const auto& entry: taxa) {
+		maxTaxa = std::max(maxTaxa, entry.second);
+	}
+
+	uint16_t targetTaxaBits = 0;
+	for (int i = 6; i <= maxTaxa; i++) {
+		targetTaxaBits |= 1 << i;
+	}
+
+	return targetTaxaBits;
 }
\ No newline at end of file
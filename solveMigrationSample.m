@@ -4,30 +4,34 @@ loadLibrary();
 
 network = createMigrationNetwork();
 
-treesAndWeights = tdfread('weights','\t');
+% Every tree ends up in one shared buffer.
+geneTrees = calllib('libnetworkprob', 'loadGeneTreeFile', 'weights');
 
-weights = [];
+if isNull(geneTrees.buffer)
+    error('Could not load the weights file');
+end
+
+preparedNetwork = calllib('libnetworkprob', 'createPreparedNetwork', network);
+batch = calllib('libnetworkprob', 'createGeneTreeBatch', preparedNetwork, geneTrees);
 
-for i=1:size(treesAndWeights.TREE, 1)
-    trees(i) = generateTreeFromNewick(treesAndWeights.TREE(i,:));
-    weights(i) = treesAndWeights.WEIGHT(i);
+if isNull(batch)
+    error('The gene trees do not match the network');
 end
 
-bestProb = 0;
-bestLengths = [];
+% All the restarts run at once natively, and ones that fall behind are abandoned.
+numStarts = 10;
+settings = calllib('libnetworkprob', 'getDefaultOptimizerSettings');
 
-for i=1:10
-    x0 = rand(10, 1);
-    [negProb, lengths] = quasiNewton(x0, @(x) computeNegativeTotalProbability(x, network, trees, weights));
+starts = libpointer('doublePtr', rand(10, numStarts));
+traces = libpointer('doublePtr', nan(settings.maxIterations + 1, numStarts));
 
-    if negProb < bestProb
-        bestProb = negProb;
-        bestLengths = lengths;
-    end
-end
-    
+best = calllib('libnetworkprob', 'optimizeBatchMultiStart', preparedNetwork, batch, numStarts, starts, settings, 5, 10, [], traces) + 1;
+
+bestLengths = starts.Value(:, best);
+bestLogLikelihood = max(traces.Value(:, best));
+
+calllib('libnetworkprob', 'freeGeneTreeBatch', batch);
+calllib('libnetworkprob', 'freePreparedNetwork', preparedNetwork);
 calllib('libnetworkprob', 'freeNetworkBuffer', network.buffer);
- 
-for i=1:size(treesAndWeights.TREE, 1)
-    calllib('libnetworkprob', 'freeTreeBuffer', trees(i).buffer);
-end
\ No newline at end of file
+
+calllib('libnetworkprob', 'freeGeneTrees', geneTrees);
\ No newline at end of file